@@ -0,0 +1,524 @@
+#include "audio.h"
+
+#include <string.h>
+#include <libavutil/samplefmt.h>
+
+// Packets buffered ahead of each audio stage. Audio packets are small and frequent, so this covers several seconds
+// and lets the demuxer run ahead of a briefly busy audio thread without stalling the video.
+#define AUDIO_QUEUE_DEPTH 256
+
+// The frame size used for encoders that accept any, and the bit rate given to each channel without --audio-bitrate.
+#define DEFAULT_FRAME_SIZE 1024
+#define DEFAULT_CHANNEL_BIT_RATE 64000
+
+// The output never has more channels than 7.1 unless --audio-channels asks for them.
+#define MAX_DEFAULT_CHANNELS 8
+
+static const struct {
+    const char *name;
+    int mode;
+} audio_modes[] = {
+        {"copy", AUDIO_COPY},
+        {"auto", AUDIO_AUTO},
+        {"aac",  AUDIO_AAC},
+        {"opus", AUDIO_OPUS}
+};
+
+// Audio MP4 players handle everywhere. In auto mode everything else is re-encoded to AAC.
+static const enum AVCodecID mp4_audio_codecs[] = {
+        AV_CODEC_ID_AAC, AV_CODEC_ID_MP3, AV_CODEC_ID_AC3, AV_CODEC_ID_EAC3, AV_CODEC_ID_OPUS
+};
+
+static const int aac_sample_rates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025,
+                                       8000, 7350};
+
+int parse_audio_mode(const char *name) {
+    for (int i = 0; i < sizeof audio_modes / sizeof *audio_modes; ++i) {
+        if (!strcmp(name, audio_modes[i].name)) {
+            return audio_modes[i].mode;
+        }
+    }
+
+    return -1;
+}
+
+static int needs_transcode(const AVCodecParameters *parameters, const struct transcode_options *options) {
+    if (options->audio_mode == AUDIO_COPY) {
+        return 0;
+    }
+    if (options->audio_mode != AUDIO_AUTO) {
+        return 1;
+    }
+
+    if (options->audio_channels && parameters->ch_layout.nb_channels != options->audio_channels) {
+        return 1;
+    }
+    for (int i = 0; i < sizeof mp4_audio_codecs / sizeof *mp4_audio_codecs; ++i) {
+        if (parameters->codec_id == mp4_audio_codecs[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// libopus only runs at 48 kHz. AAC keeps the source rate when it is one of its own.
+static int output_sample_rate(int mode, int sample_rate) {
+    if (mode == AUDIO_OPUS) {
+        return 48000;
+    }
+
+    for (int i = 0; i < sizeof aac_sample_rates / sizeof *aac_sample_rates; ++i) {
+        if (aac_sample_rates[i] == sample_rate) {
+            return sample_rate;
+        }
+    }
+
+    return 48000;
+}
+
+static void free_queued_packet(void *item) {
+    AVPacket *packet = item;
+    av_packet_free(&packet);
+}
+
+static void free_audio_stage(struct audio_stage **stage) {
+    if (!*stage) {
+        return;
+    }
+
+    queue_destroy(&(*stage)->packets, free_queued_packet);
+    avcodec_free_context(&(*stage)->encoder);
+    avcodec_free_context(&(*stage)->decoder);
+    swr_free(&(*stage)->resampler);
+    if ((*stage)->fifo) {
+        av_audio_fifo_free((*stage)->fifo);
+    }
+    av_frame_free(&(*stage)->decoded);
+    av_frame_free(&(*stage)->resampled);
+    av_frame_free(&(*stage)->frame);
+    av_packet_free(&(*stage)->packet);
+    av_channel_layout_uninit(&(*stage)->src_layout);
+    av_freep(stage);
+}
+
+static int open_audio_decoder(struct audio_stage *stage) {
+    AVCodecParameters *parameters = stage->in_stream->codecpar;
+    const AVCodec *codec = avcodec_find_decoder(parameters->codec_id);
+    if (!codec) {
+        printf("Failed to find decoder for audio stream %d\n", stage->in_stream->index);
+        return -1;
+    }
+
+    stage->decoder = avcodec_alloc_context3(codec);
+    if (!stage->decoder) {
+        printf("Failed to allocate memory for audio decoder\n");
+        return -1;
+    }
+
+    int reason = avcodec_parameters_to_context(stage->decoder, parameters);
+    if (reason >= 0) {
+        stage->decoder->pkt_timebase = stage->in_stream->time_base;
+        reason = avcodec_open2(stage->decoder, codec, NULL);
+    }
+    if (reason < 0) {
+        print_error("Failed to open audio decoder", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_audio_encoder(struct audio_stage *stage, const struct transcode_options *options) {
+    int mode = options->audio_mode == AUDIO_OPUS ? AUDIO_OPUS : AUDIO_AAC;
+    const char *name = mode == AUDIO_OPUS ? "libopus" : "aac";
+    const AVCodec *codec = avcodec_find_encoder_by_name(name);
+    if (!codec) {
+        printf("Failed to find %s codec\n", name);
+        return -1;
+    }
+
+    stage->encoder = avcodec_alloc_context3(codec);
+    if (!stage->encoder) {
+        printf("Failed to allocate memory for audio encoder\n");
+        return -1;
+    }
+
+    AVCodecContext *encoder = stage->encoder;
+    AVCodecParameters *parameters = stage->in_stream->codecpar;
+    int channels = options->audio_channels ? options->audio_channels :
+                   FFMIN(parameters->ch_layout.nb_channels, MAX_DEFAULT_CHANNELS);
+    if (!options->audio_channels && channels == parameters->ch_layout.nb_channels &&
+        parameters->ch_layout.order != AV_CHANNEL_ORDER_UNSPEC) {
+        av_channel_layout_copy(&encoder->ch_layout, &parameters->ch_layout);
+    } else {
+        av_channel_layout_default(&encoder->ch_layout, FFMAX(1, channels));
+    }
+
+    encoder->sample_fmt = mode == AUDIO_OPUS ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_FLTP;
+    encoder->sample_rate = output_sample_rate(mode, parameters->sample_rate);
+    encoder->time_base = (AVRational) {1, encoder->sample_rate};
+    encoder->bit_rate = options->audio_bit_rate ? options->audio_bit_rate :
+                        (int64_t) DEFAULT_CHANNEL_BIT_RATE * encoder->ch_layout.nb_channels;
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    int reason = avcodec_open2(encoder, codec, NULL);
+    if (reason < 0) {
+        print_error("Failed to open audio encoder", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_audio_stage(AVStream *in_stream, const struct transcode_options *options,
+                            struct audio_stage **stage) {
+    *stage = av_mallocz(sizeof **stage);
+    if (!*stage) {
+        printf("Failed to allocate memory for audio stage\n");
+        return -1;
+    }
+
+    struct audio_stage *audio = *stage;
+    audio->in_stream = in_stream;
+    audio->next_pts = AV_NOPTS_VALUE;
+    audio->src_format = AV_SAMPLE_FMT_NONE;
+    if (open_audio_decoder(audio) || open_audio_encoder(audio, options)) {
+        return -1;
+    }
+
+    audio->fifo = av_audio_fifo_alloc(audio->encoder->sample_fmt, audio->encoder->ch_layout.nb_channels,
+                                      DEFAULT_FRAME_SIZE);
+    audio->decoded = av_frame_alloc();
+    audio->resampled = av_frame_alloc();
+    audio->frame = av_frame_alloc();
+    audio->packet = av_packet_alloc();
+    if (!audio->fifo || !audio->decoded || !audio->resampled || !audio->frame || !audio->packet ||
+        queue_init(&audio->packets, AUDIO_QUEUE_DEPTH, 1)) {
+        printf("Failed to allocate memory for audio stage\n");
+        return -1;
+    }
+
+    printf("Re-encoding audio stream %d with %s\n", in_stream->index, audio->encoder->codec->name);
+    return 0;
+}
+
+int open_audio_stages(AVFormatContext *infc, const struct transcode_options *options, struct audio_stage ***stages) {
+    *stages = NULL;
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        AVCodecParameters *parameters = infc->streams[i]->codecpar;
+        if (parameters->codec_type != AVMEDIA_TYPE_AUDIO || !needs_transcode(parameters, options)) {
+            continue;
+        }
+
+        if (!*stages) {
+            *stages = av_calloc(infc->nb_streams, sizeof **stages);
+            if (!*stages) {
+                printf("Failed to allocate memory for audio stages\n");
+                return -1;
+            }
+        }
+
+        if (open_audio_stage(infc->streams[i], options, &(*stages)[i])) {
+            close_audio_stages(stages, infc->nb_streams);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void close_audio_stages(struct audio_stage ***stages, int stream_count) {
+    for (int i = 0; *stages && i < stream_count; ++i) {
+        free_audio_stage(&(*stages)[i]);
+    }
+    av_freep(stages);
+}
+
+// Writes a reference to the packet to every rendition but the last, which takes the packet itself.
+static int write_audio_packet(struct audio_stage *stage, AVPacket *packet) {
+    for (int i = 0; i < stage->rendition_count; ++i) {
+        AVPacket *target = packet;
+        if (i < stage->rendition_count - 1) {
+            target = av_packet_clone(packet);
+            if (!target) {
+                printf("Failed to reference packet\n");
+                return -1;
+            }
+        }
+
+        int reason = write_packet_in(&stage->renditions[i], target, stage->in_stream->index,
+                                     stage->encoder->time_base);
+        if (target != packet) {
+            av_packet_free(&target);
+        } else {
+            av_packet_unref(packet);
+        }
+        if (reason) {
+            return reason;
+        }
+    }
+
+    return 0;
+}
+
+// Sends a frame, or NULL to drain the encoder, and writes every packet it hands back.
+static int encode_audio_frame(struct audio_stage *stage, AVFrame *frame) {
+    struct stage_timer timer;
+    stats_begin(stage->stats, &timer);
+    int reason = avcodec_send_frame(stage->encoder, frame);
+    stats_end(stage->stats, STAGE_AUDIO, &timer);
+    if (reason < 0) {
+        print_error("Failed to send audio frame", reason);
+        return -1;
+    }
+
+    for (;;) {
+        stats_begin(stage->stats, &timer);
+        reason = avcodec_receive_packet(stage->encoder, stage->packet);
+        stats_end(stage->stats, STAGE_AUDIO, &timer);
+        if (reason == AVERROR(EAGAIN) || reason == AVERROR_EOF) {
+            return 0;
+        }
+        if (reason < 0) {
+            print_error("Failed to receive audio packets", reason);
+            return -1;
+        }
+
+        if (write_audio_packet(stage, stage->packet)) {
+            return -1;
+        }
+    }
+}
+
+// Encodes whole encoder frames from the FIFO, and with flush set, the partial frame left at the end, padded with
+// silence for encoders that need every frame full.
+static int encode_audio(struct audio_stage *stage, int flush) {
+    AVCodecContext *encoder = stage->encoder;
+    int frame_size = encoder->frame_size > 0 ? encoder->frame_size : DEFAULT_FRAME_SIZE;
+    int partial = encoder->codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE);
+
+    while (av_audio_fifo_size(stage->fifo) >= frame_size || (flush && av_audio_fifo_size(stage->fifo) > 0)) {
+        int samples = FFMIN(av_audio_fifo_size(stage->fifo), frame_size);
+        AVFrame *frame = stage->frame;
+        av_frame_unref(frame);
+        frame->nb_samples = partial ? samples : frame_size;
+        frame->format = encoder->sample_fmt;
+        frame->sample_rate = encoder->sample_rate;
+        int reason = av_channel_layout_copy(&frame->ch_layout, &encoder->ch_layout);
+        if (reason >= 0) {
+            reason = av_frame_get_buffer(frame, 0);
+        }
+        if (reason < 0) {
+            print_error("Failed to allocate audio frame", reason);
+            return -1;
+        }
+
+        av_audio_fifo_read(stage->fifo, (void **) frame->extended_data, samples);
+        if (samples < frame->nb_samples) {
+            av_samples_set_silence(frame->extended_data, samples, frame->nb_samples - samples,
+                                   encoder->ch_layout.nb_channels, encoder->sample_fmt);
+        }
+        frame->pts = stage->next_pts;
+        stage->next_pts += samples;
+
+        reason = encode_audio_frame(stage, frame);
+        av_frame_unref(frame);
+        if (reason) {
+            return reason;
+        }
+    }
+
+    return 0;
+}
+
+// Sets the resampler up for the frame's format, rate and layout. A change mid-stream drops the few samples the old
+// resampler still held.
+static int configure_resampler(struct audio_stage *stage, const AVFrame *frame) {
+    if (stage->resampler && frame->format == stage->src_format && frame->sample_rate == stage->src_sample_rate &&
+        !av_channel_layout_compare(&frame->ch_layout, &stage->src_layout)) {
+        return 0;
+    }
+
+    swr_free(&stage->resampler);
+    AVCodecContext *encoder = stage->encoder;
+    int reason = swr_alloc_set_opts2(&stage->resampler, &encoder->ch_layout, encoder->sample_fmt,
+                                     encoder->sample_rate, &frame->ch_layout, frame->format, frame->sample_rate, 0,
+                                     NULL);
+    if (reason >= 0) {
+        reason = swr_init(stage->resampler);
+    }
+    if (reason >= 0) {
+        av_channel_layout_uninit(&stage->src_layout);
+        reason = av_channel_layout_copy(&stage->src_layout, &frame->ch_layout);
+    }
+    if (reason < 0) {
+        print_error("Failed to create resampler", reason);
+        swr_free(&stage->resampler);
+        return -1;
+    }
+
+    stage->src_format = frame->format;
+    stage->src_sample_rate = frame->sample_rate;
+    return 0;
+}
+
+// Converts a decoded frame, or NULL to flush the resampler, into the encoder's format and appends it to the FIFO.
+static int resample_audio(struct audio_stage *stage, const AVFrame *frame) {
+    if (frame && configure_resampler(stage, frame)) {
+        return -1;
+    }
+    if (!stage->resampler) {
+        return 0;
+    }
+
+    // The first frame's timestamp places the audio against the video; after that the sample count keeps it gapless.
+    AVCodecContext *encoder = stage->encoder;
+    if (frame && stage->next_pts == AV_NOPTS_VALUE) {
+        stage->next_pts = frame->pts == AV_NOPTS_VALUE ? 0 :
+                          av_rescale_q(frame->pts, stage->in_stream->time_base, encoder->time_base);
+    }
+
+    AVFrame *resampled = stage->resampled;
+    av_frame_unref(resampled);
+    resampled->format = encoder->sample_fmt;
+    resampled->sample_rate = encoder->sample_rate;
+    int reason = av_channel_layout_copy(&resampled->ch_layout, &encoder->ch_layout);
+
+    struct stage_timer timer;
+    stats_begin(stage->stats, &timer);
+    if (reason >= 0) {
+        reason = swr_convert_frame(stage->resampler, resampled, frame);
+    }
+    stats_end(stage->stats, STAGE_AUDIO, &timer);
+    if (reason < 0) {
+        print_error("Failed to resample audio", reason);
+        return -1;
+    }
+
+    if (resampled->nb_samples > 0 &&
+        av_audio_fifo_write(stage->fifo, (void **) resampled->extended_data, resampled->nb_samples) <
+        resampled->nb_samples) {
+        printf("Failed to allocate memory for audio samples\n");
+        return -1;
+    }
+    av_frame_unref(resampled);
+    return 0;
+}
+
+// Sends a packet, or NULL to drain the decoder, and resamples and encodes every frame that comes out.
+static int decode_audio_packet(struct audio_stage *stage, AVPacket *packet) {
+    struct stage_timer timer;
+    stats_begin(stage->stats, &timer);
+    int reason = avcodec_send_packet(stage->decoder, packet);
+    stats_end(stage->stats, STAGE_AUDIO, &timer);
+    if (reason < 0) {
+        print_error("Failed to send audio packet", reason);
+        return -1;
+    }
+
+    for (;;) {
+        stats_begin(stage->stats, &timer);
+        reason = avcodec_receive_frame(stage->decoder, stage->decoded);
+        stats_end(stage->stats, STAGE_AUDIO, &timer);
+        if (reason == AVERROR(EAGAIN) || reason == AVERROR_EOF) {
+            return 0;
+        }
+        if (reason < 0) {
+            print_error("Failed to receive audio frames", reason);
+            return -1;
+        }
+
+        reason = resample_audio(stage, stage->decoded);
+        av_frame_unref(stage->decoded);
+        if (reason || encode_audio(stage, 0)) {
+            return -1;
+        }
+    }
+}
+
+static void *audio_thread(void *arg) {
+    struct audio_stage *stage = arg;
+
+    AVPacket *packet;
+    int pop_reason;
+    while ((pop_reason = queue_pop(&stage->packets, (void **) &packet)) == 0) {
+        int reason = decode_audio_packet(stage, packet);
+        av_packet_free(&packet);
+        if (reason) {
+            break;
+        }
+    }
+
+    // Past the end of the input, the decoder, resampler and encoder are drained in turn.
+    if (pop_reason == 1 && !decode_audio_packet(stage, NULL) && !resample_audio(stage, NULL) &&
+        !encode_audio(stage, 1) && !encode_audio_frame(stage, NULL)) {
+        return NULL;
+    }
+
+    // Aborting the queue makes the demuxer's next push fail, which stops the transcode.
+    if (pop_reason != -1) {
+        stage->failed = 1;
+        queue_abort(&stage->packets);
+    }
+    return NULL;
+}
+
+int start_audio_stages(struct audio_stage **stages, int stream_count, struct rendition *renditions,
+                       int rendition_count, struct transcode_stats *stats) {
+    for (int i = 0; stages && i < stream_count; ++i) {
+        struct audio_stage *stage = stages[i];
+        if (!stage) {
+            continue;
+        }
+
+        stage->renditions = renditions;
+        stage->rendition_count = rendition_count;
+        stage->stats = stats;
+        stage->started = !pthread_create(&stage->thread, NULL, audio_thread, stage);
+        if (!stage->started) {
+            printf("Failed to start audio thread\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int audio_stage_send(struct audio_stage *stage, AVPacket *packet) {
+    AVPacket *queued = av_packet_alloc();
+    if (!queued) {
+        printf("Failed to allocate memory for audio packet\n");
+        av_packet_unref(packet);
+        return -1;
+    }
+
+    av_packet_move_ref(queued, packet);
+    if (queue_push(&stage->packets, queued)) {
+        av_packet_free(&queued);
+        return -1;
+    }
+
+    return 0;
+}
+
+int finish_audio_stages(struct audio_stage **stages, int stream_count, int abort) {
+    int failed = 0;
+    for (int i = 0; stages && i < stream_count; ++i) {
+        struct audio_stage *stage = stages[i];
+        if (!stage || !stage->started) {
+            continue;
+        }
+
+        if (abort) {
+            queue_abort(&stage->packets);
+        } else {
+            queue_finish(&stage->packets);
+        }
+        pthread_join(stage->thread, NULL);
+        stage->started = 0;
+        failed |= stage->failed;
+    }
+
+    return failed ? -1 : 0;
+}
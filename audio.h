@@ -0,0 +1,66 @@
+#ifndef VIDEO_RESIZE_AUDIO_H
+#define VIDEO_RESIZE_AUDIO_H
+
+#include <pthread.h>
+#include <libswresample/swresample.h>
+#include <libavutil/audio_fifo.h>
+
+#include "queue.h"
+#include "transcode.h"
+
+enum audio_mode {
+    AUDIO_COPY,
+    AUDIO_AUTO,
+    AUDIO_AAC,
+    AUDIO_OPUS
+};
+
+// Decodes, resamples and re-encodes one audio stream on a thread of its own, and writes the packets to every
+// rendition. The demuxer only queues packets for it, so audio never holds up the video.
+struct audio_stage {
+    AVStream *in_stream;
+    AVCodecContext *decoder;
+    AVCodecContext *encoder;
+    SwrContext *resampler;
+    AVAudioFifo *fifo;
+    AVFrame *decoded;
+    AVFrame *resampled;
+    AVFrame *frame;
+    AVPacket *packet;
+    int64_t next_pts;
+
+    // The input format the resampler was set up for.
+    int src_format;
+    int src_sample_rate;
+    AVChannelLayout src_layout;
+
+    struct rendition *renditions;
+    int rendition_count;
+    struct transcode_stats *stats;
+    struct queue packets;
+    pthread_t thread;
+    int started;
+    int failed;
+};
+
+// Returns copy, auto, aac or opus as an audio_mode, or -1 for an unknown name.
+int parse_audio_mode(const char *name);
+
+// Opens a stage for every audio stream options->audio_mode re-encodes, into an array indexed by input stream with NULL
+// for the streams that are copied. *stages stays NULL when every stream is copied.
+int open_audio_stages(AVFormatContext *infc, const struct transcode_options *options, struct audio_stage ***stages);
+
+void close_audio_stages(struct audio_stage ***stages, int stream_count);
+
+// Starts each stage's thread writing to the renditions, whose headers must already be written.
+int start_audio_stages(struct audio_stage **stages, int stream_count, struct rendition *renditions,
+                       int rendition_count, struct transcode_stats *stats);
+
+// Queues the packet for its stage, leaving the packet blank. Fails once the stage has failed.
+int audio_stage_send(struct audio_stage *stage, AVPacket *packet);
+
+// Drains every stage and waits for its thread, or with abort set, stops them without draining. Returns -1 if any
+// stage failed.
+int finish_audio_stages(struct audio_stage **stages, int stream_count, int abort);
+
+#endif
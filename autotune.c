@@ -0,0 +1,693 @@
+#include "autotune.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
+#include "hwaccel.h"
+#include "pertitle.h"
+#include "replace_file.h"
+#include "segment.h"
+
+#define CACHE_MAGIC "VRAT1"
+
+// The calibration encodes CALIBRATION_SAMPLES runs of up to CALIBRATION_FRAMES frames, spread evenly over the stream
+// and held in memory so only the encoder is timed. Large renditions get shorter runs, keeping the frames held to about
+// CALIBRATION_PIXELS pixels.
+#define CALIBRATION_SAMPLES 3
+#define CALIBRATION_FRAMES 16
+#define MIN_CALIBRATION_FRAMES 4
+#define CALIBRATION_PIXELS 100000000
+
+// The constant rate factors searched for a quality floor, and the one speed is measured at when a rendition has none,
+// which is x265's default.
+#define MIN_CRF 16
+#define MAX_CRF 36
+#define DEFAULT_CRF 28
+
+// Complexity probes within a quarter of a doubling of each other share cached choices.
+#define COMPLEXITY_BUCKETS 4
+
+// The encoder threads are only cut when the run would still clear the speed target by this much.
+#define THREAD_MARGIN 1.15
+
+// Reported for frames that come back identical, whose PSNR is infinite.
+#define MAX_PSNR 100.0
+
+// x265's presets from fastest to slowest. placebo is left out, as it is never worth its time.
+static const char *const presets[] = {
+        "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow"
+};
+#define PRESET_COUNT ((int) FF_ARRAY_ELEMS(presets))
+#define DEFAULT_PRESET 5
+
+// Frames of the largest rendition, scaled from the source, and what producing them took.
+struct calibration {
+    AVFrame **frames;
+    int frame_count;
+    int width;
+    int height;
+    enum AVPixelFormat format;
+    AVRational frame_rate;
+
+    // Seconds per frame spent decoding and scaling, which the real run spends alongside encoding.
+    double decode_seconds;
+};
+
+struct trial {
+    double speed;
+    double psnr;
+};
+
+struct tuning {
+    int preset;
+    int crf;
+    int threads;
+};
+
+static int find_preset(const char *name) {
+    for (int i = 0; i < PRESET_COUNT; ++i) {
+        if (!strcmp(name, presets[i])) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static int encode_threads(const struct transcode_options *options) {
+    return options->encode_threads ? options->encode_threads : options->threads;
+}
+
+static uint32_t hash_string(uint32_t hash, const char *value) {
+    for (const char *c = value ? value : ""; *c; ++c) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    return (hash ^ '\n') * 16777619u;
+}
+
+// Names the host type by its CPU model and how many threads the job may use, along with the options that change
+// how fast x265 runs, so that choices only carry over to machines and jobs they were measured on.
+static uint32_t host_hash(const struct transcode_options *options) {
+    char model[256] = "unknown";
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file) {
+        char line[256];
+        while (fgets(line, sizeof line, file)) {
+            char *value = strchr(line, ':');
+            if (value && !strncmp(line, "model name", 10)) {
+                snprintf(model, sizeof model, "%s", value + 1);
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    char threads[32];
+    snprintf(threads, sizeof threads, "%d", encode_threads(options));
+    uint32_t hash = hash_string(2166136261u, model);
+    hash = hash_string(hash, threads);
+    hash = hash_string(hash, options->x265_pools);
+    hash = hash_string(hash, options->x265_params);
+    return hash_string(hash, options->preset);
+}
+
+// The rendition with the most pixels, which takes the longest to encode.
+static void largest_size(const struct transcode_options *options, int in_width, int in_height, int *width,
+                         int *height) {
+    *width = 0;
+    *height = 0;
+    for (int i = 0; i < options->rendition_count; ++i) {
+        int rendition_width, rendition_height;
+        resolve_output_size(in_width, in_height, &options->renditions[i], &rendition_width, &rendition_height);
+        if ((int64_t) rendition_width * rendition_height > (int64_t) *width * *height) {
+            *width = rendition_width;
+            *height = rendition_height;
+        }
+    }
+}
+
+// Reads the size and frame rate of the video stream, without decoding, to key the cache.
+static int describe_input(const char *input_file, const struct transcode_options *options, int *width, int *height,
+                          AVRational *frame_rate) {
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return -1;
+    }
+
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        printf("Autotuning found no video stream\n");
+        close_input(&infc);
+        return -1;
+    }
+
+    AVStream *in_stream = infc->streams[stream_index];
+    largest_size(options, in_stream->codecpar->width, in_stream->codecpar->height, width, height);
+    *frame_rate = av_guess_frame_rate(infc, in_stream, NULL);
+    if (frame_rate->num <= 0 || frame_rate->den <= 0) {
+        *frame_rate = (AVRational) {25, 1};
+    }
+
+    close_input(&infc);
+    return 0;
+}
+
+static int cache_path(const struct transcode_options *options, const struct complexity *complexity, int width,
+                      int height, AVRational frame_rate, char *path, size_t path_size) {
+    int bucket = (int) lround(log2(FFMAX(complexity->bits_per_pixel, 1e-6)) * COMPLEXITY_BUCKETS);
+    int length = snprintf(path, path_size, "%s/%08" PRIx32 "-%dx%d-%ld-%d-%g-%g.autotune", options->autotune_cache,
+                          host_hash(options), width, height, lround(av_q2d(frame_rate) * 100), bucket,
+                          options->autotune_speed, options->autotune_psnr);
+    return length < 0 || (size_t) length >= path_size ? -1 : 0;
+}
+
+static int read_tuning(const char *path, struct tuning *tuning) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    char preset[16];
+    int result = fscanf(file, CACHE_MAGIC " %15s %d %d", preset, &tuning->crf, &tuning->threads) == 3 ? 0 : -1;
+    fclose(file);
+
+    tuning->preset = result ? -1 : find_preset(preset);
+    return tuning->preset >= 0 && tuning->threads > 0 ? 0 : -1;
+}
+
+static void write_tuning(const char *path, const struct tuning *tuning) {
+    char temporary[1024];
+    FILE *file = open_replacement(path, temporary, sizeof temporary);
+    if (!file) {
+        printf("Failed to write autotuning cache %s\n", path);
+        return;
+    }
+
+    fprintf(file, CACHE_MAGIC " %s %d %d\n", presets[tuning->preset], tuning->crf, tuning->threads);
+    if (commit_replacement(file, temporary, path, 0)) {
+        printf("Failed to write autotuning cache %s\n", path);
+    }
+}
+
+static void free_calibration(struct calibration *calibration) {
+    for (int i = 0; i < calibration->frame_count; ++i) {
+        av_frame_free(&calibration->frames[i]);
+    }
+    av_freep(&calibration->frames);
+    calibration->frame_count = 0;
+}
+
+// Keeps a decoded frame at the calibration size, numbering it in the order kept. scaler is NULL when the source is
+// already that size.
+static int keep_frame(struct calibration *calibration, struct scaler *scaler, AVFrame *frame) {
+    AVFrame *kept = av_frame_alloc();
+    if (!kept) {
+        return AVERROR(ENOMEM);
+    }
+
+    int reason = scaler ? scale_frame(scaler, kept, frame) : av_frame_ref(kept, frame);
+    if (reason < 0) {
+        av_frame_free(&kept);
+        return reason;
+    }
+
+    kept->pts = calibration->frame_count;
+    kept->pict_type = AV_PICTURE_TYPE_NONE;
+    calibration->frames[calibration->frame_count++] = kept;
+    return 0;
+}
+
+// Decodes from the current position until frames frames are kept, or the stream ends.
+static int load_sample(AVFormatContext *infc, int stream_index, AVCodecContext *decoder, struct scaler *scaler,
+                       AVPacket *packet, AVFrame *frame, int frames, struct calibration *calibration) {
+    int sampled = 0;
+    int eof = 0;
+    while (sampled < frames && !eof) {
+        eof = read_packet(infc, packet, NULL) < 0;
+        if (!eof && packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        int reason = avcodec_send_packet(decoder, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (reason < 0) {
+            print_error("Failed to send calibration packet", reason);
+            return -1;
+        }
+
+        while (sampled < frames && avcodec_receive_frame(decoder, frame) >= 0) {
+            reason = keep_frame(calibration, scaler, frame);
+            av_frame_unref(frame);
+            if (reason < 0) {
+                print_error("Failed to scale calibration frame", reason);
+                return -1;
+            }
+            ++sampled;
+        }
+    }
+
+    return 0;
+}
+
+static int load_calibration(const char *input_file, const struct transcode_options *options,
+                            struct calibration *calibration) {
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return -1;
+    }
+
+    int result = -1;
+    AVCodecContext *decoder = NULL;
+    struct scaler scaler = {0};
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    if (!packet || !frame) {
+        printf("Failed to allocate memory for the calibration\n");
+        goto end;
+    }
+
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        printf("Autotuning found no video stream\n");
+        goto end;
+    }
+    if (!(infc->pb->seekable & AVIO_SEEKABLE_NORMAL) || infc->duration <= 0) {
+        printf("Autotuning needs a seekable input of known duration\n");
+        goto end;
+    }
+
+    AVStream *in_stream = infc->streams[stream_index];
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        infc->streams[i]->discard = i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    const AVCodec *codec = find_decoder(in_stream->codecpar->codec_id, options);
+    decoder = codec ? create_decode_context(codec, in_stream->codecpar, options) : NULL;
+    if (!decoder) {
+        printf("Failed to open the calibration decoder\n");
+        goto end;
+    }
+
+    largest_size(options, decoder->width, decoder->height, &calibration->width, &calibration->height);
+    calibration->format = decoder->pix_fmt;
+    calibration->frame_rate = av_guess_frame_rate(infc, in_stream, NULL);
+    if (calibration->frame_rate.num <= 0 || calibration->frame_rate.den <= 0) {
+        calibration->frame_rate = (AVRational) {25, 1};
+    }
+    int scaled = calibration->width != decoder->width || calibration->height != decoder->height;
+    if (scaled) {
+        int reason = scaler_init(&scaler, calibration->width, calibration->height, calibration->format,
+                                 options->scale_flags, options->scale_threads);
+        if (reason) {
+            print_error("Failed to create calibration scaler", reason);
+            goto end;
+        }
+    }
+
+    int64_t pixels = (int64_t) calibration->width * calibration->height;
+    int frames = (int) av_clip64(CALIBRATION_PIXELS / (pixels * CALIBRATION_SAMPLES), MIN_CALIBRATION_FRAMES,
+                                 CALIBRATION_FRAMES);
+    calibration->frames = av_calloc(CALIBRATION_SAMPLES * frames, sizeof *calibration->frames);
+    if (!calibration->frames) {
+        printf("Failed to allocate memory for the calibration\n");
+        goto end;
+    }
+
+    int64_t started = av_gettime_relative();
+    int64_t start = infc->start_time != AV_NOPTS_VALUE ? infc->start_time : 0;
+    for (int i = 0; i < CALIBRATION_SAMPLES; ++i) {
+        int64_t target = start + av_rescale(infc->duration, 2 * i + 1, 2 * CALIBRATION_SAMPLES);
+        int reason = av_seek_frame(infc, -1, target, AVSEEK_FLAG_BACKWARD);
+        if (reason < 0) {
+            print_error("Failed to seek for the calibration", reason);
+            goto end;
+        }
+        avcodec_flush_buffers(decoder);
+
+        if (load_sample(infc, stream_index, decoder, scaled ? &scaler : NULL, packet, frame, frames, calibration)) {
+            goto end;
+        }
+    }
+
+    if (!calibration->frame_count) {
+        printf("The calibration decoded no frames\n");
+        goto end;
+    }
+    calibration->decode_seconds = (double) (av_gettime_relative() - started) / AV_TIME_BASE /
+                                  calibration->frame_count;
+    result = 0;
+
+    end:
+    if (result) {
+        free_calibration(calibration);
+    }
+    scaler_uninit(&scaler);
+    avcodec_free_context(&decoder);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    close_input(&infc);
+    return result;
+}
+
+static AVCodecContext *open_calibration_encoder(const struct calibration *calibration, int preset, int crf,
+                                                int threads, const struct transcode_options *options) {
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx265");
+    if (!codec) {
+        printf("Failed to find libx265 codec for the calibration\n");
+        return NULL;
+    }
+
+    AVCodecContext *encoder = avcodec_alloc_context3(codec);
+    if (!encoder) {
+        printf("Failed to allocate memory for the calibration encoder\n");
+        return NULL;
+    }
+
+    encoder->width = calibration->width;
+    encoder->height = calibration->height;
+    encoder->pix_fmt = calibration->format;
+    encoder->time_base = av_inv_q(calibration->frame_rate);
+    encoder->framerate = calibration->frame_rate;
+    encoder->thread_count = threads;
+
+    const char *shared = options->x265_params;
+    char pools[32];
+    snprintf(pools, sizeof pools, "%d", threads);
+    char *params = av_asprintf("pools=%s:log-level=warning%s%s", options->x265_pools ? options->x265_pools : pools,
+                               shared ? ":" : "", shared ? shared : "");
+    AVDictionary *codec_options = NULL;
+    av_dict_set(&codec_options, "preset", presets[preset], 0);
+    av_dict_set_int(&codec_options, "crf", crf, 0);
+    av_dict_set(&codec_options, "x265-params", params, AV_DICT_DONT_STRDUP_VAL);
+    int reason = params ? avcodec_open2(encoder, codec, &codec_options) : AVERROR(ENOMEM);
+    av_dict_free(&codec_options);
+    if (reason < 0) {
+        print_error("Failed to open the calibration encoder", reason);
+        avcodec_free_context(&encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+// Sends a frame, or NULL to drain, and keeps every packet that comes back.
+static int encode_calibration_frame(AVCodecContext *encoder, AVFrame *frame, AVPacket *packet,
+                                    struct packet_list *packets) {
+    int reason = avcodec_send_frame(encoder, frame);
+    if (reason < 0) {
+        print_error("Failed to send calibration frame", reason);
+        return -1;
+    }
+
+    while ((reason = avcodec_receive_packet(encoder, packet)) >= 0) {
+        AVPacket *kept = av_packet_alloc();
+        if (!kept) {
+            av_packet_unref(packet);
+            printf("Failed to allocate memory for calibration packets\n");
+            return -1;
+        }
+
+        av_packet_move_ref(kept, packet);
+        if (append_packet(packets, kept)) {
+            av_packet_free(&kept);
+            printf("Failed to allocate memory for calibration packets\n");
+            return -1;
+        }
+    }
+    if (reason != AVERROR(EAGAIN) && reason != AVERROR_EOF) {
+        print_error("Failed to receive calibration packets", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The squared error between the luma planes of two frames of the same size and format.
+static double luma_error(const AVFrame *a, const AVFrame *b, int high_depth) {
+    double error = 0;
+    for (int y = 0; y < a->height; ++y) {
+        const uint8_t *row_a = a->data[0] + (ptrdiff_t) y * a->linesize[0];
+        const uint8_t *row_b = b->data[0] + (ptrdiff_t) y * b->linesize[0];
+        int64_t row_error = 0;
+        for (int x = 0; x < a->width; ++x) {
+            int difference = high_depth ? ((const uint16_t *) row_a)[x] - ((const uint16_t *) row_b)[x] :
+                             row_a[x] - row_b[x];
+            row_error += difference * difference;
+        }
+        error += (double) row_error;
+    }
+
+    return error;
+}
+
+// Decodes the calibration packets and compares each frame with the one it was encoded from, giving the PSNR of the
+// luma error over every frame together.
+static int measure_psnr(const struct calibration *calibration, const struct packet_list *packets,
+                        const struct transcode_options *options, double *psnr) {
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_HEVC);
+    AVCodecContext *decoder = codec ? avcodec_alloc_context3(codec) : NULL;
+    AVFrame *frame = av_frame_alloc();
+    int result = -1;
+    if (!decoder || !frame) {
+        printf("Failed to allocate memory for the calibration quality check\n");
+        goto end;
+    }
+
+    decoder->thread_count = FFMIN(options->threads, MAX_AUTO_DECODE_THREADS);
+    int reason = avcodec_open2(decoder, codec, NULL);
+    if (reason < 0) {
+        print_error("Failed to open the calibration quality decoder", reason);
+        goto end;
+    }
+
+    const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(calibration->format);
+    int depth = descriptor->comp[0].depth;
+    double error = 0;
+    int64_t compared = 0;
+    for (int i = 0; i <= packets->count; ++i) {
+        reason = avcodec_send_packet(decoder, i < packets->count ? packets->packets[i] : NULL);
+        if (reason < 0) {
+            print_error("Failed to send calibration packet", reason);
+            goto end;
+        }
+
+        while (avcodec_receive_frame(decoder, frame) >= 0) {
+            if (frame->pts >= 0 && frame->pts < calibration->frame_count && frame->format == calibration->format) {
+                error += luma_error(frame, calibration->frames[frame->pts], depth > 8);
+                ++compared;
+            }
+            av_frame_unref(frame);
+        }
+    }
+
+    if (!compared) {
+        printf("The calibration quality check decoded no frames\n");
+        goto end;
+    }
+
+    double peak = (double) ((1 << depth) - 1);
+    double mean_error = error / ((double) compared * calibration->width * calibration->height);
+    *psnr = mean_error > 0 ? FFMIN(10 * log10(peak * peak / mean_error), MAX_PSNR) : MAX_PSNR;
+    result = 0;
+
+    end:
+    av_frame_free(&frame);
+    avcodec_free_context(&decoder);
+    return result;
+}
+
+// Encodes the calibration frames and works out the speed of the whole run, taking decoding and encoding to follow
+// one another, which errs towards the slower side. The quality is only measured with check_quality set.
+static int run_trial(const struct calibration *calibration, int preset, int crf, int threads, int check_quality,
+                     const struct transcode_options *options, struct trial *trial) {
+    AVCodecContext *encoder = open_calibration_encoder(calibration, preset, crf, threads, options);
+    if (!encoder) {
+        return -1;
+    }
+
+    int result = -1;
+    struct packet_list packets = {0};
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        printf("Failed to allocate memory for the calibration\n");
+        goto end;
+    }
+
+    int64_t started = av_gettime_relative();
+    for (int i = 0; i < calibration->frame_count; ++i) {
+        if (encode_calibration_frame(encoder, calibration->frames[i], packet, &packets)) {
+            goto end;
+        }
+    }
+    if (encode_calibration_frame(encoder, NULL, packet, &packets)) {
+        goto end;
+    }
+
+    double encode_seconds = (double) (av_gettime_relative() - started) / AV_TIME_BASE / calibration->frame_count;
+    trial->speed = 1 / ((calibration->decode_seconds + encode_seconds) * av_q2d(calibration->frame_rate));
+    trial->psnr = 0;
+    result = check_quality ? measure_psnr(calibration, &packets, options, &trial->psnr) : 0;
+
+    end:
+    free_packet_list(&packets);
+    av_packet_free(&packet);
+    avcodec_free_context(&encoder);
+    return result;
+}
+
+// Binary searches for the slowest preset that keeps up with the speed target, then the fewest threads that still do
+// at it, then the highest CRF that stays above the quality floor. Speed falls with each slower preset and quality with
+// each higher CRF, so each search needs only a few trials.
+static int tune(const struct calibration *calibration, const struct transcode_options *options,
+                struct tuning *tuning) {
+    int threads = encode_threads(options);
+    const struct rendition_options *rendition = &options->renditions[0];
+    int crf = rendition->crf >= 0 ? rendition->crf : DEFAULT_CRF;
+    struct trial trial;
+
+    *tuning = (struct tuning) {options->preset ? find_preset(options->preset) : DEFAULT_PRESET, -1, threads};
+    if (options->autotune_speed) {
+        int low = 0;
+        int high = PRESET_COUNT - 1;
+        double speed = 0;
+        tuning->preset = -1;
+        while (low <= high) {
+            int middle = (low + high) / 2;
+            if (run_trial(calibration, middle, crf, threads, 0, options, &trial)) {
+                return -1;
+            }
+            printf("Autotuning: preset %s runs at %.2fx realtime\n", presets[middle], trial.speed);
+
+            if (trial.speed >= options->autotune_speed) {
+                tuning->preset = middle;
+                speed = trial.speed;
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        }
+
+        if (tuning->preset < 0) {
+            printf("Autotuning: no preset reaches %.2fx realtime, so the fastest is used\n", options->autotune_speed);
+            tuning->preset = 0;
+        } else if (speed > options->autotune_speed * THREAD_MARGIN && threads > 1 && !options->x265_pools) {
+            // Encoding speed grows less than linearly in threads, so the cut is checked before it is kept.
+            int fewer = FFMAX(1, (int) ceil(threads * options->autotune_speed * THREAD_MARGIN / speed));
+            if (fewer < threads) {
+                if (run_trial(calibration, tuning->preset, crf, fewer, 0, options, &trial)) {
+                    return -1;
+                }
+                printf("Autotuning: %d threads run at %.2fx realtime\n", fewer, trial.speed);
+                tuning->threads = trial.speed >= options->autotune_speed ? fewer : threads;
+            }
+        }
+    }
+
+    if (options->autotune_psnr) {
+        int low = MIN_CRF;
+        int high = MAX_CRF;
+        tuning->crf = -1;
+        while (low <= high) {
+            int middle = (low + high) / 2;
+            if (run_trial(calibration, tuning->preset, middle, tuning->threads, 1, options, &trial)) {
+                return -1;
+            }
+            printf("Autotuning: CRF %d gives %.2f dB\n", middle, trial.psnr);
+
+            if (trial.psnr >= options->autotune_psnr) {
+                tuning->crf = middle;
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        }
+
+        if (tuning->crf < 0) {
+            printf("Autotuning: no CRF reaches %.2f dB, so the lowest is used\n", options->autotune_psnr);
+            tuning->crf = MIN_CRF;
+        }
+    }
+
+    return 0;
+}
+
+int autotune_options(const char *input_file, const struct transcode_options *options,
+                     struct transcode_options *tuned) {
+    if (options->preset && find_preset(options->preset) < 0) {
+        printf("Autotuning needs an x265 preset, not %s\n", options->preset);
+        return -1;
+    }
+
+    // The calibration decodes in software and encodes with x265 alone, like the complexity probe.
+    struct transcode_options calibration_options = *options;
+    calibration_options.hw_device = NULL;
+
+    struct complexity complexity;
+    int width, height;
+    AVRational frame_rate;
+    if (probe_complexity(input_file, &calibration_options, &complexity) ||
+        describe_input(input_file, &calibration_options, &width, &height, &frame_rate)) {
+        return -1;
+    }
+
+    char path[1024];
+    int cached = options->autotune_cache &&
+                 !cache_path(options, &complexity, width, height, frame_rate, path, sizeof path);
+    struct tuning tuning;
+    if (cached && !read_tuning(path, &tuning)) {
+        printf("Autotuning: using the choice cached in %s\n", path);
+    } else {
+        struct calibration calibration = {0};
+        if (load_calibration(input_file, &calibration_options, &calibration)) {
+            return -1;
+        }
+        printf("Autotuning: calibrating on %d frames at %dx%d\n", calibration.frame_count, calibration.width,
+               calibration.height);
+
+        int result = tune(&calibration, &calibration_options, &tuning);
+        free_calibration(&calibration);
+        if (result) {
+            return -1;
+        }
+        if (cached) {
+            write_tuning(path, &tuning);
+        }
+    }
+
+    *tuned = *options;
+    tuned->renditions = av_calloc(options->rendition_count, sizeof *tuned->renditions);
+    if (!tuned->renditions) {
+        printf("Failed to allocate memory for autotuned renditions\n");
+        return -1;
+    }
+
+    // Renditions given a rate of their own keep it.
+    for (int i = 0; i < options->rendition_count; ++i) {
+        tuned->renditions[i] = options->renditions[i];
+        if (tuning.crf >= 0 && tuned->renditions[i].crf < 0 && !tuned->renditions[i].bit_rate) {
+            tuned->renditions[i].crf = tuning.crf;
+        }
+    }
+    tuned->preset = presets[tuning.preset];
+    if (tuning.threads < encode_threads(options)) {
+        tuned->encode_threads = tuning.threads;
+    }
+    tuned->autotune_speed = 0;
+    tuned->autotune_psnr = 0;
+
+    printf("Autotuning: preset %s, %d encoder threads", tuned->preset, encode_threads(tuned));
+    if (tuning.crf >= 0) {
+        printf(", CRF %d", tuning.crf);
+    }
+    printf("\n");
+    return 0;
+}
+
+void free_autotuned(struct transcode_options *tuned) {
+    av_freep(&tuned->renditions);
+}
@@ -0,0 +1,17 @@
+#ifndef VIDEO_RESIZE_AUTOTUNE_H
+#define VIDEO_RESIZE_AUTOTUNE_H
+
+#include "transcode.h"
+
+// Fills tuned with options to transcode input_file meeting options->autotune_speed, a multiple of realtime, and
+// options->autotune_psnr, a floor on luma PSNR in dB, on this host. A short calibration encode of frames sampled from
+// the input picks the slowest x265 preset that keeps up, the fewest encoder threads that still do, and the highest CRF
+// for renditions without one that stays above the floor. With options->autotune_cache set, choices are kept per host
+// and per class of content, so similar inputs later skip the calibration. tuned->renditions is a copy that
+// free_autotuned releases.
+int autotune_options(const char *input_file, const struct transcode_options *options,
+                     struct transcode_options *tuned);
+
+void free_autotuned(struct transcode_options *tuned);
+
+#endif
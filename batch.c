@@ -0,0 +1,284 @@
+#include "batch.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <libavutil/avstring.h>
+#include <libavutil/mem.h>
+
+#include "options.h"
+#include "queue.h"
+#include "scheduler.h"
+
+#define MAX_LINE_SIZE 8192
+#define MAX_ARGUMENTS 256
+
+struct batch_job {
+    int line_number;
+    char *args[MAX_ARGUMENTS];
+    int arg_count;
+
+    // The parsed options keep pointing into args, which live as long as the job does.
+    struct transcode_options options;
+    const char *input_file;
+};
+
+struct batch {
+    struct queue jobs;
+    struct scheduler *scheduler;
+    int job_count;
+    pthread_mutex_t mutex;
+    int failed;
+    int succeeded;
+};
+
+static void free_job(void *item) {
+    struct batch_job *job = item;
+    free_options(&job->options);
+    for (int i = 0; i < job->arg_count; ++i) {
+        av_free(job->args[i]);
+    }
+    av_free(job);
+}
+
+static int add_argument(struct batch_job *job, const char *start, int length) {
+    if (job->arg_count == MAX_ARGUMENTS) {
+        printf("Line %d has too many arguments\n", job->line_number);
+        return -1;
+    }
+
+    job->args[job->arg_count] = av_strndup(start, length);
+    if (!job->args[job->arg_count]) {
+        printf("Failed to allocate memory for line %d\n", job->line_number);
+        return -1;
+    }
+    ++job->arg_count;
+    return 0;
+}
+
+// Splits a line on whitespace. Single or double quotes keep an argument with spaces in it together.
+static int split_line(struct batch_job *job, const char *line) {
+    const char *cursor = line;
+    for (;;) {
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\n' || *cursor == '\r') {
+            ++cursor;
+        }
+        if (!*cursor) {
+            return 0;
+        }
+
+        char quote = *cursor == '"' || *cursor == '\'' ? *cursor++ : '\0';
+        const char *start = cursor;
+        while (*cursor && (quote ? *cursor != quote : !strchr(" \t\n\r", *cursor))) {
+            ++cursor;
+        }
+        if (quote && *cursor != quote) {
+            printf("Line %d has an unterminated quote\n", job->line_number);
+            return -1;
+        }
+
+        if (add_argument(job, start, (int) (cursor - start))) {
+            return -1;
+        }
+        if (quote) {
+            ++cursor;
+        }
+    }
+}
+
+static int is_batch_option(const char *arg) {
+    return !strcmp(arg, "--batch") || !strncmp(arg, "--batch=", 8) || !strcmp(arg, "--jobs") ||
+           !strncmp(arg, "--jobs=", 7);
+}
+
+// Builds a job from the common arguments followed by the line's own, parsed the same way as a command line.
+static struct batch_job *parse_job(const char *line, int line_number, int common_arg_count, char **common_args) {
+    struct batch_job *job = av_mallocz(sizeof *job);
+    if (!job) {
+        printf("Failed to allocate memory for line %d\n", line_number);
+        return NULL;
+    }
+    job->line_number = line_number;
+
+    // getopt skips the program name, so it gets a slot of its own ahead of the arguments.
+    if (add_argument(job, "video_resize", (int) strlen("video_resize"))) {
+        free_job(job);
+        return NULL;
+    }
+    for (int i = 0; i < common_arg_count; ++i) {
+        // A job handed the batch's own options would run a batch of its own.
+        if (is_batch_option(common_args[i])) {
+            i += !strchr(common_args[i], '=');
+            continue;
+        }
+        if (add_argument(job, common_args[i], (int) strlen(common_args[i]))) {
+            free_job(job);
+            return NULL;
+        }
+    }
+    if (split_line(job, line)) {
+        free_job(job);
+        return NULL;
+    }
+
+    // getopt may reorder the vector, so it works on a copy and the originals stay in args to be freed.
+    char *argv[MAX_ARGUMENTS + 1];
+    memcpy(argv, job->args, job->arg_count * sizeof *argv);
+    argv[job->arg_count] = NULL;
+
+    struct rendition_options single;
+    if (parse_options(job->arg_count, argv, &job->options, &single)) {
+        printf("Invalid options on line %d\n", line_number);
+        free_job(job);
+        return NULL;
+    }
+
+    if (optind >= job->arg_count) {
+        printf("Line %d has no input file\n", line_number);
+        free_job(job);
+        return NULL;
+    }
+    job->input_file = argv[optind++];
+
+    if (!job->options.rendition_count) {
+        if (optind >= job->arg_count) {
+            printf("Line %d has no output file\n", line_number);
+            free_job(job);
+            return NULL;
+        }
+        if (add_single_rendition(&job->options, &single, argv[optind])) {
+            free_job(job);
+            return NULL;
+        }
+    }
+    return job;
+}
+
+// Sizes the job's thread pools to its cores. x265 pools a job names itself are left alone.
+static void apply_allocation(struct transcode_options *options, const struct core_allocation *allocation) {
+    options->threads = allocation->threads;
+    options->decode_threads = options->decode_threads ? FFMIN(options->decode_threads, allocation->threads) : 0;
+    options->encode_threads = options->encode_threads ? FFMIN(options->encode_threads, allocation->threads) : 0;
+    if (!options->x265_pools) {
+        options->x265_pools = allocation->pools;
+    }
+}
+
+static int run_job(struct batch *batch, struct batch_job *job) {
+    struct transcode_options *options = &job->options;
+    int priority = options->priority;
+    if (priority < 0) {
+        priority = options->live ? PRIORITY_LIVE : PRIORITY_ON_DEMAND;
+    }
+
+    struct core_allocation allocation;
+    if (scheduler_acquire(batch->scheduler, job_demand(job->input_file, options), priority, &allocation)) {
+        return -1;
+    }
+
+    printf("Starting line %d on %d cores: %s\n", job->line_number, allocation.threads, job->input_file);
+    apply_allocation(options, &allocation);
+    // Jobs running at once share the memory budget evenly, as every line is given the whole of it.
+    options->memory_budget /= batch->job_count;
+    int result = transcode_file(job->input_file, options);
+    scheduler_release(batch->scheduler, &allocation);
+    return result;
+}
+
+static void *batch_worker(void *arg) {
+    struct batch *batch = arg;
+
+    struct batch_job *job;
+    while (!queue_pop(&batch->jobs, (void **) &job)) {
+        int result = run_job(batch, job);
+        printf("%s line %d: %s\n", result ? "Failed" : "Finished", job->line_number, job->input_file);
+
+        pthread_mutex_lock(&batch->mutex);
+        if (result) {
+            ++batch->failed;
+        } else {
+            ++batch->succeeded;
+        }
+        pthread_mutex_unlock(&batch->mutex);
+        free_job(job);
+    }
+
+    return NULL;
+}
+
+int run_batch(const char *manifest, const struct transcode_options *options, int common_arg_count,
+              char **common_args) {
+    FILE *file = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+    if (!file) {
+        printf("Failed to open manifest %s\n", manifest);
+        return -1;
+    }
+
+    // Twice as many workers as jobs run at once keep a job per running one waiting for cores, so a job of a higher
+    // priority read meanwhile is admitted ahead of them.
+    int job_count = FFMAX(1, options->jobs);
+    int worker_count = job_count * 2;
+    struct batch batch = {.job_count = job_count};
+    pthread_t *threads = av_calloc(worker_count, sizeof *threads);
+    batch.scheduler = scheduler_create(options->threads, job_count);
+    if (!threads || !batch.scheduler || queue_init(&batch.jobs, job_count, 1)) {
+        printf("Failed to set up batch\n");
+        scheduler_free(&batch.scheduler);
+        av_free(threads);
+        if (file != stdin) {
+            fclose(file);
+        }
+        return -1;
+    }
+    pthread_mutex_init(&batch.mutex, NULL);
+
+    int started = 0;
+    for (; started < worker_count; ++started) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &batch)) {
+            break;
+        }
+    }
+
+    int invalid = 0;
+    if (!started) {
+        printf("Failed to start batch workers\n");
+        invalid = 1;
+    }
+
+    // Lines are parsed here one at a time, since getopt is not thread-safe, and a full queue holds the reader back.
+    char line[MAX_LINE_SIZE];
+    int line_number = 0;
+    while (started && fgets(line, sizeof line, file)) {
+        ++line_number;
+        const char *content = line + strspn(line, " \t\r\n");
+        if (!*content || *content == '#') {
+            continue;
+        }
+
+        struct batch_job *job = parse_job(content, line_number, common_arg_count, common_args);
+        if (!job) {
+            ++invalid;
+            continue;
+        }
+        if (queue_push(&batch.jobs, job)) {
+            free_job(job);
+            break;
+        }
+    }
+    queue_finish(&batch.jobs);
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("Batch finished: %d succeeded, %d failed, %d invalid\n", batch.succeeded, batch.failed, invalid);
+
+    queue_destroy(&batch.jobs, free_job);
+    scheduler_free(&batch.scheduler);
+    pthread_mutex_destroy(&batch.mutex);
+    av_free(threads);
+    if (file != stdin) {
+        fclose(file);
+    }
+    return batch.failed || invalid ? -1 : 0;
+}
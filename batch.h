@@ -0,0 +1,14 @@
+#ifndef VIDEO_RESIZE_BATCH_H
+#define VIDEO_RESIZE_BATCH_H
+
+#include "transcode.h"
+
+// Runs every job in manifest, a file of lines holding "[options] input [output]" as on the command line, or standard
+// input for "-". Each job starts from the arguments in common_args, which its own options override, and up to
+// options->jobs run at once on cores of options->threads that a scheduler hands out by priority and by the size of
+// each job's encode. Lines are read as jobs start, so a process writing to a pipe or FIFO can keep feeding jobs.
+// Returns 0 if every job succeeded.
+int run_batch(const char *manifest, const struct transcode_options *options, int common_arg_count,
+              char **common_args);
+
+#endif
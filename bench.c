@@ -0,0 +1,443 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/opt.h>
+
+#include "options.h"
+#include "pool.h"
+#include "transcode.h"
+
+#define CLIP_RATE 30
+#define AUDIO_RATE 48000
+#define AUDIO_FRAME_SIZE 1024
+
+// Synthetic clips covering resolution, audio load, keyframe spacing and frame timing.
+static const struct bench_clip {
+    const char *name;
+    int width;
+    int height;
+    int gop;
+    int audio_streams;
+    int vfr;
+} clips[] = {
+        {"720p",        1280, 720,  60,  1, 0},
+        {"1080p",       1920, 1080, 60,  1, 0},
+        {"2160p",       3840, 2160, 60,  1, 0},
+        {"audio-heavy", 1280, 720,  60,  8, 0},
+        {"high-gop",    1920, 1080, 600, 1, 0},
+        {"vfr",         1280, 720,  60,  1, 1}
+};
+
+// Each configuration is applied on top of the transcode options given after "--".
+static const struct config {
+    const char *name;
+    int single_thread;
+    int pipeline;
+    int segments;
+} configs[] = {
+        {"1-thread",  1, 0, 0},
+        {"threads",   0, 0, 0},
+        {"pipeline",  0, 1, 0},
+        {"segments",  0, 0, 1}
+};
+
+struct source {
+    AVFilterGraph *graph;
+    AVFilterContext *sink;
+    AVCodecContext *encoder;
+    AVStream *stream;
+    int64_t next_pts;
+    int done;
+};
+
+static void print_bench_usage(const char *program) {
+    printf("Usage: %s [--dir <dir>] [--duration <s>] [--clip <name>]... [--input <file>]... [-- options]\n", program);
+    printf("Runs each clip through each configuration and prints fps, speed, peak RSS and stage times.\n\n");
+    printf("  --dir <dir>       where generated clips, outputs and JSON reports go (default bench)\n");
+    printf("  --duration <s>    length of the generated clips (default 10)\n");
+    printf("  --clip <name>     only run this synthetic clip; repeatable. One of:");
+    for (int i = 0; i < sizeof clips / sizeof *clips; ++i) {
+        printf(" %s", clips[i].name);
+    }
+    printf("\n  --input <file>    also run a reference clip; repeatable\n");
+    printf("  -- options        video_resize options every run starts from, e.g. -- --size 1280x-1 --crf 28\n");
+}
+
+static void free_source(struct source *source) {
+    avfilter_graph_free(&source->graph);
+    avcodec_free_context(&source->encoder);
+}
+
+static int open_source(struct source *source, AVFormatContext *outfc, const char *description,
+                       enum AVMediaType type, const AVCodec *codec, const struct bench_clip *clip) {
+    source->graph = avfilter_graph_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    if (!source->graph || !inputs) {
+        avfilter_inout_free(&inputs);
+        return AVERROR(ENOMEM);
+    }
+
+    const char *sink_name = type == AVMEDIA_TYPE_VIDEO ? "buffersink" : "abuffersink";
+    int reason = avfilter_graph_create_filter(&source->sink, avfilter_get_by_name(sink_name), "out", NULL, NULL,
+                                              source->graph);
+    if (reason >= 0) {
+        inputs->name = av_strdup("out");
+        inputs->filter_ctx = source->sink;
+        reason = avfilter_graph_parse_ptr(source->graph, description, &inputs, NULL, NULL);
+    }
+    avfilter_inout_free(&inputs);
+    if (reason >= 0) {
+        reason = avfilter_graph_config(source->graph, NULL);
+    }
+    if (reason < 0) {
+        return reason;
+    }
+
+    source->encoder = avcodec_alloc_context3(codec);
+    if (!source->encoder) {
+        return AVERROR(ENOMEM);
+    }
+
+    AVCodecContext *encoder = source->encoder;
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        encoder->width = clip->width;
+        encoder->height = clip->height;
+        encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+        encoder->time_base = av_buffersink_get_time_base(source->sink);
+        encoder->framerate = (AVRational) {CLIP_RATE, 1};
+        encoder->gop_size = clip->gop;
+        encoder->bit_rate = (int64_t) clip->width * clip->height * 4;
+        av_opt_set(encoder->priv_data, "preset", "ultrafast", 0);
+    } else {
+        encoder->sample_fmt = AV_SAMPLE_FMT_FLTP;
+        encoder->sample_rate = AUDIO_RATE;
+        encoder->time_base = (AVRational) {1, AUDIO_RATE};
+        encoder->bit_rate = 128000;
+        av_channel_layout_default(&encoder->ch_layout, 2);
+        av_buffersink_set_frame_size(source->sink, AUDIO_FRAME_SIZE);
+    }
+    if (outfc->oformat->flags & AVFMT_GLOBALHEADER) {
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    reason = avcodec_open2(encoder, codec, NULL);
+    if (reason < 0) {
+        return reason;
+    }
+
+    source->stream = avformat_new_stream(outfc, NULL);
+    if (!source->stream) {
+        return AVERROR(ENOMEM);
+    }
+    source->stream->time_base = encoder->time_base;
+    return avcodec_parameters_from_context(source->stream->codecpar, encoder);
+}
+
+// Pulls one frame from the source's filter graph, or NULL once it ends, through its encoder into the file.
+static int step_source(struct source *source, AVFormatContext *outfc, AVFrame *frame, AVPacket *packet) {
+    int reason = av_buffersink_get_frame(source->sink, frame);
+    if (reason == AVERROR_EOF) {
+        source->done = 1;
+    } else if (reason < 0) {
+        return reason;
+    } else {
+        source->next_pts = frame->pts;
+    }
+
+    reason = avcodec_send_frame(source->encoder, source->done ? NULL : frame);
+    av_frame_unref(frame);
+    if (reason < 0) {
+        return reason;
+    }
+
+    while ((reason = avcodec_receive_packet(source->encoder, packet)) >= 0) {
+        packet->stream_index = source->stream->index;
+        av_packet_rescale_ts(packet, source->encoder->time_base, source->stream->time_base);
+        reason = av_interleaved_write_frame(outfc, packet);
+        if (reason < 0) {
+            return reason;
+        }
+    }
+    return reason == AVERROR(EAGAIN) || reason == AVERROR_EOF ? 0 : reason;
+}
+
+// Renders testsrc2 with sine tones into an MP4, encoding with the first of libx264 and mpeg4 that is available.
+static int generate_clip(const struct bench_clip *clip, const char *path, int duration) {
+    const AVCodec *video_codec = avcodec_find_encoder_by_name("libx264");
+    if (!video_codec) {
+        video_codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    }
+    const AVCodec *audio_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!video_codec || !audio_codec) {
+        printf("Failed to find encoders for the benchmark clips\n");
+        return -1;
+    }
+
+    AVFormatContext *outfc = NULL;
+    int source_count = 1 + clip->audio_streams;
+    struct source *sources = av_calloc(source_count, sizeof *sources);
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+    int reason = avformat_alloc_output_context2(&outfc, NULL, "mp4", path);
+    if (!sources || !frame || !packet) {
+        reason = AVERROR(ENOMEM);
+    }
+
+    // select keeps the timestamps of the frames it passes, so dropping an uneven pattern leaves the rate variable.
+    char description[256];
+    snprintf(description, sizeof description, "testsrc2=size=%dx%d:rate=%d:duration=%d%s,format=yuv420p",
+             clip->width, clip->height, CLIP_RATE, duration,
+             clip->vfr ? ",select='not(eq(mod(n\\,7)\\,3))*not(eq(mod(n\\,11)\\,5))'" : "");
+    if (reason >= 0) {
+        reason = open_source(&sources[0], outfc, description, AVMEDIA_TYPE_VIDEO, video_codec, clip);
+    }
+    for (int i = 1; i < source_count && reason >= 0; ++i) {
+        snprintf(description, sizeof description,
+                 "sine=frequency=%d:sample_rate=%d:duration=%d,aformat=sample_fmts=fltp:channel_layouts=stereo",
+                 220 * i, AUDIO_RATE, duration);
+        reason = open_source(&sources[i], outfc, description, AVMEDIA_TYPE_AUDIO, audio_codec, clip);
+    }
+
+    if (reason >= 0) {
+        reason = avio_open(&outfc->pb, path, AVIO_FLAG_WRITE);
+    }
+    if (reason >= 0) {
+        reason = avformat_write_header(outfc, NULL);
+    }
+
+    // Always advancing the source that is furthest behind keeps the streams interleaved.
+    while (reason >= 0) {
+        struct source *next = NULL;
+        for (int i = 0; i < source_count; ++i) {
+            if (!sources[i].done && (!next || av_compare_ts(sources[i].next_pts, sources[i].encoder->time_base,
+                                                            next->next_pts, next->encoder->time_base) < 0)) {
+                next = &sources[i];
+            }
+        }
+        if (!next) {
+            reason = av_write_trailer(outfc);
+            break;
+        }
+
+        reason = step_source(next, outfc, frame, packet);
+    }
+    if (reason < 0) {
+        print_error("Failed to generate benchmark clip", reason);
+    }
+
+    for (int i = 0; sources && i < source_count; ++i) {
+        free_source(&sources[i]);
+    }
+    if (outfc) {
+        avio_closep(&outfc->pb);
+        avformat_free_context(outfc);
+    }
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    av_free(sources);
+    if (reason < 0) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Pulls a number out of the flat JSON report by key. Keys inside a stage object are found after the stage's name.
+static double report_value(const char *report, const char *object, const char *key) {
+    const char *cursor = report;
+    char pattern[64];
+    if (object) {
+        snprintf(pattern, sizeof pattern, "\"%s\":", object);
+        cursor = strstr(cursor, pattern);
+        if (!cursor) {
+            return 0;
+        }
+    }
+
+    snprintf(pattern, sizeof pattern, "\"%s\":", key);
+    cursor = strstr(cursor, pattern);
+    return cursor ? strtod(cursor + strlen(pattern), NULL) : 0;
+}
+
+// Reads a whole report, however large, with a terminating NUL.
+static char *read_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+
+    struct stat status;
+    char *contents = NULL;
+    if (!fstat(fileno(file), &status) && status.st_size < SIZE_MAX) {
+        contents = av_malloc((size_t) status.st_size + 1);
+    }
+    if (contents) {
+        size_t size = fread(contents, 1, status.st_size, file);
+        contents[size] = '\0';
+    }
+    fclose(file);
+    return contents;
+}
+
+// Runs one transcode in a child process, so its peak RSS is its own and a crash only fails the one run.
+static int run_config(const char *dir, const char *name, const char *input_file, const struct config *config,
+                      const struct transcode_options *base, const struct rendition_options *single) {
+    char output_file[1024];
+    char report_file[1024];
+    snprintf(output_file, sizeof output_file, "%s/%s-%s.mp4", dir, name, config->name);
+    snprintf(report_file, sizeof report_file, "%s/%s-%s.json", dir, name, config->name);
+    fflush(stdout);
+
+    pid_t child = fork();
+    if (child < 0) {
+        printf("Failed to start benchmark run: %s\n", strerror(errno));
+        return -1;
+    }
+    if (!child) {
+        // The run's own output would interleave with the table.
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(1);
+        }
+
+        struct transcode_options options = *base;
+        struct rendition_options rendition = *single;
+        options.renditions = NULL;
+        options.rendition_count = 0;
+        options.stats_options.report_file = report_file;
+        if (config->single_thread) {
+            options.threads = 1;
+        }
+        options.pipeline = config->pipeline;
+        if (config->segments) {
+            options.segment_workers = FFMAX(2, options.threads / 4);
+            options.segment_duration = 2;
+        }
+        if (add_single_rendition(&options, &rendition, output_file)) {
+            _exit(1);
+        }
+        _exit(transcode_file(input_file, &options) ? 1 : 0);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) < 0) {
+        printf("Failed to wait for benchmark run: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(output_file);
+
+    char *report = read_file(report_file);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) || !report) {
+        printf("%-12s %-10s failed\n", name, config->name);
+        av_free(report);
+        return -1;
+    }
+
+    printf("%-12s %-10s %8.1f %7.2fx %8.1f %6.2f %6.2f %6.2f %6.2f %6.2f %8.2f\n", name, config->name,
+           report_value(report, NULL, "fps"), report_value(report, NULL, "speed"), usage.ru_maxrss / 1024.0,
+           report_value(report, "demux", "wall_seconds"), report_value(report, "decode", "wall_seconds"),
+           report_value(report, "scale", "wall_seconds"), report_value(report, "encode", "wall_seconds"),
+           report_value(report, "mux", "wall_seconds"), report_value(report, NULL, "wall_seconds"));
+    av_free(report);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "bench";
+    int duration = 10;
+    const char *selected[sizeof clips / sizeof *clips];
+    int selected_count = 0;
+    const char *inputs[64];
+    int input_count = 0;
+
+    int index = 1;
+    for (; index < argc && strcmp(argv[index], "--"); ++index) {
+        int has_value = index + 1 < argc;
+        if (!strcmp(argv[index], "--dir") && has_value) {
+            dir = argv[++index];
+        } else if (!strcmp(argv[index], "--duration") && has_value) {
+            if (parse_int_option(argv[++index], "--duration", 1, &duration)) {
+                return -1;
+            }
+        } else if (!strcmp(argv[index], "--clip") && has_value && selected_count < sizeof selected / sizeof *selected) {
+            selected[selected_count++] = argv[++index];
+        } else if (!strcmp(argv[index], "--input") && has_value && input_count < sizeof inputs / sizeof *inputs) {
+            inputs[input_count++] = argv[++index];
+        } else {
+            print_bench_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // The options after "--" are parsed as video_resize's own, with the program name in front.
+    char *option_args[256];
+    int option_count = 0;
+    option_args[option_count++] = argv[0];
+    for (int i = index + 1; i < argc && option_count < 255; ++i) {
+        option_args[option_count++] = argv[i];
+    }
+    option_args[option_count] = NULL;
+
+    struct transcode_options base;
+    struct rendition_options single;
+    if (parse_options(option_count, option_args, &base, &single)) {
+        free_options(&base);
+        return -1;
+    }
+    if (base.rendition_count) {
+        printf("Renditions cannot be benchmarked; every run writes a single output\n");
+        free_options(&base);
+        return -1;
+    }
+    // Same-size HEVC output would otherwise be remuxed rather than encoded.
+    base.stream_copy = 0;
+
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+        printf("Failed to create %s: %s\n", dir, strerror(errno));
+        free_options(&base);
+        return -1;
+    }
+
+    printf("%-12s %-10s %8s %8s %8s %6s %6s %6s %6s %6s %8s\n", "clip", "config", "fps", "speed", "rss MiB",
+           "demux", "decode", "scale", "encode", "mux", "wall s");
+
+    int failed = 0;
+    for (int i = 0; i < sizeof clips / sizeof *clips; ++i) {
+        int wanted = !selected_count && !input_count;
+        for (int j = 0; j < selected_count; ++j) {
+            wanted |= !strcmp(selected[j], clips[i].name);
+        }
+        if (!wanted) {
+            continue;
+        }
+
+        // Clips are kept between runs of the suite, so only the first run pays for generating them.
+        char clip_file[1024];
+        snprintf(clip_file, sizeof clip_file, "%s/clip-%s-%ds.mp4", dir, clips[i].name, duration);
+        if (access(clip_file, R_OK) && generate_clip(&clips[i], clip_file, duration)) {
+            ++failed;
+            continue;
+        }
+
+        for (int j = 0; j < sizeof configs / sizeof *configs; ++j) {
+            failed |= run_config(dir, clips[i].name, clip_file, &configs[j], &base, &single) != 0;
+        }
+    }
+
+    for (int i = 0; i < input_count; ++i) {
+        const char *name = strrchr(inputs[i], '/') ? strrchr(inputs[i], '/') + 1 : inputs[i];
+        for (int j = 0; j < sizeof configs / sizeof *configs; ++j) {
+            failed |= run_config(dir, name, inputs[i], &configs[j], &base, &single) != 0;
+        }
+    }
+
+    free_options(&base);
+    pool_uninit();
+    return failed ? -1 : 0;
+}
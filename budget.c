@@ -0,0 +1,228 @@
+#include "budget.h"
+
+#include <inttypes.h>
+#include <libavutil/imgutils.h>
+
+// FFmpeg's max_interleave_delta, and the shortest one fitting a budget lowers it to. The muxer holds back up to that
+// long of every stream's packets while it waits for the one that lags.
+#define DEFAULT_INTERLEAVE_DELTA (10 * (int64_t) AV_TIME_BASE)
+#define MIN_INTERLEAVE_DELTA AV_TIME_BASE
+
+// The muxer is given at most this fraction of the budget before its delta is cut.
+#define MUX_SHARE 8
+
+// Frames a decoder keeps as references on top of one per frame thread, which is the most H.264 and HEVC allow.
+#define DECODER_REFERENCES 16
+
+// x265's defaults for medium: the rate-control lookahead, the B-frame run and the frames kept as references.
+#define DEFAULT_LOOKAHEAD 20
+#define DEFAULT_BFRAMES 4
+#define ENCODER_REFERENCES 4
+
+// x265 pads its pictures and keeps a quarter-size copy and analysis of each one, about doubling what a frame takes.
+#define ENCODER_OVERHEAD 2
+
+// Assumed of a stream whose bit rate is not known.
+#define BITS_PER_PIXEL 0.1
+#define DEFAULT_FRAME_RATE 30
+
+// What the estimates are worked out from, about the video stream and the settings in effect.
+struct source {
+    int width;
+    int height;
+    enum AVPixelFormat format;
+    double frame_rate;
+    int64_t bit_rate;
+};
+
+struct estimate {
+    int64_t frames;
+    int64_t queues;
+    int64_t encoders;
+    int64_t mux;
+    int64_t io;
+};
+
+static int64_t frame_bytes(const struct source *source, int width, int height) {
+    int size = source->format == AV_PIX_FMT_NONE ? -1 : av_image_get_buffer_size(source->format, width, height, 64);
+    return size > 0 ? size : (int64_t) width * height * 3 / 2;
+}
+
+static int local_workers(const struct transcode_options *options) {
+    return options->segment_workers || options->workers ? FFMAX(1, options->segment_workers) : 1;
+}
+
+static int decode_threads(const struct transcode_options *options) {
+    if (options->live) {
+        return 1;
+    }
+
+    int workers = local_workers(options);
+    if (options->decode_threads) {
+        return FFMAX(1, options->decode_threads / workers);
+    }
+    return FFMIN(FFMAX(1, options->threads / workers), MAX_AUTO_DECODE_THREADS);
+}
+
+// The decode threads asked for, which segment workers share between them.
+static int requested_decode_threads(const struct transcode_options *options) {
+    return options->decode_threads ? options->decode_threads : FFMIN(options->threads, MAX_AUTO_DECODE_THREADS);
+}
+
+// The frame threads x265 picks for itself from the threads in its pool.
+static int x265_frame_threads(const struct transcode_options *options) {
+    if (options->x265_frame_threads) {
+        return options->x265_frame_threads;
+    }
+
+    int threads = options->encode_threads ? options->encode_threads : options->threads;
+    threads = FFMAX(1, threads / local_workers(options));
+    return threads >= 32 ? 6 : threads >= 16 ? 4 : threads >= 8 ? 3 : threads >= 4 ? 2 : 1;
+}
+
+static int lookahead(const struct transcode_options *options) {
+    return options->lookahead >= 0 ? options->lookahead : DEFAULT_LOOKAHEAD;
+}
+
+static int bframes(const struct transcode_options *options) {
+    return options->bframes >= 0 ? options->bframes : DEFAULT_BFRAMES;
+}
+
+static int64_t interleave_delta(const struct transcode_options *options) {
+    return options->max_interleave_delta ? options->max_interleave_delta : DEFAULT_INTERLEAVE_DELTA;
+}
+
+static void estimate_memory(const struct source *source, const struct transcode_options *options,
+                            struct estimate *estimate) {
+    *estimate = (struct estimate) {0};
+    int64_t source_bytes = frame_bytes(source, source->width, source->height);
+    int workers = local_workers(options);
+    int segmented = options->segment_workers || options->workers;
+
+    // Every worker decodes, scales and encodes on its own.
+    int64_t bit_rate = 0;
+    int64_t encoded_frames = lookahead(options) + bframes(options) + x265_frame_threads(options) + ENCODER_REFERENCES;
+    estimate->frames = (decode_threads(options) + DECODER_REFERENCES) * source_bytes;
+    for (int i = 0; i < options->rendition_count; ++i) {
+        const struct rendition_options *rendition = &options->renditions[i];
+        int width, height;
+        resolve_output_size(source->width, source->height, rendition, &width, &height);
+        int64_t rendition_bytes = frame_bytes(source, width, height);
+
+        estimate->frames += rendition_bytes;
+        estimate->encoders += encoded_frames * rendition_bytes * ENCODER_OVERHEAD;
+        if (options->pipeline && !segmented) {
+            estimate->queues += options->queue_depth * (source_bytes + rendition_bytes);
+        }
+
+        if (rendition->bit_rate) {
+            bit_rate += rendition->bit_rate;
+        } else if (source->bit_rate) {
+            bit_rate += source->bit_rate;
+        } else {
+            bit_rate += (int64_t) (BITS_PER_PIXEL * width * height * source->frame_rate);
+        }
+    }
+    estimate->frames *= workers;
+    estimate->encoders *= workers;
+
+    // Live output is written as it is encoded. Segmented output holds the packets of up to two segments a worker
+    // ahead of the one being stitched.
+    if (segmented) {
+        estimate->mux = 2 * workers * options->segment_duration * bit_rate / 8;
+    } else if (!options->live) {
+        estimate->mux = av_rescale(interleave_delta(options), bit_rate / 8, AV_TIME_BASE);
+    }
+
+    int write_behind = options->write_behind ? options->write_behind : options->direct_io ? DEFAULT_WRITE_BEHIND : 0;
+    estimate->io = options->read_ahead + (int64_t) options->rendition_count * write_behind;
+}
+
+static int64_t total(const struct estimate *estimate) {
+    return estimate->frames + estimate->queues + estimate->encoders + estimate->mux + estimate->io;
+}
+
+// Lowers the first setting in line that can still go down, returning 0 once none can.
+static int lower_setting(struct transcode_options *options, const struct estimate *estimate) {
+    int segmented = options->segment_workers || options->workers;
+    int64_t mux_share = options->memory_budget / MUX_SHARE;
+    if (!segmented && !options->live && estimate->mux > mux_share &&
+        interleave_delta(options) > MIN_INTERLEAVE_DELTA) {
+        int64_t delta = av_rescale(interleave_delta(options), mux_share, estimate->mux);
+        options->max_interleave_delta = FFMAX(delta, MIN_INTERLEAVE_DELTA);
+        return 1;
+    }
+    if (options->pipeline && !segmented && options->queue_depth > 2) {
+        options->queue_depth = FFMAX(2, options->queue_depth / 2);
+        return 1;
+    }
+    // A lookahead shorter than the B-frame run is lengthened again by x265.
+    if (lookahead(options) > bframes(options) + 1) {
+        options->lookahead = FFMAX(bframes(options) + 1, lookahead(options) / 2);
+        return 1;
+    }
+    if (x265_frame_threads(options) > 1) {
+        options->x265_frame_threads = x265_frame_threads(options) / 2;
+        return 1;
+    }
+    if (!options->live && requested_decode_threads(options) > 1) {
+        options->decode_threads = requested_decode_threads(options) / 2;
+        return 1;
+    }
+    if (options->segment_workers > 1) {
+        options->segment_workers /= 2;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void print_lowered(const char *name, int64_t from, int64_t to) {
+    if (to != from) {
+        printf("Lowered %s from %" PRId64 " to %" PRId64 " to fit the memory budget\n", name, from, to);
+    }
+}
+
+int64_t fit_memory_budget(AVFormatContext *infc, struct transcode_options *options) {
+    if (!options->memory_budget) {
+        return 0;
+    }
+
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        return options->memory_budget;
+    }
+
+    AVStream *stream = infc->streams[stream_index];
+    AVRational frame_rate = av_guess_frame_rate(infc, stream, NULL);
+    struct source source = {
+            .width = stream->codecpar->width,
+            .height = stream->codecpar->height,
+            .format = stream->codecpar->format,
+            .frame_rate = frame_rate.num && frame_rate.den ? av_q2d(frame_rate) : DEFAULT_FRAME_RATE,
+            .bit_rate = stream->codecpar->bit_rate ? stream->codecpar->bit_rate : infc->bit_rate
+    };
+
+    struct transcode_options original = *options;
+    struct estimate estimate;
+    estimate_memory(&source, options, &estimate);
+    while (total(&estimate) > options->memory_budget && lower_setting(options, &estimate)) {
+        estimate_memory(&source, options, &estimate);
+    }
+
+    print_lowered("the interleave delta in ms", interleave_delta(&original) / 1000, interleave_delta(options) / 1000);
+    print_lowered("--queue-depth", original.queue_depth, options->queue_depth);
+    print_lowered("--lookahead", lookahead(&original), lookahead(options));
+    print_lowered("--x265-frame-threads", x265_frame_threads(&original), x265_frame_threads(options));
+    print_lowered("--decode-threads", requested_decode_threads(&original), requested_decode_threads(options));
+    print_lowered("--segment-workers", original.segment_workers, options->segment_workers);
+    if (total(&estimate) > options->memory_budget) {
+        printf("The transcode needs about %" PRId64 " MiB, more than the memory budget of %" PRId64 " MiB\n",
+               total(&estimate) >> 20, options->memory_budget >> 20);
+    }
+
+    // Whatever the estimates leave over goes to the frame buffers too, so the pools only hold back a demuxer that
+    // has run further ahead than they allowed for.
+    int64_t left = options->memory_budget - estimate.encoders - estimate.mux - estimate.io;
+    return FFMAX(estimate.frames + estimate.queues, left);
+}
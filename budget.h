@@ -0,0 +1,14 @@
+#ifndef VIDEO_RESIZE_BUDGET_H
+#define VIDEO_RESIZE_BUDGET_H
+
+#include "transcode.h"
+
+// Estimates the memory a transcode of infc with options takes: the decoder's frames, the --pipeline queues, the
+// encoder's lookahead and references, the muxer's interleaving and the I/O buffers. While that is over
+// options->memory_budget, lowers the settings that cost the most for the least speed, in turn: the muxer's
+// interleaving delta, the queue depth, the lookahead, the x265 frame threads, the decode threads and the segment
+// workers. Settings are only ever lowered, and each change is printed. Returns the bytes of the budget left for frame
+// buffers, which the pools are held to, or 0 without a budget.
+int64_t fit_memory_budget(AVFormatContext *infc, struct transcode_options *options);
+
+#endif
@@ -0,0 +1,240 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "replace_file.h"
+
+#define JOURNAL_MAGIC "VRCK1"
+
+// Checkpointed outputs are synced and cut back by path, so they must be local files.
+static const char *local_path(const char *url) {
+    if (!strncmp(url, "file:", 5)) {
+        return url + 5;
+    }
+
+    return strchr(url, ':') || !strcmp(url, "-") ? NULL : url;
+}
+
+// Any descriptor of a file reaches its dirty pages, so a fresh one syncs what the muxer wrote.
+static int sync_file(const char *path) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static int64_t file_size(const char *path) {
+    struct stat status;
+    return stat(path, &status) ? -1 : status.st_size;
+}
+
+// Returns 0 with the checkpoint filled in from a journal that matches this job, or -1 to start over.
+static int read_journal(struct checkpoint *checkpoint) {
+    FILE *file = fopen(checkpoint->path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    int64_t input_size;
+    int segment_duration, rendition_count;
+    int matches = fscanf(file, JOURNAL_MAGIC " %" SCNd64 " %d %d %d %" SCNd64 " ", &input_size, &segment_duration,
+                         &rendition_count, &checkpoint->segments, &checkpoint->end) == 5 &&
+                  input_size == checkpoint->input_size && segment_duration == checkpoint->segment_duration &&
+                  rendition_count == checkpoint->rendition_count && checkpoint->segments > 0;
+    for (int i = 0; i < checkpoint->rendition_count && matches; ++i) {
+        char output[4096];
+        matches = fscanf(file, "%" SCNd64 " ", &checkpoint->offsets[i]) == 1 && fgets(output, sizeof output, file);
+        if (matches) {
+            output[strcspn(output, "\n")] = '\0';
+            const char *path = local_path(checkpoint->renditions[i].output_file);
+            matches = !strcmp(output, checkpoint->renditions[i].output_file) &&
+                      file_size(path) >= checkpoint->offsets[i];
+        }
+    }
+    fclose(file);
+
+    if (!matches) {
+        checkpoint->segments = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Synced before it replaces the old one, so a job killed at any point leaves a whole journal behind.
+static int write_journal(const struct checkpoint *checkpoint) {
+    char temporary[4096];
+    FILE *file = open_replacement(checkpoint->path, temporary, sizeof temporary);
+    if (!file) {
+        printf("Failed to write checkpoint journal %s\n", checkpoint->path);
+        return -1;
+    }
+
+    fprintf(file, JOURNAL_MAGIC " %" PRId64 " %d %d %d %" PRId64 "\n", checkpoint->input_size,
+            checkpoint->segment_duration, checkpoint->rendition_count, checkpoint->segments, checkpoint->end);
+    for (int i = 0; i < checkpoint->rendition_count; ++i) {
+        fprintf(file, "%" PRId64 " %s\n", checkpoint->offsets[i], checkpoint->renditions[i].output_file);
+    }
+
+    if (commit_replacement(file, temporary, checkpoint->path, 1)) {
+        printf("Failed to write checkpoint journal %s\n", checkpoint->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct checkpoint *checkpoint_open(const char *path, AVFormatContext *infc, const struct transcode_options *options) {
+    for (int i = 0; i < options->rendition_count; ++i) {
+        if (!local_path(options->renditions[i].output_file)) {
+            printf("Checkpointed output %s must be a local file\n", options->renditions[i].output_file);
+            return NULL;
+        }
+    }
+
+    struct checkpoint *checkpoint = av_mallocz(sizeof *checkpoint);
+    if (!checkpoint) {
+        printf("Failed to allocate memory for checkpoint\n");
+        return NULL;
+    }
+
+    checkpoint->path = av_strdup(path);
+    checkpoint->offsets = av_calloc(options->rendition_count, sizeof *checkpoint->offsets);
+    if (!checkpoint->path || !checkpoint->offsets) {
+        printf("Failed to allocate memory for checkpoint\n");
+        checkpoint_close(&checkpoint, 0);
+        return NULL;
+    }
+
+    checkpoint->renditions = options->renditions;
+    checkpoint->rendition_count = options->rendition_count;
+    checkpoint->input_size = avio_size(infc->pb);
+    checkpoint->segment_duration = options->segment_duration;
+
+    if (!read_journal(checkpoint)) {
+        printf("Resuming from checkpoint %s after %d segments\n", path, checkpoint->segments);
+    } else if (!access(path, F_OK)) {
+        printf("Checkpoint %s does not match this job, so it starts over\n", path);
+        unlink(path);
+    }
+
+    return checkpoint;
+}
+
+void checkpoint_close(struct checkpoint **checkpoint, int done) {
+    if (!*checkpoint) {
+        return;
+    }
+
+    if (done && (*checkpoint)->path) {
+        unlink((*checkpoint)->path);
+    }
+    av_freep(&(*checkpoint)->offsets);
+    av_freep(&(*checkpoint)->path);
+    av_freep(checkpoint);
+}
+
+// Every run writes an index in its trailer of the fragments it wrote alone, so the outputs go without one. Resumed
+// fragments carry their own decode times, since the muxer starts counting afresh.
+int checkpoint_muxer_options(const struct checkpoint *checkpoint, AVDictionary **muxer_options) {
+    const char *flags = checkpoint->segments ? "frag_custom+empty_moov+default_base_moof+skip_trailer+frag_discont" :
+                        "frag_custom+empty_moov+default_base_moof+skip_trailer";
+    if (av_dict_set(muxer_options, "movflags", flags, 0) < 0 ||
+        av_dict_set_int(muxer_options, "fragment_index", checkpoint->segments + 1, 0) < 0) {
+        printf("Failed to set checkpoint muxer options\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int checkpoint_open_output(const struct checkpoint *checkpoint, int index, AVIOContext **pb) {
+    const char *url = checkpoint->renditions[index].output_file;
+    if (!checkpoint->segments) {
+        return avio_open(pb, url, AVIO_FLAG_WRITE);
+    }
+
+    int64_t offset = checkpoint->offsets[index];
+    if (truncate(local_path(url), offset)) {
+        return AVERROR(errno);
+    }
+
+    AVDictionary *protocol_options = NULL;
+    av_dict_set(&protocol_options, "truncate", "0", 0);
+    int reason = avio_open2(pb, url, AVIO_FLAG_WRITE, NULL, &protocol_options);
+    av_dict_free(&protocol_options);
+    if (reason) {
+        return reason;
+    }
+
+    int64_t position = avio_seek(*pb, offset, SEEK_SET);
+    if (position < 0) {
+        avio_closep(pb);
+        return (int) position;
+    }
+
+    return 0;
+}
+
+int checkpoint_write_header(const struct checkpoint *checkpoint, AVFormatContext *outfc, AVDictionary **muxer_options) {
+    if (!checkpoint->segments) {
+        return avformat_write_header(outfc, muxer_options);
+    }
+
+    AVIOContext *output = outfc->pb;
+    int reason = avio_open_dyn_buf(&outfc->pb);
+    if (reason) {
+        outfc->pb = output;
+        return reason;
+    }
+
+    reason = avformat_write_header(outfc, muxer_options);
+    uint8_t *header;
+    avio_close_dyn_buf(outfc->pb, &header);
+    av_free(header);
+    outfc->pb = output;
+    return reason;
+}
+
+int checkpoint_commit(struct checkpoint *checkpoint, struct rendition *renditions, int segments, int64_t end) {
+    for (int i = 0; i < checkpoint->rendition_count; ++i) {
+        AVFormatContext *outfc = renditions[i].outfc;
+
+        // The interleaving queue goes out first, then the fragment is cut with everything up to the segment's end.
+        pthread_mutex_lock(&renditions[i].mux_mutex);
+        int reason = av_interleaved_write_frame(outfc, NULL);
+        if (reason >= 0) {
+            reason = av_write_frame(outfc, NULL);
+        }
+        pthread_mutex_unlock(&renditions[i].mux_mutex);
+        if (reason < 0) {
+            print_error("Failed to end checkpoint fragment", reason);
+            return -1;
+        }
+
+        avio_flush(outfc->pb);
+        if (outfc->pb->error) {
+            print_error("Failed to write output file", outfc->pb->error);
+            return -1;
+        }
+        checkpoint->offsets[i] = avio_tell(outfc->pb);
+        if (sync_file(local_path(checkpoint->renditions[i].output_file))) {
+            printf("Failed to sync %s to disk\n", checkpoint->renditions[i].output_file);
+            return -1;
+        }
+    }
+
+    checkpoint->segments = segments;
+    checkpoint->end = end;
+    return write_journal(checkpoint);
+}
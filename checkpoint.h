@@ -0,0 +1,42 @@
+#ifndef VIDEO_RESIZE_CHECKPOINT_H
+#define VIDEO_RESIZE_CHECKPOINT_H
+
+#include "transcode.h"
+
+// The journal of a resumable transcode. Its outputs are fragmented MP4 with one fragment per segment, and after each
+// segment the journal records how many segments are written and how long each output was at that point.
+struct checkpoint {
+    char *path;
+    const struct rendition_options *renditions;
+    int rendition_count;
+    int64_t input_size;
+    int segment_duration;
+
+    // The segments written, the presentation timestamp the last of them ended at in the video stream's time base, and
+    // each output's size then. A job that starts over has segments at 0.
+    int segments;
+    int64_t end;
+    int64_t *offsets;
+};
+
+// Reads the journal at path. A journal left by another job, or whose outputs have since shrunk, is deleted and the
+// job starts over. Returns NULL when the outputs cannot be checkpointed.
+struct checkpoint *checkpoint_open(const char *path, AVFormatContext *infc, const struct transcode_options *options);
+
+// Done means the job finished, so the journal is deleted; otherwise it stays for the next run to resume from.
+void checkpoint_close(struct checkpoint **checkpoint, int done);
+
+// Sets the movflags of checkpointed outputs, and on resume the fragment number to carry on from.
+int checkpoint_muxer_options(const struct checkpoint *checkpoint, AVDictionary **muxer_options);
+
+// Opens a rendition's output, on resume cut back to its size at the last checkpoint and positioned at the end.
+int checkpoint_open_output(const struct checkpoint *checkpoint, int index, AVIOContext **pb);
+
+// Writes a rendition's header. On resume the output already starts with one, so it goes to a scratch buffer instead.
+int checkpoint_write_header(const struct checkpoint *checkpoint, AVFormatContext *outfc, AVDictionary **muxer_options);
+
+// Ends the current fragment of every rendition, syncs the outputs to disk and records that segments segments are
+// written, the last one ending at presentation timestamp end.
+int checkpoint_commit(struct checkpoint *checkpoint, struct rendition *renditions, int segments, int64_t end);
+
+#endif
@@ -0,0 +1,185 @@
+#include "clip.h"
+
+#include "keyframes.h"
+
+// How the clip treats the packets of an input stream.
+enum clip_mode {
+    CLIP_IGNORED,
+    CLIP_DECODED,
+    CLIP_COPIED,
+    CLIP_PASSTHROUGH
+};
+
+// Containers such as MP4 and Matroska index their keyframes, so the demuxer seeks to one straight away. Others only
+// seek by timestamp near the right place, so the keyframe is looked up in the index and sought by its byte position.
+static int seek_to_start(AVFormatContext *infc, const struct clip *clip, const struct transcode_options *options) {
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    int64_t start = clip->start;
+    if (stream_index >= 0) {
+        AVStream *stream = infc->streams[stream_index];
+        start = av_rescale_q(clip->start, AV_TIME_BASE_Q, stream->time_base);
+        if (!avformat_index_get_entries_count(stream) && infc->pb && infc->pb->seekable & AVIO_SEEKABLE_NORMAL) {
+            struct keyframe_index index;
+            if (load_keyframes(infc, stream_index, options, &index)) {
+                return -1;
+            }
+
+            int64_t pos = -1;
+            if (index.count) {
+                const struct keyframe *keyframe = find_keyframe(&index, start);
+                start = keyframe->pts;
+                pos = keyframe->pos;
+            }
+            free_keyframes(&index);
+            if (pos >= 0 && avformat_seek_file(infc, -1, pos, pos, pos, AVSEEK_FLAG_BYTE) >= 0) {
+                return 0;
+            }
+        }
+    }
+
+    int reason = av_seek_frame(infc, stream_index, start, AVSEEK_FLAG_BACKWARD);
+    if (reason < 0) {
+        print_error("Failed to seek to the start of the clip", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct clip *clip_open(AVFormatContext *infc, struct rendition *renditions, int rendition_count,
+                       const struct transcode_options *options) {
+    int64_t origin = infc->start_time == AV_NOPTS_VALUE ? 0 : infc->start_time;
+    if (infc->duration != AV_NOPTS_VALUE && options->clip_start >= infc->duration) {
+        printf("The clip starts after the end of the input\n");
+        return NULL;
+    }
+
+    struct clip *clip = av_mallocz(sizeof *clip);
+    if (!clip) {
+        printf("Failed to allocate memory for clip\n");
+        return NULL;
+    }
+
+    clip->stream_count = infc->nb_streams;
+    clip->modes = av_calloc(infc->nb_streams, sizeof *clip->modes);
+    clip->started = av_calloc(infc->nb_streams, sizeof *clip->started);
+    clip->finished = av_calloc(infc->nb_streams, sizeof *clip->finished);
+    if (!clip->modes || !clip->started || !clip->finished) {
+        printf("Failed to allocate memory for clip\n");
+        clip_close(&clip);
+        return NULL;
+    }
+
+    clip->origin = origin;
+    clip->start = origin + options->clip_start;
+    clip->end = options->clip_end ? origin + options->clip_end : INT64_MAX;
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        if (renditions[0].out_stream_indices[i] == -1) {
+            continue;
+        }
+
+        clip->modes[i] = CLIP_PASSTHROUGH;
+        if (infc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            clip->modes[i] = CLIP_DECODED;
+            for (int j = 0; j < rendition_count; ++j) {
+                if (!renditions[j].out_codec_contexts[i]) {
+                    clip->modes[i] = CLIP_COPIED;
+                }
+            }
+        }
+        ++clip->remaining;
+    }
+
+    for (int i = 0; i < rendition_count; ++i) {
+        renditions[i].outfc->output_ts_offset = -clip->start;
+        renditions[i].clip = clip;
+    }
+
+    if (options->clip_start && seek_to_start(infc, clip, options)) {
+        clip_close(&clip);
+        return NULL;
+    }
+
+    return clip;
+}
+
+void clip_close(struct clip **clip) {
+    if (!*clip) {
+        return;
+    }
+
+    av_freep(&(*clip)->finished);
+    av_freep(&(*clip)->started);
+    av_freep(&(*clip)->modes);
+    av_freep(clip);
+}
+
+static int finish_stream(struct clip *clip, int stream_index) {
+    clip->finished[stream_index] = 1;
+    --clip->remaining;
+    return 0;
+}
+
+int clip_packet(struct clip *clip, const AVPacket *packet, AVRational time_base) {
+    int i = packet->stream_index;
+    if (clip->finished[i]) {
+        return 0;
+    }
+
+    int64_t pts = packet->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(packet->pts, time_base, AV_TIME_BASE_Q);
+    int64_t dts = packet->dts == AV_NOPTS_VALUE ? pts : av_rescale_q(packet->dts, time_base, AV_TIME_BASE_Q);
+    int key = packet->flags & AV_PKT_FLAG_KEY;
+    switch (clip->modes[i]) {
+        case CLIP_COPIED:
+            // A copy has to start on a keyframe, which a seek by timestamp only gets near.
+            if (!clip->started[i] && !key) {
+                return 0;
+            }
+            if (key && pts != AV_NOPTS_VALUE && pts >= clip->end) {
+                return finish_stream(clip, i);
+            }
+            clip->started[i] = 1;
+            return 1;
+        case CLIP_DECODED:
+            // Frames are decoded before any that refer to them, so nothing in the clip needs a packet decoded after
+            // its end. Disposable frames are referred to by none, so those before the start need no decoding at all.
+            if (dts != AV_NOPTS_VALUE && dts >= clip->end) {
+                return finish_stream(clip, i);
+            }
+            return !(packet->flags & AV_PKT_FLAG_DISPOSABLE && pts != AV_NOPTS_VALUE && pts < clip->start);
+        case CLIP_PASSTHROUGH:
+            if (pts == AV_NOPTS_VALUE) {
+                return 1;
+            }
+            if (pts >= clip->end) {
+                return finish_stream(clip, i);
+            }
+            return pts + av_rescale_q(packet->duration, time_base, AV_TIME_BASE_Q) > clip->start;
+        default:
+            return 0;
+    }
+}
+
+int clip_done(const struct clip *clip) {
+    return clip->remaining <= 0;
+}
+
+int clip_frame(const struct clip *clip, const AVFrame *frame, AVRational time_base) {
+    if (frame->pts == AV_NOPTS_VALUE) {
+        return 1;
+    }
+
+    int64_t pts = av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q);
+    return pts >= clip->start && pts < clip->end;
+}
+
+int64_t clip_duration(const struct clip *clip, int64_t duration) {
+    if (!clip) {
+        return duration;
+    }
+    if (clip->end != INT64_MAX) {
+        return clip->end - clip->start;
+    }
+
+    return duration == AV_NOPTS_VALUE ? duration : duration - (clip->start - clip->origin);
+}
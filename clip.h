@@ -0,0 +1,40 @@
+#ifndef VIDEO_RESIZE_CLIP_H
+#define VIDEO_RESIZE_CLIP_H
+
+#include "transcode.h"
+
+// The window of the input a run keeps, in AV_TIME_BASE units on the input's timeline from origin, its start time, and
+// what each input stream has seen of it. Video that some rendition copies is kept in whole GOPs, from the keyframe at
+// or before start to the first one at or after end, and the outputs' edit lists hide what comes before start.
+struct clip {
+    int64_t origin;
+    int64_t start;
+    int64_t end;
+    int stream_count;
+    int *modes;
+    int *started;
+    int *finished;
+    int remaining;
+};
+
+// Measures the window of --start and --end against the input's start time and seeks infc to the last keyframe at or
+// before it, the only pre-roll the decoders need. Inputs whose container has no index of its own are seeked through
+// the keyframe index. The renditions' streams must be set up, and every output timestamp is moved back by start.
+struct clip *clip_open(AVFormatContext *infc, struct rendition *renditions, int rendition_count,
+                       const struct transcode_options *options);
+
+void clip_close(struct clip **clip);
+
+// Whether the demuxed packet is part of the clip. A packet past the end finishes its stream instead.
+int clip_packet(struct clip *clip, const AVPacket *packet, AVRational time_base);
+
+// Whether every stream the renditions take is past the end of the clip, so nothing more need be read.
+int clip_done(const struct clip *clip);
+
+// Whether a decoded frame falls within the clip, and so gets encoded. The pre-roll before start is dropped.
+int clip_frame(const struct clip *clip, const AVFrame *frame, AVRational time_base);
+
+// The length of the clip, or the input's duration without one.
+int64_t clip_duration(const struct clip *clip, int64_t duration);
+
+#endif
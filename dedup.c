@@ -0,0 +1,140 @@
+#include "dedup.h"
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixelutils.h>
+
+// Blocks are compared 16x16, the widest the SIMD SAD kernels of libavutil cover, and a run of duplicates is broken by
+// a kept frame once it lasts this long.
+#define BLOCK_BITS 4
+#define BLOCK_SIZE (1 << BLOCK_BITS)
+#define MAX_DUPLICATE_RUN AV_TIME_BASE
+
+struct dedup {
+    av_pixelutils_sad_fn sad;
+    int max_block_sad;
+    AVFrame *kept;
+    int64_t kept_time;
+    AVFrame *skipped;
+};
+
+struct dedup *dedup_open(const struct transcode_options *options) {
+    struct dedup *dedup = av_mallocz(sizeof *dedup);
+    if (!dedup) {
+        printf("Failed to allocate memory for frame deduplication\n");
+        return NULL;
+    }
+
+    dedup->sad = av_pixelutils_get_sad_fn(BLOCK_BITS, BLOCK_BITS, 0, NULL);
+    dedup->max_block_sad = (int) (options->dedup_threshold * BLOCK_SIZE * BLOCK_SIZE);
+    dedup->kept = av_frame_alloc();
+    dedup->skipped = av_frame_alloc();
+    dedup->kept_time = AV_NOPTS_VALUE;
+    if (!dedup->sad || !dedup->kept || !dedup->skipped) {
+        printf("Failed to set up frame deduplication\n");
+        dedup_close(&dedup);
+        return NULL;
+    }
+
+    return dedup;
+}
+
+void dedup_close(struct dedup **dedup) {
+    if (!*dedup) {
+        return;
+    }
+
+    av_frame_free(&(*dedup)->skipped);
+    av_frame_free(&(*dedup)->kept);
+    av_freep(dedup);
+}
+
+// Every block of the luma plane is compared, with the last block of each row and column moved back to end on the
+// edge, so a change as small as a moving cursor is caught. Samples wider than a byte are compared bytewise.
+static int same_picture(const struct dedup *dedup, const AVFrame *a, const AVFrame *b) {
+    if (a->width != b->width || a->height != b->height || a->format != b->format) {
+        return 0;
+    }
+
+    int bytewidth = av_image_get_linesize(a->format, a->width, 0);
+    if (bytewidth < BLOCK_SIZE || a->height < BLOCK_SIZE) {
+        return 0;
+    }
+
+    for (int y = 0; y < a->height; y += BLOCK_SIZE) {
+        int row = FFMIN(y, a->height - BLOCK_SIZE);
+        const uint8_t *a_row = a->data[0] + (ptrdiff_t) row * a->linesize[0];
+        const uint8_t *b_row = b->data[0] + (ptrdiff_t) row * b->linesize[0];
+        for (int x = 0; x < bytewidth; x += BLOCK_SIZE) {
+            int column = FFMIN(x, bytewidth - BLOCK_SIZE);
+            if (dedup->sad(a_row + column, a->linesize[0], b_row + column, b->linesize[0]) > dedup->max_block_sad) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+int dedup_frame(struct dedup *dedup, const AVFrame *frame, AVRational time_base) {
+    if (!dedup || frame->hw_frames_ctx) {
+        return 0;
+    }
+
+    int64_t time = frame->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q);
+    int duplicate = dedup->kept->buf[0] && time != AV_NOPTS_VALUE && dedup->kept_time != AV_NOPTS_VALUE &&
+                    time - dedup->kept_time < MAX_DUPLICATE_RUN && same_picture(dedup, dedup->kept, frame);
+    av_frame_unref(dedup->skipped);
+    if (duplicate) {
+        // Without a reference to the frame, the stream just ends a little early.
+        av_frame_ref(dedup->skipped, frame);
+        return 1;
+    }
+
+    // A frame that cannot be referenced leaves nothing to compare the next one with, so that one is kept too.
+    av_frame_unref(dedup->kept);
+    av_frame_ref(dedup->kept, frame);
+    dedup->kept_time = time;
+    return 0;
+}
+
+int dedup_flush(struct dedup *dedup, AVFrame *frame) {
+    if (!dedup || !dedup->skipped->buf[0]) {
+        return 0;
+    }
+
+    av_frame_move_ref(frame, dedup->skipped);
+    return 1;
+}
+
+int open_dedups(AVFormatContext *infc, AVCodecContext **in_codec_contexts, const struct transcode_options *options,
+                struct dedup ***dedups) {
+    *dedups = NULL;
+    if (!options->dedup) {
+        return 0;
+    }
+
+    *dedups = av_calloc(infc->nb_streams, sizeof **dedups);
+    if (!*dedups) {
+        printf("Failed to allocate memory for frame deduplication\n");
+        return -1;
+    }
+
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        if (!in_codec_contexts[i] || in_codec_contexts[i]->codec_type != AVMEDIA_TYPE_VIDEO) {
+            continue;
+        }
+        if (!((*dedups)[i] = dedup_open(options))) {
+            close_dedups(dedups, infc->nb_streams);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void close_dedups(struct dedup ***dedups, int stream_count) {
+    for (int i = 0; *dedups && i < stream_count; ++i) {
+        dedup_close(&(*dedups)[i]);
+    }
+    av_freep(dedups);
+}
@@ -0,0 +1,31 @@
+#ifndef VIDEO_RESIZE_DEDUP_H
+#define VIDEO_RESIZE_DEDUP_H
+
+#include "transcode.h"
+
+// Spots decoded frames that repeat the last frame kept of their stream, so they can be left out of the encode. The
+// frames kept keep their timestamps, so each one left out stretches the one before it and the output becomes variable
+// frame rate.
+struct dedup;
+
+struct dedup *dedup_open(const struct transcode_options *options);
+
+void dedup_close(struct dedup **dedup);
+
+// Whether the frame, with timestamps in time_base, differs from the last one kept by no more than the threshold in any
+// 16x16 block of luma. A frame is kept at least once a second whatever it shows, so keyframe intervals and seeking stay
+// bounded in time. Hardware frames, and every frame of a stream without deduplication (NULL), are always kept.
+int dedup_frame(struct dedup *dedup, const AVFrame *frame, AVRational time_base);
+
+// Moves the last frame left out into frame when the stream ended on duplicates, and returns 1, so it is encoded and
+// the output keeps the input's duration.
+int dedup_flush(struct dedup *dedup, AVFrame *frame);
+
+// Opens deduplication for every decoded video stream, into an array indexed by input stream. *dedups stays NULL
+// when options->dedup is off.
+int open_dedups(AVFormatContext *infc, AVCodecContext **in_codec_contexts, const struct transcode_options *options,
+                struct dedup ***dedups);
+
+void close_dedups(struct dedup ***dedups, int stream_count);
+
+#endif
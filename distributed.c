@@ -0,0 +1,722 @@
+#include "distributed.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <libavutil/avstring.h>
+#include <libavutil/intreadwrite.h>
+
+#include "hwaccel.h"
+#include "options.h"
+
+// Every request starts with this and the shared token, so a stray connection is turned away before anything is parsed.
+#define PROTOCOL_MAGIC "VRS2"
+
+#define MAX_ARGUMENTS 256
+#define MAX_STRING_SIZE 65536
+#define MAX_PACKET_SIZE (64 * 1024 * 1024)
+
+// A coordinator sends its whole request as soon as it connects, so a connection silent this long gives its slot back.
+#define REQUEST_TIMEOUT_SECONDS 30
+
+// getopt keeps its state in globals, so connections parse their options one at a time.
+static pthread_mutex_t parse_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+enum {
+    RECORD_PACKET = 1,
+    RECORD_END,
+    RECORD_ERROR
+};
+
+int parse_workers(const char *spec, struct remote_worker **workers, int *count) {
+    *workers = NULL;
+    *count = 0;
+
+    char *list = av_strdup(spec);
+    if (!list) {
+        printf("Failed to allocate memory for workers\n");
+        return -1;
+    }
+
+    int result = 0;
+    char *save;
+    for (char *entry = strtok_r(list, ",", &save); entry; entry = strtok_r(NULL, ",", &save)) {
+        int slots = 1;
+        char *slot_count = strchr(entry, '*');
+        if (slot_count) {
+            *slot_count++ = '\0';
+            if (parse_int_option(slot_count, "worker slots", 1, &slots)) {
+                result = -1;
+                break;
+            }
+        }
+
+        char *port = strrchr(entry, ':');
+        if (!port || port == entry || port[1] == '\0') {
+            printf("Invalid worker: %s\n", entry);
+            result = -1;
+            break;
+        }
+        *port++ = '\0';
+
+        struct remote_worker *grown = av_realloc_array(*workers, *count + 1, sizeof *grown);
+        if (!grown) {
+            printf("Failed to allocate memory for workers\n");
+            result = -1;
+            break;
+        }
+        *workers = grown;
+
+        struct remote_worker *worker = &grown[(*count)++];
+        worker->host = av_strdup(entry);
+        worker->port = av_strdup(port);
+        worker->slots = slots;
+        if (!worker->host || !worker->port) {
+            printf("Failed to allocate memory for workers\n");
+            result = -1;
+            break;
+        }
+    }
+
+    if (!result && !*count) {
+        printf("No workers given\n");
+        result = -1;
+    }
+
+    av_free(list);
+    if (result) {
+        free_workers(workers, *count);
+    }
+    return result;
+}
+
+void free_workers(struct remote_worker **workers, int count) {
+    for (int i = 0; *workers && i < count; ++i) {
+        av_freep(&(*workers)[i].host);
+        av_freep(&(*workers)[i].port);
+    }
+    av_freep(workers);
+}
+
+static int send_all(int socket, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size) {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return 0;
+}
+
+static int receive_all(int socket, void *data, size_t size) {
+    uint8_t *bytes = data;
+    while (size) {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+
+        bytes += received;
+        size -= received;
+    }
+
+    return 0;
+}
+
+// Integers go over the wire big-endian, whatever the hosts on either end use.
+static int send_u32(int socket, uint32_t value) {
+    uint8_t bytes[4];
+    AV_WB32(bytes, value);
+    return send_all(socket, bytes, sizeof bytes);
+}
+
+static int send_u64(int socket, uint64_t value) {
+    uint8_t bytes[8];
+    AV_WB64(bytes, value);
+    return send_all(socket, bytes, sizeof bytes);
+}
+
+static int send_string(int socket, const char *value) {
+    size_t length = strlen(value);
+    if (length > MAX_STRING_SIZE) {
+        return -1;
+    }
+
+    return send_u32(socket, length) || send_all(socket, value, length) ? -1 : 0;
+}
+
+static int receive_u32(int socket, uint32_t *value) {
+    uint8_t bytes[4];
+    if (receive_all(socket, bytes, sizeof bytes)) {
+        return -1;
+    }
+
+    *value = AV_RB32(bytes);
+    return 0;
+}
+
+static int receive_u64(int socket, uint64_t *value) {
+    uint8_t bytes[8];
+    if (receive_all(socket, bytes, sizeof bytes)) {
+        return -1;
+    }
+
+    *value = AV_RB64(bytes);
+    return 0;
+}
+
+static char *receive_string(int socket) {
+    uint32_t length;
+    if (receive_u32(socket, &length) || length > MAX_STRING_SIZE) {
+        return NULL;
+    }
+
+    char *value = av_malloc(length + 1);
+    if (!value) {
+        return NULL;
+    }
+
+    if (receive_all(socket, value, length)) {
+        av_free(value);
+        return NULL;
+    }
+
+    value[length] = '\0';
+    return value;
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *addresses;
+    int reason = getaddrinfo(host, port, &hints, &addresses);
+    if (reason) {
+        printf("Failed to resolve worker %s:%s: %s\n", host, port, gai_strerror(reason));
+        return -1;
+    }
+
+    int result = -1;
+    for (struct addrinfo *address = addresses; address && result == -1; address = address->ai_next) {
+        result = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (result != -1 && connect(result, address->ai_addr, address->ai_addrlen)) {
+            close(result);
+            result = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (result == -1) {
+        printf("Failed to connect to worker %s:%s\n", host, port);
+        return -1;
+    }
+
+    // A remote segment can take minutes to encode, so dead peers are noticed by keepalives rather than a timeout.
+    int enabled = 1;
+    setsockopt(result, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof enabled);
+    return result;
+}
+
+static int send_request(int socket, const char *input_file, int stream_index, int64_t start, int64_t end,
+                        const struct transcode_options *options) {
+    const char *token = options->worker_token ? options->worker_token : "";
+    if (send_all(socket, PROTOCOL_MAGIC, 4) || send_string(socket, token) ||
+        send_u32(socket, options->forwarded_arg_count)) {
+        return -1;
+    }
+
+    for (int i = 0; i < options->forwarded_arg_count; ++i) {
+        if (send_string(socket, options->forwarded_args[i])) {
+            return -1;
+        }
+    }
+
+    if (send_string(socket, input_file) || send_u32(socket, stream_index) || send_u64(socket, start) ||
+        send_u64(socket, end)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int receive_packet(int socket, int rendition_count, int stream_index, struct packet_list *packets) {
+    uint32_t rendition, flags, size;
+    uint64_t pts, dts, duration;
+    if (receive_u32(socket, &rendition) || receive_u64(socket, &pts) || receive_u64(socket, &dts) ||
+        receive_u64(socket, &duration) || receive_u32(socket, &flags) || receive_u32(socket, &size)) {
+        return -1;
+    }
+
+    if (rendition >= rendition_count || size > MAX_PACKET_SIZE) {
+        printf("Worker sent a malformed packet\n");
+        return -1;
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet || av_new_packet(packet, (int) size)) {
+        printf("Failed to allocate memory for a remote packet\n");
+        av_packet_free(&packet);
+        return -1;
+    }
+
+    if (receive_all(socket, packet->data, size)) {
+        av_packet_free(&packet);
+        return -1;
+    }
+
+    packet->pts = (int64_t) pts;
+    packet->dts = (int64_t) dts;
+    packet->duration = (int64_t) duration;
+    packet->flags = (int) flags;
+    packet->stream_index = stream_index;
+    if (append_packet(&packets[rendition], packet)) {
+        printf("Failed to allocate memory for segment packets\n");
+        av_packet_free(&packet);
+        return -1;
+    }
+
+    return 0;
+}
+
+int transcode_remote_range(const struct remote_worker *worker, const char *input_file, int stream_index,
+                           int64_t start, int64_t end, const struct transcode_options *options,
+                           struct packet_list *packets) {
+    int socket = connect_to(worker->host, worker->port);
+    if (socket == -1) {
+        return -1;
+    }
+
+    int result = -1;
+    if (send_request(socket, input_file, stream_index, start, end, options)) {
+        printf("Failed to send request to worker %s:%s\n", worker->host, worker->port);
+        goto end;
+    }
+
+    for (;;) {
+        uint8_t type;
+        if (receive_all(socket, &type, 1)) {
+            printf("Lost connection to worker %s:%s\n", worker->host, worker->port);
+            goto end;
+        }
+
+        if (type == RECORD_END) {
+            result = 0;
+            goto end;
+        }
+
+        if (type != RECORD_PACKET) {
+            printf("Worker %s:%s could not transcode the segment\n", worker->host, worker->port);
+            goto end;
+        }
+
+        if (receive_packet(socket, options->rendition_count, stream_index, packets)) {
+            goto end;
+        }
+    }
+
+    end:
+    close(socket);
+    return result;
+}
+
+struct worker_server {
+    const struct transcode_options *options;
+    int slots;
+    int busy;
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_free;
+};
+
+struct worker_connection {
+    struct worker_server *server;
+    int socket;
+};
+
+// The x265 parameters a coordinator may send: rate control, analysis, tools and stream signalling. Anything else,
+// including every parameter that names a file for the encoder to read or write, is refused.
+static const char *allowed_x265_params[] = {
+        "tune", "profile", "level-idc", "high-tier", "crf", "crf-max", "crf-min", "qp", "bitrate", "vbv-maxrate",
+        "vbv-bufsize", "vbv-init", "vbv-end", "qcomp", "qpstep", "qpmin", "qpmax", "ipratio", "pbratio", "cbqpoffs",
+        "crqpoffs", "aq-mode", "aq-strength", "aq-motion", "qg-size", "cutree", "rc-grain", "rc-lookahead",
+        "lookahead-slices", "lookahead-threads", "bframes", "bframe-bias", "b-adapt", "b-pyramid", "b-intra", "ref",
+        "limit-refs", "keyint", "min-keyint", "scenecut", "scenecut-bias", "hist-scenecut", "open-gop", "radl",
+        "intra-refresh", "me", "subme", "merange", "max-merge", "temporal-mvp", "weightp", "weightb", "rd",
+        "rdoq-level", "psy-rd", "psy-rdoq", "rd-refine", "ctu", "min-cu-size", "max-tu-size", "tu-intra-depth",
+        "tu-inter-depth", "limit-tu", "limit-modes", "rect", "amp", "early-skip", "rskip", "fast-intra", "tskip",
+        "tskip-fast", "cu-lossless", "lossless", "strong-intra-smoothing", "constrained-intra", "sao",
+        "sao-non-deblock", "selective-sao", "deblock", "nr-intra", "nr-inter", "frame-threads", "wpp", "pmode", "pme",
+        "slices", "pools", "sar", "range", "colorprim", "transfer", "colormatrix", "chromaloc", "master-display",
+        "max-cll", "hdr10", "hdr10-opt", "repeat-headers", "aud", "hrd", "info", "temporal-layers", "log-level"
+};
+
+// x265 reads "no-x" as x set to false, takes "_" for "-" and skips a leading "--", so keys are compared after the same
+// rewriting.
+static int allowed_x265_key(const char *key, size_t length) {
+    char name[64];
+    if (key[0] == '-' && key[1] == '-') {
+        key += 2;
+        length = length >= 2 ? length - 2 : 0;
+    }
+    if (!length || length >= sizeof name) {
+        return 0;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        name[i] = key[i] == '_' ? '-' : key[i];
+    }
+    name[length] = '\0';
+
+    const char *normalised = name;
+    if (!strncmp(normalised, "no", 2)) {
+        normalised += normalised[2] == '-' ? 3 : 2;
+    }
+    for (int i = 0; i < FF_ARRAY_ELEMS(allowed_x265_params); ++i) {
+        if (!strcmp(normalised, allowed_x265_params[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int allowed_x265_params_only(const char *params) {
+    for (const char *key = params; key && *key; key = strchr(key, ':') ? strchr(key, ':') + 1 : NULL) {
+        if (!allowed_x265_key(key, strcspn(key, "=:"))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Every argument must have been taken as an option that forward_option records, spelled the way coordinators send
+// it, so settings that only make sense on the coordinator never reach the worker's transcode.
+static int forwarded_only(char **args, int arg_count, const struct transcode_options *options) {
+    if (options->forwarded_arg_count != arg_count - 1) {
+        return 0;
+    }
+    for (int i = 0; i < options->forwarded_arg_count; ++i) {
+        if (strcmp(options->forwarded_args[i], args[i + 1])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Compares every byte whatever the first difference, so the time taken tells nothing about the token.
+static int same_token(const char *received, const char *expected) {
+    size_t received_length = strlen(received);
+    size_t length = strlen(expected);
+    unsigned char difference = received_length != length;
+    for (size_t i = 0; i < length; ++i) {
+        difference |= (unsigned char) (received[i < received_length ? i : 0] ^ expected[i]);
+    }
+    return !difference;
+}
+
+// The request's options replace the encoding settings, but the thread counts stay this host's own.
+static int parse_request_options(struct worker_server *server, char **args, int arg_count,
+                                 struct transcode_options *options) {
+    struct rendition_options single;
+    pthread_mutex_lock(&parse_mutex);
+    int reason = parse_options(arg_count, args, options, &single) || optind != arg_count;
+    pthread_mutex_unlock(&parse_mutex);
+    if (reason) {
+        printf("Coordinator sent invalid options\n");
+        return -1;
+    }
+    if (!forwarded_only(args, arg_count, options)) {
+        printf("Coordinator sent options that are not encoding settings\n");
+        return -1;
+    }
+
+    if (!options->rendition_count && add_single_rendition(options, &single, "-")) {
+        return -1;
+    }
+
+    int allowed = allowed_x265_params_only(options->x265_params);
+    for (int i = 0; i < options->rendition_count; ++i) {
+        allowed &= allowed_x265_params_only(options->renditions[i].x265_params);
+    }
+    if (!allowed) {
+        printf("Coordinator sent x265 parameters outside those a worker accepts\n");
+        return -1;
+    }
+
+    const struct transcode_options *local = server->options;
+    options->threads = FFMAX(1, local->threads / server->slots);
+    options->decode_threads = local->decode_threads ? FFMAX(1, local->decode_threads / server->slots) : 0;
+    options->encode_threads = local->encode_threads ? FFMAX(1, local->encode_threads / server->slots) : 0;
+    options->x265_pools = local->x265_pools;
+    options->scale_threads = local->scale_threads;
+    options->hwaccel_device = local->hwaccel_device;
+    options->probesize = local->probesize;
+    options->analyze_duration = local->analyze_duration;
+    options->trust_headers = local->trust_headers;
+    options->probe_cache = local->probe_cache;
+    options->mmap_input = local->mmap_input;
+    options->read_ahead = local->read_ahead;
+    return 0;
+}
+
+static int send_packets(int socket, struct packet_list *packets, int rendition_count) {
+    for (int i = 0; i < rendition_count; ++i) {
+        for (int j = 0; j < packets[i].count; ++j) {
+            const AVPacket *packet = packets[i].packets[j];
+            uint8_t type = RECORD_PACKET;
+            if (send_all(socket, &type, 1) || send_u32(socket, i) || send_u64(socket, packet->pts) ||
+                send_u64(socket, packet->dts) || send_u64(socket, packet->duration) ||
+                send_u32(socket, packet->flags) || send_u32(socket, packet->size) ||
+                send_all(socket, packet->data, packet->size)) {
+                return -1;
+            }
+        }
+    }
+
+    uint8_t type = RECORD_END;
+    return send_all(socket, &type, 1);
+}
+
+static int serve_request(struct worker_server *server, int socket) {
+    char magic[4];
+    if (receive_all(socket, magic, sizeof magic) || memcmp(magic, PROTOCOL_MAGIC, sizeof magic)) {
+        printf("Rejected a malformed request\n");
+        return -1;
+    }
+
+    char *token = receive_string(socket);
+    const char *expected = server->options->worker_token ? server->options->worker_token : "";
+    int accepted = token && same_token(token, expected);
+    av_free(token);
+    if (!accepted) {
+        printf("Rejected a request without the worker token\n");
+        return -1;
+    }
+
+    uint32_t arg_count;
+    if (receive_u32(socket, &arg_count) || arg_count > MAX_ARGUMENTS) {
+        printf("Rejected a malformed request\n");
+        return -1;
+    }
+
+    // getopt expects a program name before the arguments.
+    char **args = av_calloc(arg_count + 2, sizeof *args);
+    if (!args) {
+        printf("Failed to allocate memory for request\n");
+        return -1;
+    }
+
+    int result = -1;
+    char *input_file = NULL;
+    struct transcode_options options = {0};
+    struct packet_list *packets = NULL;
+    args[0] = av_strdup("video_resize");
+    for (int i = 1; i <= arg_count; ++i) {
+        if (!(args[i] = receive_string(socket))) {
+            printf("Rejected a malformed request\n");
+            goto end;
+        }
+    }
+
+    uint32_t stream_index;
+    uint64_t start, end;
+    input_file = receive_string(socket);
+    if (!args[0] || !input_file || receive_u32(socket, &stream_index) || receive_u64(socket, &start) ||
+        receive_u64(socket, &end) || stream_index > INT32_MAX) {
+        printf("Rejected a malformed request\n");
+        goto end;
+    }
+
+    if (parse_request_options(server, args, (int) arg_count + 1, &options)) {
+        goto end;
+    }
+    setup_hwaccel(&options, NULL);
+
+    packets = av_calloc(options.rendition_count, sizeof *packets);
+    if (!packets) {
+        printf("Failed to allocate memory for segment packets\n");
+        goto end;
+    }
+
+    if (transcode_range(input_file, (int) stream_index, (int64_t) start, (int64_t) end, &options, packets)) {
+        goto end;
+    }
+
+    result = send_packets(socket, packets, options.rendition_count);
+
+    end:
+    if (result) {
+        uint8_t type = RECORD_ERROR;
+        send_all(socket, &type, 1);
+    }
+    for (int i = 0; packets && i < options.rendition_count; ++i) {
+        free_packet_list(&packets[i]);
+    }
+    av_free(packets);
+    release_hwaccel(&options);
+    free_options(&options);
+    av_free(input_file);
+    for (int i = 0; i <= arg_count; ++i) {
+        av_free(args[i]);
+    }
+    av_free(args);
+    return result;
+}
+
+static void *serve_connection(void *arg) {
+    struct worker_connection *connection = arg;
+    struct worker_server *server = connection->server;
+
+    serve_request(server, connection->socket);
+    close(connection->socket);
+    av_free(connection);
+
+    pthread_mutex_lock(&server->mutex);
+    --server->busy;
+    pthread_cond_signal(&server->slot_free);
+    pthread_mutex_unlock(&server->mutex);
+    return NULL;
+}
+
+static int is_loopback(const struct sockaddr *address) {
+    if (address->sa_family == AF_INET) {
+        return ntohl(((const struct sockaddr_in *) address)->sin_addr.s_addr) >> 24 == 127;
+    }
+    if (address->sa_family == AF_INET6) {
+        const struct in6_addr *ip = &((const struct sockaddr_in6 *) address)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(ip) || (IN6_IS_ADDR_V4MAPPED(ip) && ip->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+// Addresses other machines can reach are only listened on with remote set, which takes a worker token.
+static int listen_on(const char *address, int remote) {
+    char *host = av_strdup(address);
+    if (!host) {
+        printf("Failed to allocate memory for listen address\n");
+        return -1;
+    }
+
+    char *port = strrchr(host, ':');
+    if (port) {
+        *port++ = '\0';
+    } else {
+        port = host;
+    }
+
+    // Without a host only loopback is listened on, so serving other machines takes an explicit 0.0.0.0 or ::.
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *addresses;
+    int reason = getaddrinfo(port == host || !*host ? NULL : host, port, &hints, &addresses);
+    if (reason) {
+        printf("Failed to resolve listen address %s: %s\n", address, gai_strerror(reason));
+        av_free(host);
+        return -1;
+    }
+
+    int result = -1;
+    for (struct addrinfo *candidate = addresses; candidate && result == -1; candidate = candidate->ai_next) {
+        if (!remote && !is_loopback(candidate->ai_addr)) {
+            printf("Listening on %s needs a --worker-token or VIDEO_RESIZE_WORKER_TOKEN\n", address);
+            break;
+        }
+
+        result = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (result == -1) {
+            continue;
+        }
+
+        int enabled = 1;
+        setsockopt(result, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof enabled);
+        if (bind(result, candidate->ai_addr, candidate->ai_addrlen) || listen(result, SOMAXCONN)) {
+            close(result);
+            result = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    av_free(host);
+
+    if (result == -1) {
+        printf("Failed to listen on %s\n", address);
+    }
+    return result;
+}
+
+int serve_worker(const char *address, const struct transcode_options *options) {
+    int listener = listen_on(address, options->worker_token && *options->worker_token);
+    if (listener == -1) {
+        return -1;
+    }
+
+    struct worker_server server = {
+            .options = options,
+            .slots = FFMAX(1, options->segment_workers)
+    };
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.slot_free, NULL);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    printf("Serving segments on %s with %d slots\n", address, server.slots);
+    for (;;) {
+        // Connections past the slot count wait in the listen backlog until a segment finishes.
+        pthread_mutex_lock(&server.mutex);
+        while (server.busy == server.slots) {
+            pthread_cond_wait(&server.slot_free, &server.mutex);
+        }
+        pthread_mutex_unlock(&server.mutex);
+
+        int socket = accept(listener, NULL, NULL);
+        if (socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            printf("Failed to accept connection: %s\n", strerror(errno));
+            break;
+        }
+
+        // Only the request is received here, so the timeout never cuts a segment short.
+        struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT_SECONDS};
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+        struct worker_connection *connection = av_malloc(sizeof *connection);
+        if (!connection) {
+            printf("Failed to allocate memory for connection\n");
+            close(socket);
+            continue;
+        }
+        *connection = (struct worker_connection) {.server = &server, .socket = socket};
+
+        pthread_mutex_lock(&server.mutex);
+        ++server.busy;
+        pthread_mutex_unlock(&server.mutex);
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attributes, serve_connection, connection)) {
+            printf("Failed to start connection thread\n");
+            close(socket);
+            av_free(connection);
+            pthread_mutex_lock(&server.mutex);
+            --server.busy;
+            pthread_mutex_unlock(&server.mutex);
+        }
+    }
+
+    // Connection threads still hold the server, so it outlives the accept loop; the process exits after this anyway.
+    pthread_attr_destroy(&attributes);
+    close(listener);
+    return -1;
+}
@@ -0,0 +1,28 @@
+#ifndef VIDEO_RESIZE_DISTRIBUTED_H
+#define VIDEO_RESIZE_DISTRIBUTED_H
+
+#include "segment.h"
+
+// A host running video_resize --worker-listen, and how many segments it takes at once.
+struct remote_worker {
+    char *host;
+    char *port;
+    int slots;
+};
+
+// Parses "host:port[*slots],..." into a newly allocated array.
+int parse_workers(const char *spec, struct remote_worker **workers, int *count);
+
+void free_workers(struct remote_worker **workers, int count);
+
+// Has a remote worker run transcode_range on input_file, which must be readable at that path or URL on the worker, with
+// the encoding options forwarded from this process.
+int transcode_remote_range(const struct remote_worker *worker, const char *input_file, int stream_index,
+                           int64_t start, int64_t end, const struct transcode_options *options,
+                           struct packet_list *packets);
+
+// Accepts coordinator connections on "[host:]port" and serves each on a thread of its own, sharing options->threads
+// between up to options->segment_workers concurrent segments. Only returns if listening fails.
+int serve_worker(const char *address, const struct transcode_options *options);
+
+#endif
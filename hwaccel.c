@@ -0,0 +1,255 @@
+#include "hwaccel.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+
+// Probing at a common size catches missing drivers and exhausted encoder sessions before any output is opened.
+#define PROBE_WIDTH 1280
+#define PROBE_HEIGHT 720
+
+// QSV frame pools cannot grow once initialised, so they are sized up front. The other backends allocate on demand.
+#define QSV_POOL_SIZE 32
+
+// Software encoders remembered by find_encoder besides the hardware ones. Further ones are looked up every time.
+#define MAX_SOFTWARE_ENCODERS 4
+
+static const struct hwaccel hwaccels[] = {
+        {"cuda",  AV_HWDEVICE_TYPE_CUDA,  AV_PIX_FMT_CUDA,  NULL,   "hevc_nvenc", "cq",             "rc-lookahead"},
+        {"vaapi", AV_HWDEVICE_TYPE_VAAPI, AV_PIX_FMT_VAAPI, NULL,   "hevc_vaapi", "global_quality", NULL},
+        {"qsv",   AV_HWDEVICE_TYPE_QSV,   AV_PIX_FMT_QSV,   "_qsv", "hevc_qsv",   "global_quality", "look_ahead_depth"}
+};
+
+const struct hwaccel *find_hwaccel(const char *name) {
+    for (int i = 0; i < sizeof hwaccels / sizeof *hwaccels; ++i) {
+        if (!strcmp(name, hwaccels[i].name)) {
+            return &hwaccels[i];
+        }
+    }
+
+    return NULL;
+}
+
+const AVCodec *find_decoder(enum AVCodecID codec_id, const struct transcode_options *options) {
+    if (options->hw_device && options->hwaccel->decoder_suffix) {
+        char name[64];
+        snprintf(name, sizeof name, "%s%s", avcodec_get_name(codec_id), options->hwaccel->decoder_suffix);
+        const AVCodec *codec = avcodec_find_decoder_by_name(name);
+        if (codec) {
+            return codec;
+        }
+    }
+
+    return avcodec_find_decoder(codec_id);
+}
+
+const char *encoder_name(const struct transcode_options *options) {
+    if (options->hw_device) {
+        return options->hwaccel->encoder;
+    }
+
+    return options->encoder ? options->encoder : "libx265";
+}
+
+// Jobs in one process keep looking up the same few encoders, so each one is found once. Names are copied, since a
+// batch job's options go away with the job.
+const AVCodec *find_encoder(const struct transcode_options *options) {
+    static struct {
+        char *name;
+        const AVCodec *codec;
+    } found[sizeof hwaccels / sizeof *hwaccels + MAX_SOFTWARE_ENCODERS];
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    const char *name = encoder_name(options);
+    const AVCodec *codec = NULL;
+    pthread_mutex_lock(&mutex);
+    int i = 0;
+    for (; i < sizeof found / sizeof *found && found[i].name; ++i) {
+        if (!strcmp(found[i].name, name)) {
+            codec = found[i].codec;
+            break;
+        }
+    }
+    if (!codec) {
+        codec = avcodec_find_encoder_by_name(name);
+        if (codec && i < sizeof found / sizeof *found && (found[i].name = av_strdup(name))) {
+            found[i].codec = codec;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return codec;
+}
+
+const char *quality_option(const struct transcode_options *options) {
+    return options->hw_device ? options->hwaccel->quality_option : "crf";
+}
+
+static int decoder_supports(const AVCodec *codec, const struct hwaccel *hwaccel) {
+    const AVCodecHWConfig *config;
+    for (int i = 0; (config = avcodec_get_hw_config(codec, i)); ++i) {
+        if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX && config->device_type == hwaccel->type &&
+            config->pix_fmt == hwaccel->format) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static enum AVPixelFormat sw_format(enum AVPixelFormat decoded_format) {
+    const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(decoded_format);
+    return descriptor && descriptor->comp[0].depth > 8 ? AV_PIX_FMT_P010 : AV_PIX_FMT_NV12;
+}
+
+static AVBufferRef *create_frames_context(AVBufferRef *device, const struct hwaccel *hwaccel,
+                                          enum AVPixelFormat format, int width, int height) {
+    AVBufferRef *frames = av_hwframe_ctx_alloc(device);
+    if (!frames) {
+        printf("Failed to allocate memory for hardware frames\n");
+        return NULL;
+    }
+
+    AVHWFramesContext *context = (AVHWFramesContext *) frames->data;
+    context->format = hwaccel->format;
+    context->sw_format = format;
+    context->width = width;
+    context->height = height;
+    context->initial_pool_size = hwaccel->type == AV_HWDEVICE_TYPE_QSV ? QSV_POOL_SIZE : 0;
+
+    int reason = av_hwframe_ctx_init(frames);
+    if (reason < 0) {
+        print_error("Failed to create hardware frames", reason);
+        av_buffer_unref(&frames);
+        return NULL;
+    }
+
+    return frames;
+}
+
+static int probe_encoder(const AVCodec *out_codec, AVBufferRef *device, const struct hwaccel *hwaccel) {
+    AVCodecContext *outcc = avcodec_alloc_context3(out_codec);
+    if (!outcc) {
+        printf("Failed to allocate memory for encoder probe\n");
+        return -1;
+    }
+
+    outcc->width = PROBE_WIDTH;
+    outcc->height = PROBE_HEIGHT;
+    outcc->time_base = (AVRational) {1, 25};
+    outcc->pix_fmt = hwaccel->format;
+    outcc->hw_frames_ctx = create_frames_context(device, hwaccel, AV_PIX_FMT_NV12, PROBE_WIDTH, PROBE_HEIGHT);
+    if (!outcc->hw_frames_ctx) {
+        avcodec_free_context(&outcc);
+        return -1;
+    }
+
+    int reason = avcodec_open2(outcc, out_codec, NULL);
+    avcodec_free_context(&outcc);
+    if (reason) {
+        print_error("Failed to open hardware encoder", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+void setup_hwaccel(struct transcode_options *options, AVFormatContext *infc) {
+    options->hw_device = NULL;
+    if (!options->hwaccel) {
+        return;
+    }
+
+    const struct hwaccel *hwaccel = options->hwaccel;
+    int reason = av_hwdevice_ctx_create(&options->hw_device, hwaccel->type, options->hwaccel_device, NULL, 0);
+    if (reason < 0) {
+        print_error("Failed to open hardware device", reason);
+        goto software;
+    }
+
+    const AVCodec *out_codec = avcodec_find_encoder_by_name(hwaccel->encoder);
+    if (!out_codec) {
+        printf("Failed to find %s codec\n", hwaccel->encoder);
+        goto software;
+    }
+
+    for (int i = 0; infc && i < infc->nb_streams; ++i) {
+        AVCodecParameters *in_parameters = infc->streams[i]->codecpar;
+        if (in_parameters->codec_type != AVMEDIA_TYPE_VIDEO) {
+            continue;
+        }
+
+        const AVCodec *in_codec = find_decoder(in_parameters->codec_id, options);
+        if (!in_codec || !decoder_supports(in_codec, hwaccel)) {
+            printf("%s cannot be decoded with %s\n", avcodec_get_name(in_parameters->codec_id), hwaccel->name);
+            goto software;
+        }
+    }
+
+    if (probe_encoder(out_codec, options->hw_device, hwaccel)) {
+        goto software;
+    }
+
+    return;
+
+    software:
+    printf("Falling back to software transcoding\n");
+    av_buffer_unref(&options->hw_device);
+}
+
+void release_hwaccel(struct transcode_options *options) {
+    av_buffer_unref(&options->hw_device);
+}
+
+static enum AVPixelFormat get_hw_format(AVCodecContext *incc, const enum AVPixelFormat *formats) {
+    const struct hwaccel *hwaccel = incc->opaque;
+    for (const enum AVPixelFormat *format = formats; *format != AV_PIX_FMT_NONE; ++format) {
+        if (*format == hwaccel->format) {
+            return *format;
+        }
+    }
+
+    printf("Decoder cannot output %s frames\n", hwaccel->name);
+    return AV_PIX_FMT_NONE;
+}
+
+int configure_hw_decoder(AVCodecContext *incc, const struct transcode_options *options) {
+    if (!options->hw_device) {
+        return 0;
+    }
+
+    if (!decoder_supports(incc->codec, options->hwaccel)) {
+        printf("%s cannot decode with %s\n", incc->codec->name, options->hwaccel->name);
+        return -1;
+    }
+
+    incc->hw_device_ctx = av_buffer_ref(options->hw_device);
+    if (!incc->hw_device_ctx) {
+        printf("Failed to reference hardware device\n");
+        return -1;
+    }
+
+    incc->opaque = (void *) options->hwaccel;
+    incc->get_format = get_hw_format;
+
+    // Frames waiting in the pipeline queues hold on to decoder surfaces, which fixed-size pools must allow for.
+    if (options->pipeline) {
+        incc->extra_hw_frames = 2 * options->queue_depth;
+    }
+    return 0;
+}
+
+int configure_hw_encoder(AVCodecContext *outcc, const AVCodecContext *incc, const struct transcode_options *options) {
+    if (!options->hw_device) {
+        return 0;
+    }
+
+    outcc->hw_frames_ctx = create_frames_context(options->hw_device, options->hwaccel, sw_format(incc->pix_fmt),
+                                                 outcc->width, outcc->height);
+    if (!outcc->hw_frames_ctx) {
+        return -1;
+    }
+
+    outcc->pix_fmt = options->hwaccel->format;
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef VIDEO_RESIZE_HWACCEL_H
+#define VIDEO_RESIZE_HWACCEL_H
+
+#include "transcode.h"
+
+// A GPU backend: the device type to open, the frame format that stays in video memory, and the HEVC encoder for it.
+// lookahead_option is NULL when the encoder has no rate-control lookahead.
+struct hwaccel {
+    const char *name;
+    enum AVHWDeviceType type;
+    enum AVPixelFormat format;
+    const char *decoder_suffix;
+    const char *encoder;
+    const char *quality_option;
+    const char *lookahead_option;
+};
+
+// Looks up cuda, vaapi or qsv, or returns NULL for an unknown name.
+const struct hwaccel *find_hwaccel(const char *name);
+
+// Opens the device for options->hwaccel and checks that its encoder works, and that every video stream of infc can be
+// decoded on it when infc is given. Anything missing leaves options->hw_device unset, which falls back to software.
+void setup_hwaccel(struct transcode_options *options, AVFormatContext *infc);
+
+void release_hwaccel(struct transcode_options *options);
+
+// The decoder to use for a stream: a hardware-capable one when a device is open, the software one otherwise.
+const AVCodec *find_decoder(enum AVCodecID codec_id, const struct transcode_options *options);
+
+// The video encoder to use: the device's when one is open, otherwise options->encoder or libx265.
+const char *encoder_name(const struct transcode_options *options);
+
+// Looks up the encoder_name encoder, remembering it for later jobs.
+const AVCodec *find_encoder(const struct transcode_options *options);
+
+// The codec option a CRF maps to for the chosen encoder.
+const char *quality_option(const struct transcode_options *options);
+
+// Attaches the device to a decoder so it outputs frames in video memory. Fails if the decoder cannot use it.
+int configure_hw_decoder(AVCodecContext *incc, const struct transcode_options *options);
+
+// Gives an encoder a frames context of its output size on the device, so it accepts the decoder's and scaler's frames.
+int configure_hw_encoder(AVCodecContext *outcc, const AVCodecContext *incc, const struct transcode_options *options);
+
+#endif
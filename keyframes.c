@@ -0,0 +1,157 @@
+#include "keyframes.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "probe.h"
+#include "replace_file.h"
+
+#define INDEX_MAGIC "VRKF1"
+
+static int compare_keyframes(const void *a, const void *b) {
+    int64_t first = ((const struct keyframe *) a)->pts;
+    int64_t second = ((const struct keyframe *) b)->pts;
+    return (first > second) - (first < second);
+}
+
+static int add_keyframe(struct keyframe_index *index, int *capacity, int64_t pts, int64_t pos) {
+    if (index->count == *capacity) {
+        int grown_capacity = *capacity ? *capacity * 2 : 256;
+        struct keyframe *grown = av_realloc_array(index->keyframes, grown_capacity, sizeof *grown);
+        if (!grown) {
+            return -1;
+        }
+
+        index->keyframes = grown;
+        *capacity = grown_capacity;
+    }
+
+    index->keyframes[index->count++] = (struct keyframe) {pts, pos};
+    return 0;
+}
+
+// An index written for another stream or time base leaves the scan to be done again.
+static int read_index(const char *path, const AVStream *stream, struct keyframe_index *index) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    int stream_index, count;
+    AVRational time_base;
+    int capacity = 0;
+    int result = -1;
+    if (fscanf(file, INDEX_MAGIC " %d %d/%d %d ", &stream_index, &time_base.num, &time_base.den, &count) == 4 &&
+        stream_index == stream->index && !av_cmp_q(time_base, stream->time_base) && count >= 0) {
+        result = 0;
+        for (int i = 0; i < count && !result; ++i) {
+            int64_t pts, pos;
+            result = fscanf(file, "%" SCNd64 " %" SCNd64 " ", &pts, &pos) == 2 ?
+                     add_keyframe(index, &capacity, pts, pos) : -1;
+        }
+    }
+    fclose(file);
+
+    if (result) {
+        free_keyframes(index);
+    }
+    return result;
+}
+
+static void write_index(const char *path, const AVStream *stream, const struct keyframe_index *index) {
+    char temporary[1024];
+    FILE *file = open_replacement(path, temporary, sizeof temporary);
+    if (!file) {
+        printf("Failed to write keyframe index %s\n", path);
+        return;
+    }
+
+    fprintf(file, INDEX_MAGIC " %d %d/%d %d\n", stream->index, stream->time_base.num, stream->time_base.den,
+            index->count);
+    for (int i = 0; i < index->count; ++i) {
+        fprintf(file, "%" PRId64 " %" PRId64 "\n", index->keyframes[i].pts, index->keyframes[i].pos);
+    }
+
+    if (commit_replacement(file, temporary, path, 0)) {
+        printf("Failed to write keyframe index %s\n", path);
+    }
+}
+
+static int scan_keyframes(AVFormatContext *infc, int stream_index, struct keyframe_index *index) {
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        infc->streams[i]->discard = i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        printf("Failed to allocate memory for keyframe scan\n");
+        return -1;
+    }
+
+    int capacity = 0;
+    int result = 0;
+    while (av_read_frame(infc, packet) >= 0) {
+        if (packet->stream_index == stream_index && packet->flags & AV_PKT_FLAG_KEY && packet->pts != AV_NOPTS_VALUE &&
+            add_keyframe(index, &capacity, packet->pts, packet->pos)) {
+            printf("Failed to allocate memory for keyframes\n");
+            result = -1;
+            av_packet_unref(packet);
+            break;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        infc->streams[i]->discard = AVDISCARD_DEFAULT;
+    }
+
+    if (result) {
+        free_keyframes(index);
+    }
+    return result;
+}
+
+int load_keyframes(AVFormatContext *infc, int stream_index, const struct transcode_options *options,
+                   struct keyframe_index *index) {
+    *index = (struct keyframe_index) {0};
+
+    AVStream *stream = infc->streams[stream_index];
+    char path[1024];
+    int cached = options->probe_cache && infc->url &&
+                 !probe_cache_path(infc->url, options->probe_cache, ".keyframes", path, sizeof path);
+    if (cached && !read_index(path, stream, index)) {
+        return 0;
+    }
+
+    if (scan_keyframes(infc, stream_index, index)) {
+        return -1;
+    }
+
+    qsort(index->keyframes, index->count, sizeof *index->keyframes, compare_keyframes);
+    if (cached) {
+        write_index(path, stream, index);
+    }
+    return 0;
+}
+
+const struct keyframe *find_keyframe(const struct keyframe_index *index, int64_t pts) {
+    int low = 0;
+    int high = index->count - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (index->keyframes[middle].pts <= pts) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return &index->keyframes[low];
+}
+
+void free_keyframes(struct keyframe_index *index) {
+    av_freep(&index->keyframes);
+    index->count = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef VIDEO_RESIZE_KEYFRAMES_H
+#define VIDEO_RESIZE_KEYFRAMES_H
+
+#include "transcode.h"
+
+// A keyframe's presentation timestamp in its stream's time base, and its byte position in the input, or -1.
+struct keyframe {
+    int64_t pts;
+    int64_t pos;
+};
+
+// The keyframes of one video stream in presentation order.
+struct keyframe_index {
+    struct keyframe *keyframes;
+    int count;
+};
+
+// Fills in the keyframes of a video stream by demuxing it alone, which costs a read of the file but no decoding. With
+// a probe cache, the index of a local file is kept beside its probe, so later jobs on the same file skip the scan. A
+// scan leaves infc at the end of the input.
+int load_keyframes(AVFormatContext *infc, int stream_index, const struct transcode_options *options,
+                   struct keyframe_index *index);
+
+// The last keyframe at or before pts, or the first one when there is none before it. The index must not be empty.
+const struct keyframe *find_keyframe(const struct keyframe_index *index, int64_t pts);
+
+void free_keyframes(struct keyframe_index *index);
+
+#endif
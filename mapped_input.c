@@ -0,0 +1,125 @@
+#include "mapped_input.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libavutil/common.h>
+
+// The demuxer copies out of the mapping through an AVIOContext buffer of this size.
+#define IO_BUFFER_SIZE 65536
+
+// After a seek the kernel is asked to start reading this much of the file from the new position.
+#define SEEK_PREFETCH (8 << 20)
+
+struct mapped_input {
+    uint8_t *data;
+    int64_t size;
+    int64_t position;
+};
+
+static int read_mapped(void *opaque, uint8_t *buf, int buf_size) {
+    struct mapped_input *input = opaque;
+    if (input->position >= input->size) {
+        return AVERROR_EOF;
+    }
+
+    int size = (int) FFMIN(buf_size, input->size - input->position);
+    memcpy(buf, input->data + input->position, size);
+    input->position += size;
+    return size;
+}
+
+static int64_t seek_mapped(void *opaque, int64_t offset, int whence) {
+    struct mapped_input *input = opaque;
+
+    int64_t position;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return input->size;
+    } else if (whence == SEEK_SET) {
+        position = offset;
+    } else if (whence == SEEK_CUR) {
+        position = input->position + offset;
+    } else if (whence == SEEK_END) {
+        position = input->size + offset;
+    } else {
+        return AVERROR(EINVAL);
+    }
+    if (position < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    // Sequential readahead restarts from a jump on its own, but only after the first fault there.
+    if (position < input->size) {
+        int64_t page = position & ~(int64_t) (sysconf(_SC_PAGESIZE) - 1);
+        madvise(input->data + page, FFMIN(SEEK_PREFETCH, input->size - page), MADV_WILLNEED);
+    }
+
+    input->position = position;
+    return position;
+}
+
+int is_mapped_input(const AVIOContext *pb) {
+    return pb && pb->read_packet == read_mapped;
+}
+
+int open_mapped_input(AVIOContext **pb, const char *url) {
+    *pb = NULL;
+    const char *path = url;
+    if (!strncmp(path, "file:", 5)) {
+        path += 5;
+    } else if (strchr(path, ':')) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return AVERROR(errno);
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) || !S_ISREG(status.st_mode) || !status.st_size) {
+        close(fd);
+        return 0;
+    }
+
+    // The mapping keeps the file referenced after the descriptor is closed.
+    uint8_t *data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return AVERROR(errno);
+    }
+    madvise(data, status.st_size, MADV_SEQUENTIAL);
+
+    struct mapped_input *input = av_mallocz(sizeof *input);
+    uint8_t *io_buffer = av_malloc(IO_BUFFER_SIZE);
+    if (input && io_buffer) {
+        *pb = avio_alloc_context(io_buffer, IO_BUFFER_SIZE, 0, input, read_mapped, NULL, seek_mapped);
+    }
+    if (!*pb) {
+        av_free(io_buffer);
+        av_free(input);
+        munmap(data, status.st_size);
+        return AVERROR(ENOMEM);
+    }
+
+    input->data = data;
+    input->size = status.st_size;
+    (*pb)->seekable = AVIO_SEEKABLE_NORMAL;
+    return 0;
+}
+
+void close_mapped_input(AVIOContext **pb) {
+    if (!*pb) {
+        return;
+    }
+
+    struct mapped_input *input = (*pb)->opaque;
+    munmap(input->data, input->size);
+    av_free(input);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
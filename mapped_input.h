@@ -0,0 +1,15 @@
+#ifndef VIDEO_RESIZE_MAPPED_INPUT_H
+#define VIDEO_RESIZE_MAPPED_INPUT_H
+
+#include <libavformat/avio.h>
+
+// Maps a local file into memory and reads it through the page cache with no read calls. Returns 0 with *pb set, 0
+// with *pb NULL when url is not a local regular file and should be opened the usual way, or a negative AVERROR.
+int open_mapped_input(AVIOContext **pb, const char *url);
+
+int is_mapped_input(const AVIOContext *pb);
+
+// Unmaps the file. Does nothing to a NULL context.
+void close_mapped_input(AVIOContext **pb);
+
+#endif
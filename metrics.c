@@ -0,0 +1,442 @@
+#include "metrics.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+
+#include "queue.h"
+
+// Items queued for the stage's thread before the encoding thread waits, and sampled frames held while they wait for
+// the encoder's version of them, which is at most its latency.
+#define METRICS_QUEUE_DEPTH 64
+#define MAX_PENDING 64
+
+// Reported for frames that come out identical, whose PSNR is infinite.
+#define MAX_PSNR 100.0
+
+// Exactly one of the three is set.
+struct metrics_item {
+    AVFrame *source;
+    AVFrame *output;
+    AVPacket *packet;
+};
+
+struct metrics {
+    char *output;
+    int stream_index;
+
+    // Touched only by the encoding thread. With reconstructed frames, the timestamps of the frames sampled are kept so
+    // that only their reconstructions are handed over.
+    AVCodecContext *encoder;
+    AVFrame *reconstructed;
+    int interval;
+    int64_t sent;
+    int64_t sampled_pts[MAX_PENDING];
+    int sampled_count;
+    int next_sampled;
+    int abandoned;
+
+    struct queue queue;
+    pthread_t thread;
+    int thread_started;
+
+    // Touched only by the stage's thread. Sampled frames wait in pending until their counterpart comes out of the
+    // decoder or the encoder, and then go through main -> psnr <- split <- reference, then ssim of that, into sink.
+    AVCodecContext *decoder;
+    AVFrame *decoded;
+    AVFrame *measured;
+    AVFrame *pending[MAX_PENDING];
+    int pending_count;
+    AVFilterGraph *graph;
+    AVFilterContext *main;
+    AVFilterContext *reference;
+    AVFilterContext *sink;
+    int64_t compared;
+    int failed;
+
+    int64_t frames;
+    double psnr_total;
+    double min_psnr;
+    double ssim_total;
+    double min_ssim;
+};
+
+static void free_item(void *item) {
+    struct metrics_item *metrics_item = item;
+    av_frame_free(&metrics_item->source);
+    av_frame_free(&metrics_item->output);
+    av_packet_free(&metrics_item->packet);
+    av_free(metrics_item);
+}
+
+static int configure_graph(struct metrics *metrics, const AVFrame *frame) {
+    metrics->graph = avfilter_graph_alloc();
+    if (!metrics->graph) {
+        return AVERROR(ENOMEM);
+    }
+
+    // The filters run on this thread alone, staying off the cores the encoder works on.
+    metrics->graph->nb_threads = 1;
+
+    // Each pair is renumbered as it goes in, so any time base will do.
+    char args[128];
+    snprintf(args, sizeof args, "video_size=%dx%d:pix_fmt=%d:time_base=1/%d", frame->width, frame->height,
+             frame->format, AV_TIME_BASE);
+    AVFilterContext *split = NULL;
+    AVFilterContext *psnr = NULL;
+    AVFilterContext *ssim = NULL;
+    int reason = avfilter_graph_create_filter(&metrics->main, avfilter_get_by_name("buffer"), "main", args, NULL,
+                                              metrics->graph);
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&metrics->reference, avfilter_get_by_name("buffer"), "reference", args,
+                                              NULL, metrics->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&split, avfilter_get_by_name("split"), "split", NULL, NULL,
+                                              metrics->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&psnr, avfilter_get_by_name("psnr"), "psnr", NULL, NULL,
+                                              metrics->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&ssim, avfilter_get_by_name("ssim"), "ssim", NULL, NULL,
+                                              metrics->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&metrics->sink, avfilter_get_by_name("buffersink"), "sink", NULL, NULL,
+                                              metrics->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(metrics->main, 0, psnr, 0);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(metrics->reference, 0, split, 0);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(split, 0, psnr, 1);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(psnr, 0, ssim, 0);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(split, 1, ssim, 1);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(ssim, 0, metrics->sink, 0);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_config(metrics->graph, NULL);
+    }
+    if (reason < 0) {
+        avfilter_graph_free(&metrics->graph);
+    }
+    return reason;
+}
+
+static double metadata_value(const AVFrame *frame, const char *key, double fallback) {
+    const AVDictionaryEntry *entry = av_dict_get(frame->metadata, key, NULL, 0);
+    return entry ? strtod(entry->value, NULL) : fallback;
+}
+
+// Takes in the scores of every pair the filters have finished with.
+static int read_scores(struct metrics *metrics) {
+    int reason;
+    while ((reason = av_buffersink_get_frame(metrics->sink, metrics->measured)) >= 0) {
+        double psnr = FFMIN(metadata_value(metrics->measured, "lavfi.psnr.psnr_avg", MAX_PSNR), MAX_PSNR);
+        double ssim = metadata_value(metrics->measured, "lavfi.ssim.All", 1);
+        av_frame_unref(metrics->measured);
+
+        metrics->min_psnr = metrics->frames ? FFMIN(metrics->min_psnr, psnr) : psnr;
+        metrics->min_ssim = metrics->frames ? FFMIN(metrics->min_ssim, ssim) : ssim;
+        metrics->psnr_total += psnr;
+        metrics->ssim_total += ssim;
+        ++metrics->frames;
+    }
+
+    return reason == AVERROR(EAGAIN) || reason == AVERROR_EOF ? 0 : reason;
+}
+
+// Compares a frame out of the encoder with the sampled frame it was encoded from, if it was sampled.
+static int compare_frame(struct metrics *metrics, AVFrame *frame) {
+    int index = 0;
+    while (index < metrics->pending_count && metrics->pending[index]->pts != frame->pts) {
+        ++index;
+    }
+    if (index == metrics->pending_count || frame->width != metrics->pending[index]->width ||
+        frame->height != metrics->pending[index]->height || frame->format != metrics->pending[index]->format) {
+        return 0;
+    }
+
+    AVFrame *source = metrics->pending[index];
+    memmove(&metrics->pending[index], &metrics->pending[index + 1],
+            (metrics->pending_count - index - 1) * sizeof *metrics->pending);
+    --metrics->pending_count;
+
+    int reason = metrics->graph ? 0 : configure_graph(metrics, frame);
+    if (reason < 0) {
+        av_frame_free(&source);
+        return reason;
+    }
+
+    // Reconstructed frames come in coding order, so each pair gets the next timestamp to keep the filters in step.
+    frame->pts = source->pts = metrics->compared++;
+    frame->sample_aspect_ratio = source->sample_aspect_ratio = (AVRational) {0, 1};
+    reason = av_buffersrc_add_frame_flags(metrics->main, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (reason >= 0) {
+        reason = av_buffersrc_add_frame(metrics->reference, source);
+    }
+    av_frame_free(&source);
+    return reason < 0 ? reason : read_scores(metrics);
+}
+
+static int decode_output(struct metrics *metrics, const AVPacket *packet) {
+    int reason = avcodec_send_packet(metrics->decoder, packet);
+    if (reason < 0) {
+        return reason;
+    }
+
+    while ((reason = avcodec_receive_frame(metrics->decoder, metrics->decoded)) >= 0) {
+        reason = compare_frame(metrics, metrics->decoded);
+        av_frame_unref(metrics->decoded);
+        if (reason < 0) {
+            return reason;
+        }
+    }
+
+    return reason == AVERROR(EAGAIN) || reason == AVERROR_EOF ? 0 : reason;
+}
+
+static int measure_item(struct metrics *metrics, struct metrics_item *item) {
+    if (item->source) {
+        // A sample the encoder never gives back, such as one it was still holding at a failure, is dropped once the
+        // newer samples fill up the pending frames.
+        if (metrics->pending_count == MAX_PENDING) {
+            av_frame_free(&metrics->pending[0]);
+            memmove(&metrics->pending[0], &metrics->pending[1], (MAX_PENDING - 1) * sizeof *metrics->pending);
+            --metrics->pending_count;
+        }
+        metrics->pending[metrics->pending_count++] = item->source;
+        item->source = NULL;
+        return 0;
+    }
+
+    return item->packet ? decode_output(metrics, item->packet) : compare_frame(metrics, item->output);
+}
+
+static void *metrics_thread(void *arg) {
+    struct metrics *metrics = arg;
+    struct metrics_item *item;
+    int reason = 0;
+    while (queue_pop(&metrics->queue, (void **) &item) == 0) {
+        if (reason >= 0) {
+            reason = measure_item(metrics, item);
+        }
+        free_item(item);
+    }
+
+    if (reason >= 0 && metrics->decoder) {
+        reason = decode_output(metrics, NULL);
+    }
+    if (reason >= 0 && metrics->graph) {
+        reason = av_buffersrc_add_frame(metrics->main, NULL);
+        if (reason >= 0) {
+            reason = av_buffersrc_add_frame(metrics->reference, NULL);
+        }
+        if (reason >= 0) {
+            reason = read_scores(metrics);
+        }
+    }
+    if (reason < 0) {
+        print_error("Failed to measure output quality", reason);
+        metrics->failed = 1;
+    }
+    return NULL;
+}
+
+// Without reconstructed frames from the encoder, its packets are decoded again on the stage's thread.
+static int open_output_decoder(struct metrics *metrics, const AVCodecContext *outcc,
+                               const struct transcode_options *options) {
+    const AVCodec *codec = avcodec_find_decoder(outcc->codec_id);
+    AVCodecParameters *parameters = avcodec_parameters_alloc();
+    if (!codec || !parameters) {
+        printf("Failed to find a decoder to measure %s\n", metrics->output);
+        avcodec_parameters_free(&parameters);
+        return -1;
+    }
+
+    int reason = avcodec_parameters_from_context(parameters, outcc);
+    if (reason < 0) {
+        print_error("Failed to copy encoder parameters for quality metrics", reason);
+        avcodec_parameters_free(&parameters);
+        return -1;
+    }
+
+    metrics->decoder = create_decode_context(codec, parameters, options);
+    avcodec_parameters_free(&parameters);
+    return metrics->decoder ? 0 : -1;
+}
+
+struct metrics *metrics_open(AVCodecContext *outcc, const char *output, int stream_index, int interval,
+                             const struct transcode_options *options) {
+    struct metrics *metrics = av_mallocz(sizeof *metrics);
+    if (!metrics) {
+        printf("Failed to allocate memory for quality metrics\n");
+        return NULL;
+    }
+
+    metrics->output = av_strdup(output);
+    metrics->stream_index = stream_index;
+    metrics->encoder = outcc;
+    metrics->interval = interval;
+    metrics->decoded = av_frame_alloc();
+    metrics->measured = av_frame_alloc();
+    if (outcc->flags & AV_CODEC_FLAG_RECON_FRAME) {
+        metrics->reconstructed = av_frame_alloc();
+    }
+    if (!metrics->output || !metrics->decoded || !metrics->measured ||
+        (outcc->flags & AV_CODEC_FLAG_RECON_FRAME && !metrics->reconstructed)) {
+        printf("Failed to allocate memory for quality metrics\n");
+        metrics_close(&metrics, NULL);
+        return NULL;
+    }
+
+    if ((!metrics->reconstructed && open_output_decoder(metrics, outcc, options)) ||
+        queue_init(&metrics->queue, METRICS_QUEUE_DEPTH, 1)) {
+        metrics_close(&metrics, NULL);
+        return NULL;
+    }
+
+    metrics->thread_started = !pthread_create(&metrics->thread, NULL, metrics_thread, metrics);
+    if (!metrics->thread_started) {
+        printf("Failed to start quality metrics for %s\n", output);
+        metrics_close(&metrics, NULL);
+        return NULL;
+    }
+
+    return metrics;
+}
+
+static void report(const struct metrics *metrics, struct transcode_stats *stats) {
+    if (metrics->failed || !metrics->frames) {
+        printf("No quality metrics for stream %d of %s\n", metrics->stream_index, metrics->output);
+        return;
+    }
+
+    struct stats_quality quality = {
+            .output = metrics->output,
+            .stream_index = metrics->stream_index,
+            .frames = metrics->frames,
+            .psnr = metrics->psnr_total / metrics->frames,
+            .min_psnr = metrics->min_psnr,
+            .ssim = metrics->ssim_total / metrics->frames,
+            .min_ssim = metrics->min_ssim
+    };
+    printf("Quality of stream %d of %s over %" PRId64 " frames: PSNR %.2f dB (lowest %.2f), SSIM %.4f (lowest %.4f)\n",
+           quality.stream_index, quality.output, quality.frames, quality.psnr, quality.min_psnr, quality.ssim,
+           quality.min_ssim);
+    stats_add_quality(stats, &quality);
+}
+
+void metrics_close(struct metrics **metrics, struct transcode_stats *stats) {
+    if (!*metrics) {
+        return;
+    }
+
+    struct metrics *closing = *metrics;
+    if (closing->thread_started) {
+        if (!closing->abandoned) {
+            queue_finish(&closing->queue);
+        }
+        pthread_join(closing->thread, NULL);
+        report(closing, stats);
+    }
+    queue_destroy(&closing->queue, free_item);
+
+    for (int i = 0; i < closing->pending_count; ++i) {
+        av_frame_free(&closing->pending[i]);
+    }
+    avfilter_graph_free(&closing->graph);
+    avcodec_free_context(&closing->decoder);
+    av_frame_free(&closing->measured);
+    av_frame_free(&closing->decoded);
+    av_frame_free(&closing->reconstructed);
+    av_free(closing->output);
+    av_freep(metrics);
+}
+
+// A failure to hand something over only costs the measurement, so the stage stops taking items instead of failing
+// the transcode.
+static void hand_over(struct metrics *metrics, struct metrics_item *item) {
+    if (!item || queue_push(&metrics->queue, item)) {
+        if (item) {
+            free_item(item);
+        }
+        printf("Quality metrics for %s stopped\n", metrics->output);
+        metrics->abandoned = 1;
+        queue_finish(&metrics->queue);
+    }
+}
+
+void metrics_frame(struct metrics *metrics, const AVFrame *frame) {
+    if (!metrics || metrics->abandoned || metrics->sent++ % metrics->interval) {
+        return;
+    }
+
+    struct metrics_item *item = av_mallocz(sizeof *item);
+    if (item && !(item->source = av_frame_clone(frame))) {
+        av_freep(&item);
+    }
+    if (item && metrics->reconstructed) {
+        metrics->sampled_pts[metrics->next_sampled] = frame->pts;
+        metrics->next_sampled = (metrics->next_sampled + 1) % MAX_PENDING;
+        metrics->sampled_count = FFMIN(metrics->sampled_count + 1, MAX_PENDING);
+    }
+    hand_over(metrics, item);
+}
+
+static int was_sampled(const struct metrics *metrics, int64_t pts) {
+    for (int i = 0; i < metrics->sampled_count; ++i) {
+        if (metrics->sampled_pts[i] == pts) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void metrics_packet(struct metrics *metrics, const AVPacket *packet) {
+    if (!metrics || metrics->abandoned) {
+        return;
+    }
+
+    struct metrics_item *item = NULL;
+    if (metrics->reconstructed) {
+        // Every packet comes with a reconstruction, which is only kept when its frame was sampled.
+        if (avcodec_receive_frame(metrics->encoder, metrics->reconstructed) < 0) {
+            return;
+        }
+        if (!was_sampled(metrics, metrics->reconstructed->pts)) {
+            av_frame_unref(metrics->reconstructed);
+            return;
+        }
+
+        item = av_mallocz(sizeof *item);
+        if (item && !(item->output = av_frame_alloc())) {
+            av_freep(&item);
+        }
+        if (item) {
+            av_frame_move_ref(item->output, metrics->reconstructed);
+        }
+        av_frame_unref(metrics->reconstructed);
+    } else {
+        item = av_mallocz(sizeof *item);
+        if (item && !(item->packet = av_packet_clone(packet))) {
+            av_freep(&item);
+        }
+    }
+
+    hand_over(metrics, item);
+}
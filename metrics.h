@@ -0,0 +1,27 @@
+#ifndef VIDEO_RESIZE_METRICS_H
+#define VIDEO_RESIZE_METRICS_H
+
+#include "transcode.h"
+
+// Measures the quality of an encoded video stream while it is encoded, comparing frames sent to the encoder with
+// what comes out of it: the encoder's reconstructed frames when it can return them, or else its packets decoded
+// again. PSNR and SSIM are worked out with libavfilter's SIMD psnr and ssim filters on a thread of the stage's own,
+// behind a bounded queue, so the encoding thread only hands over references.
+struct metrics;
+
+// Opens a stage for the encoder outcc of the input stream stream_index of output, measuring one frame in every
+// interval sent. Encoders opened with AV_CODEC_FLAG_RECON_FRAME are measured on their reconstructed frames.
+struct metrics *metrics_open(AVCodecContext *outcc, const char *output, int stream_index, int interval,
+                             const struct transcode_options *options);
+
+// Waits for the stage to measure what it was handed, prints the results and adds them to stats, which may be NULL.
+void metrics_close(struct metrics **metrics, struct transcode_stats *stats);
+
+// Hands over a frame that was just sent to the encoder. Does nothing with a NULL stage.
+void metrics_frame(struct metrics *metrics, const AVFrame *frame);
+
+// Hands over a packet the encoder just returned, before its timestamps leave the encoder's time base. Does nothing
+// with a NULL stage.
+void metrics_packet(struct metrics *metrics, const AVPacket *packet);
+
+#endif
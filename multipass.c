@@ -0,0 +1,361 @@
+#include "multipass.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "audio.h"
+#include "pertitle.h"
+
+// Reuse levels of the analysis a rendition saves. Level 5 keeps the modes and motion vectors, which only a rendition of
+// the same size can use; a rendition twice the size refines from the full level 10 data.
+#define SAME_SIZE_REUSE_LEVEL 5
+#define SCALED_REUSE_LEVEL 10
+
+// x265 refinement for a rendition loading the analysis of one half its size.
+#define SCALED_REFINEMENT "refine-intra=4:refine-inter=2:refine-mv=1"
+
+// Every file x265 may leave behind for a rendition, as suffixes of its base path.
+static const char *pass_file_suffixes[] = {".stats", ".stats.cutree", ".analysis"};
+
+// Numbers the planned transcodes of this process, so batch jobs running at once get files of their own.
+static atomic_int next_plan;
+
+struct planned_rendition {
+    struct rendition_options options;
+    int width;
+    int height;
+
+    // The path the rendition's pass files start with, and its x265 parameters for the run in progress.
+    char *base;
+    char *params;
+
+    // The rendition whose analysis this one loads, or -1, with the scale factor between them. A rendition that others
+    // load from saves at save_level, and one that does neither has both at 0.
+    int donor;
+    int scale_factor;
+    int save_level;
+};
+
+static int probe_source(const char *input_file, const struct transcode_options *options, int *width, int *height,
+                        double *frame_rate) {
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return -1;
+    }
+
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        printf("Found no video stream in %s\n", input_file);
+        close_input(&infc);
+        return -1;
+    }
+
+    AVStream *stream = infc->streams[stream_index];
+    *width = stream->codecpar->width;
+    *height = stream->codecpar->height;
+    *frame_rate = av_q2d(av_guess_frame_rate(infc, stream, NULL));
+    close_input(&infc);
+    return 0;
+}
+
+// Sets the bit rate of every rendition without a CRF from the probe, keeping any --bitrate as a cap. A probe that fails
+// leaves the bit rates as they were.
+static void apply_per_title(const char *input_file, const struct transcode_options *options,
+                            struct planned_rendition *planned, int count, double frame_rate) {
+    struct complexity complexity;
+    if (frame_rate <= 0 || probe_complexity(input_file, options, &complexity)) {
+        printf("Per-title probe failed, keeping the given bit rates\n");
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (planned[i].options.crf >= 0) {
+            continue;
+        }
+
+        int64_t bit_rate = per_title_bit_rate(&complexity, planned[i].width, planned[i].height, frame_rate);
+        if (planned[i].options.bit_rate && planned[i].options.bit_rate < bit_rate) {
+            bit_rate = planned[i].options.bit_rate;
+        }
+        planned[i].options.bit_rate = bit_rate;
+        printf("Per-title bit rate for %s: %" PRId64 "k\n", planned[i].options.output_file, bit_rate / 1000);
+    }
+}
+
+// Runs the renditions that include is set for, each with its params. pass 1 writes no output and copies the audio.
+static int run_renditions(const char *input_file, const struct transcode_options *options,
+                          struct planned_rendition *planned, int count, const int *include, int pass) {
+    struct rendition_options *renditions = av_malloc_array(count, sizeof *renditions);
+    if (!renditions) {
+        printf("Failed to allocate memory for renditions\n");
+        return -1;
+    }
+
+    int rendition_count = 0;
+    for (int i = 0; i < count; ++i) {
+        if (include[i]) {
+            renditions[rendition_count] = planned[i].options;
+            renditions[rendition_count++].x265_params = planned[i].params;
+        }
+    }
+
+    int result = 0;
+    if (rendition_count) {
+        struct transcode_options run_options = *options;
+        run_options.renditions = renditions;
+        run_options.rendition_count = rendition_count;
+        run_options.pass = pass;
+        if (pass == 1) {
+            run_options.audio_mode = AUDIO_COPY;
+        }
+        result = transcode_once(input_file, &run_options);
+    }
+
+    av_free(renditions);
+    return result;
+}
+
+static int set_params(struct planned_rendition *rendition, char *params) {
+    av_free(rendition->params);
+    rendition->params = params;
+    if (!params) {
+        printf("Failed to allocate memory for x265 parameters\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Two passes for the renditions with a target bit rate, the first only writing x265's stats. With analysis_reuse the
+// first pass also saves its analysis for the second to refine instead of repeating.
+static int run_two_pass(const char *input_file, const struct transcode_options *options,
+                        struct planned_rendition *planned, int count) {
+    int *include = av_calloc(count, sizeof *include);
+    if (!include) {
+        printf("Failed to allocate memory for passes\n");
+        return -1;
+    }
+
+    int result = -1;
+    for (int pass = 1; pass <= 2; ++pass) {
+        for (int i = 0; i < count; ++i) {
+            include[i] = pass == 2 || planned[i].options.crf < 0;
+            if (planned[i].options.crf >= 0) {
+                continue;
+            }
+
+            char *params;
+            if (options->analysis_reuse) {
+                params = av_asprintf("pass=%d:stats=%s.stats:multi-pass-opt-analysis=1:multi-pass-opt-distortion=1:"
+                                     "analysis-reuse-file=%s.analysis", pass, planned[i].base, planned[i].base);
+            } else {
+                params = av_asprintf("pass=%d:stats=%s.stats", pass, planned[i].base);
+            }
+            if (set_params(&planned[i], params)) {
+                goto end;
+            }
+        }
+
+        if (run_renditions(input_file, options, planned, count, include, pass)) {
+            goto end;
+        }
+    }
+    result = 0;
+
+    end:
+    av_free(include);
+    return result;
+}
+
+static int64_t area(const struct planned_rendition *rendition) {
+    return (int64_t) rendition->width * rendition->height;
+}
+
+// Pairs each rendition with one it can load the analysis of: the same size, or half the width and height. Taking them
+// smallest first settles whether a rendition loads before any larger one can pick it to save, since one cannot do both.
+static int choose_donors(struct planned_rendition *planned, int count) {
+    int *order = av_malloc_array(count, sizeof *order);
+    if (!order) {
+        printf("Failed to allocate memory for passes\n");
+        return -1;
+    }
+
+    // An insertion sort keeps renditions of the same size in command line order.
+    for (int i = 0; i < count; ++i) {
+        int k = i;
+        for (; k > 0 && area(&planned[order[k - 1]]) > area(&planned[i]); --k) {
+            order[k] = order[k - 1];
+        }
+        order[k] = i;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct planned_rendition *rendition = &planned[order[i]];
+        for (int j = 0; j < i && rendition->donor == -1; ++j) {
+            struct planned_rendition *donor = &planned[order[j]];
+            if (donor->donor != -1) {
+                continue;
+            }
+
+            if (donor->width == rendition->width && donor->height == rendition->height) {
+                rendition->scale_factor = 1;
+            } else if (2 * donor->width == rendition->width && 2 * donor->height == rendition->height) {
+                rendition->scale_factor = 2;
+            } else {
+                continue;
+            }
+
+            rendition->donor = order[j];
+            int level = rendition->scale_factor == 1 ? SAME_SIZE_REUSE_LEVEL : SCALED_REUSE_LEVEL;
+            donor->save_level = FFMAX(donor->save_level, level);
+        }
+    }
+
+    av_free(order);
+    return 0;
+}
+
+// Encodes the donors and the renditions that share nothing first, then every rendition that loads a donor's analysis
+// in place of its own mode decision and motion search.
+static int run_analysis_reuse(const char *input_file, const struct transcode_options *options,
+                              struct planned_rendition *planned, int count) {
+    if (choose_donors(planned, count)) {
+        return -1;
+    }
+
+    int *include = av_calloc(count, sizeof *include);
+    if (!include) {
+        printf("Failed to allocate memory for passes\n");
+        return -1;
+    }
+
+    int result = -1;
+    for (int i = 0; i < count; ++i) {
+        include[i] = planned[i].donor == -1;
+        if (planned[i].save_level && set_params(&planned[i], av_asprintf(
+                "analysis-save=%s.analysis:analysis-save-reuse-level=%d", planned[i].base, planned[i].save_level))) {
+            goto end;
+        }
+    }
+    if (run_renditions(input_file, options, planned, count, include, 0)) {
+        goto end;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        include[i] = planned[i].donor != -1;
+        if (!include[i]) {
+            continue;
+        }
+
+        const struct planned_rendition *donor = &planned[planned[i].donor];
+        char *params = av_asprintf("analysis-load=%s.analysis:analysis-load-reuse-level=%d:scale-factor=%d%s%s",
+                                   donor->base, donor->save_level, planned[i].scale_factor,
+                                   planned[i].scale_factor > 1 ? ":" : "",
+                                   planned[i].scale_factor > 1 ? SCALED_REFINEMENT : "");
+        if (set_params(&planned[i], params)) {
+            goto end;
+        }
+    }
+
+    // The first run has taken the thumbnails already.
+    struct transcode_options loading_options = *options;
+    loading_options.thumbnails_dir = NULL;
+    if (run_renditions(input_file, &loading_options, planned, count, include, 0)) {
+        goto end;
+    }
+    result = 0;
+
+    end:
+    av_free(include);
+    return result;
+}
+
+static void remove_pass_files(const struct planned_rendition *rendition) {
+    for (int i = 0; i < FF_ARRAY_ELEMS(pass_file_suffixes); ++i) {
+        char *path = av_asprintf("%s%s", rendition->base, pass_file_suffixes[i]);
+        if (path) {
+            unlink(path);
+            av_free(path);
+        }
+    }
+}
+
+int transcode_planned(const char *input_file, const struct transcode_options *options) {
+    if (!strcmp(input_file, "-")) {
+        printf("--two-pass, --analysis-reuse and --per-title read the input more than once, so it cannot be standard "
+               "input\n");
+        return -1;
+    }
+
+    int width, height;
+    double frame_rate;
+    if (probe_source(input_file, options, &width, &height, &frame_rate)) {
+        return -1;
+    }
+
+    int count = options->rendition_count;
+    struct planned_rendition *planned = av_calloc(count, sizeof *planned);
+    if (!planned) {
+        printf("Failed to allocate memory for renditions\n");
+        return -1;
+    }
+
+    const char *dir = options->pass_dir ? options->pass_dir : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int plan = atomic_fetch_add(&next_plan, 1);
+
+    // Every run shares one set of stats, so the report covers the whole job.
+    struct transcode_options run_options = *options;
+    run_options.stats = stats_start(input_file, frame_rate, &options->stats_options);
+
+    int result = -1;
+    for (int i = 0; i < count; ++i) {
+        planned[i].options = options->renditions[i];
+        planned[i].donor = -1;
+        resolve_output_size(width, height, &options->renditions[i], &planned[i].width, &planned[i].height);
+        planned[i].base = av_asprintf("%s/video_resize-%d-%d-%d", dir, (int) getpid(), plan, i);
+        if (!planned[i].base) {
+            printf("Failed to allocate memory for pass file names\n");
+            goto end;
+        }
+    }
+
+    if (options->per_title) {
+        apply_per_title(input_file, options, planned, count, frame_rate);
+    }
+
+    if (options->two_pass) {
+        result = run_two_pass(input_file, &run_options, planned, count);
+    } else if (options->analysis_reuse) {
+        result = run_analysis_reuse(input_file, &run_options, planned, count);
+    } else {
+        int *include = av_malloc_array(count, sizeof *include);
+        if (!include) {
+            printf("Failed to allocate memory for passes\n");
+            goto end;
+        }
+        for (int i = 0; i < count; ++i) {
+            include[i] = 1;
+        }
+        result = run_renditions(input_file, &run_options, planned, count, include, 0);
+        av_free(include);
+    }
+
+    end:
+    if (run_options.stats && stats_finish(run_options.stats, result)) {
+        result = -1;
+    }
+    stats_free(&run_options.stats);
+    for (int i = 0; i < count; ++i) {
+        if (planned[i].base) {
+            remove_pass_files(&planned[i]);
+        }
+        av_free(planned[i].base);
+        av_free(planned[i].params);
+    }
+    av_free(planned);
+    return result;
+}
@@ -0,0 +1,10 @@
+#ifndef VIDEO_RESIZE_MULTIPASS_H
+#define VIDEO_RESIZE_MULTIPASS_H
+
+#include "transcode.h"
+
+// Runs a transcode that needs more than one run over the input: a per-title probe to pick the bit rates, then x265
+// first passes or analysis runs, then the final encode of every rendition. The input is read once per run.
+int transcode_planned(const char *input_file, const struct transcode_options *options);
+
+#endif
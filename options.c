@@ -0,0 +1,1005 @@
+#include "options.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/avstring.h>
+#include <libavutil/cpu.h>
+
+#include "audio.h"
+#include "hwaccel.h"
+#include "scheduler.h"
+#include "thumbnails.h"
+
+enum {
+    OPTION_PIPELINE = 256,
+    OPTION_QUEUE_DEPTH,
+    OPTION_THREADS,
+    OPTION_DECODE_THREADS,
+    OPTION_DECODE_THREAD_TYPE,
+    OPTION_ENCODE_THREADS,
+    OPTION_X265_POOLS,
+    OPTION_X265_FRAME_THREADS,
+    OPTION_X265_WPP,
+    OPTION_X265_NO_WPP,
+    OPTION_X265_PARAMS,
+    OPTION_PRESET,
+    OPTION_AUTOTUNE_SPEED,
+    OPTION_AUTOTUNE_PSNR,
+    OPTION_AUTOTUNE_CACHE,
+    OPTION_LOOKAHEAD,
+    OPTION_BFRAMES,
+    OPTION_LOW_LATENCY,
+    OPTION_LIVE,
+    OPTION_SIZE,
+    OPTION_BITRATE,
+    OPTION_CRF,
+    OPTION_RENDITION,
+    OPTION_TWO_PASS,
+    OPTION_ANALYSIS_REUSE,
+    OPTION_PER_TITLE,
+    OPTION_PASS_DIR,
+    OPTION_SCALE_FILTER,
+    OPTION_SCALE_THREADS,
+    OPTION_AUDIO,
+    OPTION_AUDIO_CHANNELS,
+    OPTION_AUDIO_BITRATE,
+    OPTION_SEGMENT_WORKERS,
+    OPTION_SEGMENT_DURATION,
+    OPTION_CHECKPOINT,
+    OPTION_START,
+    OPTION_END,
+    OPTION_THUMBNAILS,
+    OPTION_THUMBNAILS_ONLY,
+    OPTION_THUMBNAIL_INTERVAL,
+    OPTION_THUMBNAIL_WIDTH,
+    OPTION_THUMBNAIL_GRID,
+    OPTION_THUMBNAIL_FORMAT,
+    OPTION_DEDUP,
+    OPTION_DEDUP_THRESHOLD,
+    OPTION_METRICS,
+    OPTION_METRICS_INTERVAL,
+    OPTION_WORKERS,
+    OPTION_WORKER_INPUT,
+    OPTION_WORKER_LISTEN,
+    OPTION_WORKER_TOKEN,
+    OPTION_HWACCEL,
+    OPTION_HWACCEL_DEVICE,
+    OPTION_NO_STREAM_COPY,
+    OPTION_READ_AHEAD,
+    OPTION_FRAGMENT,
+    OPTION_PACKAGE,
+    OPTION_PACKAGE_DURATION,
+    OPTION_WRITE_BEHIND,
+    OPTION_DIRECT_IO,
+    OPTION_MEMORY_BUDGET,
+    OPTION_MMAP,
+    OPTION_BATCH,
+    OPTION_JOBS,
+    OPTION_ENCODER,
+    OPTION_FORMAT,
+    OPTION_PRIORITY,
+    OPTION_PROBESIZE,
+    OPTION_ANALYZE_DURATION,
+    OPTION_TRUST_HEADERS,
+    OPTION_PROBE_CACHE,
+    OPTION_PROGRESS,
+    OPTION_REPORT,
+    OPTION_PROMETHEUS,
+    OPTION_STATSD
+};
+
+void print_usage(const char *program) {
+    printf("Usage: %s [options] [input file] [output file]\n", program);
+    printf("Prompts for any file that is not given on the command line. Files may be URLs, and - reads from\n");
+    printf("standard input or writes to standard output.\n\n");
+    printf("  --pipeline                 run demux, decode, encode and mux on separate threads\n");
+    printf("  --queue-depth <n>          frames or packets buffered between pipeline stages (default 8)\n");
+    printf("  --threads <n>              cores to use (default: all detected cores)\n");
+    printf("  --decode-threads <n>       decoder threads (default: --threads, at most %d)\n",
+           MAX_AUTO_DECODE_THREADS);
+    printf("  --decode-thread-type <t>   frame, slice or auto (default auto, which allows both)\n");
+    printf("  --encode-threads <n>       encoder threads and x265 pool size (default: --threads)\n");
+    printf("  --x265-pools <pools>       x265 pools string, overriding the pool size, e.g. \"32,32\"\n");
+    printf("  --x265-frame-threads <n>   concurrently encoded x265 frames (default: chosen by x265)\n");
+    printf("  --x265-wpp, --x265-no-wpp  force x265 wavefront parallel processing on or off\n");
+    printf("  --x265-params <params>     extra x265 key=value parameters separated by ':'\n");
+    printf("  --preset <name>            encoder preset, e.g. veryfast or slow (default: the encoder's)\n");
+    printf("  --autotune-speed <x>       pick the slowest x265 preset, and the fewest encoder threads, that still\n");
+    printf("                             encode at x times realtime here, from a short calibration encode\n");
+    printf("  --autotune-psnr <dB>       pick the highest CRF whose luma PSNR stays above dB, for renditions\n");
+    printf("                             without --crf or --bitrate\n");
+    printf("  --autotune-cache <dir>     reuse autotuned choices per host type and class of content, cached in dir\n");
+    printf("  --lookahead <n>            frames of rate-control lookahead (default: chosen by the encoder)\n");
+    printf("  --bframes <n>              most consecutive B-frames, 0 for no reordering (default: encoder's)\n");
+    printf("  --low-latency              no lookahead or B-frames, unless --lookahead or --bframes is given\n");
+    printf("  --live                     --low-latency with zerolatency tuning, writing and flushing every packet\n");
+    printf("                             as its own fragment, and reporting the input to output delay\n");
+    printf("  --probesize <size>         input bytes to read while probing streams, e.g. 512k (minimum 32)\n");
+    printf("  --analyzeduration <s>      seconds of input to read while probing streams, e.g. 0.5\n");
+    printf("  --trust-headers            skip probing when the container headers describe every stream\n");
+    printf("  --probe-cache <dir>        reuse stream probes of local files, cached in dir by file hash\n");
+    printf("  --mmap                     map local input files into memory instead of reading them\n");
+    printf("  --read-ahead <size>        input bytes to buffer on a separate thread, e.g. 8M (default 0: off)\n");
+    printf("  --write-behind <size>      output bytes to queue for a writer thread, e.g. 16M (default 0: off)\n");
+    printf("  --direct-io                write local output files with O_DIRECT through the write-behind queue\n");
+    printf("  --memory-budget <size>     memory to keep the transcode within, e.g. 2G, by lowering the settings\n");
+    printf("                             that hold the most frames and bytes (default 0: no limit)\n");
+    printf("  --fragment                 write fragmented MP4, which non-seekable outputs always get\n");
+    printf("  --package <dir>            write CMAF segments with HLS and DASH manifests to dir instead of MP4,\n");
+    printf("                             each rendition in the subdirectory its output names\n");
+    printf("  --package-duration <s>     packaged segment length in seconds, aligned across renditions (default 4)\n");
+    printf("  --thumbnails <dir>         also write sprite sheets of thumbnails and a WebVTT index of them to dir\n");
+    printf("  --thumbnails-only          write the thumbnails and no video, decoding only keyframes\n");
+    printf("  --thumbnail-interval <s>   seconds between thumbnails, 0 for every keyframe (default 10)\n");
+    printf("  --thumbnail-width <px>     thumbnail width; the height keeps the aspect ratio (default 160)\n");
+    printf("  --thumbnail-grid <c>x<r>   thumbnails per sheet as columns x rows (default 10x10)\n");
+    printf("  --thumbnail-format <f>     jpeg or webp sheets (default jpeg)\n");
+    printf("  --dedup                    leave out decoded frames that repeat the last one kept, for variable\n");
+    printf("                             frame rate output; a frame is still kept at least once a second\n");
+    printf("  --dedup-threshold <n>      mean luma difference per pixel within which every 16x16 block of a\n");
+    printf("                             duplicate must stay (default 2)\n");
+    printf("  --metrics                  measure PSNR and SSIM of re-encoded video against the encoder's input\n");
+    printf("                             while encoding, printed and added to --report\n");
+    printf("  --metrics-interval <n>     measure one frame in every n (default 10)\n");
+    printf("  --encoder <name>           FFmpeg video encoder, e.g. libx264 or libsvtav1 (default libx265)\n");
+    printf("  --format <name>            FFmpeg output format, e.g. matroska or mpegts (default mp4)\n");
+    printf("  --no-stream-copy           re-encode video even when it is already in the output codec and matches\n");
+    printf("                             the output\n");
+    printf("  --size <w>x<h>             output resolution; -1 for either side keeps the aspect ratio\n");
+    printf("  --bitrate <rate>           target bit rate, e.g. 4500k or 6M (default: source bit rate)\n");
+    printf("  --crf <n>                  constant rate factor; --bitrate then caps the rate\n");
+    printf("  --rendition <spec>         add a ladder output, e.g. 1280x720,bitrate=3M,crf=23,output=720.mp4;\n");
+    printf("                             repeat for each rung, replacing --size, --bitrate, --crf and the\n");
+    printf("                             output file\n");
+    printf("  --two-pass                 encode renditions that have no --crf twice, the first pass gathering x265\n");
+    printf("                             rate-control stats for the second\n");
+    printf("  --analysis-reuse           reuse x265's analysis: in the second pass with --two-pass, otherwise\n");
+    printf("                             between rungs of the same size or twice the size of another\n");
+    printf("  --per-title                pick the bit rates of renditions without --crf from a quick complexity\n");
+    printf("                             probe of the input; --bitrate then caps the rate\n");
+    printf("  --pass-dir <dir>           directory for pass and analysis files (default: $TMPDIR or /tmp)\n");
+    printf("  --scale-filter <filter>    fast_bilinear, bilinear, bicubic, area, lanczos, spline or point\n");
+    printf("                             (default bicubic)\n");
+    printf("  --scale-threads <n>        scaler slice threads, 0 for one per core (default 0)\n");
+    printf("  --audio <mode>             copy, or re-encode on a separate thread: aac, opus, or auto to encode\n");
+    printf("                             only audio MP4 players may not support to AAC (default copy)\n");
+    printf("  --audio-channels <n>       channels of re-encoded audio (default: the source's, at most 8)\n");
+    printf("  --audio-bitrate <rate>     bit rate of re-encoded audio (default 64k per channel)\n");
+    printf("  --start <s>                transcode from this many seconds into the input, seeking to the keyframe\n");
+    printf("                             before it; copied video keeps whole GOPs\n");
+    printf("  --end <s>                  stop this many seconds into the input (default: its end)\n");
+    printf("  --segment-workers <n>      split the input at keyframes and transcode segments on n workers\n");
+    printf("  --segment-duration <s>     minimum segment length in seconds (default 10)\n");
+    printf("  --checkpoint <journal>     write fragmented output a segment at a time, recording progress in the\n");
+    printf("                             journal, and resume from it when it matches the job\n");
+    printf("  --workers <list>           also send segments to remote workers, e.g. node1:9000*4,node2:9000*8\n");
+    printf("                             where *n is the segments a worker takes at once (default 1)\n");
+    printf("  --worker-input <url>       input path or URL the remote workers read (default: the input file)\n");
+    printf("  --hwaccel <backend>        decode, scale and encode on the GPU with cuda, vaapi or qsv, falling\n");
+    printf("                             back to software when the backend is unavailable\n");
+    printf("  --hwaccel-device <device>  device to open, e.g. a GPU index or /dev/dri/renderD128\n");
+    printf("  --progress <s>             print a progress line every s seconds\n");
+    printf("  --report <file>            write per-stage timings and counters as JSON when done\n");
+    printf("  --prometheus <file>        write the same in Prometheus text format, e.g. for node_exporter\n");
+    printf("  --statsd <host:port>       send progress gauges to statsd over UDP\n");
+    printf("  --batch <manifest>         run one job per manifest line of \"[options] input [output]\", read from\n");
+    printf("                             standard input for -\n");
+    printf("  --jobs <n>                 batch jobs to run at once, sharing --threads (default 1)\n");
+    printf("  --priority <p>             live, on-demand or backfill: the order batch jobs get cores in\n");
+    printf("                             (default live with --live, otherwise on-demand)\n");
+    printf("  --worker-listen <addr>     serve segments to a coordinator on [host:]port instead of transcoding;\n");
+    printf("                             --segment-workers caps the concurrent segments (default 1); only\n");
+    printf("                             loopback is listened on unless a host is given, e.g. 0.0.0.0:9000\n");
+    printf("  --worker-token <token>     shared secret workers require of coordinators (default: the\n");
+    printf("                             VIDEO_RESIZE_WORKER_TOKEN environment variable)\n");
+}
+
+int parse_int_option(const char *value, const char *name, int minimum, int *out) {
+    char *end;
+    long parsed = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || parsed < minimum || parsed > INT_MAX) {
+        printf("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+
+    *out = (int) parsed;
+    return 0;
+}
+
+static int parse_bit_rate(const char *value, const char *name, int64_t *out) {
+    char *end;
+    double parsed = strtod(value, &end);
+    if (*end == 'k' || *end == 'K') {
+        parsed *= 1000;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        parsed *= 1000000;
+        ++end;
+    }
+
+    if (*value == '\0' || *end != '\0' || parsed <= 0 || parsed > INT64_MAX) {
+        printf("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+
+    *out = (int64_t) parsed;
+    return 0;
+}
+
+static int parse_bytes(const char *value, const char *name, int64_t maximum, int64_t *out) {
+    char *end;
+    double parsed = strtod(value, &end);
+    if (*end == 'k' || *end == 'K') {
+        parsed *= 1 << 10;
+        ++end;
+    } else if (*end == 'm' || *end == 'M') {
+        parsed *= 1 << 20;
+        ++end;
+    } else if (*end == 'g' || *end == 'G') {
+        parsed *= 1 << 30;
+        ++end;
+    }
+
+    if (*value == '\0' || *end != '\0' || parsed < 0 || parsed > maximum) {
+        printf("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+
+    *out = (int64_t) parsed;
+    return 0;
+}
+
+static int parse_byte_size(const char *value, const char *name, int *out) {
+    int64_t parsed;
+    if (parse_bytes(value, name, INT_MAX, &parsed)) {
+        return -1;
+    }
+
+    *out = (int) parsed;
+    return 0;
+}
+
+// Parses a positive number of seconds, or one that may be 0 with allow_zero set, into microseconds.
+static int parse_seconds(const char *value, const char *name, int allow_zero, int64_t *out) {
+    char *end;
+    double parsed = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || parsed < 0 || (!allow_zero && parsed == 0) ||
+        parsed > INT64_MAX / AV_TIME_BASE) {
+        printf("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+
+    *out = (int64_t) (parsed * AV_TIME_BASE);
+    return 0;
+}
+
+// Parses a luma difference per pixel of 8-bit samples.
+static int parse_threshold(const char *value, const char *name, double *out) {
+    char *end;
+    double parsed = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || parsed < 0 || parsed > 255) {
+        printf("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+
+    *out = parsed;
+    return 0;
+}
+
+// Parses a positive autotuning target.
+static int parse_target(const char *value, const char *name, double *out) {
+    char *end;
+    double parsed = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || !(parsed > 0) || isinf(parsed)) {
+        printf("Invalid value for %s: %s\n", name, value);
+        return -1;
+    }
+
+    *out = parsed;
+    return 0;
+}
+
+static int parse_priority(const char *value, int *out) {
+    if (!strcmp(value, "live")) {
+        *out = PRIORITY_LIVE;
+    } else if (!strcmp(value, "on-demand")) {
+        *out = PRIORITY_ON_DEMAND;
+    } else if (!strcmp(value, "backfill")) {
+        *out = PRIORITY_BACKFILL;
+    } else {
+        printf("Invalid value for --priority: %s\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_thread_type(const char *value, int *out) {
+    if (!strcmp(value, "frame")) {
+        *out = FF_THREAD_FRAME;
+    } else if (!strcmp(value, "slice")) {
+        *out = FF_THREAD_SLICE;
+    } else if (!strcmp(value, "auto")) {
+        *out = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    } else {
+        printf("Invalid value for --decode-thread-type: %s\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_size(const char *value, int *width, int *height) {
+    char end;
+    if (sscanf(value, "%dx%d%c", width, height, &end) != 2 || !*width || !*height || *width < -1 ||
+        *height < -1 || (*width == -1 && *height == -1)) {
+        printf("Invalid size: %s\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_grid(const char *value, int *columns, int *rows) {
+    char end;
+    if (sscanf(value, "%dx%d%c", columns, rows, &end) != 2 || *columns < 1 || *rows < 1) {
+        printf("Invalid value for --thumbnail-grid: %s\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int parse_thumbnail_format(const char *value, int *out) {
+    if (!strcmp(value, "jpeg")) {
+        *out = THUMBNAIL_JPEG;
+    } else if (!strcmp(value, "webp")) {
+        *out = THUMBNAIL_WEBP;
+    } else {
+        printf("Invalid value for --thumbnail-format: %s\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int add_rendition(struct transcode_options *options) {
+    struct rendition_options *renditions = av_realloc_array(options->renditions, options->rendition_count + 1,
+                                                            sizeof *renditions);
+    if (!renditions) {
+        printf("Failed to allocate memory for renditions\n");
+        return -1;
+    }
+
+    options->renditions = renditions;
+    renditions[options->rendition_count++] = (struct rendition_options) {.crf = -1};
+    return 0;
+}
+
+// Parses "<w>x<h>[,bitrate=<rate>][,crf=<n>],output=<file>".
+static int parse_rendition(const char *value, struct transcode_options *options) {
+    if (add_rendition(options)) {
+        return -1;
+    }
+    struct rendition_options *rendition = &options->renditions[options->rendition_count - 1];
+
+    char *spec = av_strdup(value);
+    if (!spec) {
+        printf("Failed to allocate memory for rendition\n");
+        return -1;
+    }
+
+    int result = 0;
+    char *save;
+    char *size = strtok_r(spec, ",", &save);
+    if (!size || parse_size(size, &rendition->width, &rendition->height)) {
+        result = -1;
+    }
+
+    for (char *field = strtok_r(NULL, ",", &save); field && !result; field = strtok_r(NULL, ",", &save)) {
+        char *field_value = strchr(field, '=');
+        if (!field_value) {
+            printf("Invalid rendition field: %s\n", field);
+            result = -1;
+            break;
+        }
+        *field_value++ = '\0';
+
+        if (!strcmp(field, "bitrate")) {
+            result = parse_bit_rate(field_value, "rendition bitrate", &rendition->bit_rate);
+        } else if (!strcmp(field, "crf")) {
+            result = parse_int_option(field_value, "rendition crf", 0, &rendition->crf);
+        } else if (!strcmp(field, "output")) {
+            av_free(rendition->output_file);
+            rendition->output_file = av_strdup(field_value);
+            if (!rendition->output_file) {
+                printf("Failed to allocate memory for rendition\n");
+                result = -1;
+            }
+        } else {
+            printf("Unknown rendition field: %s\n", field);
+            result = -1;
+        }
+    }
+
+    if (!result && !rendition->output_file) {
+        printf("Rendition %s has no output file\n", value);
+        result = -1;
+    }
+
+    av_free(spec);
+    return result;
+}
+
+int add_single_rendition(struct transcode_options *options, struct rendition_options *single,
+                         const char *output_file) {
+    single->output_file = av_strdup(output_file);
+    if (!single->output_file || add_rendition(options)) {
+        printf("Failed to allocate memory for output file\n");
+        av_freep(&single->output_file);
+        return -1;
+    }
+
+    options->renditions[0] = *single;
+    return 0;
+}
+
+// Records an option that changes the encoded output, so remote workers can be given the same settings.
+static int forward_option(struct transcode_options *options, const char *name, const char *value) {
+    char **args = av_realloc_array(options->forwarded_args, options->forwarded_arg_count + 2, sizeof *args);
+    if (!args) {
+        printf("Failed to allocate memory for forwarded options\n");
+        return -1;
+    }
+    options->forwarded_args = args;
+
+    args[options->forwarded_arg_count] = av_asprintf("--%s", name);
+    if (!args[options->forwarded_arg_count]) {
+        printf("Failed to allocate memory for forwarded options\n");
+        return -1;
+    }
+    ++options->forwarded_arg_count;
+
+    if (value) {
+        args[options->forwarded_arg_count] = av_strdup(value);
+        if (!args[options->forwarded_arg_count]) {
+            printf("Failed to allocate memory for forwarded options\n");
+            return -1;
+        }
+        ++options->forwarded_arg_count;
+    }
+
+    return 0;
+}
+
+void free_options(struct transcode_options *options) {
+    for (int i = 0; i < options->rendition_count; ++i) {
+        av_freep(&options->renditions[i].output_file);
+    }
+    av_freep(&options->renditions);
+    options->rendition_count = 0;
+
+    for (int i = 0; i < options->forwarded_arg_count; ++i) {
+        av_freep(&options->forwarded_args[i]);
+    }
+    av_freep(&options->forwarded_args);
+    options->forwarded_arg_count = 0;
+}
+
+int parse_options(int argc, char **argv, struct transcode_options *options, struct rendition_options *single) {
+    static const struct option long_options[] = {
+            {"pipeline",           no_argument,       NULL, OPTION_PIPELINE},
+            {"queue-depth",        required_argument, NULL, OPTION_QUEUE_DEPTH},
+            {"threads",            required_argument, NULL, OPTION_THREADS},
+            {"decode-threads",     required_argument, NULL, OPTION_DECODE_THREADS},
+            {"decode-thread-type", required_argument, NULL, OPTION_DECODE_THREAD_TYPE},
+            {"encode-threads",     required_argument, NULL, OPTION_ENCODE_THREADS},
+            {"x265-pools",         required_argument, NULL, OPTION_X265_POOLS},
+            {"x265-frame-threads", required_argument, NULL, OPTION_X265_FRAME_THREADS},
+            {"x265-wpp",           no_argument,       NULL, OPTION_X265_WPP},
+            {"x265-no-wpp",        no_argument,       NULL, OPTION_X265_NO_WPP},
+            {"x265-params",        required_argument, NULL, OPTION_X265_PARAMS},
+            {"preset",             required_argument, NULL, OPTION_PRESET},
+            {"autotune-speed",     required_argument, NULL, OPTION_AUTOTUNE_SPEED},
+            {"autotune-psnr",      required_argument, NULL, OPTION_AUTOTUNE_PSNR},
+            {"autotune-cache",     required_argument, NULL, OPTION_AUTOTUNE_CACHE},
+            {"lookahead",          required_argument, NULL, OPTION_LOOKAHEAD},
+            {"bframes",            required_argument, NULL, OPTION_BFRAMES},
+            {"low-latency",        no_argument,       NULL, OPTION_LOW_LATENCY},
+            {"live",               no_argument,       NULL, OPTION_LIVE},
+            {"size",               required_argument, NULL, OPTION_SIZE},
+            {"bitrate",            required_argument, NULL, OPTION_BITRATE},
+            {"crf",                required_argument, NULL, OPTION_CRF},
+            {"rendition",          required_argument, NULL, OPTION_RENDITION},
+            {"two-pass",           no_argument,       NULL, OPTION_TWO_PASS},
+            {"analysis-reuse",     no_argument,       NULL, OPTION_ANALYSIS_REUSE},
+            {"per-title",          no_argument,       NULL, OPTION_PER_TITLE},
+            {"pass-dir",           required_argument, NULL, OPTION_PASS_DIR},
+            {"scale-filter",       required_argument, NULL, OPTION_SCALE_FILTER},
+            {"scale-threads",      required_argument, NULL, OPTION_SCALE_THREADS},
+            {"audio",              required_argument, NULL, OPTION_AUDIO},
+            {"audio-channels",     required_argument, NULL, OPTION_AUDIO_CHANNELS},
+            {"audio-bitrate",      required_argument, NULL, OPTION_AUDIO_BITRATE},
+            {"segment-workers",    required_argument, NULL, OPTION_SEGMENT_WORKERS},
+            {"segment-duration",   required_argument, NULL, OPTION_SEGMENT_DURATION},
+            {"checkpoint",         required_argument, NULL, OPTION_CHECKPOINT},
+            {"start",              required_argument, NULL, OPTION_START},
+            {"end",                required_argument, NULL, OPTION_END},
+            {"thumbnails",         required_argument, NULL, OPTION_THUMBNAILS},
+            {"thumbnails-only",    no_argument,       NULL, OPTION_THUMBNAILS_ONLY},
+            {"thumbnail-interval", required_argument, NULL, OPTION_THUMBNAIL_INTERVAL},
+            {"thumbnail-width",    required_argument, NULL, OPTION_THUMBNAIL_WIDTH},
+            {"thumbnail-grid",     required_argument, NULL, OPTION_THUMBNAIL_GRID},
+            {"thumbnail-format",   required_argument, NULL, OPTION_THUMBNAIL_FORMAT},
+            {"dedup",              no_argument,       NULL, OPTION_DEDUP},
+            {"dedup-threshold",    required_argument, NULL, OPTION_DEDUP_THRESHOLD},
+            {"metrics",            no_argument,       NULL, OPTION_METRICS},
+            {"metrics-interval",   required_argument, NULL, OPTION_METRICS_INTERVAL},
+            {"workers",            required_argument, NULL, OPTION_WORKERS},
+            {"worker-input",       required_argument, NULL, OPTION_WORKER_INPUT},
+            {"worker-listen",      required_argument, NULL, OPTION_WORKER_LISTEN},
+            {"worker-token",       required_argument, NULL, OPTION_WORKER_TOKEN},
+            {"hwaccel",            required_argument, NULL, OPTION_HWACCEL},
+            {"hwaccel-device",     required_argument, NULL, OPTION_HWACCEL_DEVICE},
+            {"no-stream-copy",     no_argument,       NULL, OPTION_NO_STREAM_COPY},
+            {"read-ahead",         required_argument, NULL, OPTION_READ_AHEAD},
+            {"fragment",           no_argument,       NULL, OPTION_FRAGMENT},
+            {"package",            required_argument, NULL, OPTION_PACKAGE},
+            {"package-duration",   required_argument, NULL, OPTION_PACKAGE_DURATION},
+            {"write-behind",       required_argument, NULL, OPTION_WRITE_BEHIND},
+            {"direct-io",          no_argument,       NULL, OPTION_DIRECT_IO},
+            {"memory-budget",      required_argument, NULL, OPTION_MEMORY_BUDGET},
+            {"mmap",               no_argument,       NULL, OPTION_MMAP},
+            {"batch",              required_argument, NULL, OPTION_BATCH},
+            {"jobs",               required_argument, NULL, OPTION_JOBS},
+            {"encoder",            required_argument, NULL, OPTION_ENCODER},
+            {"format",             required_argument, NULL, OPTION_FORMAT},
+            {"priority",           required_argument, NULL, OPTION_PRIORITY},
+            {"probesize",          required_argument, NULL, OPTION_PROBESIZE},
+            {"analyzeduration",    required_argument, NULL, OPTION_ANALYZE_DURATION},
+            {"trust-headers",      no_argument,       NULL, OPTION_TRUST_HEADERS},
+            {"probe-cache",        required_argument, NULL, OPTION_PROBE_CACHE},
+            {"progress",           required_argument, NULL, OPTION_PROGRESS},
+            {"report",             required_argument, NULL, OPTION_REPORT},
+            {"prometheus",         required_argument, NULL, OPTION_PROMETHEUS},
+            {"statsd",             required_argument, NULL, OPTION_STATSD},
+            {"help",               no_argument,       NULL, 'h'},
+            {NULL, 0,                                 NULL, 0}
+    };
+
+    *options = (struct transcode_options) {
+            .queue_depth = 8,
+            .stream_copy = 1,
+            .threads = av_cpu_count(),
+            .decode_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE,
+            .x265_wpp = -1,
+            .lookahead = -1,
+            .bframes = -1,
+            .scale_flags = SWS_BICUBIC,
+            .segment_duration = 10,
+            .package_duration = 4,
+            .thumbnail_interval = 10,
+            .thumbnail_width = 160,
+            .thumbnail_columns = 10,
+            .thumbnail_rows = 10,
+            .dedup_threshold = 2,
+            .metrics_interval = 10,
+            .priority = -1,
+            .worker_token = getenv("VIDEO_RESIZE_WORKER_TOKEN")
+    };
+    *single = (struct rendition_options) {.crf = -1};
+
+    // Resetting to 0 rather than 1 makes glibc reinitialise getopt, so a second argument vector parses cleanly.
+    optind = 0;
+
+    int low_latency = 0;
+    int option;
+    int option_index;
+    while ((option = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+        int reason = 0;
+        int forward = 0;
+        switch (option) {
+            case OPTION_PIPELINE:
+                options->pipeline = 1;
+                break;
+            case OPTION_QUEUE_DEPTH:
+                reason = parse_int_option(optarg, "--queue-depth", 1, &options->queue_depth);
+                break;
+            case OPTION_THREADS:
+                reason = parse_int_option(optarg, "--threads", 1, &options->threads);
+                break;
+            case OPTION_DECODE_THREADS:
+                reason = parse_int_option(optarg, "--decode-threads", 1, &options->decode_threads);
+                break;
+            case OPTION_DECODE_THREAD_TYPE:
+                reason = parse_thread_type(optarg, &options->decode_thread_type);
+                forward = 1;
+                break;
+            case OPTION_ENCODE_THREADS:
+                reason = parse_int_option(optarg, "--encode-threads", 1, &options->encode_threads);
+                break;
+            case OPTION_X265_POOLS:
+                options->x265_pools = optarg;
+                break;
+            case OPTION_X265_FRAME_THREADS:
+                reason = parse_int_option(optarg, "--x265-frame-threads", 1, &options->x265_frame_threads);
+                forward = 1;
+                break;
+            case OPTION_X265_WPP:
+                options->x265_wpp = 1;
+                forward = 1;
+                break;
+            case OPTION_X265_NO_WPP:
+                options->x265_wpp = 0;
+                forward = 1;
+                break;
+            case OPTION_X265_PARAMS:
+                options->x265_params = optarg;
+                forward = 1;
+                break;
+            case OPTION_PRESET:
+                options->preset = optarg;
+                forward = 1;
+                break;
+            case OPTION_AUTOTUNE_SPEED:
+                reason = parse_target(optarg, "--autotune-speed", &options->autotune_speed);
+                break;
+            case OPTION_AUTOTUNE_PSNR:
+                reason = parse_target(optarg, "--autotune-psnr", &options->autotune_psnr);
+                break;
+            case OPTION_AUTOTUNE_CACHE:
+                options->autotune_cache = optarg;
+                break;
+            case OPTION_LOOKAHEAD:
+                reason = parse_int_option(optarg, "--lookahead", 0, &options->lookahead);
+                forward = 1;
+                break;
+            case OPTION_BFRAMES:
+                reason = parse_int_option(optarg, "--bframes", 0, &options->bframes);
+                forward = 1;
+                break;
+            case OPTION_LOW_LATENCY:
+                low_latency = 1;
+                forward = 1;
+                break;
+            case OPTION_LIVE:
+                options->live = 1;
+                options->stats_options.track_delay = 1;
+                low_latency = 1;
+                break;
+            case OPTION_SIZE:
+                reason = parse_size(optarg, &single->width, &single->height);
+                forward = 1;
+                break;
+            case OPTION_BITRATE:
+                reason = parse_bit_rate(optarg, "--bitrate", &single->bit_rate);
+                forward = 1;
+                break;
+            case OPTION_CRF:
+                reason = parse_int_option(optarg, "--crf", 0, &single->crf);
+                forward = 1;
+                break;
+            case OPTION_RENDITION:
+                reason = parse_rendition(optarg, options);
+                forward = 1;
+                break;
+            case OPTION_TWO_PASS:
+                options->two_pass = 1;
+                break;
+            case OPTION_ANALYSIS_REUSE:
+                options->analysis_reuse = 1;
+                break;
+            case OPTION_PER_TITLE:
+                options->per_title = 1;
+                break;
+            case OPTION_PASS_DIR:
+                options->pass_dir = optarg;
+                break;
+            case OPTION_SCALE_FILTER:
+                options->scale_flags = parse_scale_filter(optarg);
+                if (options->scale_flags == -1) {
+                    printf("Invalid value for --scale-filter: %s\n", optarg);
+                    reason = -1;
+                }
+                forward = 1;
+                break;
+            case OPTION_SCALE_THREADS:
+                reason = parse_int_option(optarg, "--scale-threads", 0, &options->scale_threads);
+                break;
+            case OPTION_AUDIO:
+                options->audio_mode = parse_audio_mode(optarg);
+                if (options->audio_mode == -1) {
+                    printf("Invalid value for --audio: %s\n", optarg);
+                    reason = -1;
+                }
+                break;
+            case OPTION_AUDIO_CHANNELS:
+                reason = parse_int_option(optarg, "--audio-channels", 1, &options->audio_channels);
+                break;
+            case OPTION_AUDIO_BITRATE:
+                reason = parse_bit_rate(optarg, "--audio-bitrate", &options->audio_bit_rate);
+                break;
+            case OPTION_SEGMENT_WORKERS:
+                reason = parse_int_option(optarg, "--segment-workers", 1, &options->segment_workers);
+                break;
+            case OPTION_SEGMENT_DURATION:
+                reason = parse_int_option(optarg, "--segment-duration", 1, &options->segment_duration);
+                break;
+            case OPTION_CHECKPOINT:
+                options->checkpoint_file = optarg;
+                break;
+            case OPTION_START:
+                reason = parse_seconds(optarg, "--start", 1, &options->clip_start);
+                break;
+            case OPTION_END:
+                reason = parse_seconds(optarg, "--end", 0, &options->clip_end);
+                break;
+            case OPTION_THUMBNAILS:
+                options->thumbnails_dir = optarg;
+                break;
+            case OPTION_THUMBNAILS_ONLY:
+                options->thumbnails_only = 1;
+                break;
+            case OPTION_THUMBNAIL_INTERVAL:
+                reason = parse_int_option(optarg, "--thumbnail-interval", 0, &options->thumbnail_interval);
+                break;
+            case OPTION_THUMBNAIL_WIDTH:
+                reason = parse_int_option(optarg, "--thumbnail-width", 2, &options->thumbnail_width);
+                break;
+            case OPTION_THUMBNAIL_GRID:
+                reason = parse_grid(optarg, &options->thumbnail_columns, &options->thumbnail_rows);
+                break;
+            case OPTION_THUMBNAIL_FORMAT:
+                reason = parse_thumbnail_format(optarg, &options->thumbnail_format);
+                break;
+            case OPTION_DEDUP:
+                options->dedup = 1;
+                forward = 1;
+                break;
+            case OPTION_DEDUP_THRESHOLD:
+                reason = parse_threshold(optarg, "--dedup-threshold", &options->dedup_threshold);
+                forward = 1;
+                break;
+            case OPTION_METRICS:
+                options->metrics = 1;
+                break;
+            case OPTION_METRICS_INTERVAL:
+                reason = parse_int_option(optarg, "--metrics-interval", 1, &options->metrics_interval);
+                break;
+            case OPTION_WORKERS:
+                options->workers = optarg;
+                break;
+            case OPTION_WORKER_INPUT:
+                options->worker_input = optarg;
+                break;
+            case OPTION_WORKER_LISTEN:
+                options->worker_listen = optarg;
+                break;
+            case OPTION_WORKER_TOKEN:
+                options->worker_token = optarg;
+                break;
+            case OPTION_HWACCEL:
+                options->hwaccel = find_hwaccel(optarg);
+                if (!options->hwaccel) {
+                    printf("Invalid value for --hwaccel: %s\n", optarg);
+                    reason = -1;
+                }
+                forward = 1;
+                break;
+            case OPTION_HWACCEL_DEVICE:
+                options->hwaccel_device = optarg;
+                break;
+            case OPTION_NO_STREAM_COPY:
+                options->stream_copy = 0;
+                break;
+            case OPTION_READ_AHEAD:
+                reason = parse_byte_size(optarg, "--read-ahead", &options->read_ahead);
+                break;
+            case OPTION_FRAGMENT:
+                options->fragment = 1;
+                break;
+            case OPTION_PACKAGE:
+                options->package_dir = optarg;
+                break;
+            case OPTION_PACKAGE_DURATION:
+                reason = parse_int_option(optarg, "--package-duration", 1, &options->package_duration);
+                break;
+            case OPTION_WRITE_BEHIND:
+                reason = parse_byte_size(optarg, "--write-behind", &options->write_behind);
+                break;
+            case OPTION_DIRECT_IO:
+                options->direct_io = 1;
+                break;
+            case OPTION_MEMORY_BUDGET:
+                reason = parse_bytes(optarg, "--memory-budget", INT64_MAX / 2, &options->memory_budget);
+                break;
+            case OPTION_MMAP:
+                options->mmap_input = 1;
+                break;
+            case OPTION_BATCH:
+                options->batch = optarg;
+                break;
+            case OPTION_JOBS:
+                reason = parse_int_option(optarg, "--jobs", 1, &options->jobs);
+                break;
+            case OPTION_ENCODER:
+                options->encoder = optarg;
+                forward = 1;
+                break;
+            case OPTION_FORMAT:
+                options->format = optarg;
+                break;
+            case OPTION_PRIORITY:
+                reason = parse_priority(optarg, &options->priority);
+                break;
+            case OPTION_PROBESIZE:
+                reason = parse_byte_size(optarg, "--probesize", &options->probesize);
+                if (!reason && options->probesize < 32) {
+                    printf("Invalid value for --probesize: %s\n", optarg);
+                    reason = -1;
+                }
+                break;
+            case OPTION_ANALYZE_DURATION:
+                reason = parse_seconds(optarg, "--analyzeduration", 0, &options->analyze_duration);
+                break;
+            case OPTION_TRUST_HEADERS:
+                options->trust_headers = 1;
+                break;
+            case OPTION_PROBE_CACHE:
+                options->probe_cache = optarg;
+                break;
+            case OPTION_PROGRESS:
+                reason = parse_int_option(optarg, "--progress", 1, &options->stats_options.progress_interval);
+                break;
+            case OPTION_REPORT:
+                options->stats_options.report_file = optarg;
+                break;
+            case OPTION_PROMETHEUS:
+                options->stats_options.prometheus_file = optarg;
+                break;
+            case OPTION_STATSD:
+                options->stats_options.statsd = optarg;
+                break;
+            case 'h':
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+
+        if (!reason && forward) {
+            reason = forward_option(options, long_options[option_index].name, optarg);
+        }
+        if (reason) {
+            return reason;
+        }
+    }
+
+    // Segments are encoded ahead of the stitcher, which defeats the point of live mode.
+    if (options->live && (options->segment_workers || options->workers)) {
+        printf("--live cannot be combined with --segment-workers or --workers\n");
+        return -1;
+    }
+
+    // Every pass after the first reads the input again, and each segment would need passes of its own.
+    int multi_pass = options->two_pass || options->analysis_reuse;
+    if ((multi_pass || options->per_title) && options->live) {
+        printf("--two-pass, --analysis-reuse and --per-title cannot be combined with --live\n");
+        return -1;
+    }
+    if (multi_pass && (options->segment_workers || options->workers)) {
+        printf("--two-pass and --analysis-reuse cannot be combined with --segment-workers or --workers\n");
+        return -1;
+    }
+    if (multi_pass && options->hwaccel) {
+        printf("--two-pass and --analysis-reuse need the libx265 encoder, so cannot be combined with --hwaccel\n");
+        return -1;
+    }
+    if (multi_pass && options->encoder && strcmp(options->encoder, "libx265")) {
+        printf("--two-pass and --analysis-reuse need the libx265 encoder\n");
+        return -1;
+    }
+
+    // Segments are encoded apart, each by an encoder of its own, and hardware frames stay on the GPU.
+    if (options->metrics && (options->segment_workers || options->workers || options->checkpoint_file ||
+                             options->hwaccel)) {
+        printf("--metrics cannot be combined with --segment-workers, --workers, --checkpoint or --hwaccel\n");
+        return -1;
+    }
+
+    // The calibration encodes with x265 in software, and remote workers would not be given what it picks.
+    if (options->autotune_speed || options->autotune_psnr) {
+        if (options->live || options->hwaccel || options->workers) {
+            printf("--autotune-speed and --autotune-psnr cannot be combined with --live, --hwaccel or --workers\n");
+            return -1;
+        }
+        if (options->encoder && strcmp(options->encoder, "libx265")) {
+            printf("--autotune-speed and --autotune-psnr need the libx265 encoder\n");
+            return -1;
+        }
+        if (options->autotune_speed && options->preset) {
+            printf("--autotune-speed picks the preset, so it cannot be combined with --preset\n");
+            return -1;
+        }
+        if (options->autotune_psnr && options->per_title) {
+            printf("--autotune-psnr picks the rate control, so it cannot be combined with --per-title\n");
+            return -1;
+        }
+    }
+
+    // Packages are CMAF and checkpoints resume fragmented MP4.
+    if (options->format && (options->package_dir || options->checkpoint_file)) {
+        printf("--format cannot be combined with --package or --checkpoint\n");
+        return -1;
+    }
+
+    // Packaged renditions are listed together once they are all written, so they must all come out of one run, and
+    // segment-parallel stitching would not keep the forced keyframes aligned.
+    if (options->package_dir) {
+        if (options->live || options->checkpoint_file || options->segment_workers || options->workers) {
+            printf("--package cannot be combined with --live, --checkpoint, --segment-workers or --workers\n");
+            return -1;
+        }
+        if (options->analysis_reuse && !options->two_pass) {
+            printf("--package needs --two-pass when combined with --analysis-reuse\n");
+            return -1;
+        }
+    }
+
+    // Segment mode plans its segments over the whole input, and checkpointed jobs run in segment mode.
+    if (options->clip_start || options->clip_end) {
+        if (options->clip_end && options->clip_end <= options->clip_start) {
+            printf("--end must come after --start\n");
+            return -1;
+        }
+        if (options->live || options->checkpoint_file || options->segment_workers || options->workers) {
+            printf("--start and --end cannot be combined with --live, --checkpoint, --segment-workers or --workers\n");
+            return -1;
+        }
+    }
+
+    // Segments are decoded apart from the stream thumbnails are taken of, and a thumbnails-only job reads the keyframes
+    // of the whole input.
+    if (options->thumbnails_only && !options->thumbnails_dir) {
+        printf("--thumbnails-only needs --thumbnails\n");
+        return -1;
+    }
+    if (options->thumbnails_dir && (options->segment_workers || options->workers || options->checkpoint_file)) {
+        printf("--thumbnails cannot be combined with --segment-workers, --workers or --checkpoint\n");
+        return -1;
+    }
+    if (options->thumbnails_only && (options->clip_start || options->clip_end)) {
+        printf("--thumbnails-only cannot be combined with --start or --end\n");
+        return -1;
+    }
+
+    // Checkpoints are taken between segments, so a checkpointed job runs in segment mode, on one worker unless told
+    // otherwise. Everything written up to a checkpoint must be on disk and no audio may be in flight.
+    if (options->checkpoint_file) {
+        if (options->live || multi_pass) {
+            printf("--checkpoint cannot be combined with --live, --two-pass or --analysis-reuse\n");
+            return -1;
+        }
+        if (options->write_behind || options->direct_io) {
+            printf("--checkpoint cannot be combined with --write-behind or --direct-io\n");
+            return -1;
+        }
+        if (options->audio_mode != AUDIO_COPY) {
+            printf("--checkpoint copies the audio, so it cannot be combined with --audio\n");
+            return -1;
+        }
+        if (!options->segment_workers && !options->workers) {
+            options->segment_workers = 1;
+        }
+    }
+
+    // Applied after the loop so an explicit --lookahead or --bframes wins whichever side of --low-latency it is on.
+    if (low_latency) {
+        options->lookahead = options->lookahead == -1 ? 0 : options->lookahead;
+        options->bframes = options->bframes == -1 ? 0 : options->bframes;
+    }
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef VIDEO_RESIZE_OPTIONS_H
+#define VIDEO_RESIZE_OPTIONS_H
+
+#include "transcode.h"
+
+void print_usage(const char *program);
+
+int parse_int_option(const char *value, const char *name, int minimum, int *out);
+
+// Fills options and single from the command line, leaving optind at the first positional argument. single holds the
+// --size, --bitrate and --crf settings for when no --rendition is given.
+int parse_options(int argc, char **argv, struct transcode_options *options, struct rendition_options *single);
+
+// Makes single, written to output_file, the only rendition.
+int add_single_rendition(struct transcode_options *options, struct rendition_options *single,
+                         const char *output_file);
+
+void free_options(struct transcode_options *options);
+
+#endif
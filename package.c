@@ -0,0 +1,367 @@
+#include "package.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/pixdesc.h>
+
+#define MASTER_PLAYLIST "master.m3u8"
+#define DASH_MANIFEST "manifest.mpd"
+#define MEDIA_PLAYLIST "playlist.m3u8"
+#define INIT_SEGMENT "init.mp4"
+#define MEDIA_SEGMENT "segment_%05d.m4s"
+
+// HEVC levels as level_idc, with the largest picture in luma samples and the luma sample rate each allows.
+static const struct {
+    int level;
+    int64_t max_picture_size;
+    int64_t max_sample_rate;
+} hevc_levels[] = {
+        {30,  36864,    552960},
+        {60,  122880,   3686400},
+        {63,  245760,   7372800},
+        {90,  552960,   16588800},
+        {93,  983040,   33177600},
+        {120, 2228224,  66846720},
+        {123, 2228224,  133693440},
+        {150, 8912896,  267386880},
+        {153, 8912896,  534773760},
+        {156, 8912896,  1069547520},
+        {180, 35651584, 1069547520},
+        {183, 35651584, 2139095040},
+        {186, 35651584, 4278190080}
+};
+
+static int make_directory(const char *path) {
+    if (mkdir(path, 0777) && errno != EEXIST) {
+        printf("Failed to create directory %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int package_open_rendition(const struct transcode_options *options, const struct rendition_options *rendition,
+                           AVFormatContext **outfc) {
+    if (!strcmp(rendition->output_file, "-") || strstr(rendition->output_file, "..")) {
+        printf("Packaged rendition %s must be named by a directory inside %s\n", rendition->output_file,
+               options->package_dir);
+        return -1;
+    }
+
+    char *directory = av_asprintf("%s/%s", options->package_dir, rendition->output_file);
+    char *playlist = av_asprintf("%s/" MEDIA_PLAYLIST, directory ? directory : "");
+    if (!directory || !playlist) {
+        printf("Failed to allocate memory for rendition %s\n", rendition->output_file);
+        av_free(playlist);
+        av_free(directory);
+        return -1;
+    }
+
+    int result = -1;
+    if (make_directory(options->package_dir) || make_directory(directory)) {
+        goto end;
+    }
+
+    int reason = avformat_alloc_output_context2(outfc, NULL, "hls", playlist);
+    if (reason) {
+        print_error("Failed to create output context", reason);
+        goto end;
+    }
+    result = 0;
+
+    end:
+    av_free(playlist);
+    av_free(directory);
+    return result;
+}
+
+// Video-on-demand playlists over fMP4 segments cut at the forced keyframes. The init segment goes next to the media
+// segments, whose names are relative to the playlist in the same directory.
+int package_muxer_options(const struct transcode_options *options, const struct rendition_options *rendition,
+                          AVDictionary **muxer_options) {
+    char *segments = av_asprintf("%s/%s/" MEDIA_SEGMENT, options->package_dir, rendition->output_file);
+    if (!segments) {
+        printf("Failed to allocate memory for muxer options\n");
+        return -1;
+    }
+
+    int reason = 0;
+    reason = FFMIN(reason, av_dict_set(muxer_options, "hls_segment_filename", segments, 0));
+    reason = FFMIN(reason, av_dict_set(muxer_options, "hls_segment_type", "fmp4", 0));
+    reason = FFMIN(reason, av_dict_set(muxer_options, "hls_fmp4_init_filename", INIT_SEGMENT, 0));
+    reason = FFMIN(reason, av_dict_set_int(muxer_options, "hls_time", options->package_duration, 0));
+    reason = FFMIN(reason, av_dict_set(muxer_options, "hls_playlist_type", "vod", 0));
+    reason = FFMIN(reason, av_dict_set(muxer_options, "hls_flags", "independent_segments", 0));
+    av_free(segments);
+    if (reason < 0) {
+        print_error("Failed to set muxer options", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+void package_mark_keyframe(struct rendition *rendition, AVFrame *frame, AVRational time_base) {
+    if (!rendition->package_duration || frame->pts == AV_NOPTS_VALUE) {
+        return;
+    }
+
+    int64_t pts = av_rescale_q(frame->pts, time_base, AV_TIME_BASE_Q);
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    if (rendition->next_keyframe == AV_NOPTS_VALUE) {
+        rendition->next_keyframe = pts + rendition->package_duration;
+        return;
+    }
+
+    if (pts >= rendition->next_keyframe) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        while (rendition->next_keyframe <= pts) {
+            rendition->next_keyframe += rendition->package_duration;
+        }
+    }
+}
+
+// The sizes of a rendition's media segments, read back from disk once its muxer has closed them.
+struct segment_sizes {
+    int count;
+    int64_t total;
+    int64_t largest;
+};
+
+static void measure_segments(const struct transcode_options *options, const struct rendition_options *rendition,
+                             struct segment_sizes *sizes) {
+    *sizes = (struct segment_sizes) {0};
+    for (;;) {
+        char segment[32];
+        snprintf(segment, sizeof segment, MEDIA_SEGMENT, sizes->count);
+        char *path = av_asprintf("%s/%s/%s", options->package_dir, rendition->output_file, segment);
+        struct stat status;
+        int found = path && !stat(path, &status);
+        av_free(path);
+        if (!found) {
+            return;
+        }
+
+        ++sizes->count;
+        sizes->total += status.st_size;
+        sizes->largest = FFMAX(sizes->largest, status.st_size);
+    }
+}
+
+// Main or Main 10 at the lowest level that fits the picture size and sample rate, when the encoder has not said. The
+// profile compatibility flags are written bit-reversed, and 90 marks progressive, frame-only video.
+static void hevc_codec_string(const AVCodecParameters *parameters, AVRational frame_rate, char *codec, size_t size) {
+    const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(parameters->format);
+    int main10 = descriptor && descriptor->comp[0].depth > 8;
+
+    int level = parameters->level;
+    if (level <= 0) {
+        int64_t picture_size = (int64_t) parameters->width * parameters->height;
+        int64_t sample_rate = (int64_t) (picture_size * (frame_rate.num > 0 ? av_q2d(frame_rate) : 30));
+        level = hevc_levels[FF_ARRAY_ELEMS(hevc_levels) - 1].level;
+        for (int i = 0; i < FF_ARRAY_ELEMS(hevc_levels); ++i) {
+            if (picture_size <= hevc_levels[i].max_picture_size && sample_rate <= hevc_levels[i].max_sample_rate) {
+                level = hevc_levels[i].level;
+                break;
+            }
+        }
+    }
+
+    snprintf(codec, size, main10 ? "hvc1.2.4.L%d.90" : "hvc1.1.6.L%d.90", level);
+}
+
+// Returns -1 for codecs without an RFC 6381 name here, which leaves CODECS out of the manifests.
+static int audio_codec_string(const AVCodecParameters *parameters, char *codec, size_t size) {
+    switch (parameters->codec_id) {
+        case AV_CODEC_ID_AAC:
+            // The MPEG-4 audio object type is one more than FFmpeg's AAC profile.
+            snprintf(codec, size, "mp4a.40.%d", parameters->profile >= 0 ? parameters->profile + 1 : 2);
+            return 0;
+        case AV_CODEC_ID_MP3:
+            snprintf(codec, size, "mp4a.40.34");
+            return 0;
+        case AV_CODEC_ID_AC3:
+            snprintf(codec, size, "ac-3");
+            return 0;
+        case AV_CODEC_ID_EAC3:
+            snprintf(codec, size, "ec-3");
+            return 0;
+        case AV_CODEC_ID_OPUS:
+            snprintf(codec, size, "Opus");
+            return 0;
+        case AV_CODEC_ID_FLAC:
+            snprintf(codec, size, "fLaC");
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// What the manifests say about one rendition.
+struct package_entry {
+    const char *name;
+    int width;
+    int height;
+    AVRational frame_rate;
+    int64_t peak_bit_rate;
+    int64_t average_bit_rate;
+    char codecs[128];
+    int codecs_known;
+};
+
+static void describe_rendition(const struct transcode_options *options, const struct rendition *rendition,
+                               double seconds, struct package_entry *entry) {
+    *entry = (struct package_entry) {.name = rendition->options->output_file, .codecs_known = 1};
+
+    struct segment_sizes sizes;
+    measure_segments(options, rendition->options, &sizes);
+    entry->peak_bit_rate = 8 * sizes.largest / options->package_duration;
+    entry->average_bit_rate = seconds > 0 ? (int64_t) (8 * sizes.total / seconds) : entry->peak_bit_rate;
+
+    size_t length = 0;
+    for (int i = 0; i < rendition->outfc->nb_streams; ++i) {
+        const AVCodecParameters *parameters = rendition->outfc->streams[i]->codecpar;
+        char codec[32];
+        int reason = -1;
+        if (parameters->codec_type == AVMEDIA_TYPE_VIDEO && parameters->codec_id == AV_CODEC_ID_HEVC) {
+            entry->width = parameters->width;
+            entry->height = parameters->height;
+            entry->frame_rate = rendition->outfc->streams[i]->avg_frame_rate;
+            hevc_codec_string(parameters, entry->frame_rate, codec, sizeof codec);
+            reason = 0;
+        } else if (parameters->codec_type == AVMEDIA_TYPE_AUDIO) {
+            reason = audio_codec_string(parameters, codec, sizeof codec);
+        }
+
+        if (reason) {
+            entry->codecs_known = 0;
+        } else if (length < sizeof entry->codecs) {
+            length += snprintf(entry->codecs + length, sizeof entry->codecs - length, "%s%s", length ? "," : "",
+                               codec);
+        }
+    }
+}
+
+static int write_master_playlist(const struct transcode_options *options, const struct package_entry *entries,
+                                 int count) {
+    char *path = av_asprintf("%s/" MASTER_PLAYLIST, options->package_dir);
+    FILE *file = path ? fopen(path, "w") : NULL;
+    if (!file) {
+        printf("Failed to write %s\n", path ? path : MASTER_PLAYLIST);
+        av_free(path);
+        return -1;
+    }
+
+    fprintf(file, "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-INDEPENDENT-SEGMENTS\n");
+    for (int i = 0; i < count; ++i) {
+        const struct package_entry *entry = &entries[i];
+        fprintf(file, "#EXT-X-STREAM-INF:BANDWIDTH=%" PRId64 ",AVERAGE-BANDWIDTH=%" PRId64, entry->peak_bit_rate,
+                entry->average_bit_rate);
+        if (entry->width) {
+            fprintf(file, ",RESOLUTION=%dx%d", entry->width, entry->height);
+        }
+        if (entry->frame_rate.num > 0) {
+            fprintf(file, ",FRAME-RATE=%.3f", av_q2d(entry->frame_rate));
+        }
+        if (entry->codecs_known) {
+            fprintf(file, ",CODECS=\"%s\"", entry->codecs);
+        }
+        fprintf(file, "\n%s/" MEDIA_PLAYLIST "\n", entry->name);
+    }
+
+    int result = fclose(file) ? -1 : 0;
+    if (result) {
+        printf("Failed to write %s\n", path);
+    }
+    av_free(path);
+    return result;
+}
+
+static void write_xml_text(FILE *file, const char *text) {
+    for (; *text; ++text) {
+        switch (*text) {
+            case '&':
+                fputs("&amp;", file);
+                break;
+            case '<':
+                fputs("&lt;", file);
+                break;
+            case '"':
+                fputs("&quot;", file);
+                break;
+            default:
+                fputc(*text, file);
+        }
+    }
+}
+
+// One adaptation set of muxed representations over the same segments as the playlists. Every segment but the last
+// spans the segment duration, so a template with a fixed duration describes them.
+static int write_dash_manifest(const struct transcode_options *options, const struct package_entry *entries,
+                               int count, double seconds) {
+    char *path = av_asprintf("%s/" DASH_MANIFEST, options->package_dir);
+    FILE *file = path ? fopen(path, "w") : NULL;
+    if (!file) {
+        printf("Failed to write %s\n", path ? path : DASH_MANIFEST);
+        av_free(path);
+        return -1;
+    }
+
+    fprintf(file, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+    fprintf(file, "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                  "type=\"static\" mediaPresentationDuration=\"PT%.3fS\" minBufferTime=\"PT%dS\">\n", seconds,
+            options->package_duration);
+    fprintf(file, "  <Period id=\"0\" start=\"PT0S\">\n");
+    fprintf(file, "    <AdaptationSet id=\"0\" mimeType=\"video/mp4\" segmentAlignment=\"true\" "
+                  "startWithSAP=\"1\">\n");
+    for (int i = 0; i < count; ++i) {
+        const struct package_entry *entry = &entries[i];
+        fprintf(file, "      <Representation id=\"%d\" bandwidth=\"%" PRId64 "\"", i, entry->peak_bit_rate);
+        if (entry->width) {
+            fprintf(file, " width=\"%d\" height=\"%d\"", entry->width, entry->height);
+        }
+        if (entry->frame_rate.num > 0) {
+            fprintf(file, " frameRate=\"%d/%d\"", entry->frame_rate.num, entry->frame_rate.den);
+        }
+        if (entry->codecs_known) {
+            fprintf(file, " codecs=\"%s\"", entry->codecs);
+        }
+        fprintf(file, ">\n        <SegmentTemplate timescale=\"1000\" duration=\"%d\" startNumber=\"0\" "
+                      "initialization=\"", options->package_duration * 1000);
+        write_xml_text(file, entry->name);
+        fprintf(file, "/" INIT_SEGMENT "\" media=\"");
+        write_xml_text(file, entry->name);
+        fprintf(file, "/segment_$Number%%05d$.m4s\"/>\n      </Representation>\n");
+    }
+    fprintf(file, "    </AdaptationSet>\n  </Period>\n</MPD>\n");
+
+    int result = fclose(file) ? -1 : 0;
+    if (result) {
+        printf("Failed to write %s\n", path);
+    }
+    av_free(path);
+    return result;
+}
+
+int package_write_manifests(const struct transcode_options *options, struct rendition *renditions,
+                            int rendition_count, int64_t duration) {
+    struct package_entry *entries = av_calloc(rendition_count, sizeof *entries);
+    if (!entries) {
+        printf("Failed to allocate memory for manifests\n");
+        return -1;
+    }
+
+    double seconds = duration != AV_NOPTS_VALUE ? (double) duration / AV_TIME_BASE : 0;
+    for (int i = 0; i < rendition_count; ++i) {
+        describe_rendition(options, &renditions[i], seconds, &entries[i]);
+    }
+
+    int result = write_master_playlist(options, entries, rendition_count) ||
+                 write_dash_manifest(options, entries, rendition_count, seconds) ? -1 : 0;
+    av_free(entries);
+    return result;
+}
@@ -0,0 +1,28 @@
+#ifndef VIDEO_RESIZE_PACKAGE_H
+#define VIDEO_RESIZE_PACKAGE_H
+
+#include "transcode.h"
+
+// Packaged output gives each rendition a directory under options->package_dir, named after its output, holding an HLS
+// media playlist over CMAF segments: init.mp4 and segment_00000.m4s onwards. master.m3u8 and manifest.mpd in
+// package_dir then list every rendition over those same segments, for HLS and DASH players alike.
+
+// Creates the rendition's directory and an HLS output context writing its playlist and segments.
+int package_open_rendition(const struct transcode_options *options, const struct rendition_options *rendition,
+                           AVFormatContext **outfc);
+
+// Sets the rendition's HLS muxer options.
+int package_muxer_options(const struct transcode_options *options, const struct rendition_options *rendition,
+                          AVDictionary **muxer_options);
+
+// Every rendition starts a segment on the first frame at or past each multiple of the segment duration, counted from
+// the first frame. Forcing a keyframe there from the source timestamps puts it on the same frame in every rendition,
+// so their segments line up. Other frames have the decoder's picture type cleared so the encoder chooses.
+void package_mark_keyframe(struct rendition *rendition, AVFrame *frame, AVRational time_base);
+
+// Writes the master playlist and the DASH manifest once every rendition's trailer is written. duration is the
+// input's, in AV_TIME_BASE units, or AV_NOPTS_VALUE when unknown.
+int package_write_manifests(const struct transcode_options *options, struct rendition *renditions,
+                            int rendition_count, int64_t duration);
+
+#endif
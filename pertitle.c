@@ -0,0 +1,227 @@
+#include "pertitle.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+#include "hwaccel.h"
+
+// The probe encodes PROBE_SAMPLES runs of PROBE_FRAMES frames, spread evenly over the stream, at PROBE_WIDTH wide and a
+// constant rate factor of PROBE_CRF.
+#define PROBE_SAMPLES 6
+#define PROBE_FRAMES 30
+#define PROBE_WIDTH 640
+#define PROBE_CRF 23
+
+// Larger frames are smoother at the pixel level, so the rate for a given quality grows more slowly than the pixel
+// count. The usual rule of thumb puts it at about the 0.75th power.
+#define PIXEL_EXPONENT 0.75
+
+static AVCodecContext *open_probe_encoder(int width, int height, AVRational frame_rate,
+                                          const struct transcode_options *options) {
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx265");
+    if (!codec) {
+        printf("Failed to find libx265 codec for the complexity probe\n");
+        return NULL;
+    }
+
+    AVCodecContext *encoder = avcodec_alloc_context3(codec);
+    if (!encoder) {
+        printf("Failed to allocate memory for the complexity probe encoder\n");
+        return NULL;
+    }
+
+    encoder->width = width;
+    encoder->height = height;
+    encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+    encoder->time_base = av_inv_q(frame_rate);
+    encoder->framerate = frame_rate;
+    encoder->thread_count = options->threads;
+
+    AVDictionary *codec_options = NULL;
+    av_dict_set(&codec_options, "preset", "ultrafast", 0);
+    av_dict_set_int(&codec_options, "crf", PROBE_CRF, 0);
+    av_dict_set(&codec_options, "x265-params", "log-level=warning", 0);
+    int reason = avcodec_open2(encoder, codec, &codec_options);
+    av_dict_free(&codec_options);
+    if (reason < 0) {
+        print_error("Failed to open the complexity probe encoder", reason);
+        avcodec_free_context(&encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+// Sends a frame, or NULL to drain, and adds the size of every packet that comes back to *bytes.
+static int encode_probe_frame(AVCodecContext *encoder, AVFrame *frame, AVPacket *packet, int64_t *bytes) {
+    int reason = avcodec_send_frame(encoder, frame);
+    if (reason < 0) {
+        print_error("Failed to send complexity probe frame", reason);
+        return -1;
+    }
+
+    while ((reason = avcodec_receive_packet(encoder, packet)) >= 0) {
+        *bytes += packet->size;
+        av_packet_unref(packet);
+    }
+    if (reason != AVERROR(EAGAIN) && reason != AVERROR_EOF) {
+        print_error("Failed to receive complexity probe packets", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Decodes from the current position until PROBE_FRAMES frames have been scaled and encoded, or the stream ends.
+static int probe_sample(AVFormatContext *infc, int stream_index, AVCodecContext *decoder, AVCodecContext *encoder,
+                        struct scaler *scaler, AVPacket *packet, AVFrame *frame, AVFrame *scaled_frame,
+                        int64_t *frames, int64_t *bytes) {
+    int sampled = 0;
+    int eof = 0;
+    while (sampled < PROBE_FRAMES && !eof) {
+        eof = read_packet(infc, packet, NULL) < 0;
+        if (!eof && packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        int reason = avcodec_send_packet(decoder, eof ? NULL : packet);
+        av_packet_unref(packet);
+        if (reason < 0) {
+            print_error("Failed to send complexity probe packet", reason);
+            return -1;
+        }
+
+        while (sampled < PROBE_FRAMES && avcodec_receive_frame(decoder, frame) >= 0) {
+            reason = scale_frame(scaler, scaled_frame, frame);
+            av_frame_unref(frame);
+            if (reason < 0) {
+                print_error("Failed to scale complexity probe frame", reason);
+                return -1;
+            }
+
+            // The samples are encoded as one continuous clip, each jump between them looking like a scene cut.
+            scaled_frame->pts = (*frames)++;
+            reason = encode_probe_frame(encoder, scaled_frame, packet, bytes);
+            av_frame_unref(scaled_frame);
+            if (reason) {
+                return -1;
+            }
+            ++sampled;
+        }
+    }
+
+    return 0;
+}
+
+int probe_complexity(const char *input_file, const struct transcode_options *options, struct complexity *complexity) {
+    // The probe is short, so it decodes in software rather than depend on a device that may not be open yet.
+    struct transcode_options probe_options = *options;
+    probe_options.hw_device = NULL;
+    probe_options.live = 0;
+
+    AVFormatContext *infc = open_input(input_file, &probe_options);
+    if (!infc) {
+        return -1;
+    }
+
+    int result = -1;
+    AVCodecContext *decoder = NULL;
+    AVCodecContext *encoder = NULL;
+    struct scaler scaler = {0};
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *scaled_frame = av_frame_alloc();
+    if (!packet || !frame || !scaled_frame) {
+        printf("Failed to allocate memory for the complexity probe\n");
+        goto end;
+    }
+
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        printf("The complexity probe found no video stream\n");
+        goto end;
+    }
+    if (!(infc->pb->seekable & AVIO_SEEKABLE_NORMAL) || infc->duration <= 0) {
+        printf("The complexity probe needs a seekable input of known duration\n");
+        goto end;
+    }
+
+    AVStream *in_stream = infc->streams[stream_index];
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        infc->streams[i]->discard = i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    const AVCodec *codec = find_decoder(in_stream->codecpar->codec_id, &probe_options);
+    decoder = codec ? create_decode_context(codec, in_stream->codecpar, &probe_options) : NULL;
+    if (!decoder) {
+        printf("Failed to open the complexity probe decoder\n");
+        goto end;
+    }
+
+    int width = FFMIN(PROBE_WIDTH, decoder->width) & ~1;
+    int height = (int) FFMAX(2, av_rescale(width, decoder->height, decoder->width) & ~1);
+    AVRational frame_rate = av_guess_frame_rate(infc, in_stream, NULL);
+    if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+        frame_rate = (AVRational) {25, 1};
+    }
+
+    encoder = open_probe_encoder(width, height, frame_rate, options);
+    if (!encoder) {
+        goto end;
+    }
+    int reason = scaler_init(&scaler, width, height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, 0);
+    if (reason) {
+        print_error("Failed to create complexity probe scaler", reason);
+        goto end;
+    }
+
+    int64_t frames = 0;
+    int64_t bytes = 0;
+    int64_t start = infc->start_time != AV_NOPTS_VALUE ? infc->start_time : 0;
+    for (int i = 0; i < PROBE_SAMPLES; ++i) {
+        int64_t target = start + av_rescale(infc->duration, 2 * i + 1, 2 * PROBE_SAMPLES);
+        reason = av_seek_frame(infc, -1, target, AVSEEK_FLAG_BACKWARD);
+        if (reason < 0) {
+            print_error("Failed to seek for the complexity probe", reason);
+            goto end;
+        }
+        avcodec_flush_buffers(decoder);
+
+        if (probe_sample(infc, stream_index, decoder, encoder, &scaler, packet, frame, scaled_frame, &frames,
+                         &bytes)) {
+            goto end;
+        }
+    }
+
+    if (encode_probe_frame(encoder, NULL, packet, &bytes)) {
+        goto end;
+    }
+    if (!frames) {
+        printf("The complexity probe decoded no frames\n");
+        goto end;
+    }
+
+    complexity->bits_per_pixel = 8.0 * bytes / ((double) frames * width * height);
+    complexity->width = width;
+    complexity->height = height;
+    printf("Complexity probe: %.4f bits per pixel at %dx%d over %" PRId64 " frames\n", complexity->bits_per_pixel,
+           width, height, frames);
+    result = 0;
+
+    end:
+    scaler_uninit(&scaler);
+    avcodec_free_context(&encoder);
+    avcodec_free_context(&decoder);
+    av_frame_free(&scaled_frame);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    close_input(&infc);
+    return result;
+}
+
+int64_t per_title_bit_rate(const struct complexity *complexity, int width, int height, double frame_rate) {
+    double probe_pixels = (double) complexity->width * complexity->height;
+    double probe_rate = complexity->bits_per_pixel * probe_pixels * frame_rate;
+    return (int64_t) (probe_rate * pow((double) width * height / probe_pixels, PIXEL_EXPONENT));
+}
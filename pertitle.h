@@ -0,0 +1,20 @@
+#ifndef VIDEO_RESIZE_PERTITLE_H
+#define VIDEO_RESIZE_PERTITLE_H
+
+#include "transcode.h"
+
+// How hard a title is to encode: the bits per pixel per frame it took at a fixed quality, at the probe's size.
+struct complexity {
+    double bits_per_pixel;
+    int width;
+    int height;
+};
+
+// Encodes short samples spread over the video stream at a small size and a fixed quality with x265's fastest preset.
+// The input must be seekable and of known duration.
+int probe_complexity(const char *input_file, const struct transcode_options *options, struct complexity *complexity);
+
+// The bit rate a width x height rendition at frame_rate needs for the probe's quality.
+int64_t per_title_bit_rate(const struct complexity *complexity, int width, int height, double frame_rate);
+
+#endif
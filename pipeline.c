@@ -0,0 +1,684 @@
+#include "pipeline.h"
+
+#include <pthread.h>
+
+#include "audio.h"
+#include "clip.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "package.h"
+#include "pool.h"
+#include "queue.h"
+#include "thumbnails.h"
+
+struct pipeline;
+
+// Scales and encodes one video stream for one rendition. A rendition that copies the stream has an idle stage, with
+// no queues or threads, and takes the demuxed packets directly.
+struct encode_stage {
+    struct pipeline *pipeline;
+    struct rendition *rendition;
+    struct queue *mux_queue;
+    int stream_index;
+    int copy;
+    struct queue frames;
+    struct queue scaled_frames;
+    struct queue *encode_input;
+    pthread_t scale_thread;
+    pthread_t encode_thread;
+    int scale_started;
+    int encode_started;
+};
+
+// Decodes one video stream once and hands every frame to each rendition's encode stage.
+struct video_stage {
+    struct pipeline *pipeline;
+    int stream_index;
+    struct queue packets;
+    struct encode_stage *encode_stages;
+    pthread_t decode_thread;
+    int decode_started;
+};
+
+struct mux_stage {
+    struct pipeline *pipeline;
+    struct rendition *rendition;
+    struct queue packets;
+    pthread_t thread;
+    int started;
+};
+
+struct pipeline {
+    AVFormatContext *infc;
+    AVCodecContext **in_codec_contexts;
+    struct rendition *renditions;
+    int rendition_count;
+    struct video_stage **video_stages;
+    struct mux_stage *mux_stages;
+    struct transcode_stats *stats;
+    pthread_mutex_t failure_mutex;
+    int failed;
+};
+
+static void free_queued_packet(void *item) {
+    AVPacket *packet = item;
+    av_packet_free(&packet);
+}
+
+static void free_queued_frame(void *item) {
+    AVFrame *frame = item;
+    av_frame_free(&frame);
+}
+
+static void abort_pipeline(struct pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->failure_mutex);
+    pipeline->failed = 1;
+    pthread_mutex_unlock(&pipeline->failure_mutex);
+
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        queue_abort(&pipeline->mux_stages[i].packets);
+    }
+    for (int i = 0; i < pipeline->infc->nb_streams; ++i) {
+        struct video_stage *stage = pipeline->video_stages[i];
+        if (!stage) {
+            continue;
+        }
+
+        queue_abort(&stage->packets);
+        for (int j = 0; j < pipeline->rendition_count; ++j) {
+            queue_abort(&stage->encode_stages[j].frames);
+            queue_abort(&stage->encode_stages[j].scaled_frames);
+        }
+    }
+}
+
+// Queues the packet, or a new reference to it for all but the last queue, on every rendition's mux queue.
+static int push_to_mux_queues(struct pipeline *pipeline, AVPacket *packet) {
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        AVPacket *target = packet;
+        if (i < pipeline->rendition_count - 1) {
+            target = av_packet_clone(packet);
+            if (!target) {
+                printf("Failed to reference packet\n");
+                av_packet_free(&packet);
+                abort_pipeline(pipeline);
+                return -1;
+            }
+        }
+
+        if (queue_push(&pipeline->mux_stages[i].packets, target)) {
+            av_packet_free(&target);
+            if (target != packet) {
+                av_packet_free(&packet);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Queues a new reference to the packet for each rendition that copies the stream rather than encoding it.
+static int push_stream_copies(struct video_stage *stage, AVPacket *packet) {
+    for (int i = 0; i < stage->pipeline->rendition_count; ++i) {
+        if (!stage->encode_stages[i].copy) {
+            continue;
+        }
+
+        AVPacket *copy = av_packet_clone(packet);
+        if (!copy) {
+            printf("Failed to reference packet\n");
+            abort_pipeline(stage->pipeline);
+            return -1;
+        }
+
+        if (queue_push(stage->encode_stages[i].mux_queue, copy)) {
+            av_packet_free(&copy);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void demux_stage(struct pipeline *pipeline) {
+    for (;;) {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            printf("Failed to allocate memory for demuxed packet\n");
+            abort_pipeline(pipeline);
+            return;
+        }
+
+        // Under a memory budget, the demuxer waits for frames to be released before reading more.
+        pool_throttle();
+        int reason = read_packet(pipeline->infc, packet, pipeline->stats);
+        if (reason < 0) {
+            av_packet_free(&packet);
+            break;
+        }
+
+        struct clip *clip = pipeline->renditions[0].clip;
+        AVRational time_base = pipeline->infc->streams[packet->stream_index]->time_base;
+        if (pipeline->renditions[0].out_stream_indices[packet->stream_index] == -1 ||
+            (clip && !clip_packet(clip, packet, time_base))) {
+            av_packet_free(&packet);
+            if (clip && clip_done(clip)) {
+                break;
+            }
+            continue;
+        }
+
+        struct video_stage *stage = pipeline->video_stages[packet->stream_index];
+        struct audio_stage **audio_stages = pipeline->renditions[0].audio_stages;
+        if (audio_stages && audio_stages[packet->stream_index]) {
+            reason = audio_stage_send(audio_stages[packet->stream_index], packet);
+            av_packet_free(&packet);
+            if (reason) {
+                abort_pipeline(pipeline);
+                return;
+            }
+        } else if (stage) {
+            if (push_stream_copies(stage, packet) || queue_push(&stage->packets, packet)) {
+                av_packet_free(&packet);
+                return;
+            }
+        } else if (push_to_mux_queues(pipeline, packet)) {
+            return;
+        }
+    }
+
+    for (int i = 0; i < pipeline->infc->nb_streams; ++i) {
+        if (pipeline->video_stages[i]) {
+            queue_finish(&pipeline->video_stages[i]->packets);
+        }
+    }
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        queue_finish(&pipeline->mux_stages[i].packets);
+    }
+}
+
+// Queues the frame, or a new reference to it for all but the last rendition, on every encoding stage.
+static int push_to_encode_stages(struct video_stage *stage, AVFrame *frame) {
+    int last = stage->pipeline->rendition_count - 1;
+    while (last >= 0 && stage->encode_stages[last].copy) {
+        --last;
+    }
+
+    // A stream every rendition copies is decoded for its thumbnails alone.
+    if (last < 0) {
+        av_frame_free(&frame);
+        return 0;
+    }
+
+    for (int i = 0; i <= last; ++i) {
+        if (stage->encode_stages[i].copy) {
+            continue;
+        }
+
+        AVFrame *target = frame;
+        if (i < last) {
+            target = av_frame_clone(frame);
+            if (!target) {
+                printf("Failed to reference frame\n");
+                av_frame_free(&frame);
+                abort_pipeline(stage->pipeline);
+                return -1;
+            }
+        }
+
+        if (queue_push(&stage->encode_stages[i].frames, target)) {
+            av_frame_free(&target);
+            if (target != frame) {
+                av_frame_free(&frame);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Sends a packet, or NULL to drain the decoder, and passes on every frame that comes out. Returns -1 once the
+// pipeline has been aborted.
+static int decode_packet(struct video_stage *stage, AVCodecContext *incc, AVPacket *packet) {
+    struct transcode_stats *stats = stage->pipeline->stats;
+    struct stage_timer timer;
+    stats_begin(stats, &timer);
+    int reason = avcodec_send_packet(incc, packet);
+    stats_end(stats, STAGE_DECODE, &timer);
+    if (reason) {
+        print_error("Failed to send decode packet", reason);
+        abort_pipeline(stage->pipeline);
+        return -1;
+    }
+
+    for (;;) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            printf("Failed to allocate memory for decoded frame\n");
+            abort_pipeline(stage->pipeline);
+            return -1;
+        }
+
+        stats_begin(stats, &timer);
+        int frame_reason = avcodec_receive_frame(incc, frame);
+        stats_end(stats, STAGE_DECODE, &timer);
+        if (frame_reason < 0) {
+            av_frame_free(&frame);
+            if (frame_reason != AVERROR_EOF && frame_reason != AVERROR(EAGAIN)) {
+                print_error("Failed to receive decode frames", frame_reason);
+                abort_pipeline(stage->pipeline);
+                return -1;
+            }
+            return 0;
+        }
+        stats_add(stats, COUNTER_FRAMES_DECODED, 1);
+
+        AVRational time_base = stage->pipeline->infc->streams[stage->stream_index]->time_base;
+        const struct clip *clip = stage->pipeline->renditions[0].clip;
+        if (clip && !clip_frame(clip, frame, time_base)) {
+            av_frame_free(&frame);
+            continue;
+        }
+
+        struct thumbnails *thumbnails = stage->pipeline->renditions[0].thumbnails;
+        if (thumbnails && thumbnails_add(thumbnails, frame, stage->stream_index)) {
+            av_frame_free(&frame);
+            abort_pipeline(stage->pipeline);
+            return -1;
+        }
+
+        struct dedup **dedups = stage->pipeline->renditions[0].dedups;
+        if (dedups && dedup_frame(dedups[stage->stream_index], frame, time_base)) {
+            stats_add(stats, COUNTER_FRAMES_DEDUPLICATED, 1);
+            av_frame_free(&frame);
+            continue;
+        }
+
+        if (push_to_encode_stages(stage, frame)) {
+            return -1;
+        }
+    }
+}
+
+// Passes on the last duplicate left out of a stream that ended on duplicates, so the stream keeps its duration.
+// Returns -1 once the pipeline has been aborted.
+static int flush_duplicate(struct video_stage *stage) {
+    struct dedup **dedups = stage->pipeline->renditions[0].dedups;
+    if (!dedups) {
+        return 0;
+    }
+
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        printf("Failed to allocate memory for decoded frame\n");
+        abort_pipeline(stage->pipeline);
+        return -1;
+    }
+
+    if (!dedup_flush(dedups[stage->stream_index], frame)) {
+        av_frame_free(&frame);
+        return 0;
+    }
+    return push_to_encode_stages(stage, frame);
+}
+
+static void *decode_stage(void *arg) {
+    struct video_stage *stage = arg;
+    AVCodecContext *incc = stage->pipeline->in_codec_contexts[stage->stream_index];
+
+    AVPacket *packet;
+    int pop_reason;
+    while ((pop_reason = queue_pop(&stage->packets, (void **) &packet)) == 0) {
+        int reason = decode_packet(stage, incc, packet);
+        av_packet_free(&packet);
+        if (reason) {
+            return NULL;
+        }
+    }
+
+    if (pop_reason == 1 && !decode_packet(stage, incc, NULL) && !flush_duplicate(stage)) {
+        for (int i = 0; i < stage->pipeline->rendition_count; ++i) {
+            if (!stage->encode_stages[i].copy) {
+                queue_finish(&stage->encode_stages[i].frames);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *scale_stage(void *arg) {
+    struct encode_stage *stage = arg;
+    struct scaler *scaler = stage->rendition->scalers[stage->stream_index];
+
+    AVFrame *frame;
+    int pop_reason;
+    while ((pop_reason = queue_pop(&stage->frames, (void **) &frame)) == 0) {
+        AVFrame *scaled_frame = av_frame_alloc();
+        if (!scaled_frame) {
+            printf("Failed to allocate memory for scaled frame\n");
+            av_frame_free(&frame);
+            abort_pipeline(stage->pipeline);
+            return NULL;
+        }
+
+        struct stage_timer timer;
+        stats_begin(stage->pipeline->stats, &timer);
+        int reason = scale_frame(scaler, scaled_frame, frame);
+        stats_end(stage->pipeline->stats, STAGE_SCALE, &timer);
+        av_frame_free(&frame);
+        if (reason) {
+            print_error("Failed to scale frame", reason);
+            av_frame_free(&scaled_frame);
+            abort_pipeline(stage->pipeline);
+            return NULL;
+        }
+
+        if (queue_push(&stage->scaled_frames, scaled_frame)) {
+            av_frame_free(&scaled_frame);
+            return NULL;
+        }
+    }
+
+    if (pop_reason == 1) {
+        queue_finish(&stage->scaled_frames);
+    }
+    return NULL;
+}
+
+// Sends a frame, or NULL to drain the encoder, and queues every packet it hands back for muxing. Returns -1 once the
+// pipeline has been aborted.
+static int encode_frame(struct encode_stage *stage, AVCodecContext *outcc, AVFrame *frame) {
+    struct transcode_stats *stats = stage->pipeline->stats;
+    int64_t *encoded_packets = &stage->rendition->encoded_packets[stage->stream_index];
+    if (frame) {
+        package_mark_keyframe(stage->rendition, frame, stage->pipeline->infc->streams[stage->stream_index]->time_base);
+    }
+
+    struct stage_timer timer;
+    stats_begin(stats, &timer);
+    int reason = avcodec_send_frame(outcc, frame);
+    stats_end(stats, STAGE_ENCODE, &timer);
+    if (reason) {
+        print_error("Failed to send encode frame", reason);
+        abort_pipeline(stage->pipeline);
+        return -1;
+    }
+    if (frame) {
+        stats_add(stats, COUNTER_FRAMES_ENCODED, 1);
+        metrics_frame(stage->rendition->metrics[stage->stream_index], frame);
+    }
+
+    for (;;) {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            printf("Failed to allocate memory for encoded packet\n");
+            abort_pipeline(stage->pipeline);
+            return -1;
+        }
+
+        stats_begin(stats, &timer);
+        int packet_reason = avcodec_receive_packet(outcc, packet);
+        stats_end(stats, STAGE_ENCODE, &timer);
+        if (packet_reason < 0) {
+            av_packet_free(&packet);
+            if (packet_reason != AVERROR_EOF && packet_reason != AVERROR(EAGAIN)) {
+                print_error("Failed to receive encode packets", packet_reason);
+                abort_pipeline(stage->pipeline);
+                return -1;
+            }
+            return 0;
+        }
+        stats_add(stats, COUNTER_PACKETS_ENCODED, 1);
+        stats_encoder_latency(stats, outcc->frame_num - ++*encoded_packets);
+        metrics_packet(stage->rendition->metrics[stage->stream_index], packet);
+
+        packet->stream_index = stage->stream_index;
+        if (queue_push(stage->mux_queue, packet)) {
+            av_packet_free(&packet);
+            return -1;
+        }
+    }
+}
+
+static void *encode_stage(void *arg) {
+    struct encode_stage *stage = arg;
+    AVCodecContext *outcc = stage->rendition->out_codec_contexts[stage->stream_index];
+
+    AVFrame *frame;
+    int pop_reason;
+    while ((pop_reason = queue_pop(stage->encode_input, (void **) &frame)) == 0) {
+        int reason = encode_frame(stage, outcc, frame);
+        av_frame_free(&frame);
+        if (reason) {
+            return NULL;
+        }
+    }
+
+    if (pop_reason == 1 && !encode_frame(stage, outcc, NULL)) {
+        queue_finish(stage->mux_queue);
+    }
+    return NULL;
+}
+
+static void *mux_stage(void *arg) {
+    struct mux_stage *stage = arg;
+    struct rendition *rendition = stage->rendition;
+
+    AVPacket *packet;
+    while (queue_pop(&stage->packets, (void **) &packet) == 0) {
+        AVStream *in_stream = stage->pipeline->infc->streams[packet->stream_index];
+        int reason = write_packet(rendition, packet, in_stream);
+        av_packet_free(&packet);
+        if (reason) {
+            abort_pipeline(stage->pipeline);
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static void destroy_pipeline_stages(struct pipeline *pipeline) {
+    for (int i = 0; pipeline->video_stages && i < pipeline->infc->nb_streams; ++i) {
+        struct video_stage *stage = pipeline->video_stages[i];
+        if (!stage) {
+            continue;
+        }
+
+        stats_add_queue(pipeline->stats, QUEUE_PACKETS, &stage->packets);
+        for (int j = 0; stage->encode_stages && j < pipeline->rendition_count; ++j) {
+            stats_add_queue(pipeline->stats, QUEUE_FRAMES, &stage->encode_stages[j].frames);
+            stats_add_queue(pipeline->stats, QUEUE_SCALED_FRAMES, &stage->encode_stages[j].scaled_frames);
+            queue_destroy(&stage->encode_stages[j].scaled_frames, free_queued_frame);
+            queue_destroy(&stage->encode_stages[j].frames, free_queued_frame);
+        }
+        av_freep(&stage->encode_stages);
+        queue_destroy(&stage->packets, free_queued_packet);
+        av_freep(&pipeline->video_stages[i]);
+    }
+    av_freep(&pipeline->video_stages);
+
+    for (int i = 0; pipeline->mux_stages && i < pipeline->rendition_count; ++i) {
+        stats_add_queue(pipeline->stats, QUEUE_MUX, &pipeline->mux_stages[i].packets);
+        queue_destroy(&pipeline->mux_stages[i].packets, free_queued_packet);
+    }
+    av_freep(&pipeline->mux_stages);
+}
+
+static int create_video_stage(struct pipeline *pipeline, int stream_index, const struct transcode_options *options) {
+    struct video_stage *stage = av_mallocz(sizeof *stage);
+    if (!stage) {
+        return -1;
+    }
+    pipeline->video_stages[stream_index] = stage;
+    stage->pipeline = pipeline;
+    stage->stream_index = stream_index;
+
+    stage->encode_stages = av_calloc(pipeline->rendition_count, sizeof *stage->encode_stages);
+    if (!stage->encode_stages || queue_init(&stage->packets, options->queue_depth, 1)) {
+        return -1;
+    }
+
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        struct encode_stage *encode = &stage->encode_stages[i];
+        encode->pipeline = pipeline;
+        encode->rendition = &pipeline->renditions[i];
+        encode->mux_queue = &pipeline->mux_stages[i].packets;
+        encode->stream_index = stream_index;
+        encode->copy = !encode->rendition->out_codec_contexts[stream_index];
+        if (encode->copy) {
+            continue;
+        }
+
+        int scaled = encode->rendition->scalers[stream_index] != NULL;
+        if (queue_init(&encode->frames, options->queue_depth, 1) ||
+            (scaled && queue_init(&encode->scaled_frames, options->queue_depth, 1))) {
+            return -1;
+        }
+        encode->encode_input = scaled ? &encode->scaled_frames : &encode->frames;
+    }
+
+    return 0;
+}
+
+static int create_pipeline_stages(struct pipeline *pipeline, const struct transcode_options *options) {
+    pipeline->video_stages = av_calloc(pipeline->infc->nb_streams, sizeof *pipeline->video_stages);
+    pipeline->mux_stages = av_calloc(pipeline->rendition_count, sizeof *pipeline->mux_stages);
+    if (!pipeline->video_stages || !pipeline->mux_stages) {
+        return -1;
+    }
+
+    // Each mux queue is fed by the demuxer and by the encode stage of every video stream the rendition re-encodes.
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        struct mux_stage *stage = &pipeline->mux_stages[i];
+        stage->pipeline = pipeline;
+        stage->rendition = &pipeline->renditions[i];
+
+        int producers = 1;
+        for (int j = 0; j < pipeline->infc->nb_streams; ++j) {
+            if (pipeline->in_codec_contexts[j] && stage->rendition->out_codec_contexts[j]) {
+                ++producers;
+            }
+        }
+
+        if (queue_init(&stage->packets, options->queue_depth * producers, producers)) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < pipeline->infc->nb_streams; ++i) {
+        if (pipeline->in_codec_contexts[i] && create_video_stage(pipeline, i, options)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int start_pipeline_threads(struct pipeline *pipeline) {
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        struct mux_stage *stage = &pipeline->mux_stages[i];
+        stage->started = !pthread_create(&stage->thread, NULL, mux_stage, stage);
+        if (!stage->started) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < pipeline->infc->nb_streams; ++i) {
+        struct video_stage *stage = pipeline->video_stages[i];
+        if (!stage) {
+            continue;
+        }
+
+        stage->decode_started = !pthread_create(&stage->decode_thread, NULL, decode_stage, stage);
+        if (!stage->decode_started) {
+            return -1;
+        }
+
+        for (int j = 0; j < pipeline->rendition_count; ++j) {
+            struct encode_stage *encode = &stage->encode_stages[j];
+            if (encode->copy) {
+                continue;
+            }
+
+            if (encode->encode_input == &encode->scaled_frames) {
+                encode->scale_started = !pthread_create(&encode->scale_thread, NULL, scale_stage, encode);
+                if (!encode->scale_started) {
+                    return -1;
+                }
+            }
+
+            encode->encode_started = !pthread_create(&encode->encode_thread, NULL, encode_stage, encode);
+            if (!encode->encode_started) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void join_pipeline_threads(struct pipeline *pipeline) {
+    for (int i = 0; i < pipeline->infc->nb_streams; ++i) {
+        struct video_stage *stage = pipeline->video_stages[i];
+        if (!stage) {
+            continue;
+        }
+
+        if (stage->decode_started) {
+            pthread_join(stage->decode_thread, NULL);
+        }
+        for (int j = 0; j < pipeline->rendition_count; ++j) {
+            struct encode_stage *encode = &stage->encode_stages[j];
+            if (encode->scale_started) {
+                pthread_join(encode->scale_thread, NULL);
+            }
+            if (encode->encode_started) {
+                pthread_join(encode->encode_thread, NULL);
+            }
+        }
+    }
+
+    for (int i = 0; i < pipeline->rendition_count; ++i) {
+        if (pipeline->mux_stages[i].started) {
+            pthread_join(pipeline->mux_stages[i].thread, NULL);
+        }
+    }
+}
+
+// Demuxes on the calling thread. Each video stream decodes on its own thread and each rendition scales, encodes and
+// muxes on threads of its own, so the decode cost is paid once for the whole ladder.
+int write_body_pipelined(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                         int rendition_count, const struct transcode_options *options) {
+    struct pipeline pipeline = {
+            .infc = infc,
+            .in_codec_contexts = in_codec_contexts,
+            .renditions = renditions,
+            .rendition_count = rendition_count,
+            .stats = options->stats
+    };
+
+    if (create_pipeline_stages(&pipeline, options)) {
+        printf("Failed to allocate memory for pipeline stages\n");
+        destroy_pipeline_stages(&pipeline);
+        return -1;
+    }
+    pthread_mutex_init(&pipeline.failure_mutex, NULL);
+
+    if (start_pipeline_threads(&pipeline)) {
+        printf("Failed to start pipeline threads\n");
+        abort_pipeline(&pipeline);
+    } else {
+        demux_stage(&pipeline);
+    }
+
+    join_pipeline_threads(&pipeline);
+    int result = pipeline.failed ? -1 : 0;
+
+    pthread_mutex_destroy(&pipeline.failure_mutex);
+    destroy_pipeline_stages(&pipeline);
+    return result;
+}
+
@@ -0,0 +1,11 @@
+#ifndef VIDEO_RESIZE_PIPELINE_H
+#define VIDEO_RESIZE_PIPELINE_H
+
+#include "transcode.h"
+
+// Runs demuxing on the calling thread and decoding, scaling, encoding and muxing on threads of their own, connected by
+// bounded queues.
+int write_body_pipelined(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                         int rendition_count, const struct transcode_options *options);
+
+#endif
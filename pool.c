@@ -0,0 +1,235 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+// Wide enough for the AVX-512 paths in swscale and for libx265's own SIMD loads.
+#define POOL_ALIGN 64
+
+// Per-pixel SIMD readers may run this far past the end of the last line.
+#define POOL_PADDING 64
+
+#define MAX_POOLS 128
+
+// Packet sizes vary frame to frame, so packets are rounded up to one of four sizes per power of two, which wastes at
+// most a quarter of each buffer while keeping the number of pools small.
+#define MIN_PACKET_BUFFER 4096
+#define PACKET_STEPS 4
+
+// Anything larger is allocated directly rather than pinning a huge buffer in a pool.
+#define MAX_POOLED_SIZE ((size_t) 256 * 1024 * 1024)
+
+// The demuxer is held back at most this long at a time, so a pipeline whose buffers cannot drain without more input
+// still makes progress.
+#define MAX_THROTTLE_NS 100000000
+
+static struct {
+    size_t size;
+    AVBufferPool *pool;
+} pools[MAX_POOLS];
+static int pool_count;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Under a memory budget, the pools stop growing once they hold budget bytes, and every buffer handed out is counted
+// until it is released. Buffers beyond the pools' share are allocated directly and freed when released.
+static atomic_int_fast64_t budget;
+static atomic_int_fast64_t pooled_bytes;
+static atomic_int_fast64_t in_use_bytes;
+static atomic_int throttled;
+static pthread_mutex_t released_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+
+static AVBufferRef *allocate_pooled(void *opaque, size_t size) {
+    int64_t limit = atomic_load(&budget);
+    if (limit > 0 && atomic_load(&pooled_bytes) + (int64_t) size > limit) {
+        return NULL;
+    }
+
+    AVBufferRef *buffer = av_buffer_alloc(size);
+    if (buffer) {
+        atomic_fetch_add(&pooled_bytes, (int64_t) size);
+    }
+    return buffer;
+}
+
+static void release_counted(void *opaque, uint8_t *data) {
+    AVBufferRef *buffer = opaque;
+    atomic_fetch_sub(&in_use_bytes, (int64_t) buffer->size);
+    av_buffer_unref(&buffer);
+
+    if (atomic_load(&throttled)) {
+        pthread_mutex_lock(&released_mutex);
+        pthread_cond_broadcast(&released);
+        pthread_mutex_unlock(&released_mutex);
+    }
+}
+
+// Wraps the buffer in one that counts it as in use until its last reference goes.
+static AVBufferRef *count_buffer(AVBufferRef *buffer) {
+    if (!buffer || atomic_load(&budget) <= 0) {
+        return buffer;
+    }
+
+    AVBufferRef *counted = av_buffer_create(buffer->data, buffer->size, release_counted, buffer, 0);
+    if (!counted) {
+        av_buffer_unref(&buffer);
+        return NULL;
+    }
+
+    atomic_fetch_add(&in_use_bytes, (int64_t) buffer->size);
+    return counted;
+}
+
+static AVBufferPool *find_pool(size_t size) {
+    AVBufferPool *pool = NULL;
+
+    pthread_mutex_lock(&pools_mutex);
+    for (int i = 0; i < pool_count && !pool; ++i) {
+        if (pools[i].size == size) {
+            pool = pools[i].pool;
+        }
+    }
+
+    if (!pool && pool_count < MAX_POOLS) {
+        pool = av_buffer_pool_init2(size, NULL, allocate_pooled, NULL);
+        if (pool) {
+            pools[pool_count].size = size;
+            pools[pool_count].pool = pool;
+            ++pool_count;
+        }
+    }
+    pthread_mutex_unlock(&pools_mutex);
+
+    return pool;
+}
+
+AVBufferRef *pool_get_buffer(size_t size) {
+    AVBufferPool *pool = size <= MAX_POOLED_SIZE ? find_pool(size) : NULL;
+    AVBufferRef *buffer = pool ? av_buffer_pool_get(pool) : NULL;
+    return count_buffer(buffer ? buffer : av_buffer_alloc(size));
+}
+
+void pool_add_budget(int64_t bytes) {
+    atomic_fetch_add(&budget, bytes);
+}
+
+void pool_throttle(void) {
+    int64_t limit = atomic_load(&budget);
+    if (limit <= 0 || atomic_load(&in_use_bytes) <= limit) {
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += MAX_THROTTLE_NS;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&released_mutex);
+    atomic_fetch_add(&throttled, 1);
+    int timed_out = 0;
+    while (atomic_load(&in_use_bytes) > limit && !timed_out) {
+        timed_out = pthread_cond_timedwait(&released, &released_mutex, &deadline) == ETIMEDOUT;
+    }
+    atomic_fetch_sub(&throttled, 1);
+    pthread_mutex_unlock(&released_mutex);
+}
+
+int pool_get_image(AVFrame *frame, int width, int height) {
+    int linesizes[4];
+    int reason = av_image_fill_linesizes(linesizes, frame->format, width);
+    if (reason < 0) {
+        return reason;
+    }
+
+    ptrdiff_t aligned_linesizes[4];
+    for (int i = 0; i < 4; ++i) {
+        linesizes[i] = FFALIGN(linesizes[i], POOL_ALIGN);
+        aligned_linesizes[i] = linesizes[i];
+    }
+
+    size_t plane_sizes[4];
+    reason = av_image_fill_plane_sizes(plane_sizes, frame->format, height, aligned_linesizes);
+    if (reason < 0) {
+        return reason;
+    }
+
+    size_t size = POOL_PADDING;
+    for (int i = 0; i < 4; ++i) {
+        size += plane_sizes[i];
+    }
+
+    AVBufferRef *buffer = pool_get_buffer(size);
+    if (!buffer) {
+        return AVERROR(ENOMEM);
+    }
+
+    reason = av_image_fill_pointers(frame->data, frame->format, height, buffer->data, linesizes);
+    if (reason < 0) {
+        av_buffer_unref(&buffer);
+        return reason;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        frame->linesize[i] = linesizes[i];
+    }
+    frame->buf[0] = buffer;
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+int pool_get_decoder_buffer(AVCodecContext *incc, AVFrame *frame, int flags) {
+    const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(frame->format);
+    if (incc->codec_type != AVMEDIA_TYPE_VIDEO || !(incc->codec->capabilities & AV_CODEC_CAP_DR1) || !descriptor ||
+        descriptor->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) {
+        return avcodec_default_get_buffer2(incc, frame, flags);
+    }
+
+    // The decoder may write into the edges that alignment adds around the picture, so those are allocated too.
+    int width = frame->width;
+    int height = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(incc, &width, &height, linesize_align);
+    return pool_get_image(frame, width, height);
+}
+
+static size_t packet_buffer_size(size_t size) {
+    if (size <= MIN_PACKET_BUFFER) {
+        return MIN_PACKET_BUFFER;
+    }
+
+    size_t power = MIN_PACKET_BUFFER;
+    while (power * 2 < size) {
+        power *= 2;
+    }
+
+    size_t step = power / PACKET_STEPS;
+    return (size + step - 1) / step * step;
+}
+
+int pool_get_encoder_buffer(AVCodecContext *outcc, AVPacket *packet, int flags) {
+    AVBufferRef *buffer = pool_get_buffer(packet_buffer_size(packet->size + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!buffer) {
+        return AVERROR(ENOMEM);
+    }
+
+    memset(buffer->data + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    packet->buf = buffer;
+    packet->data = buffer->data;
+    return 0;
+}
+
+void pool_uninit(void) {
+    pthread_mutex_lock(&pools_mutex);
+    for (int i = 0; i < pool_count; ++i) {
+        av_buffer_pool_uninit(&pools[i].pool);
+    }
+    pool_count = 0;
+    atomic_store(&pooled_bytes, 0);
+    pthread_mutex_unlock(&pools_mutex);
+}
@@ -0,0 +1,34 @@
+#ifndef VIDEO_RESIZE_POOL_H
+#define VIDEO_RESIZE_POOL_H
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+
+// Process-wide buffer pools keyed by size. Decoders, scalers and encoders all draw from them, so a buffer released by
+// one stage is handed to the next one that needs the same size instead of going back to the allocator. Pools are
+// thread-safe and keep their free buffers until pool_uninit.
+AVBufferRef *pool_get_buffer(size_t size);
+
+// Gives the frame a pooled buffer for its format laid out as width x height, with every line aligned for SIMD. The
+// frame's own width and height are left alone, so the layout may be padded beyond them.
+int pool_get_image(AVFrame *frame, int width, int height);
+
+// A get_buffer2 callback for software video decoders.
+int pool_get_decoder_buffer(AVCodecContext *incc, AVFrame *frame, int flags);
+
+// A get_encode_buffer callback for encoders with AV_CODEC_CAP_DR1.
+int pool_get_encoder_buffer(AVCodecContext *outcc, AVPacket *packet, int flags);
+
+// Adds bytes to the memory budget the pools share, or takes them away again when negative. While the budget is above 0,
+// the pools hold at most that many bytes and every buffer handed out is counted until it is released.
+void pool_add_budget(int64_t bytes);
+
+// Holds the calling thread back while the buffers in use exceed the budget, for at most a tenth of a second, so a
+// demuxer does not read ahead of stages that are still working through what it read.
+void pool_throttle(void);
+
+// Releases every pool. Buffers still in use stay valid; each pool goes away once its last buffer is returned.
+void pool_uninit(void);
+
+#endif
@@ -0,0 +1,284 @@
+#include "probe.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libavutil/md5.h>
+#include <libavutil/mem.h>
+
+#include "replace_file.h"
+
+#define CACHE_MAGIC "VRPC1"
+
+// The cache key hashes the file size, modification time and this much of each end of the file. That tells files
+// apart without reading them whole.
+#define HASHED_SIZE 65536
+
+#define MAX_EXTRADATA_SIZE (1 << 20)
+
+static int headers_complete(const AVFormatContext *infc) {
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        const AVStream *stream = infc->streams[i];
+        const AVCodecParameters *parameters = stream->codecpar;
+        if (parameters->codec_id == AV_CODEC_ID_NONE) {
+            return 0;
+        }
+
+        if (parameters->codec_type == AVMEDIA_TYPE_VIDEO &&
+            (!parameters->width || !parameters->height || parameters->format < 0 ||
+             (!stream->avg_frame_rate.num && !stream->r_frame_rate.num))) {
+            return 0;
+        }
+        if (parameters->codec_type == AVMEDIA_TYPE_AUDIO &&
+            (!parameters->sample_rate || !parameters->ch_layout.nb_channels || parameters->format < 0)) {
+            return 0;
+        }
+    }
+
+    return infc->nb_streams > 0;
+}
+
+static int hash_range(struct AVMD5 *md5, int fd, off_t offset, size_t size) {
+    uint8_t buffer[HASHED_SIZE];
+    ssize_t read = pread(fd, buffer, FFMIN(size, sizeof buffer), offset);
+    if (read < 0) {
+        return -1;
+    }
+
+    av_md5_update(md5, buffer, read);
+    return 0;
+}
+
+int probe_cache_path(const char *input_file, const char *directory, const char *suffix, char *path, size_t path_size) {
+    const char *file = input_file;
+    if (!strncmp(file, "file:", 5)) {
+        file += 5;
+    } else if (strchr(file, ':')) {
+        return -1;
+    }
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat status;
+    struct AVMD5 *md5 = av_md5_alloc();
+    int result = -1;
+    if (md5 && !fstat(fd, &status) && S_ISREG(status.st_mode)) {
+        int64_t identity[3] = {status.st_size, status.st_mtim.tv_sec, status.st_mtim.tv_nsec};
+        av_md5_init(md5);
+        av_md5_update(md5, (const uint8_t *) identity, sizeof identity);
+        off_t tail = FFMAX(0, status.st_size - HASHED_SIZE);
+        if (!hash_range(md5, fd, 0, HASHED_SIZE) && !hash_range(md5, fd, tail, HASHED_SIZE)) {
+            uint8_t digest[16];
+            av_md5_final(md5, digest);
+
+            int length = snprintf(path, path_size, "%s/", directory);
+            for (int i = 0; i < 16 && length < path_size; ++i) {
+                length += snprintf(path + length, path_size - length, "%02x", digest[i]);
+            }
+            snprintf(path + length, path_size - length, "%s", suffix);
+            result = 0;
+        }
+    }
+
+    av_free(md5);
+    close(fd);
+    return result;
+}
+
+static int read_stream(FILE *file, AVStream *stream) {
+    AVCodecParameters *parameters = stream->codecpar;
+    int type, codec_id, format, channels, field_order, color_range, color_primaries, color_trc, color_space;
+    int chroma_location, extradata_size;
+    AVCodecParameters cached = {0};
+    AVRational avg_frame_rate, r_frame_rate;
+    if (fscanf(file, "stream %d %d %d %d %d %d/%d %d %d %d %d %" SCNd64 " %d %d/%d %d/%d %d %d %d %d %d %d %d",
+               &type, &codec_id, &format, &cached.width, &cached.height, &cached.sample_aspect_ratio.num,
+               &cached.sample_aspect_ratio.den, &cached.sample_rate, &channels, &cached.profile, &cached.level,
+               &cached.bit_rate, &cached.video_delay, &avg_frame_rate.num, &avg_frame_rate.den, &r_frame_rate.num,
+               &r_frame_rate.den, &field_order, &color_range, &color_primaries, &color_trc, &color_space,
+               &chroma_location, &extradata_size) != 24) {
+        return -1;
+    }
+
+    // A cache written for another demuxer or another version of the file leaves the probe to be done again.
+    if (type != parameters->codec_type || (parameters->codec_id != AV_CODEC_ID_NONE &&
+                                           codec_id != parameters->codec_id) ||
+        extradata_size < 0 || extradata_size > MAX_EXTRADATA_SIZE) {
+        return -1;
+    }
+
+    uint8_t *extradata = NULL;
+    if (extradata_size && (!parameters->extradata_size || parameters->codec_id == AV_CODEC_ID_NONE)) {
+        extradata = av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!extradata) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < extradata_size; ++i) {
+        unsigned byte;
+        if (fscanf(file, "%2x", &byte) != 1) {
+            av_free(extradata);
+            return -1;
+        }
+        if (extradata) {
+            extradata[i] = byte;
+        }
+    }
+    if (extradata) {
+        av_free(parameters->extradata);
+        parameters->extradata = extradata;
+        parameters->extradata_size = extradata_size;
+    }
+
+    // Only what the headers left unset is taken from the cache.
+    parameters->codec_id = codec_id;
+    if (parameters->format < 0) {
+        parameters->format = format;
+    }
+    if (!parameters->width) {
+        parameters->width = cached.width;
+        parameters->height = cached.height;
+    }
+    if (!parameters->sample_aspect_ratio.num) {
+        parameters->sample_aspect_ratio = cached.sample_aspect_ratio;
+    }
+    if (!parameters->sample_rate) {
+        parameters->sample_rate = cached.sample_rate;
+    }
+    if (!parameters->ch_layout.nb_channels && channels) {
+        av_channel_layout_default(&parameters->ch_layout, channels);
+    }
+    if (parameters->profile < 0) {
+        parameters->profile = cached.profile;
+    }
+    if (parameters->level < 0) {
+        parameters->level = cached.level;
+    }
+    if (!parameters->bit_rate) {
+        parameters->bit_rate = cached.bit_rate;
+    }
+    if (!parameters->video_delay) {
+        parameters->video_delay = cached.video_delay;
+    }
+    if (parameters->field_order == AV_FIELD_UNKNOWN) {
+        parameters->field_order = field_order;
+    }
+    if (parameters->color_range == AVCOL_RANGE_UNSPECIFIED) {
+        parameters->color_range = color_range;
+    }
+    if (parameters->color_primaries == AVCOL_PRI_UNSPECIFIED) {
+        parameters->color_primaries = color_primaries;
+    }
+    if (parameters->color_trc == AVCOL_TRC_UNSPECIFIED) {
+        parameters->color_trc = color_trc;
+    }
+    if (parameters->color_space == AVCOL_SPC_UNSPECIFIED) {
+        parameters->color_space = color_space;
+    }
+    if (parameters->chroma_location == AVCHROMA_LOC_UNSPECIFIED) {
+        parameters->chroma_location = chroma_location;
+    }
+    if (!stream->avg_frame_rate.num) {
+        stream->avg_frame_rate = avg_frame_rate;
+    }
+    if (!stream->r_frame_rate.num) {
+        stream->r_frame_rate = r_frame_rate;
+    }
+    return 0;
+}
+
+static int read_cache(AVFormatContext *infc, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    unsigned stream_count;
+    int64_t start_time, duration, bit_rate;
+    int result = -1;
+    if (fscanf(file, CACHE_MAGIC " %u %" SCNd64 " %" SCNd64 " %" SCNd64 " ", &stream_count, &start_time, &duration,
+               &bit_rate) == 4 && stream_count == infc->nb_streams) {
+        result = 0;
+        for (int i = 0; i < infc->nb_streams && !result; ++i) {
+            result = read_stream(file, infc->streams[i]);
+            fscanf(file, " ");
+        }
+    }
+    fclose(file);
+    if (result) {
+        return -1;
+    }
+
+    if (infc->start_time == AV_NOPTS_VALUE) {
+        infc->start_time = start_time;
+    }
+    if (infc->duration == AV_NOPTS_VALUE) {
+        infc->duration = duration;
+    }
+    if (!infc->bit_rate) {
+        infc->bit_rate = bit_rate;
+    }
+    return 0;
+}
+
+static void write_cache(const AVFormatContext *infc, const char *path) {
+    char temporary[1024];
+    FILE *file = open_replacement(path, temporary, sizeof temporary);
+    if (!file) {
+        printf("Failed to write probe cache %s\n", path);
+        return;
+    }
+
+    fprintf(file, CACHE_MAGIC " %u %" PRId64 " %" PRId64 " %" PRId64 "\n", infc->nb_streams, infc->start_time,
+            infc->duration, infc->bit_rate);
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        const AVStream *stream = infc->streams[i];
+        const AVCodecParameters *parameters = stream->codecpar;
+        int extradata_size = parameters->extradata_size <= MAX_EXTRADATA_SIZE ? parameters->extradata_size : 0;
+        fprintf(file, "stream %d %d %d %d %d %d/%d %d %d %d %d %" PRId64 " %d %d/%d %d/%d %d %d %d %d %d %d %d ",
+                parameters->codec_type, parameters->codec_id, parameters->format, parameters->width,
+                parameters->height, parameters->sample_aspect_ratio.num, parameters->sample_aspect_ratio.den,
+                parameters->sample_rate, parameters->ch_layout.nb_channels, parameters->profile, parameters->level,
+                parameters->bit_rate, parameters->video_delay, stream->avg_frame_rate.num, stream->avg_frame_rate.den,
+                stream->r_frame_rate.num, stream->r_frame_rate.den, parameters->field_order, parameters->color_range,
+                parameters->color_primaries, parameters->color_trc, parameters->color_space,
+                parameters->chroma_location, extradata_size);
+        for (int j = 0; j < extradata_size; ++j) {
+            fprintf(file, "%02x", parameters->extradata[j]);
+        }
+        fprintf(file, "\n");
+    }
+
+    if (commit_replacement(file, temporary, path, 0)) {
+        printf("Failed to write probe cache %s\n", path);
+    }
+}
+
+int probe_input(AVFormatContext *infc, const char *input_file, const struct transcode_options *options) {
+    char path[1024];
+    int cached = options->probe_cache &&
+                 !probe_cache_path(input_file, options->probe_cache, ".probe", path, sizeof path);
+    if (cached && !read_cache(infc, path)) {
+        return 0;
+    }
+
+    if (options->trust_headers && headers_complete(infc)) {
+        return 0;
+    }
+
+    int reason = avformat_find_stream_info(infc, NULL);
+    if (reason < 0) {
+        return reason;
+    }
+
+    if (cached) {
+        write_cache(infc, path);
+    }
+    return 0;
+}
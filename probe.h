@@ -0,0 +1,15 @@
+#ifndef VIDEO_RESIZE_PROBE_H
+#define VIDEO_RESIZE_PROBE_H
+
+#include "transcode.h"
+
+// Fills in the stream parameters of an opened input. A probe cached for the same file is used when there is one, and
+// with trust_headers set the container headers alone are used when they describe every stream. Otherwise the input is
+// probed with avformat_find_stream_info, and the result is cached if a cache directory is set.
+int probe_input(AVFormatContext *infc, const char *input_file, const struct transcode_options *options);
+
+// Names the file in a cache directory that holds what is cached under suffix for a local input, or returns -1 for
+// inputs that cannot be cached.
+int probe_cache_path(const char *input_file, const char *directory, const char *suffix, char *path, size_t path_size);
+
+#endif
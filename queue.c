@@ -0,0 +1,106 @@
+#include "queue.h"
+
+#include <stdlib.h>
+
+int queue_init(struct queue *queue, int capacity, int producers) {
+    queue->items = calloc(capacity, sizeof *queue->items);
+    if (!queue->items) {
+        return -1;
+    }
+
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->size = 0;
+    queue->producers = producers;
+    queue->aborted = 0;
+    queue->depth_total = 0;
+    queue->pops = 0;
+    queue->max_depth = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+void queue_destroy(struct queue *queue, void (*free_item)(void *item)) {
+    if (!queue->items) {
+        return;
+    }
+
+    for (int i = 0; i < queue->size; ++i) {
+        free_item(queue->items[(queue->head + i) % queue->capacity]);
+    }
+
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->items);
+    queue->items = NULL;
+}
+
+int queue_push(struct queue *queue, void *item) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->size == queue->capacity && !queue->aborted) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+
+    if (queue->aborted) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    queue->items[(queue->head + queue->size) % queue->capacity] = item;
+    ++queue->size;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+int queue_pop(struct queue *queue, void **item) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->size == 0 && queue->producers > 0 && !queue->aborted) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+
+    if (queue->aborted) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    if (queue->size == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return 1;
+    }
+
+    queue->depth_total += queue->size;
+    ++queue->pops;
+    if (queue->size > queue->max_depth) {
+        queue->max_depth = queue->size;
+    }
+
+    *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->size;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+void queue_finish(struct queue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    --queue->producers;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void queue_abort(struct queue *queue) {
+    if (!queue->items) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->aborted = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+}
@@ -0,0 +1,45 @@
+#ifndef VIDEO_RESIZE_QUEUE_H
+#define VIDEO_RESIZE_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A bounded queue of pointers shared between pipeline stages. Pushing blocks while the queue is full, so a slow
+// consumer throttles its producers instead of letting frames pile up in memory.
+struct queue {
+    void **items;
+    int capacity;
+    int head;
+    int size;
+    int producers;
+    int aborted;
+
+    // The depth seen by every pop that found an item, for instrumentation.
+    int64_t depth_total;
+    int64_t pops;
+    int max_depth;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+int queue_init(struct queue *queue, int capacity, int producers);
+
+// Frees any items still queued with free_item, then releases the queue itself.
+void queue_destroy(struct queue *queue, void (*free_item)(void *item));
+
+// Returns 0 once the item is queued, or -1 if the queue was aborted (the item is not taken in that case).
+int queue_push(struct queue *queue, void *item);
+
+// Returns 0 with an item, 1 once every producer has finished and the queue is empty, or -1 if the queue was aborted.
+int queue_pop(struct queue *queue, void **item);
+
+// Called by each producer when it will push no more items.
+void queue_finish(struct queue *queue);
+
+// Wakes every waiting producer and consumer and makes all further pushes and pops fail. Does nothing to a queue that
+// was never initialised.
+void queue_abort(struct queue *queue);
+
+#endif
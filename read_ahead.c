@@ -0,0 +1,191 @@
+#include "read_ahead.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <libavutil/common.h>
+
+// The thread asks the source for an eighth of the buffer at a time, within these bounds, and the demuxer reads through
+// an AVIOContext buffer of the same size. Network protocols return less whenever less has arrived.
+#define MIN_CHUNK_SIZE 65536
+#define MAX_CHUNK_SIZE (4 << 20)
+
+struct read_ahead {
+    AVIOContext *source;
+    uint8_t *buffer;
+    uint8_t *chunk;
+    int chunk_size;
+    int capacity;
+    int head;
+    int size;
+    int eof;
+    int error;
+    int stop;
+    pthread_t thread;
+
+    // source_mutex is held for the whole of each read from the source, so a seek never lands in the middle of one.
+    pthread_mutex_t source_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+};
+
+static void store(struct read_ahead *read_ahead, const uint8_t *data, int size) {
+    int tail = (read_ahead->head + read_ahead->size) % read_ahead->capacity;
+    int first = FFMIN(size, read_ahead->capacity - tail);
+    memcpy(read_ahead->buffer + tail, data, first);
+    memcpy(read_ahead->buffer, data + first, size - first);
+    read_ahead->size += size;
+}
+
+static void *read_ahead_thread(void *arg) {
+    struct read_ahead *read_ahead = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&read_ahead->mutex);
+        while (!read_ahead->stop && (read_ahead->eof || read_ahead->error ||
+                                     read_ahead->capacity - read_ahead->size < read_ahead->chunk_size)) {
+            pthread_cond_wait(&read_ahead->changed, &read_ahead->mutex);
+        }
+        int stop = read_ahead->stop;
+        pthread_mutex_unlock(&read_ahead->mutex);
+        if (stop) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&read_ahead->source_mutex);
+        int read = avio_read_partial(read_ahead->source, read_ahead->chunk, read_ahead->chunk_size);
+
+        pthread_mutex_lock(&read_ahead->mutex);
+        if (read > 0) {
+            store(read_ahead, read_ahead->chunk, read);
+        } else if (read == AVERROR_EOF || read == 0) {
+            read_ahead->eof = 1;
+        } else {
+            read_ahead->error = read;
+        }
+        pthread_cond_broadcast(&read_ahead->changed);
+        pthread_mutex_unlock(&read_ahead->mutex);
+        pthread_mutex_unlock(&read_ahead->source_mutex);
+    }
+}
+
+static int read_buffered(void *opaque, uint8_t *buf, int buf_size) {
+    struct read_ahead *read_ahead = opaque;
+
+    pthread_mutex_lock(&read_ahead->mutex);
+    while (!read_ahead->size && !read_ahead->eof && !read_ahead->error) {
+        pthread_cond_wait(&read_ahead->changed, &read_ahead->mutex);
+    }
+
+    if (!read_ahead->size) {
+        int reason = read_ahead->error ? read_ahead->error : AVERROR_EOF;
+        pthread_mutex_unlock(&read_ahead->mutex);
+        return reason;
+    }
+
+    int size = FFMIN(buf_size, FFMIN(read_ahead->size, read_ahead->capacity - read_ahead->head));
+    memcpy(buf, read_ahead->buffer + read_ahead->head, size);
+    read_ahead->head = (read_ahead->head + size) % read_ahead->capacity;
+    read_ahead->size -= size;
+    pthread_cond_broadcast(&read_ahead->changed);
+    pthread_mutex_unlock(&read_ahead->mutex);
+    return size;
+}
+
+// AVIOContext resolves SEEK_CUR against its own position before calling this, so offsets are never relative to the
+// source, which runs ahead of the demuxer.
+static int64_t seek_buffered(void *opaque, int64_t offset, int whence) {
+    struct read_ahead *read_ahead = opaque;
+
+    pthread_mutex_lock(&read_ahead->source_mutex);
+    if (whence == AVSEEK_SIZE) {
+        int64_t size = avio_size(read_ahead->source);
+        pthread_mutex_unlock(&read_ahead->source_mutex);
+        return size;
+    }
+
+    int64_t position = avio_seek(read_ahead->source, offset, whence & ~AVSEEK_FORCE);
+    pthread_mutex_lock(&read_ahead->mutex);
+    read_ahead->head = 0;
+    read_ahead->size = 0;
+    read_ahead->eof = 0;
+    read_ahead->error = 0;
+    pthread_cond_broadcast(&read_ahead->changed);
+    pthread_mutex_unlock(&read_ahead->mutex);
+    pthread_mutex_unlock(&read_ahead->source_mutex);
+    return position;
+}
+
+static void free_read_ahead(struct read_ahead *read_ahead) {
+    avio_closep(&read_ahead->source);
+    av_free(read_ahead->buffer);
+    av_free(read_ahead->chunk);
+    pthread_cond_destroy(&read_ahead->changed);
+    pthread_mutex_destroy(&read_ahead->mutex);
+    pthread_mutex_destroy(&read_ahead->source_mutex);
+    av_free(read_ahead);
+}
+
+int open_read_ahead(AVIOContext **pb, const char *url, int size, AVDictionary **io_options) {
+    *pb = NULL;
+    struct read_ahead *read_ahead = av_mallocz(sizeof *read_ahead);
+    if (!read_ahead) {
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&read_ahead->source_mutex, NULL);
+    pthread_mutex_init(&read_ahead->mutex, NULL);
+    pthread_cond_init(&read_ahead->changed, NULL);
+
+    read_ahead->chunk_size = av_clip(size / 8, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+    read_ahead->capacity = FFMAX(size, 2 * read_ahead->chunk_size);
+    read_ahead->buffer = av_malloc(read_ahead->capacity);
+    read_ahead->chunk = av_malloc(read_ahead->chunk_size);
+    uint8_t *io_buffer = av_malloc(read_ahead->chunk_size);
+    if (!read_ahead->buffer || !read_ahead->chunk || !io_buffer) {
+        av_free(io_buffer);
+        free_read_ahead(read_ahead);
+        return AVERROR(ENOMEM);
+    }
+
+    int reason = avio_open2(&read_ahead->source, url, AVIO_FLAG_READ, NULL, io_options);
+    if (reason < 0) {
+        av_free(io_buffer);
+        free_read_ahead(read_ahead);
+        return reason;
+    }
+
+    int seekable = read_ahead->source->seekable;
+    *pb = avio_alloc_context(io_buffer, read_ahead->chunk_size, 0, read_ahead, read_buffered, NULL,
+                             seekable ? seek_buffered : NULL);
+    if (!*pb) {
+        av_free(io_buffer);
+        free_read_ahead(read_ahead);
+        return AVERROR(ENOMEM);
+    }
+    (*pb)->seekable = seekable;
+
+    if (pthread_create(&read_ahead->thread, NULL, read_ahead_thread, read_ahead)) {
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+        free_read_ahead(read_ahead);
+        return AVERROR(EAGAIN);
+    }
+
+    return 0;
+}
+
+void close_read_ahead(AVIOContext **pb) {
+    if (!*pb) {
+        return;
+    }
+
+    struct read_ahead *read_ahead = (*pb)->opaque;
+    pthread_mutex_lock(&read_ahead->mutex);
+    read_ahead->stop = 1;
+    pthread_cond_broadcast(&read_ahead->changed);
+    pthread_mutex_unlock(&read_ahead->mutex);
+    pthread_join(read_ahead->thread, NULL);
+
+    free_read_ahead(read_ahead);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
@@ -0,0 +1,14 @@
+#ifndef VIDEO_RESIZE_READ_AHEAD_H
+#define VIDEO_RESIZE_READ_AHEAD_H
+
+#include <libavformat/avio.h>
+
+// Opens url for reading behind a thread that keeps up to size bytes buffered ahead of the demuxer, so a slow or bursty
+// source such as a pipe or an HTTP download does not stall decoding. Seeks are passed through when the source allows
+// them and discard the buffered data. Returns 0 with *pb set, or a negative AVERROR.
+int open_read_ahead(AVIOContext **pb, const char *url, int size, AVDictionary **io_options);
+
+// Stops the read-ahead thread and closes the source. Does nothing to a NULL context.
+void close_read_ahead(AVIOContext **pb);
+
+#endif
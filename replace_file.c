@@ -0,0 +1,26 @@
+#include "replace_file.h"
+
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Numbers the temporary files of this process, so batch jobs writing the same path at once get files of their own.
+static atomic_int next_replacement;
+
+FILE *open_replacement(const char *path, char *temporary, size_t size) {
+    int written = snprintf(temporary, size, "%s.%d.%d", path, (int) getpid(), atomic_fetch_add(&next_replacement, 1));
+    if (written < 0 || (size_t) written >= size) {
+        return NULL;
+    }
+
+    return fopen(temporary, "w");
+}
+
+int commit_replacement(FILE *file, const char *temporary, const char *path, int sync) {
+    int failed = sync && (fflush(file) || fsync(fileno(file)));
+    if (fclose(file) || failed || rename(temporary, path)) {
+        unlink(temporary);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef VIDEO_RESIZE_REPLACE_FILE_H
+#define VIDEO_RESIZE_REPLACE_FILE_H
+
+#include <stdio.h>
+
+// Files that other jobs and processes read while they are rewritten, such as caches and reports, are written under a
+// temporary name of their own and renamed over the old one, so a reader never sees half a file and two writers never
+// share one. Opens the temporary file for path, naming it in temporary, or returns NULL.
+FILE *open_replacement(const char *path, char *temporary, size_t size);
+
+// Closes the temporary file and renames it over path, or removes it when anything failed. With sync set, the contents
+// reach the disk before the rename, so a crash leaves either the old file or the whole new one. Returns 0 on success.
+int commit_replacement(FILE *file, const char *temporary, const char *path, int sync);
+
+#endif
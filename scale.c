@@ -0,0 +1,230 @@
+#include "scale.h"
+
+#include <string.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+
+#include "pool.h"
+
+static const struct {
+    const char *name;
+    int flag;
+} scale_filters[] = {
+        {"fast_bilinear", SWS_FAST_BILINEAR},
+        {"bilinear",      SWS_BILINEAR},
+        {"bicubic",       SWS_BICUBIC},
+        {"area",          SWS_AREA},
+        {"lanczos",       SWS_LANCZOS},
+        {"spline",        SWS_SPLINE},
+        {"point",         SWS_POINT}
+};
+
+static const struct {
+    enum AVPixelFormat format;
+    const char *filter;
+} hw_scale_filters[] = {
+        {AV_PIX_FMT_CUDA,  "scale_cuda"},
+        {AV_PIX_FMT_VAAPI, "scale_vaapi"},
+        {AV_PIX_FMT_QSV,   "vpp_qsv"}
+};
+
+int parse_scale_filter(const char *name) {
+    for (int i = 0; i < sizeof scale_filters / sizeof *scale_filters; ++i) {
+        if (!strcmp(name, scale_filters[i].name)) {
+            return scale_filters[i].flag;
+        }
+    }
+
+    return -1;
+}
+
+int scaler_init(struct scaler *scaler, int width, int height, enum AVPixelFormat format, int flags, int threads) {
+    *scaler = (struct scaler) {
+            .src_format = AV_PIX_FMT_NONE,
+            .width = width,
+            .height = height,
+            .format = format,
+            .flags = flags,
+            .threads = threads
+    };
+
+    const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(format);
+    if (descriptor && descriptor->flags & AV_PIX_FMT_FLAG_HWACCEL) {
+        scaler->hardware = 1;
+        return 0;
+    }
+
+    int size = av_image_get_buffer_size(format, width, height, 1);
+    return size < 0 ? size : 0;
+}
+
+void scaler_uninit(struct scaler *scaler) {
+    sws_freeContext(scaler->context);
+    scaler->context = NULL;
+    avfilter_graph_free(&scaler->graph);
+}
+
+static const char *hw_scale_filter(enum AVPixelFormat format) {
+    for (int i = 0; i < sizeof hw_scale_filters / sizeof *hw_scale_filters; ++i) {
+        if (hw_scale_filters[i].format == format) {
+            return hw_scale_filters[i].filter;
+        }
+    }
+
+    return NULL;
+}
+
+// Builds buffer -> scale_cuda/scale_vaapi/vpp_qsv -> buffersink for the source's frames context.
+static int configure_graph(struct scaler *scaler, const AVFrame *src) {
+    if (scaler->graph && src->width == scaler->src_width && src->height == scaler->src_height &&
+        src->format == scaler->src_format) {
+        return 0;
+    }
+
+    const char *filter_name = hw_scale_filter(scaler->format);
+    if (src->format != scaler->format || !src->hw_frames_ctx || !filter_name) {
+        return AVERROR(EINVAL);
+    }
+
+    avfilter_graph_free(&scaler->graph);
+    scaler->graph = avfilter_graph_alloc();
+    if (!scaler->graph) {
+        return AVERROR(ENOMEM);
+    }
+
+    scaler->source = avfilter_graph_alloc_filter(scaler->graph, avfilter_get_by_name("buffer"), "source");
+    AVBufferSrcParameters *parameters = av_buffersrc_parameters_alloc();
+    if (!scaler->source || !parameters) {
+        av_free(parameters);
+        avfilter_graph_free(&scaler->graph);
+        return AVERROR(ENOMEM);
+    }
+
+    // Timestamps pass through the scale filter untouched, so any valid time base will do.
+    parameters->format = src->format;
+    parameters->width = src->width;
+    parameters->height = src->height;
+    parameters->sample_aspect_ratio = src->sample_aspect_ratio;
+    parameters->time_base = AV_TIME_BASE_Q;
+    parameters->hw_frames_ctx = src->hw_frames_ctx;
+    int reason = av_buffersrc_parameters_set(scaler->source, parameters);
+    av_free(parameters);
+    if (reason >= 0) {
+        reason = avfilter_init_str(scaler->source, NULL);
+    }
+
+    char args[64];
+    snprintf(args, sizeof args, "w=%d:h=%d", scaler->width, scaler->height);
+    AVFilterContext *scale = NULL;
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&scale, avfilter_get_by_name(filter_name), "scale", args, NULL,
+                                              scaler->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_create_filter(&scaler->sink, avfilter_get_by_name("buffersink"), "sink", NULL, NULL,
+                                              scaler->graph);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(scaler->source, 0, scale, 0);
+    }
+    if (reason >= 0) {
+        reason = avfilter_link(scale, 0, scaler->sink, 0);
+    }
+    if (reason >= 0) {
+        reason = avfilter_graph_config(scaler->graph, NULL);
+    }
+    if (reason < 0) {
+        avfilter_graph_free(&scaler->graph);
+        return reason;
+    }
+
+    scaler->src_width = src->width;
+    scaler->src_height = src->height;
+    scaler->src_format = src->format;
+    return 0;
+}
+
+static int scale_hw_frame(struct scaler *scaler, AVFrame *dst, const AVFrame *src) {
+    int reason = configure_graph(scaler, src);
+    if (reason < 0) {
+        return reason;
+    }
+
+    reason = av_buffersrc_add_frame_flags(scaler->source, (AVFrame *) src, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (reason < 0) {
+        return reason;
+    }
+
+    return av_buffersink_get_frame(scaler->sink, dst);
+}
+
+static int configure_context(struct scaler *scaler, const AVFrame *src) {
+    if (scaler->context && src->width == scaler->src_width && src->height == scaler->src_height &&
+        src->format == scaler->src_format) {
+        return 0;
+    }
+
+    sws_freeContext(scaler->context);
+    scaler->context = sws_alloc_context();
+    if (!scaler->context) {
+        return AVERROR(ENOMEM);
+    }
+
+    av_opt_set_int(scaler->context, "srcw", src->width, 0);
+    av_opt_set_int(scaler->context, "srch", src->height, 0);
+    av_opt_set_int(scaler->context, "src_format", src->format, 0);
+    av_opt_set_int(scaler->context, "dstw", scaler->width, 0);
+    av_opt_set_int(scaler->context, "dsth", scaler->height, 0);
+    av_opt_set_int(scaler->context, "dst_format", scaler->format, 0);
+    av_opt_set_int(scaler->context, "sws_flags", scaler->flags, 0);
+    av_opt_set_int(scaler->context, "threads", scaler->threads, 0);
+
+    int reason = sws_init_context(scaler->context, NULL, NULL);
+    if (reason < 0) {
+        sws_freeContext(scaler->context);
+        scaler->context = NULL;
+        return reason;
+    }
+
+    scaler->src_width = src->width;
+    scaler->src_height = src->height;
+    scaler->src_format = src->format;
+    return 0;
+}
+
+int scale_frame(struct scaler *scaler, AVFrame *dst, const AVFrame *src) {
+    if (scaler->hardware) {
+        return scale_hw_frame(scaler, dst, src);
+    }
+
+    int reason = configure_context(scaler, src);
+    if (reason < 0) {
+        return reason;
+    }
+
+    dst->width = scaler->width;
+    dst->height = scaler->height;
+    dst->format = scaler->format;
+    reason = pool_get_image(dst, scaler->width, scaler->height);
+    if (reason < 0) {
+        av_frame_unref(dst);
+        return reason;
+    }
+
+    reason = av_frame_copy_props(dst, src);
+    if (reason < 0) {
+        av_frame_unref(dst);
+        return reason;
+    }
+
+    reason = sws_scale_frame(scaler->context, dst, src);
+    if (reason < 0) {
+        av_frame_unref(dst);
+        return reason;
+    }
+
+    return 0;
+}
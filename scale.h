@@ -0,0 +1,38 @@
+#ifndef VIDEO_RESIZE_SCALE_H
+#define VIDEO_RESIZE_SCALE_H
+
+#include <libavutil/frame.h>
+#include <libavfilter/avfilter.h>
+#include <libswscale/swscale.h>
+
+// Resizes decoded frames to a fixed output size. swscale picks its SIMD kernels (SSE/AVX2 on x86, NEON on ARM) from
+// the CPU flags at init, and scaled frames come out of the shared buffer pools so steady-state scaling allocates nothing.
+// Hardware frames are resized on the GPU by the backend's scale filter instead, so they never leave video memory.
+struct scaler {
+    struct SwsContext *context;
+    int hardware;
+    AVFilterGraph *graph;
+    AVFilterContext *source;
+    AVFilterContext *sink;
+    int src_width;
+    int src_height;
+    enum AVPixelFormat src_format;
+    int width;
+    int height;
+    enum AVPixelFormat format;
+    int flags;
+    int threads;
+};
+
+// A hardware format such as AV_PIX_FMT_CUDA selects GPU scaling; the frames passed in must then be in that format.
+int scaler_init(struct scaler *scaler, int width, int height, enum AVPixelFormat format, int flags, int threads);
+
+void scaler_uninit(struct scaler *scaler);
+
+// Fills dst with src resized to the scaler's output size. dst must be blank; it holds a pooled buffer afterwards.
+int scale_frame(struct scaler *scaler, AVFrame *dst, const AVFrame *src);
+
+// Maps a filter name such as "bicubic" or "lanczos" to its swscale flag, or returns -1 for an unknown name.
+int parse_scale_filter(const char *name);
+
+#endif
@@ -0,0 +1,323 @@
+// CPU affinity is a glibc extension.
+#define _GNU_SOURCE
+
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_NODES 64
+#define PRIORITY_COUNT 3
+
+// x265 runs a wavefront across the rows of 64x64 coding tree units, and its frame threads each keep about a row
+// busy, so a rendition keeps about a core per row busy. Hardware encodes need cores only to feed the GPU.
+#define CTU_SIZE 64
+#define HWACCEL_DEMAND 2
+#define THUMBNAILS_DEMAND 2
+
+struct scheduler {
+    // The cores scheduled, in node order, with the node of each and whether a job holds it.
+    int core_count;
+    int *cpus;
+    int *nodes;
+    int *taken;
+    int node_count;
+    int largest_node;
+    cpu_set_t allowed;
+
+    int free_cores;
+    int running;
+    int running_jobs;
+
+    // Waiters of each priority get tickets in arrival order. The next ticket to admit is the oldest still waiting.
+    int64_t tickets[PRIORITY_COUNT];
+    int64_t admitted[PRIORITY_COUNT];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+};
+
+// Reads a sysfs CPU list such as "0-15,32-47".
+static int read_cpu_list(const char *path, cpu_set_t *set) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    CPU_ZERO(set);
+    int first;
+    int last;
+    char separator;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        if (fscanf(file, "%c", &separator) == 1 && separator == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            if (fscanf(file, "%c", &separator) != 1) {
+                separator = '\n';
+            }
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static void add_core(struct scheduler *scheduler, int cpu, int node) {
+    scheduler->cpus[scheduler->core_count] = cpu;
+    scheduler->nodes[scheduler->core_count] = node;
+    ++scheduler->core_count;
+    scheduler->node_count = FFMAX(scheduler->node_count, node + 1);
+}
+
+// Takes the cores the process may run on node by node, so that a --threads below the core count fills whole nodes
+// instead of spreading thinly over all of them. Machines without NUMA information count as a single node.
+static void find_cores(struct scheduler *scheduler, int threads) {
+    for (int node = 0; node < MAX_NODES && scheduler->core_count < threads; ++node) {
+        char path[64];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        cpu_set_t node_cpus;
+        if (read_cpu_list(path, &node_cpus)) {
+            continue;
+        }
+
+        for (int cpu = 0; cpu < CPU_SETSIZE && scheduler->core_count < threads; ++cpu) {
+            if (CPU_ISSET(cpu, &node_cpus) && CPU_ISSET(cpu, &scheduler->allowed)) {
+                add_core(scheduler, cpu, node);
+            }
+        }
+    }
+
+    if (!scheduler->core_count) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && scheduler->core_count < threads; ++cpu) {
+            if (CPU_ISSET(cpu, &scheduler->allowed)) {
+                add_core(scheduler, cpu, 0);
+            }
+        }
+    }
+
+    int node_cores[MAX_NODES] = {0};
+    for (int i = 0; i < scheduler->core_count; ++i) {
+        scheduler->largest_node = FFMAX(scheduler->largest_node, ++node_cores[scheduler->nodes[i]]);
+    }
+}
+
+struct scheduler *scheduler_create(int threads, int running_jobs) {
+    struct scheduler *scheduler = av_mallocz(sizeof *scheduler);
+    if (!scheduler) {
+        printf("Failed to allocate memory for scheduler\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&scheduler->mutex, NULL);
+    pthread_cond_init(&scheduler->changed, NULL);
+    if (sched_getaffinity(0, sizeof scheduler->allowed, &scheduler->allowed)) {
+        printf("Failed to read the CPU affinity of the process\n");
+        scheduler_free(&scheduler);
+        return NULL;
+    }
+
+    int cpu_count = CPU_COUNT(&scheduler->allowed);
+    scheduler->cpus = av_calloc(cpu_count, sizeof *scheduler->cpus);
+    scheduler->nodes = av_calloc(cpu_count, sizeof *scheduler->nodes);
+    scheduler->taken = av_calloc(cpu_count, sizeof *scheduler->taken);
+    if (!scheduler->cpus || !scheduler->nodes || !scheduler->taken) {
+        printf("Failed to allocate memory for scheduler\n");
+        scheduler_free(&scheduler);
+        return NULL;
+    }
+
+    find_cores(scheduler, FFMIN(threads, cpu_count));
+    if (!scheduler->core_count) {
+        printf("No cores to schedule jobs on\n");
+        scheduler_free(&scheduler);
+        return NULL;
+    }
+
+    scheduler->free_cores = scheduler->core_count;
+    scheduler->running_jobs = running_jobs;
+    return scheduler;
+}
+
+void scheduler_free(struct scheduler **scheduler) {
+    if (!*scheduler) {
+        return;
+    }
+
+    pthread_cond_destroy(&(*scheduler)->changed);
+    pthread_mutex_destroy(&(*scheduler)->mutex);
+    av_freep(&(*scheduler)->taken);
+    av_freep(&(*scheduler)->nodes);
+    av_freep(&(*scheduler)->cpus);
+    av_freep(scheduler);
+}
+
+int job_demand(const char *input_file, const struct transcode_options *options) {
+    if (options->thumbnails_only) {
+        return THUMBNAILS_DEMAND;
+    }
+    if (options->hwaccel) {
+        return HWACCEL_DEMAND;
+    }
+    if (!strcmp(input_file, "-") || strstr(input_file, "://")) {
+        return 0;
+    }
+
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return 0;
+    }
+
+    // Decoding and muxing take about a core.
+    int demand = 1;
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index >= 0) {
+        const AVCodecParameters *parameters = infc->streams[stream_index]->codecpar;
+        for (int i = 0; i < options->rendition_count; ++i) {
+            const struct rendition_options *rendition = &options->renditions[i];
+            int height = rendition->height > 0 ? rendition->height : parameters->height;
+            if (rendition->height == -1 && rendition->width > 0 && parameters->width > 0) {
+                height = (int) av_rescale(rendition->width, parameters->height, parameters->width);
+            }
+            demand += (height + CTU_SIZE - 1) / CTU_SIZE;
+        }
+    }
+
+    close_input(&infc);
+    return demand;
+}
+
+// Whether the oldest waiter of priority is next in line, which it is once nothing of a higher priority waits.
+static int next_in_line(const struct scheduler *scheduler, int priority, int64_t ticket) {
+    for (int i = 0; i < priority; ++i) {
+        if (scheduler->tickets[i] != scheduler->admitted[i]) {
+            return 0;
+        }
+    }
+
+    return ticket == scheduler->admitted[priority];
+}
+
+// Best fit: the node with the fewest free cores that still holds the whole job, so that the larger gaps stay for
+// larger jobs. A job no node holds takes from the emptiest nodes first, to span as few as it can.
+static void take_cores(struct scheduler *scheduler, int demand, int *cores) {
+    int node_free[MAX_NODES] = {0};
+    for (int i = 0; i < scheduler->core_count; ++i) {
+        if (!scheduler->taken[i]) {
+            ++node_free[scheduler->nodes[i]];
+        }
+    }
+
+    int best = -1;
+    for (int node = 0; node < scheduler->node_count; ++node) {
+        if (node_free[node] >= demand && (best < 0 || node_free[node] < node_free[best])) {
+            best = node;
+        }
+    }
+
+    int count = 0;
+    while (count < demand) {
+        int node = best;
+        if (node < 0) {
+            for (int i = 0; i < scheduler->node_count; ++i) {
+                if (node_free[i] && (node < 0 || node_free[i] > node_free[node])) {
+                    node = i;
+                }
+            }
+        }
+
+        for (int i = 0; i < scheduler->core_count && count < demand && node_free[node]; ++i) {
+            if (!scheduler->taken[i] && scheduler->nodes[i] == node) {
+                scheduler->taken[i] = 1;
+                --node_free[node];
+                cores[count++] = i;
+            }
+        }
+    }
+
+    scheduler->free_cores -= demand;
+}
+
+// Gives each node the encoder threads of the cores taken on it. x265 reads a single count as its pool size on a
+// machine of one node.
+static void format_pools(const struct scheduler *scheduler, struct core_allocation *allocation) {
+    if (scheduler->node_count <= 1) {
+        snprintf(allocation->pools, sizeof allocation->pools, "%d", allocation->threads);
+        return;
+    }
+
+    int node_threads[MAX_NODES] = {0};
+    for (int i = 0; i < allocation->threads; ++i) {
+        ++node_threads[scheduler->nodes[allocation->cores[i]]];
+    }
+
+    size_t length = 0;
+    for (int node = 0; node < scheduler->node_count && length < sizeof allocation->pools; ++node) {
+        char count[16] = "-";
+        if (node_threads[node]) {
+            snprintf(count, sizeof count, "%d", node_threads[node]);
+        }
+        length += snprintf(allocation->pools + length, sizeof allocation->pools - length, "%s%s", node ? "," : "",
+                           count);
+    }
+}
+
+int scheduler_acquire(struct scheduler *scheduler, int demand, int priority, struct core_allocation *allocation) {
+    demand = FFMIN(demand ? demand : scheduler->largest_node, scheduler->core_count);
+    allocation->threads = demand;
+    allocation->cores = av_calloc(demand, sizeof *allocation->cores);
+    if (!allocation->cores) {
+        printf("Failed to allocate memory for scheduled cores\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&scheduler->mutex);
+    int64_t ticket = scheduler->tickets[priority]++;
+    while (!next_in_line(scheduler, priority, ticket) || scheduler->free_cores < demand ||
+           scheduler->running >= scheduler->running_jobs) {
+        pthread_cond_wait(&scheduler->changed, &scheduler->mutex);
+    }
+    ++scheduler->admitted[priority];
+    ++scheduler->running;
+    take_cores(scheduler, demand, allocation->cores);
+
+    // The next waiter may fit in what is left.
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    format_pools(scheduler, allocation);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < demand; ++i) {
+        CPU_SET(scheduler->cpus[allocation->cores[i]], &cpus);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus)) {
+        printf("Failed to pin a job to its cores; it runs unpinned\n");
+    }
+    return 0;
+}
+
+void scheduler_release(struct scheduler *scheduler, struct core_allocation *allocation) {
+    pthread_setaffinity_np(pthread_self(), sizeof scheduler->allowed, &scheduler->allowed);
+
+    pthread_mutex_lock(&scheduler->mutex);
+    for (int i = 0; i < allocation->threads; ++i) {
+        scheduler->taken[allocation->cores[i]] = 0;
+    }
+    scheduler->free_cores += allocation->threads;
+    --scheduler->running;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    av_freep(&allocation->cores);
+}
@@ -0,0 +1,42 @@
+#ifndef VIDEO_RESIZE_SCHEDULER_H
+#define VIDEO_RESIZE_SCHEDULER_H
+
+#include "transcode.h"
+
+// Waiting jobs are admitted in this order, and in arrival order within a priority.
+enum job_priority {
+    PRIORITY_LIVE,
+    PRIORITY_ON_DEMAND,
+    PRIORITY_BACKFILL
+};
+
+// Hands the cores of the process out to concurrent batch jobs, each getting the cores it can keep busy on as few NUMA
+// nodes as hold them. Each core belongs to one job at a time, so jobs never oversubscribe the machine between them.
+struct scheduler;
+
+// The cores a job was admitted with. pools is the x265 pools string that puts its encoder threads on the same NUMA
+// nodes as its cores.
+struct core_allocation {
+    int threads;
+    int *cores;
+    char pools[64];
+};
+
+// Schedules up to threads cores of those the process may run on, for at most running_jobs jobs at once.
+struct scheduler *scheduler_create(int threads, int running_jobs);
+
+void scheduler_free(struct scheduler **scheduler);
+
+// Estimates the cores a job can keep busy from the sizes its renditions encode at. The input is opened to read the
+// source size, which a probe cache makes cheap. Returns 0 for inputs that are not opened twice, such as standard
+// input and URLs, which then get a whole node.
+int job_demand(const char *input_file, const struct transcode_options *options);
+
+// Blocks until the job is admitted with demand cores, or all of them if it wants more, and then pins the calling
+// thread to them. Threads the job starts inherit the pinning.
+int scheduler_acquire(struct scheduler *scheduler, int demand, int priority, struct core_allocation *allocation);
+
+// Hands the cores back and unpins the calling thread.
+void scheduler_release(struct scheduler *scheduler, struct core_allocation *allocation);
+
+#endif
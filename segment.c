@@ -0,0 +1,820 @@
+#include "segment.h"
+
+#include <pthread.h>
+
+#include "checkpoint.h"
+#include "dedup.h"
+#include "distributed.h"
+#include "hwaccel.h"
+#include "keyframes.h"
+
+int append_packet(struct packet_list *list, AVPacket *packet) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        AVPacket **packets = av_realloc_array(list->packets, capacity, sizeof *packets);
+        if (!packets) {
+            return -1;
+        }
+
+        list->packets = packets;
+        list->capacity = capacity;
+    }
+
+    list->packets[list->count++] = packet;
+    return 0;
+}
+
+void free_packet_list(struct packet_list *list) {
+    for (int i = 0; i < list->count; ++i) {
+        av_packet_free(&list->packets[i]);
+    }
+    av_freep(&list->packets);
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// A run of whole GOPs, bounded by keyframe presentation timestamps in the video stream's time base. The encoded
+// packets for each rendition stay in memory, in the input time base, until the segment is stitched.
+struct segment {
+    int64_t start;
+    int64_t end;
+    struct packet_list *packets;
+    int done;
+};
+
+struct segment_job {
+    AVFormatContext *infc;
+    int stream_index;
+    const struct transcode_options *options;
+    struct transcode_options worker_options;
+    struct segment *segments;
+    int segment_count;
+    int next_segment;
+    int stitched_segments;
+    int max_ahead;
+    int failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+};
+
+// Groups keyframes into segments of at least the requested duration. The first segment starts at the beginning of the
+// file and the last one runs to its end, so no frame falls outside every segment.
+static int plan_segments(struct segment_job *job, const struct keyframe_index *index) {
+    AVRational time_base = job->infc->streams[job->stream_index]->time_base;
+    int64_t duration = av_rescale_q(job->options->segment_duration * (int64_t) AV_TIME_BASE, AV_TIME_BASE_Q,
+                                    time_base);
+
+    const struct keyframe *keyframes = index->keyframes;
+    job->segments = av_calloc(FFMAX(index->count, 1), sizeof *job->segments);
+    if (!job->segments) {
+        return -1;
+    }
+
+    struct segment *segment = &job->segments[0];
+    segment->start = INT64_MIN;
+    int64_t segment_start = index->count ? keyframes[0].pts : 0;
+    job->segment_count = 1;
+    for (int i = 1; i < index->count; ++i) {
+        if (keyframes[i].pts - segment_start < duration) {
+            continue;
+        }
+
+        segment->end = keyframes[i].pts;
+        segment = &job->segments[job->segment_count++];
+        segment->start = keyframes[i].pts;
+        segment_start = keyframes[i].pts;
+    }
+    segment->end = INT64_MAX;
+
+    for (int i = 0; i < job->segment_count; ++i) {
+        job->segments[i].packets = av_calloc(job->options->rendition_count, sizeof(struct packet_list));
+        if (!job->segments[i].packets) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void free_segments(struct segment_job *job) {
+    for (int i = 0; job->segments && i < job->segment_count; ++i) {
+        for (int j = 0; job->segments[i].packets && j < job->options->rendition_count; ++j) {
+            free_packet_list(&job->segments[i].packets[j]);
+        }
+        av_freep(&job->segments[i].packets);
+    }
+    av_freep(&job->segments);
+}
+
+// Sends a frame, or NULL to drain, and keeps every packet the encoder hands back.
+static int encode_segment_frame(AVCodecContext *outcc, struct scaler *scaler, AVFrame *frame, AVFrame *scaled_frame,
+                                struct packet_list *packets, int stream_index, struct transcode_stats *stats) {
+    struct stage_timer timer;
+    if (frame && scaler) {
+        stats_begin(stats, &timer);
+        int reason = scale_frame(scaler, scaled_frame, frame);
+        stats_end(stats, STAGE_SCALE, &timer);
+        if (reason) {
+            print_error("Failed to scale frame", reason);
+            return -1;
+        }
+        frame = scaled_frame;
+    }
+
+    stats_begin(stats, &timer);
+    int reason = avcodec_send_frame(outcc, frame);
+    stats_end(stats, STAGE_ENCODE, &timer);
+    av_frame_unref(scaled_frame);
+    if (reason) {
+        print_error("Failed to send encode frame", reason);
+        return -1;
+    }
+    if (frame) {
+        stats_add(stats, COUNTER_FRAMES_ENCODED, 1);
+    }
+
+    for (;;) {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            printf("Failed to allocate memory for encoded packet\n");
+            return -1;
+        }
+
+        stats_begin(stats, &timer);
+        reason = avcodec_receive_packet(outcc, packet);
+        stats_end(stats, STAGE_ENCODE, &timer);
+        if (reason < 0) {
+            av_packet_free(&packet);
+            if (reason != AVERROR_EOF && reason != AVERROR(EAGAIN)) {
+                print_error("Failed to receive encode packets", reason);
+                return -1;
+            }
+            return 0;
+        }
+        stats_add(stats, COUNTER_PACKETS_ENCODED, 1);
+        stats_encoder_latency(stats, outcc->frame_num - packets->count - 1);
+
+        packet->stream_index = stream_index;
+        if (append_packet(packets, packet)) {
+            printf("Failed to allocate memory for segment packets\n");
+            av_packet_free(&packet);
+            return -1;
+        }
+    }
+}
+
+// Receives every frame the decoder has ready and encodes the ones inside [start, end) that are not duplicates. Sets
+// *done once a frame at or past the end comes out, since everything before it in presentation order has then been seen.
+static int receive_segment_frames(AVCodecContext *incc, AVCodecContext **out_codec_contexts, struct scaler **scalers,
+                                  AVFrame *frame, AVFrame *scaled_frame, int64_t start, int64_t end,
+                                  struct packet_list *packets, int rendition_count, AVStream *in_stream,
+                                  struct dedup *dedup, int *done, struct transcode_stats *stats) {
+    for (;;) {
+        struct stage_timer timer;
+        stats_begin(stats, &timer);
+        int reason = avcodec_receive_frame(incc, frame);
+        stats_end(stats, STAGE_DECODE, &timer);
+        if (reason == AVERROR_EOF || reason == AVERROR(EAGAIN)) {
+            return 0;
+        }
+        if (reason < 0) {
+            print_error("Failed to receive decode frames", reason);
+            return -1;
+        }
+        stats_add(stats, COUNTER_FRAMES_DECODED, 1);
+
+        if (frame->pts != AV_NOPTS_VALUE && frame->pts >= end) {
+            av_frame_unref(frame);
+            *done = 1;
+            return 0;
+        }
+
+        if (frame->pts != AV_NOPTS_VALUE && frame->pts < start) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        if (dedup_frame(dedup, frame, in_stream->time_base)) {
+            stats_add(stats, COUNTER_FRAMES_DEDUPLICATED, 1);
+            av_frame_unref(frame);
+            continue;
+        }
+
+        for (int i = 0; i < rendition_count; ++i) {
+            if (encode_segment_frame(out_codec_contexts[i], scalers[i], frame, scaled_frame,
+                                     &packets[i], in_stream->index, stats)) {
+                av_frame_unref(frame);
+                return -1;
+            }
+        }
+        av_frame_unref(frame);
+    }
+}
+
+static int decode_segment(AVFormatContext *infc, AVCodecContext *incc, AVCodecContext **out_codec_contexts,
+                          struct scaler **scalers, int64_t start, int64_t end, struct packet_list *packets,
+                          int rendition_count, int stream_index, struct dedup *dedup, struct transcode_stats *stats) {
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *scaled_frame = av_frame_alloc();
+    if (!packet || !frame || !scaled_frame) {
+        printf("Failed to allocate memory for segment decoding\n");
+        av_frame_free(&scaled_frame);
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        return -1;
+    }
+
+    int result = 0;
+    int done = 0;
+    while (!done && !result) {
+        int eof = read_packet(infc, packet, stats) < 0;
+        if (!eof && packet->stream_index != stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        struct stage_timer timer;
+        stats_begin(stats, &timer);
+        int reason = avcodec_send_packet(incc, eof ? NULL : packet);
+        stats_end(stats, STAGE_DECODE, &timer);
+        av_packet_unref(packet);
+        if (reason) {
+            print_error("Failed to send decode packet", reason);
+            result = -1;
+            break;
+        }
+
+        result = receive_segment_frames(incc, out_codec_contexts, scalers, frame, scaled_frame, start, end, packets,
+                                        rendition_count, infc->streams[stream_index], dedup, &done, stats);
+        if (eof) {
+            break;
+        }
+    }
+
+    // Only the last range ends the stream. The next range starts on a kept frame, which ends the run of any other.
+    if (!result && end == INT64_MAX && dedup_flush(dedup, frame)) {
+        for (int i = 0; i < rendition_count && !result; ++i) {
+            result = encode_segment_frame(out_codec_contexts[i], scalers[i], frame, scaled_frame, &packets[i],
+                                          stream_index, stats);
+        }
+        av_frame_unref(frame);
+    }
+
+    for (int i = 0; i < rendition_count && !result; ++i) {
+        result = encode_segment_frame(out_codec_contexts[i], NULL, NULL, scaled_frame, &packets[i], stream_index,
+                                      stats);
+    }
+
+    av_frame_free(&scaled_frame);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    return result;
+}
+
+// Uses a private demuxer, decoder and set of encoders, so concurrent ranges share no codec state.
+int transcode_range(const char *input_file, int stream_index, int64_t start, int64_t end,
+                    const struct transcode_options *options, struct packet_list *packets) {
+    int rendition_count = options->rendition_count;
+
+    const AVCodec *out_codec = find_encoder(options);
+    if (!out_codec) {
+        printf("Failed to find %s codec\n", encoder_name(options));
+        return -1;
+    }
+
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return -1;
+    }
+
+    if (stream_index >= infc->nb_streams || infc->streams[stream_index]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+        printf("Stream %d of %s is not a video stream\n", stream_index, input_file);
+        close_input(&infc);
+        return -1;
+    }
+
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        infc->streams[i]->discard = i == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    AVStream *in_stream = infc->streams[stream_index];
+    AVCodecContext *incc = NULL;
+    AVCodecContext **out_codec_contexts = av_calloc(rendition_count, sizeof(AVCodecContext *));
+    struct scaler **scalers = av_calloc(rendition_count, sizeof(struct scaler *));
+    struct dedup *dedup = NULL;
+    int result = -1;
+    if (!out_codec_contexts || !scalers) {
+        printf("Failed to allocate memory for segment encoders\n");
+        goto end;
+    }
+
+    const AVCodec *in_codec = find_decoder(in_stream->codecpar->codec_id, options);
+    if (!in_codec) {
+        printf("Failed to find decoder\n");
+        goto end;
+    }
+
+    incc = create_decode_context(in_codec, in_stream->codecpar, options);
+    if (!incc) {
+        goto end;
+    }
+
+    for (int i = 0; i < rendition_count; ++i) {
+        out_codec_contexts[i] = create_encode_context(out_codec, incc, infc, in_stream, &options->renditions[i],
+                                                      options);
+        if (!out_codec_contexts[i]) {
+            goto end;
+        }
+
+        if (incc->width != out_codec_contexts[i]->width || incc->height != out_codec_contexts[i]->height) {
+            scalers[i] = create_scaler(out_codec_contexts[i], options);
+            if (!scalers[i]) {
+                goto end;
+            }
+        }
+    }
+
+    if (options->dedup && !(dedup = dedup_open(options))) {
+        goto end;
+    }
+
+    if (start != INT64_MIN) {
+        int reason = av_seek_frame(infc, stream_index, start, AVSEEK_FLAG_BACKWARD);
+        if (reason < 0) {
+            print_error("Failed to seek to range start", reason);
+            goto end;
+        }
+    }
+
+    result = decode_segment(infc, incc, out_codec_contexts, scalers, start, end, packets, rendition_count,
+                            stream_index, dedup, options->stats);
+
+    end:
+    dedup_close(&dedup);
+    for (int i = 0; i < rendition_count; ++i) {
+        if (out_codec_contexts) {
+            avcodec_free_context(&out_codec_contexts[i]);
+        }
+        if (scalers) {
+            free_scaler(&scalers[i]);
+        }
+    }
+    av_freep(&scalers);
+    av_freep(&out_codec_contexts);
+    avcodec_free_context(&incc);
+    close_input(&infc);
+    return result;
+}
+
+static void fail_segment_job(struct segment_job *job) {
+    pthread_mutex_lock(&job->mutex);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->mutex);
+}
+
+static int transcode_segment(struct segment_job *job, struct segment *segment, const struct remote_worker *remote) {
+    const char *input_file = job->infc->url;
+    if (remote) {
+        if (job->options->worker_input) {
+            input_file = job->options->worker_input;
+        }
+
+        if (!transcode_remote_range(remote, input_file, job->stream_index, segment->start, segment->end,
+                                    job->options, segment->packets)) {
+            return 0;
+        }
+
+        // Whatever the worker sent before failing is thrown away and the segment is redone here.
+        printf("Worker %s:%s failed, transcoding the segment locally\n", remote->host, remote->port);
+        for (int i = 0; i < job->options->rendition_count; ++i) {
+            free_packet_list(&segment->packets[i]);
+        }
+        input_file = job->infc->url;
+    }
+
+    return transcode_range(input_file, job->stream_index, segment->start, segment->end, &job->worker_options,
+                           segment->packets);
+}
+
+struct segment_worker {
+    struct segment_job *job;
+    const struct remote_worker *remote;
+    pthread_t thread;
+};
+
+// Takes segments in order, but never runs further than max_ahead segments past the stitcher, which bounds how many
+// encoded segments are held in memory at once. A worker with a remote transcodes its segments on that host.
+static void *segment_worker(void *arg) {
+    struct segment_worker *worker = arg;
+    struct segment_job *job = worker->job;
+
+    for (;;) {
+        pthread_mutex_lock(&job->mutex);
+        while (!job->failed && job->next_segment < job->segment_count &&
+               job->next_segment >= job->stitched_segments + job->max_ahead) {
+            pthread_cond_wait(&job->changed, &job->mutex);
+        }
+
+        if (job->failed || job->next_segment == job->segment_count) {
+            pthread_mutex_unlock(&job->mutex);
+            return NULL;
+        }
+
+        struct segment *segment = &job->segments[job->next_segment++];
+        pthread_mutex_unlock(&job->mutex);
+
+        if (transcode_segment(job, segment, worker->remote)) {
+            fail_segment_job(job);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        segment->done = 1;
+        pthread_cond_broadcast(&job->changed);
+        pthread_mutex_unlock(&job->mutex);
+    }
+}
+
+struct segment_stitcher {
+    AVFormatContext *audio_infc;
+    struct rendition *renditions;
+    int rendition_count;
+    AVStream *video_stream;
+    AVPacket *audio_packet;
+    AVPacket *copy;
+    int audio_pending;
+    int audio_eof;
+
+    // Passthrough packets before this timestamp, in the video time base, were written before a resume.
+    int64_t audio_start;
+    int64_t *last_dts;
+    int *cursors;
+};
+
+// Segments are encoded independently, so the reorder delay at the start of each one can step the decode timestamps
+// back past the end of the previous segment. Nudging them forward keeps them strictly increasing for the muxer.
+static int write_segment_packet(struct rendition *rendition, AVPacket *packet, AVStream *in_stream, int64_t *last_dts) {
+    int out_stream_index = rendition->out_stream_indices[in_stream->index];
+    AVStream *out_stream = rendition->outfc->streams[out_stream_index];
+
+    packet->stream_index = out_stream_index;
+    av_packet_rescale_ts(packet, in_stream->time_base, out_stream->time_base);
+    if (packet->dts != AV_NOPTS_VALUE) {
+        if (*last_dts != INT64_MIN && packet->dts <= *last_dts) {
+            packet->dts = *last_dts + 1;
+        }
+        if (packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts) {
+            packet->pts = packet->dts;
+        }
+        *last_dts = packet->dts;
+    }
+
+    struct stage_timer timer;
+    stats_begin(rendition->stats, &timer);
+    int size = packet->size;
+    pthread_mutex_lock(&rendition->mux_mutex);
+    int reason = av_interleaved_write_frame(rendition->outfc, packet);
+    pthread_mutex_unlock(&rendition->mux_mutex);
+    stats_end(rendition->stats, STAGE_MUX, &timer);
+    if (reason) {
+        print_error("Failed to write frame", reason);
+        return -1;
+    }
+
+    stats_add(rendition->stats, COUNTER_PACKETS_WRITTEN, 1);
+    stats_add(rendition->stats, COUNTER_BYTES_WRITTEN, size);
+    return 0;
+}
+
+static int64_t packet_timestamp(const AVPacket *packet) {
+    return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+// Writes each rendition's video packets from the segment whose timestamps come before limit.
+static int write_segment_video(struct segment_stitcher *stitcher, struct segment *segment, int64_t limit,
+                               AVRational limit_time_base) {
+    for (int i = 0; i < stitcher->rendition_count; ++i) {
+        struct packet_list *packets = &segment->packets[i];
+        while (stitcher->cursors[i] < packets->count) {
+            AVPacket *packet = packets->packets[stitcher->cursors[i]];
+            if (limit != INT64_MAX && av_compare_ts(packet_timestamp(packet), stitcher->video_stream->time_base,
+                                                    limit, limit_time_base) >= 0) {
+                break;
+            }
+
+            if (write_segment_packet(&stitcher->renditions[i], packet, stitcher->video_stream,
+                                     &stitcher->last_dts[i])) {
+                return -1;
+            }
+            ++stitcher->cursors[i];
+        }
+    }
+
+    return 0;
+}
+
+// Interleaves the segment's video with the source's passthrough streams, in timestamp order, into every rendition.
+static int stitch_segment(struct segment_stitcher *stitcher, struct segment *segment) {
+    for (int i = 0; i < stitcher->rendition_count; ++i) {
+        stitcher->cursors[i] = 0;
+    }
+
+    for (;;) {
+        while (!stitcher->audio_pending && !stitcher->audio_eof) {
+            if (read_packet(stitcher->audio_infc, stitcher->audio_packet, stitcher->renditions[0].stats) < 0) {
+                stitcher->audio_eof = 1;
+            } else if (stitcher->renditions[0].out_stream_indices[stitcher->audio_packet->stream_index] == -1 ||
+                       stitcher->audio_packet->stream_index == stitcher->video_stream->index ||
+                       (stitcher->audio_start != INT64_MIN &&
+                        av_compare_ts(packet_timestamp(stitcher->audio_packet),
+                                      stitcher->audio_infc->streams[stitcher->audio_packet->stream_index]->time_base,
+                                      stitcher->audio_start, stitcher->video_stream->time_base) < 0)) {
+                av_packet_unref(stitcher->audio_packet);
+            } else {
+                stitcher->audio_pending = 1;
+            }
+        }
+
+        if (!stitcher->audio_pending) {
+            break;
+        }
+
+        AVStream *audio_stream = stitcher->audio_infc->streams[stitcher->audio_packet->stream_index];
+        int64_t audio_timestamp = packet_timestamp(stitcher->audio_packet);
+        if (segment->end != INT64_MAX && av_compare_ts(audio_timestamp, audio_stream->time_base, segment->end,
+                                                       stitcher->video_stream->time_base) >= 0) {
+            break;
+        }
+
+        if (write_segment_video(stitcher, segment, audio_timestamp, audio_stream->time_base) ||
+            write_passthrough(stitcher->renditions, stitcher->rendition_count, stitcher->audio_packet,
+                              stitcher->copy, audio_stream)) {
+            return -1;
+        }
+        stitcher->audio_pending = 0;
+    }
+
+    return write_segment_video(stitcher, segment, INT64_MAX, stitcher->video_stream->time_base);
+}
+
+static int stitch_segments(struct segment_job *job, struct rendition *renditions) {
+    struct segment_stitcher stitcher = {
+            .renditions = renditions,
+            .rendition_count = job->options->rendition_count,
+            .video_stream = job->infc->streams[job->stream_index],
+            .audio_start = INT64_MIN
+    };
+
+    int result = -1;
+    stitcher.audio_infc = open_input(job->infc->url, job->options);
+    stitcher.audio_packet = av_packet_alloc();
+    stitcher.copy = av_packet_alloc();
+    stitcher.last_dts = av_malloc_array(stitcher.rendition_count, sizeof *stitcher.last_dts);
+    stitcher.cursors = av_calloc(stitcher.rendition_count, sizeof *stitcher.cursors);
+    if (!stitcher.audio_infc || !stitcher.audio_packet || !stitcher.copy || !stitcher.last_dts ||
+        !stitcher.cursors) {
+        printf("Failed to set up segment stitching\n");
+        goto end;
+    }
+
+    stitcher.audio_infc->streams[job->stream_index]->discard = AVDISCARD_ALL;
+    for (int i = 0; i < stitcher.rendition_count; ++i) {
+        stitcher.last_dts[i] = INT64_MIN;
+    }
+
+    // A resumed job picks the passthrough streams up from the keyframe its first segment starts at.
+    if (job->stitched_segments) {
+        stitcher.audio_start = job->segments[job->stitched_segments].start;
+        int reason = av_seek_frame(stitcher.audio_infc, job->stream_index, stitcher.audio_start,
+                                   AVSEEK_FLAG_BACKWARD);
+        if (reason < 0) {
+            print_error("Failed to seek to the checkpoint", reason);
+            goto end;
+        }
+    }
+
+    for (int i = job->stitched_segments; i < job->segment_count; ++i) {
+        struct segment *segment = &job->segments[i];
+
+        pthread_mutex_lock(&job->mutex);
+        while (!segment->done && !job->failed) {
+            pthread_cond_wait(&job->changed, &job->mutex);
+        }
+        int failed = job->failed;
+        pthread_mutex_unlock(&job->mutex);
+        if (failed) {
+            goto end;
+        }
+
+        if (stitch_segment(&stitcher, segment)) {
+            goto end;
+        }
+
+        for (int j = 0; j < stitcher.rendition_count; ++j) {
+            free_packet_list(&segment->packets[j]);
+        }
+
+        // The last segment is followed by the trailer, which makes the journal unnecessary.
+        if (job->options->checkpoint && i + 1 < job->segment_count &&
+            checkpoint_commit(job->options->checkpoint, renditions, i + 1, segment->end)) {
+            goto end;
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        ++job->stitched_segments;
+        pthread_cond_broadcast(&job->changed);
+        pthread_mutex_unlock(&job->mutex);
+    }
+    result = 0;
+
+    end:
+    av_freep(&stitcher.cursors);
+    av_freep(&stitcher.last_dts);
+    av_packet_free(&stitcher.copy);
+    av_packet_free(&stitcher.audio_packet);
+    close_input(&stitcher.audio_infc);
+    return result;
+}
+
+// Starts one worker per local slot and one per slot of each remote host.
+static int start_segment_workers(struct segment_job *job, const struct remote_worker *remotes, int remote_count,
+                                 struct segment_worker **workers, int *started) {
+    int worker_count = job->options->segment_workers;
+    for (int i = 0; i < remote_count; ++i) {
+        worker_count += remotes[i].slots;
+    }
+    worker_count = FFMIN(worker_count, job->segment_count);
+
+    *started = 0;
+    *workers = av_calloc(worker_count, sizeof **workers);
+    if (!*workers) {
+        printf("Failed to allocate memory for segment workers\n");
+        return -1;
+    }
+
+    int remote = 0;
+    int slot = 0;
+    for (; *started < worker_count; ++*started) {
+        struct segment_worker *worker = &(*workers)[*started];
+        worker->job = job;
+        if (*started >= job->options->segment_workers) {
+            worker->remote = &remotes[remote];
+            if (++slot == remotes[remote].slots) {
+                ++remote;
+                slot = 0;
+            }
+        }
+
+        if (pthread_create(&worker->thread, NULL, segment_worker, worker)) {
+            printf("Failed to start segment worker\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Splits the input at keyframes and transcodes the segments on a pool of workers, each with its own decoder and
+// encoders or a connection to a remote worker process, while this thread stitches finished segments back together in
+// order.
+int write_body_segmented(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                         int rendition_count, const struct transcode_options *options) {
+    struct segment_job job = {
+            .infc = infc,
+            .stream_index = -1,
+            .options = options,
+            .worker_options = *options
+    };
+
+    // Every segment reopens the input at its own offset, which a pipe cannot do.
+    if (!(infc->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        if (options->checkpoint) {
+            printf("Checkpoints need an input that can be reopened\n");
+            return -1;
+        }
+        printf("The input cannot be reopened, so it is transcoded without segments\n");
+        return write_body(infc, in_codec_contexts, renditions, rendition_count);
+    }
+
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        if (!in_codec_contexts[i]) {
+            continue;
+        }
+
+        if (job.stream_index != -1) {
+            printf("Segment-parallel transcoding supports a single video stream\n");
+            return -1;
+        }
+        job.stream_index = i;
+    }
+
+    if (job.stream_index == -1) {
+        if (options->checkpoint) {
+            printf("Checkpoints need a video stream to cut segments from\n");
+            return -1;
+        }
+        return write_body(infc, in_codec_contexts, renditions, rendition_count);
+    }
+
+    for (int i = 0; i < rendition_count; ++i) {
+        if (!renditions[i].out_codec_contexts[job.stream_index]) {
+            if (options->checkpoint) {
+                printf("Checkpoints need every rendition to re-encode the video, see --no-stream-copy\n");
+                return -1;
+            }
+            printf("Some renditions copy the video stream, so the rest are transcoded without segments\n");
+            return write_body(infc, in_codec_contexts, renditions, rendition_count);
+        }
+    }
+
+    struct remote_worker *remotes = NULL;
+    int remote_count = 0;
+    if (options->workers && parse_workers(options->workers, &remotes, &remote_count)) {
+        return -1;
+    }
+
+    int slots = options->segment_workers;
+    for (int i = 0; i < remote_count; ++i) {
+        slots += remotes[i].slots;
+    }
+    job.max_ahead = 2 * slots;
+
+    // The encoders made for each rendition only supplied the output stream parameters; the workers bring their own.
+    for (int i = 0; i < rendition_count; ++i) {
+        avcodec_free_context(&renditions[i].out_codec_contexts[job.stream_index]);
+    }
+
+    // Segments that fall back from a remote worker are transcoded here too, so they get a local worker's share.
+    int local_workers = FFMAX(1, options->segment_workers);
+    job.worker_options.threads = FFMAX(1, options->threads / local_workers);
+    if (job.worker_options.decode_threads) {
+        job.worker_options.decode_threads = FFMAX(1, options->decode_threads / local_workers);
+    }
+    if (job.worker_options.encode_threads) {
+        job.worker_options.encode_threads = FFMAX(1, options->encode_threads / local_workers);
+    }
+
+    struct keyframe_index index;
+    if (load_keyframes(infc, job.stream_index, options, &index)) {
+        free_workers(&remotes, remote_count);
+        return -1;
+    }
+
+    int reason = plan_segments(&job, &index);
+    free_keyframes(&index);
+    if (reason) {
+        printf("Failed to allocate memory for segments\n");
+        free_segments(&job);
+        free_workers(&remotes, remote_count);
+        return -1;
+    }
+
+    // The plan is made the same way from the same input every run, so the segments a checkpoint covers are skipped.
+    const struct checkpoint *checkpoint = options->checkpoint;
+    if (checkpoint && checkpoint->segments) {
+        int segments = checkpoint->segments;
+        if (segments >= job.segment_count || job.segments[segments - 1].end != checkpoint->end) {
+            printf("The checkpoint does not match the segments of the input, delete %s to start over\n",
+                   checkpoint->path);
+            free_segments(&job);
+            free_workers(&remotes, remote_count);
+            return -1;
+        }
+
+        for (int i = 0; i < checkpoint->segments; ++i) {
+            job.segments[i].done = 1;
+        }
+        job.next_segment = checkpoint->segments;
+        job.stitched_segments = checkpoint->segments;
+    }
+
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    struct segment_worker *workers;
+    int started;
+    if (start_segment_workers(&job, remotes, remote_count, &workers, &started)) {
+        fail_segment_job(&job);
+    }
+
+    int result = stitch_segments(&job, renditions);
+    if (result) {
+        fail_segment_job(&job);
+    }
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (job.failed) {
+        result = -1;
+    }
+
+    av_freep(&workers);
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.mutex);
+    free_segments(&job);
+    free_workers(&remotes, remote_count);
+    return result;
+}
@@ -0,0 +1,26 @@
+#ifndef VIDEO_RESIZE_SEGMENT_H
+#define VIDEO_RESIZE_SEGMENT_H
+
+#include "transcode.h"
+
+struct packet_list {
+    AVPacket **packets;
+    int count;
+    int capacity;
+};
+
+// Takes ownership of the packet, or returns -1 without it when the list cannot grow.
+int append_packet(struct packet_list *list, AVPacket *packet);
+
+void free_packet_list(struct packet_list *list);
+
+// Transcodes the frames of a video stream whose presentation timestamps fall in [start, end), given in the stream's
+// time base, into one packet list per rendition. INT64_MIN and INT64_MAX leave the range open at either end. The
+// packets keep the input time base, and start should be a keyframe so decoding begins cleanly there.
+int transcode_range(const char *input_file, int stream_index, int64_t start, int64_t end,
+                    const struct transcode_options *options, struct packet_list *packets);
+
+int write_body_segmented(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                         int rendition_count, const struct transcode_options *options);
+
+#endif
@@ -0,0 +1,396 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "queue.h"
+#include "replace_file.h"
+
+static const char *stage_names[STAGE_COUNT] = {"demux", "decode", "scale", "encode", "mux", "audio"};
+
+static const char *counter_names[COUNTER_COUNT] = {
+        "packets_read", "bytes_read", "frames_decoded", "frames_deduplicated", "frames_encoded", "packets_encoded",
+        "packets_written", "bytes_written"
+};
+
+static const char *queue_names[QUEUE_COUNT] = {"packets", "frames", "scaled_frames", "mux"};
+
+static int64_t clock_ns(clockid_t clock) {
+    struct timespec time;
+    clock_gettime(clock, &time);
+    return (int64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void store_max(atomic_int_fast64_t *max, int64_t value) {
+    int_fast64_t current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(max, &current, value, memory_order_relaxed,
+                                                                     memory_order_relaxed)) {
+    }
+}
+
+static int64_t load(atomic_int_fast64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+void stats_begin(const struct transcode_stats *stats, struct stage_timer *timer) {
+    if (stats) {
+        timer->wall_ns = clock_ns(CLOCK_MONOTONIC);
+        timer->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+
+void stats_end(struct transcode_stats *stats, enum stats_stage stage, const struct stage_timer *timer) {
+    if (stats) {
+        atomic_fetch_add_explicit(&stats->wall_ns[stage], clock_ns(CLOCK_MONOTONIC) - timer->wall_ns,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->cpu_ns[stage], clock_ns(CLOCK_THREAD_CPUTIME_ID) - timer->cpu_ns,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->calls[stage], 1, memory_order_relaxed);
+    }
+}
+
+void stats_add(struct transcode_stats *stats, enum stats_counter counter, int64_t value) {
+    if (stats) {
+        atomic_fetch_add_explicit(&stats->counters[counter], value, memory_order_relaxed);
+    }
+}
+
+void stats_encoder_latency(struct transcode_stats *stats, int64_t frames) {
+    if (stats) {
+        atomic_fetch_add_explicit(&stats->latency_total, frames, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->latency_samples, 1, memory_order_relaxed);
+        store_max(&stats->latency_max, frames);
+    }
+}
+
+void stats_add_queue(struct transcode_stats *stats, enum stats_queue kind, const struct queue *queue) {
+    if (stats && queue->items) {
+        atomic_fetch_add_explicit(&stats->depth_total[kind], queue->depth_total, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->depth_samples[kind], queue->pops, memory_order_relaxed);
+        store_max(&stats->depth_max[kind], queue->max_depth);
+    }
+}
+
+void stats_add_quality(struct transcode_stats *stats, const struct stats_quality *quality) {
+    if (!stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats->quality_mutex);
+    struct stats_quality *grown = av_realloc_array(stats->quality, stats->quality_count + 1, sizeof *grown);
+    if (grown) {
+        stats->quality = grown;
+    }
+    char *output = grown ? av_strdup(quality->output) : NULL;
+    if (output) {
+        stats->quality[stats->quality_count] = *quality;
+        stats->quality[stats->quality_count++].output = output;
+    } else {
+        printf("Failed to allocate memory for quality stats\n");
+    }
+    pthread_mutex_unlock(&stats->quality_mutex);
+}
+
+int stats_stamp_packet(struct transcode_stats *stats, AVPacket *packet) {
+    if (!stats || !stats->options.track_delay) {
+        return 0;
+    }
+
+    av_buffer_unref(&packet->opaque_ref);
+    packet->opaque_ref = av_buffer_alloc(sizeof(int64_t));
+    if (!packet->opaque_ref) {
+        return AVERROR(ENOMEM);
+    }
+    *(int64_t *) packet->opaque_ref->data = clock_ns(CLOCK_MONOTONIC);
+    return 0;
+}
+
+int64_t stats_arrival(const struct transcode_stats *stats, const AVPacket *packet) {
+    if (!stats || !stats->options.track_delay || !packet->opaque_ref ||
+        packet->opaque_ref->size != sizeof(int64_t)) {
+        return 0;
+    }
+
+    return *(const int64_t *) packet->opaque_ref->data;
+}
+
+void stats_output_delay(struct transcode_stats *stats, int64_t arrival) {
+    if (stats && arrival) {
+        int64_t delay = clock_ns(CLOCK_MONOTONIC) - arrival;
+        atomic_fetch_add_explicit(&stats->delay_total_ns, delay, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->delay_samples, 1, memory_order_relaxed);
+        store_max(&stats->delay_max_ns, delay);
+    }
+}
+
+static double average_delay_ms(struct transcode_stats *stats) {
+    int64_t samples = load(&stats->delay_samples);
+    return samples ? load(&stats->delay_total_ns) / 1e6 / samples : 0;
+}
+
+static double elapsed_seconds(const struct transcode_stats *stats) {
+    return (clock_ns(CLOCK_MONOTONIC) - stats->start_ns) / 1e9;
+}
+
+// Decoded frames over the source frame rate give the media time covered, whatever the number of renditions.
+static double speed(struct transcode_stats *stats, double elapsed) {
+    return stats->frame_rate > 0 && elapsed > 0 ? load(&stats->counters[COUNTER_FRAMES_DECODED]) /
+                                                  stats->frame_rate / elapsed : 0;
+}
+
+static double fps(struct transcode_stats *stats, double elapsed) {
+    return elapsed > 0 ? load(&stats->counters[COUNTER_FRAMES_DECODED]) / elapsed : 0;
+}
+
+// Sends gauges as statsd lines over UDP. Losing some is harmless, so failures are ignored.
+static void send_statsd(struct transcode_stats *stats, double elapsed) {
+    char *address = av_strdup(stats->options.statsd);
+    char *port = address ? strrchr(address, ':') : NULL;
+    if (!port) {
+        av_free(address);
+        return;
+    }
+    *port++ = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *addresses;
+    if (getaddrinfo(address, port, &hints, &addresses)) {
+        av_free(address);
+        return;
+    }
+
+    char message[1024];
+    int length = snprintf(message, sizeof message,
+                          "video_resize.fps:%.2f|g\nvideo_resize.speed:%.3f|g\nvideo_resize.delay_ms:%.1f|g\n",
+                          fps(stats, elapsed), speed(stats, elapsed), average_delay_ms(stats));
+    for (int i = 0; i < COUNTER_COUNT && length < sizeof message; ++i) {
+        length += snprintf(message + length, sizeof message - length, "video_resize.%s:%" PRId64 "|g\n",
+                           counter_names[i], load(&stats->counters[i]));
+    }
+    length = FFMIN(length, (int) sizeof message - 1);
+
+    int socket_fd = socket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol);
+    if (socket_fd >= 0) {
+        sendto(socket_fd, message, length, 0, addresses->ai_addr, addresses->ai_addrlen);
+        close(socket_fd);
+    }
+    freeaddrinfo(addresses);
+    av_free(address);
+}
+
+static void print_progress(struct transcode_stats *stats) {
+    double elapsed = elapsed_seconds(stats);
+    printf("Progress: %.1fs, %" PRId64 " frames decoded, %" PRId64 " encoded, %.1f fps, %.2fx realtime, "
+           "%" PRId64 " bytes written\n", elapsed, load(&stats->counters[COUNTER_FRAMES_DECODED]),
+           load(&stats->counters[COUNTER_FRAMES_ENCODED]), fps(stats, elapsed), speed(stats, elapsed),
+           load(&stats->counters[COUNTER_BYTES_WRITTEN]));
+    if (stats->options.track_delay) {
+        printf("Delay: %.1f ms average, %.1f ms max\n", average_delay_ms(stats), load(&stats->delay_max_ns) / 1e6);
+    }
+    fflush(stdout);
+    if (stats->options.statsd) {
+        send_statsd(stats, elapsed);
+    }
+}
+
+static void *progress_thread(void *arg) {
+    struct transcode_stats *stats = arg;
+
+    pthread_mutex_lock(&stats->progress_mutex);
+    while (!stats->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += stats->options.progress_interval;
+        if (pthread_cond_timedwait(&stats->progress_stop, &stats->progress_mutex, &deadline) == ETIMEDOUT) {
+            print_progress(stats);
+        }
+    }
+    pthread_mutex_unlock(&stats->progress_mutex);
+    return NULL;
+}
+
+struct transcode_stats *stats_start(const char *input_file, double frame_rate, const struct stats_options *options) {
+    struct transcode_stats *stats = av_mallocz(sizeof *stats);
+    if (!stats) {
+        return NULL;
+    }
+
+    stats->input_file = av_strdup(input_file);
+    if (!stats->input_file) {
+        av_free(stats);
+        return NULL;
+    }
+    stats->frame_rate = frame_rate;
+    stats->options = *options;
+    stats->start_ns = clock_ns(CLOCK_MONOTONIC);
+    stats->start_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    pthread_mutex_init(&stats->progress_mutex, NULL);
+    pthread_cond_init(&stats->progress_stop, NULL);
+    pthread_mutex_init(&stats->quality_mutex, NULL);
+
+    if (options->progress_interval > 0 || options->statsd) {
+        if (stats->options.progress_interval <= 0) {
+            stats->options.progress_interval = 10;
+        }
+        stats->progress_started = !pthread_create(&stats->progress_thread, NULL, progress_thread, stats);
+    }
+    return stats;
+}
+
+static void write_json_string(FILE *file, const char *value) {
+    fputc('"', file);
+    for (const char *cursor = value; *cursor; ++cursor) {
+        if (*cursor == '"' || *cursor == '\\') {
+            fprintf(file, "\\%c", *cursor);
+        } else if ((unsigned char) *cursor < 0x20) {
+            fprintf(file, "\\u%04x", *cursor);
+        } else {
+            fputc(*cursor, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void write_json(struct transcode_stats *stats, FILE *file, int result, double elapsed, double cpu,
+                       long peak_rss) {
+    fprintf(file, "{\n  \"input\": ");
+    write_json_string(file, stats->input_file);
+    fprintf(file, ",\n  \"success\": %s,\n", result ? "false" : "true");
+    fprintf(file, "  \"wall_seconds\": %.3f,\n  \"cpu_seconds\": %.3f,\n  \"peak_rss_kb\": %ld,\n", elapsed, cpu,
+            peak_rss);
+    fprintf(file, "  \"fps\": %.2f,\n  \"speed\": %.3f,\n", fps(stats, elapsed), speed(stats, elapsed));
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        fprintf(file, "  \"%s\": %" PRId64 ",\n", counter_names[i], load(&stats->counters[i]));
+    }
+
+    int64_t samples = load(&stats->latency_samples);
+    fprintf(file, "  \"encoder_latency_frames\": {\"average\": %.2f, \"max\": %" PRId64 "},\n",
+            samples ? (double) load(&stats->latency_total) / samples : 0, load(&stats->latency_max));
+    fprintf(file, "  \"output_delay_ms\": {\"average\": %.2f, \"max\": %.2f, \"samples\": %" PRId64 "},\n",
+            average_delay_ms(stats), load(&stats->delay_max_ns) / 1e6, load(&stats->delay_samples));
+
+    fprintf(file, "  \"stages\": {\n");
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        fprintf(file, "    \"%s\": {\"wall_seconds\": %.3f, \"cpu_seconds\": %.3f, \"calls\": %" PRId64 "}%s\n",
+                stage_names[i], load(&stats->wall_ns[i]) / 1e9, load(&stats->cpu_ns[i]) / 1e9,
+                load(&stats->calls[i]), i < STAGE_COUNT - 1 ? "," : "");
+    }
+    fprintf(file, "  },\n  \"queues\": {\n");
+    for (int i = 0; i < QUEUE_COUNT; ++i) {
+        samples = load(&stats->depth_samples[i]);
+        fprintf(file, "    \"%s\": {\"average_depth\": %.2f, \"max_depth\": %" PRId64 "}%s\n", queue_names[i],
+                samples ? (double) load(&stats->depth_total[i]) / samples : 0, load(&stats->depth_max[i]),
+                i < QUEUE_COUNT - 1 ? "," : "");
+    }
+    fprintf(file, "  },\n  \"quality\": [\n");
+    pthread_mutex_lock(&stats->quality_mutex);
+    for (int i = 0; i < stats->quality_count; ++i) {
+        const struct stats_quality *quality = &stats->quality[i];
+        fprintf(file, "    {\"output\": ");
+        write_json_string(file, quality->output);
+        fprintf(file, ", \"stream\": %d, \"frames\": %" PRId64 ", \"psnr\": {\"average\": %.3f, \"min\": %.3f}, "
+                      "\"ssim\": {\"average\": %.5f, \"min\": %.5f}}%s\n", quality->stream_index, quality->frames,
+                quality->psnr, quality->min_psnr, quality->ssim, quality->min_ssim,
+                i < stats->quality_count - 1 ? "," : "");
+    }
+    pthread_mutex_unlock(&stats->quality_mutex);
+    fprintf(file, "  ]\n}\n");
+}
+
+// In the text format node_exporter's textfile collector reads.
+static void write_prometheus(struct transcode_stats *stats, FILE *file, int result, double elapsed, double cpu,
+                             long peak_rss) {
+    fprintf(file, "video_resize_success %d\n", !result);
+    fprintf(file, "video_resize_wall_seconds %.3f\nvideo_resize_cpu_seconds %.3f\n", elapsed, cpu);
+    fprintf(file, "video_resize_peak_rss_bytes %ld\n", peak_rss * 1024);
+    fprintf(file, "video_resize_fps %.2f\nvideo_resize_speed %.3f\n", fps(stats, elapsed), speed(stats, elapsed));
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        fprintf(file, "video_resize_%s %" PRId64 "\n", counter_names[i], load(&stats->counters[i]));
+    }
+    fprintf(file, "video_resize_encoder_latency_frames_max %" PRId64 "\n", load(&stats->latency_max));
+    fprintf(file, "video_resize_output_delay_ms_average %.2f\nvideo_resize_output_delay_ms_max %.2f\n",
+            average_delay_ms(stats), load(&stats->delay_max_ns) / 1e6);
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        fprintf(file, "video_resize_stage_wall_seconds{stage=\"%s\"} %.3f\n", stage_names[i],
+                load(&stats->wall_ns[i]) / 1e9);
+        fprintf(file, "video_resize_stage_cpu_seconds{stage=\"%s\"} %.3f\n", stage_names[i],
+                load(&stats->cpu_ns[i]) / 1e9);
+    }
+    for (int i = 0; i < QUEUE_COUNT; ++i) {
+        fprintf(file, "video_resize_queue_depth_max{queue=\"%s\"} %" PRId64 "\n", queue_names[i],
+                load(&stats->depth_max[i]));
+    }
+}
+
+static int write_report(struct transcode_stats *stats, const char *path, int result, double elapsed, double cpu,
+                        long peak_rss, void (*writer)(struct transcode_stats *, FILE *, int, double, double, long)) {
+    char temporary[1024];
+    FILE *file = open_replacement(path, temporary, sizeof temporary);
+    if (!file) {
+        printf("Failed to write report %s\n", path);
+        return -1;
+    }
+
+    writer(stats, file, result, elapsed, cpu, peak_rss);
+    if (commit_replacement(file, temporary, path, 0)) {
+        printf("Failed to write report %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int stats_finish(struct transcode_stats *stats, int result) {
+    if (stats->progress_started) {
+        pthread_mutex_lock(&stats->progress_mutex);
+        stats->stopping = 1;
+        pthread_cond_signal(&stats->progress_stop);
+        pthread_mutex_unlock(&stats->progress_mutex);
+        pthread_join(stats->progress_thread, NULL);
+        stats->progress_started = 0;
+        print_progress(stats);
+    }
+
+    // CPU time and peak RSS are the whole process's, which includes encoder worker threads the stage times miss.
+    double elapsed = elapsed_seconds(stats);
+    double cpu = (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - stats->start_cpu_ns) / 1e9;
+    struct rusage usage;
+    long peak_rss = getrusage(RUSAGE_SELF, &usage) ? 0 : usage.ru_maxrss;
+
+    int failed = 0;
+    if (stats->options.report_file) {
+        failed |= write_report(stats, stats->options.report_file, result, elapsed, cpu, peak_rss, write_json);
+    }
+    if (stats->options.prometheus_file) {
+        failed |= write_report(stats, stats->options.prometheus_file, result, elapsed, cpu, peak_rss,
+                               write_prometheus);
+    }
+    return failed ? -1 : 0;
+}
+
+void stats_free(struct transcode_stats **stats) {
+    if (!*stats) {
+        return;
+    }
+
+    for (int i = 0; i < (*stats)->quality_count; ++i) {
+        av_free((*stats)->quality[i].output);
+    }
+    av_free((*stats)->quality);
+    pthread_mutex_destroy(&(*stats)->quality_mutex);
+    pthread_cond_destroy(&(*stats)->progress_stop);
+    pthread_mutex_destroy(&(*stats)->progress_mutex);
+    av_free((*stats)->input_file);
+    av_freep(stats);
+}
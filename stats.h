@@ -0,0 +1,142 @@
+#ifndef VIDEO_RESIZE_STATS_H
+#define VIDEO_RESIZE_STATS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+struct AVPacket;
+struct queue;
+
+enum stats_stage {
+    STAGE_DEMUX,
+    STAGE_DECODE,
+    STAGE_SCALE,
+    STAGE_ENCODE,
+    STAGE_MUX,
+    STAGE_AUDIO,
+    STAGE_COUNT
+};
+
+enum stats_counter {
+    COUNTER_PACKETS_READ,
+    COUNTER_BYTES_READ,
+    COUNTER_FRAMES_DECODED,
+    COUNTER_FRAMES_DEDUPLICATED,
+    COUNTER_FRAMES_ENCODED,
+    COUNTER_PACKETS_ENCODED,
+    COUNTER_PACKETS_WRITTEN,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_COUNT
+};
+
+enum stats_queue {
+    QUEUE_PACKETS,
+    QUEUE_FRAMES,
+    QUEUE_SCALED_FRAMES,
+    QUEUE_MUX,
+    QUEUE_COUNT
+};
+
+// Where to send the stats of a run, and how often to print progress. Every field is optional.
+struct stats_options {
+    int progress_interval;
+    const char *report_file;
+    const char *prometheus_file;
+    const char *statsd;
+
+    // Stamps each demuxed packet with the time it arrived, to measure how long it takes to reach the output.
+    int track_delay;
+};
+
+// The quality of an encoded video stream against the frames sent to its encoder, as averages and lows over the frames
+// measured.
+struct stats_quality {
+    char *output;
+    int stream_index;
+    int64_t frames;
+    double psnr;
+    double min_psnr;
+    double ssim;
+    double min_ssim;
+};
+
+// Times and counters of one transcode, updated lock-free by every thread working on it. A NULL stats pointer turns
+// every call below into a no-op, so code shared with remote workers needs no checks of its own.
+struct transcode_stats {
+    atomic_int_fast64_t wall_ns[STAGE_COUNT];
+    atomic_int_fast64_t cpu_ns[STAGE_COUNT];
+    atomic_int_fast64_t calls[STAGE_COUNT];
+    atomic_int_fast64_t counters[COUNTER_COUNT];
+
+    // Frames an encoder held when it returned a packet: the lookahead, frame threads and reordering it adds.
+    atomic_int_fast64_t latency_total;
+    atomic_int_fast64_t latency_samples;
+    atomic_int_fast64_t latency_max;
+
+    // Time from a packet's arrival at the demuxer to the output write of it or of the frame decoded from it.
+    atomic_int_fast64_t delay_total_ns;
+    atomic_int_fast64_t delay_samples;
+    atomic_int_fast64_t delay_max_ns;
+
+    // Queue depths seen by each pop, summed over every queue of a kind.
+    atomic_int_fast64_t depth_total[QUEUE_COUNT];
+    atomic_int_fast64_t depth_samples[QUEUE_COUNT];
+    atomic_int_fast64_t depth_max[QUEUE_COUNT];
+
+    // Quality measured of each encoded stream, added as each finishes.
+    struct stats_quality *quality;
+    int quality_count;
+    pthread_mutex_t quality_mutex;
+
+    char *input_file;
+    double frame_rate;
+    int64_t start_ns;
+    int64_t start_cpu_ns;
+    struct stats_options options;
+
+    pthread_t progress_thread;
+    pthread_mutex_t progress_mutex;
+    pthread_cond_t progress_stop;
+    int progress_started;
+    int stopping;
+};
+
+struct stage_timer {
+    int64_t wall_ns;
+    int64_t cpu_ns;
+};
+
+// Starts collecting stats for input_file, whose video plays at frame_rate, and starts the progress output.
+struct transcode_stats *stats_start(const char *input_file, double frame_rate, const struct stats_options *options);
+
+// Stops the progress output and writes the final report to each configured destination.
+int stats_finish(struct transcode_stats *stats, int result);
+
+void stats_free(struct transcode_stats **stats);
+
+// Brackets one call of a stage on the calling thread, adding its wall and thread CPU time to the stage.
+void stats_begin(const struct transcode_stats *stats, struct stage_timer *timer);
+void stats_end(struct transcode_stats *stats, enum stats_stage stage, const struct stage_timer *timer);
+
+void stats_add(struct transcode_stats *stats, enum stats_counter counter, int64_t value);
+
+void stats_encoder_latency(struct transcode_stats *stats, int64_t frames);
+
+// With track_delay set, attaches the current time to a demuxed packet as its opaque_ref. Decoders and encoders opened
+// with AV_CODEC_FLAG_COPY_OPAQUE carry it through to the frames and packets made from it.
+int stats_stamp_packet(struct transcode_stats *stats, struct AVPacket *packet);
+
+// The arrival time stamped on a packet about to be written, or 0 when it has none.
+int64_t stats_arrival(const struct transcode_stats *stats, const struct AVPacket *packet);
+
+// Records the delay of a packet with the given arrival time once it is written.
+void stats_output_delay(struct transcode_stats *stats, int64_t arrival);
+
+// Records the quality measured of an encoded stream, copying its output name.
+void stats_add_quality(struct transcode_stats *stats, const struct stats_quality *quality);
+
+// Adds the depths a queue saw over its life to the totals of its kind.
+void stats_add_queue(struct transcode_stats *stats, enum stats_queue kind, const struct queue *queue);
+
+#endif
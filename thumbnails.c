@@ -0,0 +1,484 @@
+#include "thumbnails.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+
+#include "hwaccel.h"
+
+#define INDEX_FILE "thumbnails.vtt"
+#define SHEET_FILE "sprite_%05d.%s"
+
+// JPEG quantiser scale of the sheets, from 2 for the best to 31 for the smallest, and libwebp's quality out of 100.
+#define JPEG_QSCALE 4
+#define WEBP_QUALITY "75"
+
+struct thumbnails {
+    char *dir;
+    int format;
+    int stream_index;
+    AVRational time_base;
+
+    // In AV_TIME_BASE units: the input time the outputs start at, the time between thumbnails, or 0 for every
+    // keyframe, and the time the next one is due at.
+    int64_t origin;
+    int64_t interval;
+    int64_t next_time;
+
+    int width;
+    int height;
+    int columns;
+    int rows;
+    struct scaler scaler;
+    AVFrame *thumbnail;
+    AVFrame *sheet;
+    AVCodecContext *encoder;
+    AVPacket *packet;
+    int sheet_count;
+    int placed;
+    int taken;
+
+    // The WebVTT cue of the latest thumbnail is written once the next one says where it ends.
+    FILE *index;
+    int64_t cue_start;
+    int cue_sheet;
+    int cue_x;
+    int cue_y;
+    int64_t last_time;
+};
+
+static int make_directory(const char *path) {
+    if (mkdir(path, 0777) && errno != EEXIST) {
+        printf("Failed to create directory %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void fill_plane(uint8_t *data, int linesize, int width, int height, int value) {
+    for (int y = 0; y < height; ++y) {
+        memset(data + y * linesize, value, width);
+    }
+}
+
+// Blanks the sheet to black, in full range for JPEG and limited range otherwise.
+static int clear_sheet(struct thumbnails *thumbnails) {
+    AVFrame *sheet = thumbnails->sheet;
+    int reason = av_frame_make_writable(sheet);
+    if (reason < 0) {
+        return reason;
+    }
+
+    fill_plane(sheet->data[0], sheet->linesize[0], sheet->width, sheet->height,
+               thumbnails->format == THUMBNAIL_JPEG ? 0 : 16);
+    for (int i = 1; i < 3; ++i) {
+        fill_plane(sheet->data[i], sheet->linesize[i], (sheet->width + 1) / 2, (sheet->height + 1) / 2, 128);
+    }
+    return 0;
+}
+
+static int open_encoder(struct thumbnails *thumbnails, const struct transcode_options *options) {
+    const char *name = thumbnails->format == THUMBNAIL_JPEG ? "mjpeg" : "libwebp";
+    const AVCodec *codec = avcodec_find_encoder_by_name(name);
+    if (!codec) {
+        printf("Failed to find %s encoder for thumbnails\n", name);
+        return -1;
+    }
+
+    AVCodecContext *encoder = avcodec_alloc_context3(codec);
+    if (!encoder) {
+        printf("Failed to allocate memory for thumbnail encoder\n");
+        return -1;
+    }
+    thumbnails->encoder = encoder;
+
+    encoder->width = thumbnails->columns * thumbnails->width;
+    encoder->height = thumbnails->rows * thumbnails->height;
+    encoder->time_base = AV_TIME_BASE_Q;
+    AVDictionary *codec_options = NULL;
+    if (thumbnails->format == THUMBNAIL_JPEG) {
+        encoder->pix_fmt = AV_PIX_FMT_YUVJ420P;
+        encoder->flags |= AV_CODEC_FLAG_QSCALE;
+        encoder->global_quality = FF_QP2LAMBDA * JPEG_QSCALE;
+    } else {
+        encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+        av_dict_set(&codec_options, "quality", WEBP_QUALITY, 0);
+    }
+
+    int reason = avcodec_open2(encoder, codec, &codec_options);
+    av_dict_free(&codec_options);
+    if (reason) {
+        print_error("Failed to open thumbnail encoder", reason);
+        return -1;
+    }
+
+    reason = scaler_init(&thumbnails->scaler, thumbnails->width, thumbnails->height, encoder->pix_fmt,
+                         options->scale_flags, 1);
+    if (reason) {
+        print_error("Failed to create thumbnail scaler", reason);
+        return -1;
+    }
+
+    AVFrame *sheet = thumbnails->sheet;
+    sheet->format = encoder->pix_fmt;
+    sheet->width = encoder->width;
+    sheet->height = encoder->height;
+    reason = av_frame_get_buffer(sheet, 0);
+    if (reason >= 0) {
+        reason = clear_sheet(thumbnails);
+    }
+    if (reason < 0) {
+        print_error("Failed to allocate thumbnail sheet", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct thumbnails *thumbnails_open(AVFormatContext *infc, const struct transcode_options *options) {
+    int stream_index = av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream_index < 0) {
+        printf("Found no video stream to take thumbnails of\n");
+        return NULL;
+    }
+
+    struct thumbnails *thumbnails = av_mallocz(sizeof *thumbnails);
+    if (!thumbnails) {
+        printf("Failed to allocate memory for thumbnails\n");
+        return NULL;
+    }
+
+    // The height follows the display aspect ratio, and both sides are even for the 4:2:0 sheets.
+    AVStream *stream = infc->streams[stream_index];
+    AVCodecParameters *parameters = stream->codecpar;
+    AVRational sample_aspect_ratio = parameters->sample_aspect_ratio.num ? parameters->sample_aspect_ratio :
+                                     (AVRational) {1, 1};
+    int64_t display_width = av_rescale(parameters->width, sample_aspect_ratio.num, sample_aspect_ratio.den);
+    thumbnails->width = FFMAX(2, options->thumbnail_width & ~1);
+    thumbnails->height = display_width > 0 ?
+                         FFMAX(2, (int) av_rescale(thumbnails->width, parameters->height, display_width) & ~1) :
+                         thumbnails->width;
+    thumbnails->columns = options->thumbnail_columns;
+    thumbnails->rows = options->thumbnail_rows;
+    thumbnails->format = options->thumbnail_format;
+    thumbnails->stream_index = stream_index;
+    thumbnails->time_base = stream->time_base;
+    thumbnails->origin = (infc->start_time == AV_NOPTS_VALUE ? 0 : infc->start_time) + options->clip_start;
+    thumbnails->interval = options->thumbnail_interval * (int64_t) AV_TIME_BASE;
+    thumbnails->next_time = AV_NOPTS_VALUE;
+    thumbnails->cue_start = AV_NOPTS_VALUE;
+    thumbnails->last_time = AV_NOPTS_VALUE;
+
+    thumbnails->dir = av_strdup(options->thumbnails_dir);
+    thumbnails->thumbnail = av_frame_alloc();
+    thumbnails->sheet = av_frame_alloc();
+    thumbnails->packet = av_packet_alloc();
+    char *index_path = av_asprintf("%s/" INDEX_FILE, options->thumbnails_dir);
+    if (!thumbnails->dir || !thumbnails->thumbnail || !thumbnails->sheet || !thumbnails->packet || !index_path) {
+        printf("Failed to allocate memory for thumbnails\n");
+        av_free(index_path);
+        thumbnails_close(&thumbnails);
+        return NULL;
+    }
+
+    if (make_directory(thumbnails->dir) || open_encoder(thumbnails, options)) {
+        av_free(index_path);
+        thumbnails_close(&thumbnails);
+        return NULL;
+    }
+
+    thumbnails->index = fopen(index_path, "w");
+    if (!thumbnails->index) {
+        printf("Failed to write thumbnail index %s\n", index_path);
+        av_free(index_path);
+        thumbnails_close(&thumbnails);
+        return NULL;
+    }
+    av_free(index_path);
+    fprintf(thumbnails->index, "WEBVTT\n\n");
+
+    return thumbnails;
+}
+
+void thumbnails_close(struct thumbnails **thumbnails) {
+    if (!*thumbnails) {
+        return;
+    }
+
+    if ((*thumbnails)->index) {
+        fclose((*thumbnails)->index);
+    }
+    scaler_uninit(&(*thumbnails)->scaler);
+    avcodec_free_context(&(*thumbnails)->encoder);
+    av_packet_free(&(*thumbnails)->packet);
+    av_frame_free(&(*thumbnails)->sheet);
+    av_frame_free(&(*thumbnails)->thumbnail);
+    av_freep(&(*thumbnails)->dir);
+    av_freep(thumbnails);
+}
+
+int thumbnails_due(const struct thumbnails *thumbnails, int64_t pts, int key) {
+    if (!thumbnails->interval) {
+        return key;
+    }
+
+    int64_t time = av_rescale_q(pts, thumbnails->time_base, AV_TIME_BASE_Q);
+    return thumbnails->next_time == AV_NOPTS_VALUE || time >= thumbnails->next_time;
+}
+
+static void format_time(char *buffer, size_t size, int64_t time) {
+    int64_t milliseconds = FFMAX(0, time) / 1000;
+    snprintf(buffer, size, "%02" PRId64 ":%02d:%02d.%03d", milliseconds / 3600000, (int) (milliseconds / 60000 % 60),
+             (int) (milliseconds / 1000 % 60), (int) (milliseconds % 1000));
+}
+
+static const char *extension(const struct thumbnails *thumbnails) {
+    return thumbnails->format == THUMBNAIL_JPEG ? "jpg" : "webp";
+}
+
+// Ends the cue of the latest thumbnail at end, in AV_TIME_BASE units on the outputs' timeline.
+static void write_cue(struct thumbnails *thumbnails, int64_t end) {
+    if (thumbnails->cue_start == AV_NOPTS_VALUE) {
+        return;
+    }
+
+    char start_text[32], end_text[32];
+    format_time(start_text, sizeof start_text, thumbnails->cue_start);
+    format_time(end_text, sizeof end_text, end);
+    fprintf(thumbnails->index, "%s --> %s\n" SHEET_FILE "#xywh=%d,%d,%d,%d\n\n", start_text, end_text,
+            thumbnails->cue_sheet, extension(thumbnails), thumbnails->cue_x, thumbnails->cue_y, thumbnails->width,
+            thumbnails->height);
+}
+
+// Encodes the sheet as one image and starts a blank one.
+static int write_sheet(struct thumbnails *thumbnails) {
+    char *path = av_asprintf("%s/" SHEET_FILE, thumbnails->dir, thumbnails->sheet_count, extension(thumbnails));
+    if (!path) {
+        printf("Failed to allocate memory for thumbnail sheet\n");
+        return -1;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Failed to write thumbnail sheet %s\n", path);
+        av_free(path);
+        return -1;
+    }
+
+    thumbnails->sheet->pts = thumbnails->sheet_count;
+    thumbnails->sheet->quality = thumbnails->encoder->global_quality;
+    int reason = avcodec_send_frame(thumbnails->encoder, thumbnails->sheet);
+    int written = 1;
+    while (reason >= 0) {
+        reason = avcodec_receive_packet(thumbnails->encoder, thumbnails->packet);
+        if (reason >= 0) {
+            written &= fwrite(thumbnails->packet->data, 1, thumbnails->packet->size, file) == thumbnails->packet->size;
+            av_packet_unref(thumbnails->packet);
+        }
+    }
+    written &= !fclose(file);
+
+    int result = 0;
+    if (reason != AVERROR(EAGAIN) && reason != AVERROR_EOF) {
+        print_error("Failed to encode thumbnail sheet", reason);
+        result = -1;
+    } else if (!written) {
+        printf("Failed to write thumbnail sheet %s\n", path);
+        result = -1;
+    }
+    av_free(path);
+
+    ++thumbnails->sheet_count;
+    thumbnails->placed = 0;
+    reason = clear_sheet(thumbnails);
+    if (!result && reason < 0) {
+        print_error("Failed to allocate thumbnail sheet", reason);
+        result = -1;
+    }
+    return result;
+}
+
+// Copies the scaled thumbnail into its cell of the sheet.
+static void place_thumbnail(struct thumbnails *thumbnails, int x, int y) {
+    AVFrame *sheet = thumbnails->sheet;
+    AVFrame *thumbnail = thumbnails->thumbnail;
+    for (int i = 0; i < 3; ++i) {
+        int shift = i ? 1 : 0;
+        av_image_copy_plane(sheet->data[i] + (y >> shift) * sheet->linesize[i] + (x >> shift), sheet->linesize[i],
+                            thumbnail->data[i], thumbnail->linesize[i], thumbnails->width >> shift,
+                            thumbnails->height >> shift);
+    }
+}
+
+int thumbnails_add(struct thumbnails *thumbnails, const AVFrame *frame, int stream_index) {
+    if (stream_index != thumbnails->stream_index || frame->pts == AV_NOPTS_VALUE) {
+        return 0;
+    }
+
+    int64_t time = av_rescale_q(frame->pts, thumbnails->time_base, AV_TIME_BASE_Q);
+    if (thumbnails->last_time == AV_NOPTS_VALUE || time > thumbnails->last_time) {
+        thumbnails->last_time = time;
+    }
+    if (!thumbnails_due(thumbnails, frame->pts, frame->flags & AV_FRAME_FLAG_KEY)) {
+        return 0;
+    }
+
+    // Frames decoded on the GPU come down to memory first, which only the few that become thumbnails pay for.
+    AVFrame *downloaded = NULL;
+    const AVFrame *source = frame;
+    int reason = 0;
+    if (frame->hw_frames_ctx) {
+        downloaded = av_frame_alloc();
+        reason = downloaded ? av_hwframe_transfer_data(downloaded, frame, 0) : AVERROR(ENOMEM);
+        source = downloaded;
+    }
+    if (reason >= 0) {
+        reason = scale_frame(&thumbnails->scaler, thumbnails->thumbnail, source);
+    }
+    av_frame_free(&downloaded);
+    if (reason < 0) {
+        print_error("Failed to scale thumbnail", reason);
+        return -1;
+    }
+
+    int x = thumbnails->placed % thumbnails->columns * thumbnails->width;
+    int y = thumbnails->placed / thumbnails->columns * thumbnails->height;
+    place_thumbnail(thumbnails, x, y);
+    av_frame_unref(thumbnails->thumbnail);
+
+    write_cue(thumbnails, time - thumbnails->origin);
+    thumbnails->cue_start = time - thumbnails->origin;
+    thumbnails->cue_sheet = thumbnails->sheet_count;
+    thumbnails->cue_x = x;
+    thumbnails->cue_y = y;
+    ++thumbnails->taken;
+
+    // Thumbnails stay on a grid from the first one, however far past their time the frames that make them land.
+    if (thumbnails->interval) {
+        if (thumbnails->next_time == AV_NOPTS_VALUE) {
+            thumbnails->next_time = time;
+        }
+        while (thumbnails->next_time <= time) {
+            thumbnails->next_time += thumbnails->interval;
+        }
+    }
+
+    if (++thumbnails->placed == thumbnails->columns * thumbnails->rows) {
+        return write_sheet(thumbnails);
+    }
+    return 0;
+}
+
+int thumbnails_finish(struct thumbnails *thumbnails) {
+    if (thumbnails->placed && write_sheet(thumbnails)) {
+        return -1;
+    }
+
+    // The last cue runs to the last frame, or for a second when that frame is the thumbnail itself.
+    if (thumbnails->cue_start != AV_NOPTS_VALUE) {
+        int64_t end = thumbnails->last_time - thumbnails->origin;
+        write_cue(thumbnails, end > thumbnails->cue_start ? end : thumbnails->cue_start + AV_TIME_BASE);
+    }
+
+    int reason = fclose(thumbnails->index);
+    thumbnails->index = NULL;
+    if (reason) {
+        printf("Failed to write thumbnail index in %s\n", thumbnails->dir);
+        return -1;
+    }
+
+    printf("Wrote %d thumbnails on %d sheets to %s\n", thumbnails->taken, thumbnails->sheet_count, thumbnails->dir);
+    return 0;
+}
+
+// Sends a keyframe, or NULL to drain the decoder, and takes thumbnails of what comes out.
+static int decode_thumbnails(struct thumbnails *thumbnails, AVCodecContext *incc, AVPacket *packet, AVFrame *frame) {
+    int reason = avcodec_send_packet(incc, packet);
+    if (reason) {
+        print_error("Failed to send decode packet", reason);
+        return -1;
+    }
+
+    for (;;) {
+        reason = avcodec_receive_frame(incc, frame);
+        if (reason < 0) {
+            if (reason != AVERROR_EOF && reason != AVERROR(EAGAIN)) {
+                print_error("Failed to receive decode frames", reason);
+                return -1;
+            }
+            return 0;
+        }
+
+        reason = thumbnails_add(thumbnails, frame, thumbnails->stream_index);
+        av_frame_unref(frame);
+        if (reason) {
+            return reason;
+        }
+    }
+}
+
+int transcode_thumbnails(const char *input_file, const struct transcode_options *options) {
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return -1;
+    }
+
+    AVCodecContext *incc = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int result = -1;
+    struct thumbnails *thumbnails = thumbnails_open(infc, options);
+    if (!thumbnails) {
+        goto end;
+    }
+    if (!packet || !frame) {
+        printf("Failed to allocate memory for thumbnails\n");
+        goto end;
+    }
+
+    // Demuxers that index their keyframes skip reading the other frames altogether.
+    int stream_index = thumbnails->stream_index;
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        infc->streams[i]->discard = i == stream_index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+    }
+
+    AVStream *stream = infc->streams[stream_index];
+    const AVCodec *in_codec = find_decoder(stream->codecpar->codec_id, options);
+    if (!in_codec) {
+        printf("Failed to find decoder\n");
+        goto end;
+    }
+    incc = create_decode_context(in_codec, stream->codecpar, options);
+    if (!incc) {
+        goto end;
+    }
+    incc->skip_frame = AVDISCARD_NONKEY;
+
+    while (read_packet(infc, packet, NULL) >= 0) {
+        int wanted = packet->stream_index == stream_index && packet->flags & AV_PKT_FLAG_KEY &&
+                     (packet->pts == AV_NOPTS_VALUE || thumbnails_due(thumbnails, packet->pts, 1));
+        int reason = wanted ? decode_thumbnails(thumbnails, incc, packet, frame) : 0;
+        av_packet_unref(packet);
+        if (reason) {
+            goto end;
+        }
+    }
+
+    if (!decode_thumbnails(thumbnails, incc, NULL, frame)) {
+        result = thumbnails_finish(thumbnails);
+    }
+
+    end:
+    avcodec_free_context(&incc);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    thumbnails_close(&thumbnails);
+    close_input(&infc);
+    return result;
+}
@@ -0,0 +1,32 @@
+#ifndef VIDEO_RESIZE_THUMBNAILS_H
+#define VIDEO_RESIZE_THUMBNAILS_H
+
+#include "transcode.h"
+
+enum thumbnail_format {
+    THUMBNAIL_JPEG,
+    THUMBNAIL_WEBP
+};
+
+struct thumbnails;
+
+// Starts sprite sheets of the first video stream of infc in options->thumbnails_dir, on the timeline of the outputs.
+struct thumbnails *thumbnails_open(AVFormatContext *infc, const struct transcode_options *options);
+
+// Whether a frame at pts, in the stream's time base, would be taken: the first one after each interval, or every
+// keyframe with an interval of 0.
+int thumbnails_due(const struct thumbnails *thumbnails, int64_t pts, int key);
+
+// Scales a decoded frame of the thumbnail stream onto the current sheet when it is due, and writes full sheets.
+// Frames of other streams are ignored.
+int thumbnails_add(struct thumbnails *thumbnails, const AVFrame *frame, int stream_index);
+
+// Writes the last sheet and the WebVTT index that maps times to thumbnails.
+int thumbnails_finish(struct thumbnails *thumbnails);
+
+void thumbnails_close(struct thumbnails **thumbnails);
+
+// Writes the thumbnails of input_file and nothing else. Only keyframes are decoded, and only those that are due.
+int transcode_thumbnails(const char *input_file, const struct transcode_options *options);
+
+#endif
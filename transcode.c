@@ -0,0 +1,1213 @@
+#include "transcode.h"
+
+#include <limits.h>
+#include <string.h>
+#include <libavutil/avstring.h>
+#include <libavutil/opt.h>
+
+#include "audio.h"
+#include "autotune.h"
+#include "budget.h"
+#include "checkpoint.h"
+#include "clip.h"
+#include "dedup.h"
+#include "hwaccel.h"
+#include "mapped_input.h"
+#include "metrics.h"
+#include "multipass.h"
+#include "package.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "probe.h"
+#include "read_ahead.h"
+#include "segment.h"
+#include "thumbnails.h"
+#include "write_behind.h"
+
+
+void print_error(const char *description, int errnum) {
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(errnum, errbuf, AV_ERROR_MAX_STRING_SIZE);
+    printf("%s: %s\n", description, errbuf);
+}
+
+// A NULL packet makes the MP4 muxer close the fragment it is building, so a live packet is out as soon as it is
+// written instead of when the next one arrives.
+static int write_live_packet(AVFormatContext *outfc, AVPacket *packet) {
+    int reason = av_write_frame(outfc, packet);
+    if (reason >= 0) {
+        reason = av_write_frame(outfc, NULL);
+    }
+    if (reason >= 0) {
+        avio_flush(outfc->pb);
+        reason = outfc->pb->error;
+    }
+    av_packet_unref(packet);
+    return reason;
+}
+
+// The sink takes the packet's data by reference, so nothing is copied on the way out.
+static int write_sink_packet(struct packet_list *sink, AVPacket *packet) {
+    AVPacket *queued = av_packet_alloc();
+    if (!queued) {
+        av_packet_unref(packet);
+        return AVERROR(ENOMEM);
+    }
+
+    av_packet_move_ref(queued, packet);
+    if (append_packet(sink, queued)) {
+        av_packet_free(&queued);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+int write_packet_in(struct rendition *rendition, AVPacket *packet, int stream_index, AVRational time_base) {
+    int out_stream_index = rendition->out_stream_indices[stream_index];
+    AVStream *out_stream = rendition->outfc->streams[out_stream_index];
+    packet->stream_index = out_stream_index;
+    av_packet_rescale_ts(packet, time_base, out_stream->time_base);
+
+    struct stage_timer timer;
+    stats_begin(rendition->stats, &timer);
+    int size = packet->size;
+    int64_t arrival = stats_arrival(rendition->stats, packet);
+    pthread_mutex_lock(&rendition->mux_mutex);
+    int reason;
+    if (rendition->sink) {
+        reason = write_sink_packet(rendition->sink, packet);
+    } else if (rendition->live) {
+        reason = write_live_packet(rendition->outfc, packet);
+    } else {
+        reason = av_interleaved_write_frame(rendition->outfc, packet);
+    }
+    pthread_mutex_unlock(&rendition->mux_mutex);
+    stats_end(rendition->stats, STAGE_MUX, &timer);
+    if (reason) {
+        print_error("Failed to write frame", reason);
+        return -1;
+    }
+
+    stats_add(rendition->stats, COUNTER_PACKETS_WRITTEN, 1);
+    stats_add(rendition->stats, COUNTER_BYTES_WRITTEN, size);
+    stats_output_delay(rendition->stats, arrival);
+    return 0;
+}
+
+int write_packet(struct rendition *rendition, AVPacket *packet, AVStream *in_stream) {
+    return write_packet_in(rendition, packet, in_stream->index, in_stream->time_base);
+}
+
+// Sends a frame, or NULL to drain the encoder, and writes every packet it hands back.
+static int encode_frame_and_send(struct rendition *rendition, AVPacket *packet, AVFrame *frame, AVStream *in_stream) {
+    AVCodecContext *outcc = rendition->out_codec_contexts[in_stream->index];
+    int64_t *encoded_packets = &rendition->encoded_packets[in_stream->index];
+
+    if (frame) {
+        package_mark_keyframe(rendition, frame, in_stream->time_base);
+    }
+
+    struct stage_timer timer;
+    stats_begin(rendition->stats, &timer);
+    int reason = avcodec_send_frame(outcc, frame);
+    stats_end(rendition->stats, STAGE_ENCODE, &timer);
+    if (reason) {
+        print_error("Failed to send encode frame", reason);
+        return -1;
+    }
+    if (frame) {
+        stats_add(rendition->stats, COUNTER_FRAMES_ENCODED, 1);
+        metrics_frame(rendition->metrics[in_stream->index], frame);
+    }
+
+    for (;;) {
+        stats_begin(rendition->stats, &timer);
+        int packet_reason = avcodec_receive_packet(outcc, packet);
+        stats_end(rendition->stats, STAGE_ENCODE, &timer);
+        if (packet_reason < 0) {
+            if (packet_reason != AVERROR_EOF && packet_reason != AVERROR(EAGAIN)) {
+                print_error("Failed to receive encode packets", packet_reason);
+                return -1;
+            }
+            return 0;
+        }
+
+        stats_add(rendition->stats, COUNTER_PACKETS_ENCODED, 1);
+        stats_encoder_latency(rendition->stats, outcc->frame_num - ++*encoded_packets);
+        metrics_packet(rendition->metrics[in_stream->index], packet);
+        reason = write_packet(rendition, packet, in_stream);
+        if (reason) {
+            return reason;
+        }
+
+        av_packet_unref(packet);
+    }
+}
+
+static int encode_rendition_frame(struct rendition *rendition, AVPacket *packet, AVFrame *frame, AVFrame *scaled_frame,
+                                  AVStream *in_stream) {
+    struct scaler *scaler = rendition->scalers[in_stream->index];
+
+    if (!scaler) {
+        return encode_frame_and_send(rendition, packet, frame, in_stream);
+    }
+
+    struct stage_timer timer;
+    stats_begin(rendition->stats, &timer);
+    int reason = scale_frame(scaler, scaled_frame, frame);
+    stats_end(rendition->stats, STAGE_SCALE, &timer);
+    if (reason) {
+        print_error("Failed to scale frame", reason);
+        return -1;
+    }
+
+    reason = encode_frame_and_send(rendition, packet, scaled_frame, in_stream);
+    av_frame_unref(scaled_frame);
+    return reason;
+}
+
+// Writes a reference to the packet to each rendition that copies the stream instead of re-encoding it.
+static int write_stream_copies(struct rendition *renditions, int rendition_count, AVPacket *packet, AVPacket *copy,
+                               AVStream *in_stream) {
+    for (int i = 0; i < rendition_count; ++i) {
+        struct rendition *rendition = &renditions[i];
+        if (rendition->out_codec_contexts[in_stream->index]) {
+            continue;
+        }
+
+        int reason = av_packet_ref(copy, packet);
+        if (reason) {
+            print_error("Failed to reference packet", reason);
+            return -1;
+        }
+
+        reason = write_packet(rendition, copy, in_stream);
+        av_packet_unref(copy);
+        if (reason) {
+            return reason;
+        }
+    }
+
+    return 0;
+}
+
+// Decodes the packet, or drains the decoder when it is NULL, and encodes every frame that comes out.
+static int transcode(AVCodecContext *incc, struct rendition *renditions, int rendition_count, AVPacket *packet,
+                     AVPacket *copy, AVFrame *frame, AVFrame *scaled_frame, AVStream *in_stream) {
+    if (packet && write_stream_copies(renditions, rendition_count, packet, copy, in_stream)) {
+        av_packet_unref(packet);
+        return -1;
+    }
+
+    struct transcode_stats *stats = renditions[0].stats;
+    struct stage_timer timer;
+    stats_begin(stats, &timer);
+    int reason = avcodec_send_packet(incc, packet);
+    stats_end(stats, STAGE_DECODE, &timer);
+    if (reason) {
+        print_error("Failed to send decode packet", reason);
+        return -1;
+    }
+
+    if (packet) {
+        av_packet_unref(packet);
+    }
+    for (;;) {
+        stats_begin(stats, &timer);
+        int frame_reason = avcodec_receive_frame(incc, frame);
+        stats_end(stats, STAGE_DECODE, &timer);
+        if (frame_reason < 0) {
+            if (frame_reason != AVERROR_EOF && frame_reason != AVERROR(EAGAIN)) {
+                print_error("Failed to receive decode frames", frame_reason);
+                return -1;
+            }
+            return 0;
+        }
+        stats_add(stats, COUNTER_FRAMES_DECODED, 1);
+        if (renditions[0].clip && !clip_frame(renditions[0].clip, frame, in_stream->time_base)) {
+            av_frame_unref(frame);
+            continue;
+        }
+        if (renditions[0].thumbnails && thumbnails_add(renditions[0].thumbnails, frame, in_stream->index)) {
+            av_frame_unref(frame);
+            return -1;
+        }
+        if (renditions[0].dedups && dedup_frame(renditions[0].dedups[in_stream->index], frame, in_stream->time_base)) {
+            stats_add(stats, COUNTER_FRAMES_DEDUPLICATED, 1);
+            av_frame_unref(frame);
+            continue;
+        }
+
+        for (int i = 0; i < rendition_count; ++i) {
+            if (!renditions[i].out_codec_contexts[in_stream->index]) {
+                continue;
+            }
+
+            reason = encode_rendition_frame(&renditions[i], copy, frame, scaled_frame, in_stream);
+            if (reason) {
+                av_frame_unref(frame);
+                return reason;
+            }
+        }
+        av_frame_unref(frame);
+    }
+}
+
+int flush_streams(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                  int rendition_count, AVPacket *packet, AVFrame *frame, AVFrame *scaled_frame) {
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        AVCodecContext *incc = in_codec_contexts[i];
+        if (!incc || renditions[0].out_stream_indices[i] == -1) {
+            continue;
+        }
+
+        AVStream *in_stream = infc->streams[i];
+        int reason = transcode(incc, renditions, rendition_count, NULL, packet, frame, scaled_frame, in_stream);
+        if (reason) {
+            return reason;
+        }
+
+        // A stream that ends on duplicates gets the last of them after all, so it keeps its duration.
+        if (renditions[0].dedups && dedup_flush(renditions[0].dedups[i], frame)) {
+            for (int j = 0; j < rendition_count && !reason; ++j) {
+                if (renditions[j].out_codec_contexts[i]) {
+                    reason = encode_rendition_frame(&renditions[j], packet, frame, scaled_frame, in_stream);
+                }
+            }
+            av_frame_unref(frame);
+            if (reason) {
+                return reason;
+            }
+        }
+
+        for (int j = 0; j < rendition_count; ++j) {
+            if (!renditions[j].out_codec_contexts[i]) {
+                continue;
+            }
+
+            reason = encode_frame_and_send(&renditions[j], packet, NULL, in_stream);
+            if (reason) {
+                return reason;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Every rendition but the last writes its own reference to the packet, because writing consumes it. Audio that is
+// re-encoded goes to its stage instead, which writes to every rendition itself.
+int write_passthrough(struct rendition *renditions, int rendition_count, AVPacket *packet, AVPacket *copy,
+                      AVStream *in_stream) {
+    if (renditions[0].audio_stages && renditions[0].audio_stages[in_stream->index]) {
+        return audio_stage_send(renditions[0].audio_stages[in_stream->index], packet);
+    }
+
+    for (int i = 0; i < rendition_count; ++i) {
+        AVPacket *target = packet;
+        if (i < rendition_count - 1) {
+            int reason = av_packet_ref(copy, packet);
+            if (reason) {
+                print_error("Failed to reference packet", reason);
+                return -1;
+            }
+            target = copy;
+        }
+
+        int reason = write_packet(&renditions[i], target, in_stream);
+        av_packet_unref(target);
+        if (reason) {
+            return reason;
+        }
+    }
+
+    return 0;
+}
+
+// Reads the next packet, counting the time and bytes against the demux stage.
+int read_packet(AVFormatContext *infc, AVPacket *packet, struct transcode_stats *stats) {
+    struct stage_timer timer;
+    stats_begin(stats, &timer);
+    int reason = av_read_frame(infc, packet);
+    stats_end(stats, STAGE_DEMUX, &timer);
+    if (reason >= 0) {
+        stats_add(stats, COUNTER_PACKETS_READ, 1);
+        stats_add(stats, COUNTER_BYTES_READ, packet->size);
+        reason = stats_stamp_packet(stats, packet);
+        if (reason < 0) {
+            av_packet_unref(packet);
+        }
+    }
+    return reason;
+}
+
+int transcode_packet(AVCodecContext **in_codec_contexts, struct rendition *renditions, int rendition_count,
+                     AVPacket *packet, AVPacket *copy, AVFrame *frame, AVFrame *scaled_frame, AVStream *in_stream) {
+    AVCodecContext *incc = in_codec_contexts[in_stream->index];
+    if (incc) {
+        return transcode(incc, renditions, rendition_count, packet, copy, frame, scaled_frame, in_stream);
+    }
+
+    return write_passthrough(renditions, rendition_count, packet, copy, in_stream);
+}
+
+int write_body(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+               int rendition_count) {
+    int result = 0;
+
+    AVPacket *packet = av_packet_alloc();
+    AVPacket *copy = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *scaled_frame = av_frame_alloc();
+    struct clip *clip = renditions[0].clip;
+    while ((!clip || !clip_done(clip)) && read_packet(infc, packet, renditions[0].stats) >= 0) {
+        AVStream *in_stream = infc->streams[packet->stream_index];
+        if (renditions[0].out_stream_indices[packet->stream_index] == -1 ||
+            (clip && !clip_packet(clip, packet, in_stream->time_base))) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        int reason = transcode_packet(in_codec_contexts, renditions, rendition_count, packet, copy, frame,
+                                      scaled_frame, in_stream);
+        if (reason) {
+            result = reason;
+            goto end;
+        }
+    }
+
+    result = flush_streams(infc, in_codec_contexts, renditions, rendition_count, packet, frame, scaled_frame);
+
+    end:
+    av_frame_free(&scaled_frame);
+    av_frame_free(&frame);
+    av_packet_free(&copy);
+    av_packet_free(&packet);
+    return result;
+}
+
+static void configure_decode_threads(AVCodecContext *incc, const struct transcode_options *options) {
+    if (options->decode_threads) {
+        incc->thread_count = options->decode_threads;
+    } else {
+        incc->thread_count = FFMIN(options->threads, MAX_AUTO_DECODE_THREADS);
+    }
+    incc->thread_type = options->decode_thread_type;
+
+    // Each frame thread holds back a frame of its own, so live input decodes with slice threads alone.
+    if (options->live) {
+        incc->thread_type = FF_THREAD_SLICE;
+        incc->flags |= AV_CODEC_FLAG_LOW_DELAY | AV_CODEC_FLAG_COPY_OPAQUE;
+    }
+}
+
+static int set_x265_params(AVDictionary **codec_options, const struct rendition_options *rendition_options,
+                           const struct transcode_options *options) {
+    char pools[32];
+    const char *pools_value = options->x265_pools;
+    if (!pools_value) {
+        snprintf(pools, sizeof pools, "%d", options->encode_threads ? options->encode_threads : options->threads);
+        pools_value = pools;
+    }
+
+    char frame_threads[32] = "";
+    if (options->x265_frame_threads) {
+        snprintf(frame_threads, sizeof frame_threads, ":frame-threads=%d", options->x265_frame_threads);
+    }
+
+    char wpp[16] = "";
+    if (options->x265_wpp != -1) {
+        snprintf(wpp, sizeof wpp, ":wpp=%d", options->x265_wpp);
+    }
+
+    // x265 lengthens a lookahead that is shorter than the B-frame run, so the B-frames can still be placed.
+    char latency[64] = "";
+    if (options->lookahead >= 0) {
+        snprintf(latency, sizeof latency, ":rc-lookahead=%d", options->lookahead);
+    }
+    if (options->bframes >= 0) {
+        snprintf(latency + strlen(latency), sizeof latency - strlen(latency), ":bframes=%d", options->bframes);
+    }
+
+    const char *shared = options->x265_params;
+    const char *own = rendition_options->x265_params;
+    char *params = av_asprintf("pools=%s%s%s%s%s%s%s%s", pools_value, frame_threads, wpp, latency, shared ? ":" : "",
+                               shared ? shared : "", own ? ":" : "", own ? own : "");
+    if (!params) {
+        printf("Failed to allocate memory for x265 parameters\n");
+        return -1;
+    }
+
+    int reason = av_dict_set(codec_options, "x265-params", params, 0);
+    av_free(params);
+    if (reason < 0) {
+        print_error("Failed to set x265 parameters", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Hardware encoders take the limits as codec options. libx265 takes them through its own parameters instead.
+static int set_latency_limits(AVCodecContext *outcc, AVDictionary **codec_options, const AVCodec *out_codec,
+                              const struct transcode_options *options) {
+    if (options->bframes >= 0) {
+        outcc->max_b_frames = options->bframes;
+    }
+
+    // Encoders that cannot carry the arrival stamps through reordering only go without delay measurements.
+    if (options->live) {
+        if (out_codec->capabilities & AV_CODEC_CAP_ENCODER_REORDERED_OPAQUE) {
+            outcc->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+        }
+        if (!strcmp(out_codec->name, "libx265") && av_dict_set(codec_options, "tune", "zerolatency", 0) < 0) {
+            printf("Failed to set x265 tune\n");
+            return -1;
+        }
+    }
+
+    // Packaged segments must each decode on their own, so the keyframes forced at their starts are IDR frames.
+    void *codec_class = (void *) &out_codec->priv_class;
+    int forced_idr = av_opt_find(codec_class, "forced-idr", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ) != NULL;
+    if (options->package_dir && forced_idr && av_dict_set(codec_options, "forced-idr", "1", 0) < 0) {
+        printf("Failed to set forced IDR frames\n");
+        return -1;
+    }
+
+    const char *lookahead_option = options->hw_device ? options->hwaccel->lookahead_option : NULL;
+    if (options->lookahead >= 0 && lookahead_option) {
+        int reason = av_dict_set_int(codec_options, lookahead_option, options->lookahead, 0);
+        if (reason < 0) {
+            print_error("Failed to set lookahead", reason);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void warn_unused_codec_options(AVDictionary *codec_options) {
+    const AVDictionaryEntry *entry = NULL;
+    while ((entry = av_dict_get(codec_options, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+        printf("Codec option %s was not recognised\n", entry->key);
+    }
+}
+
+AVCodecContext *create_decode_context(const AVCodec *in_codec, AVCodecParameters *in_parameters,
+                                      const struct transcode_options *options) {
+    AVCodecContext *incc = avcodec_alloc_context3(in_codec);
+    if (!incc) {
+        printf("Failed to allocate memory for input in_stream codec context\n");
+        return NULL;
+    }
+
+    int reason = avcodec_parameters_to_context(incc, in_parameters);
+    if (reason) {
+        print_error("Failed to copy parameters to context", reason);
+        avcodec_free_context(&incc);
+        return NULL;
+    }
+
+    configure_decode_threads(incc, options);
+    if (configure_hw_decoder(incc, options)) {
+        avcodec_free_context(&incc);
+        return NULL;
+    }
+    if (!options->hw_device) {
+        incc->get_buffer2 = pool_get_decoder_buffer;
+    }
+
+    reason = avcodec_open2(incc, in_codec, NULL);
+    if (reason) {
+        print_error("Failed to open input codec context", reason);
+        avcodec_free_context(&incc);
+        return NULL;
+    }
+
+    return incc;
+}
+
+static int even_dimension(int64_t dimension) {
+    return (int) FFMAX(2, dimension & ~1);
+}
+
+void resolve_output_size(int in_width, int in_height, const struct rendition_options *rendition_options,
+                         int *width, int *height) {
+    *width = rendition_options->width > 0 ? rendition_options->width : in_width;
+    *height = rendition_options->height > 0 ? rendition_options->height : in_height;
+
+    if (rendition_options->width == -1) {
+        *width = even_dimension(av_rescale(*height, in_width, in_height));
+    } else if (rendition_options->height == -1) {
+        *height = even_dimension(av_rescale(*width, in_height, in_width));
+    }
+}
+
+// Decided from the stream parameters alone, before any decoder is opened. The source is remuxed as it is when it is
+// 8- or 10-bit 4:2:0 in the output codec already, and re-encoding would leave it at the same size and no higher bit
+// rate. A CRF asks for a specific quality, so it always re-encodes.
+static int can_copy_video(AVFormatContext *infc, AVStream *in_stream,
+                          const struct rendition_options *rendition_options, const struct transcode_options *options) {
+    AVCodecParameters *in_parameters = in_stream->codecpar;
+    const AVCodec *out_codec = find_encoder(options);
+    if (!options->stream_copy || !out_codec || in_parameters->codec_id != out_codec->id ||
+        !in_parameters->extradata_size || rendition_options->crf >= 0) {
+        return 0;
+    }
+
+    if (in_parameters->format != AV_PIX_FMT_YUV420P && in_parameters->format != AV_PIX_FMT_YUV420P10) {
+        return 0;
+    }
+
+    int width, height;
+    resolve_output_size(in_parameters->width, in_parameters->height, rendition_options, &width, &height);
+    if (width != in_parameters->width || height != in_parameters->height) {
+        return 0;
+    }
+
+    // Without a stream bit rate the container's is used, which also counts audio and so errs towards re-encoding.
+    if (rendition_options->bit_rate) {
+        int64_t bit_rate = in_parameters->bit_rate ? in_parameters->bit_rate : infc->bit_rate;
+        if (bit_rate <= 0 || bit_rate > rendition_options->bit_rate) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int set_rate_control(AVCodecContext *outcc, AVDictionary **codec_options, AVCodecContext *incc,
+                            const struct rendition_options *rendition_options,
+                            const struct transcode_options *options) {
+    if (rendition_options->crf < 0) {
+        outcc->bit_rate = rendition_options->bit_rate ? rendition_options->bit_rate : incc->bit_rate;
+        return 0;
+    }
+
+    if (rendition_options->bit_rate) {
+        outcc->rc_max_rate = rendition_options->bit_rate;
+        outcc->rc_buffer_size = (int) FFMIN(2 * rendition_options->bit_rate, INT_MAX);
+    }
+
+    int reason = av_dict_set_int(codec_options, quality_option(options), rendition_options->crf, 0);
+    if (reason < 0) {
+        print_error("Failed to set CRF", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+AVCodecContext *
+create_encode_context(const AVCodec *out_codec, AVCodecContext *incc, AVFormatContext *infc, AVStream *in_stream,
+                      const struct rendition_options *rendition_options, const struct transcode_options *options) {
+    AVCodecContext *outcc = avcodec_alloc_context3(out_codec);
+    if (!outcc) {
+        printf("Failed to allocate memory for output in_stream codec context\n");
+        return NULL;
+    }
+
+    resolve_output_size(incc->width, incc->height, rendition_options, &outcc->width, &outcc->height);
+    outcc->sample_aspect_ratio = incc->sample_aspect_ratio;
+    outcc->pix_fmt = incc->pix_fmt;
+    if (configure_hw_encoder(outcc, incc, options)) {
+        avcodec_free_context(&outcc);
+        return NULL;
+    }
+
+    AVRational frame_rate = av_guess_frame_rate(infc, in_stream, NULL);
+    outcc->time_base = av_inv_q(frame_rate);
+
+    if (out_codec->capabilities & AV_CODEC_CAP_DR1) {
+        outcc->get_encode_buffer = pool_get_encoder_buffer;
+    }
+
+    outcc->thread_count = options->encode_threads ? options->encode_threads : options->threads;
+    outcc->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    // Measuring the encoder's own reconstruction saves decoding its output again.
+    if (options->metrics && options->pass != 1 && out_codec->capabilities & AV_CODEC_CAP_ENCODER_RECON_FRAME) {
+        outcc->flags |= AV_CODEC_FLAG_RECON_FRAME;
+    }
+
+    AVDictionary *codec_options = NULL;
+    if ((options->preset && av_dict_set(&codec_options, "preset", options->preset, 0) < 0) ||
+        set_rate_control(outcc, &codec_options, incc, rendition_options, options) ||
+        set_latency_limits(outcc, &codec_options, out_codec, options) ||
+        (!strcmp(out_codec->name, "libx265") && set_x265_params(&codec_options, rendition_options, options))) {
+        av_dict_free(&codec_options);
+        avcodec_free_context(&outcc);
+        return NULL;
+    }
+
+    int reason = avcodec_open2(outcc, out_codec, &codec_options);
+    warn_unused_codec_options(codec_options);
+    av_dict_free(&codec_options);
+    if (reason) {
+        print_error("Failed to open output codec context", reason);
+        avcodec_free_context(&outcc);
+        return NULL;
+    }
+
+    return outcc;
+}
+
+struct scaler *create_scaler(AVCodecContext *outcc, const struct transcode_options *options) {
+    struct scaler *scaler = av_malloc(sizeof *scaler);
+    if (!scaler) {
+        printf("Failed to allocate memory for scaler\n");
+        return NULL;
+    }
+
+    int reason = scaler_init(scaler, outcc->width, outcc->height, outcc->pix_fmt, options->scale_flags,
+                             options->scale_threads);
+    if (reason) {
+        print_error("Failed to create scaler", reason);
+        av_freep(&scaler);
+        return NULL;
+    }
+
+    return scaler;
+}
+
+void free_scaler(struct scaler **scaler) {
+    if (*scaler) {
+        scaler_uninit(*scaler);
+        av_freep(scaler);
+    }
+}
+
+static int is_network_url(const char *url) {
+    return !strncmp(url, "http://", 7) || !strncmp(url, "https://", 8);
+}
+
+static void close_custom_input(AVIOContext **pb) {
+    if (is_mapped_input(*pb)) {
+        close_mapped_input(pb);
+    } else {
+        close_read_ahead(pb);
+    }
+}
+
+AVFormatContext *open_input(const char *input_file, const struct transcode_options *options) {
+    AVFormatContext *infc = avformat_alloc_context();
+    if (!infc) {
+        printf("Failed to allocate memory for input format context\n");
+        return NULL;
+    }
+
+    if (options->probesize) {
+        infc->probesize = options->probesize;
+    }
+    if (options->analyze_duration) {
+        infc->max_analyze_duration = options->analyze_duration;
+    }
+    if (options->live) {
+        infc->flags |= AVFMT_FLAG_NOBUFFER;
+    }
+
+    // A dropped connection is resumed from where it broke off rather than ending the input early.
+    AVDictionary *io_options = NULL;
+    if (is_network_url(input_file)) {
+        av_dict_set(&io_options, "reconnect", "1", 0);
+        av_dict_set(&io_options, "reconnect_streamed", "1", 0);
+        av_dict_set(&io_options, "reconnect_delay_max", "10", 0);
+    }
+
+    int reason = options->mmap_input ? open_mapped_input(&infc->pb, input_file) : 0;
+    if (!reason && !infc->pb && options->read_ahead) {
+        reason = open_read_ahead(&infc->pb, input_file, options->read_ahead, &io_options);
+    }
+    if (reason) {
+        print_error("Failed to open input file", reason);
+        av_dict_free(&io_options);
+        avformat_free_context(infc);
+        return NULL;
+    }
+    if (infc->pb) {
+        infc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // avformat_open_input frees infc on failure but leaves a custom pb to the caller.
+    AVIOContext *pb = infc->pb;
+    reason = avformat_open_input(&infc, input_file, NULL, &io_options);
+    av_dict_free(&io_options);
+    if (reason) {
+        print_error("Failed to open input file", reason);
+        close_custom_input(&pb);
+        return NULL;
+    }
+
+    reason = probe_input(infc, input_file, options);
+    if (reason) {
+        print_error("Failed to query stream info", reason);
+        close_input(&infc);
+        return NULL;
+    }
+
+    return infc;
+}
+
+void close_input(AVFormatContext **infc) {
+    if (!*infc) {
+        return;
+    }
+
+    AVIOContext *pb = (*infc)->flags & AVFMT_FLAG_CUSTOM_IO ? (*infc)->pb : NULL;
+    avformat_close_input(infc);
+    close_custom_input(&pb);
+}
+
+static int write_output(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                        int rendition_count, const struct transcode_options *options) {
+    for (int i = 0; i < rendition_count; ++i) {
+        // A regular MP4 goes back to the start to write the index, so an output that cannot seek gets a fragment per
+        // keyframe instead, each one complete when written. Live fragments are cut by write_packet, one per packet.
+        AVDictionary *muxer_options = NULL;
+        AVIOContext *pb = renditions[i].outfc->pb;
+        if (options->package_dir && options->pass != 1) {
+            if (package_muxer_options(options, renditions[i].options, &muxer_options)) {
+                av_dict_free(&muxer_options);
+                return -1;
+            }
+        } else if (options->checkpoint) {
+            if (checkpoint_muxer_options(options->checkpoint, &muxer_options)) {
+                av_dict_free(&muxer_options);
+                return -1;
+            }
+        } else if (options->live) {
+            av_dict_set(&muxer_options, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+        } else if (pb && (options->fragment || !(pb->seekable & AVIO_SEEKABLE_NORMAL))) {
+            av_dict_set(&muxer_options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        }
+
+        int reason = options->checkpoint ?
+                     checkpoint_write_header(options->checkpoint, renditions[i].outfc, &muxer_options) :
+                     avformat_write_header(renditions[i].outfc, &muxer_options);
+        av_dict_free(&muxer_options);
+        if (reason != AVSTREAM_INIT_IN_WRITE_HEADER) {
+            print_error("Failed to write header to output file", reason);
+            return -1;
+        }
+    }
+
+    struct audio_stage **audio_stages = renditions[0].audio_stages;
+    if (start_audio_stages(audio_stages, infc->nb_streams, renditions, rendition_count, options->stats)) {
+        finish_audio_stages(audio_stages, infc->nb_streams, 1);
+        return -1;
+    }
+
+    int reason;
+    if (options->segment_workers || options->workers) {
+        reason = write_body_segmented(infc, in_codec_contexts, renditions, rendition_count, options);
+    } else if (options->pipeline) {
+        reason = write_body_pipelined(infc, in_codec_contexts, renditions, rendition_count, options);
+    } else {
+        reason = write_body(infc, in_codec_contexts, renditions, rendition_count);
+    }
+
+    // The audio threads finish their own drain before the trailers go out.
+    if (finish_audio_stages(audio_stages, infc->nb_streams, reason != 0)) {
+        return -1;
+    }
+    if (reason) {
+        return reason;
+    }
+    if (renditions[0].thumbnails && thumbnails_finish(renditions[0].thumbnails)) {
+        return -1;
+    }
+
+    for (int i = 0; i < rendition_count; ++i) {
+        reason = av_write_trailer(renditions[i].outfc);
+        if (reason) {
+            print_error("Failed to write trailer", reason);
+            return -1;
+        }
+
+        // Background writes fail after the muxer has moved on, so their errors only surface here.
+        if (renditions[i].outfc->flags & AVFMT_FLAG_CUSTOM_IO) {
+            reason = flush_write_behind(renditions[i].outfc->pb);
+            if (reason) {
+                print_error("Failed to write output file", reason);
+                return -1;
+            }
+        }
+    }
+
+    if (options->package_dir && options->pass != 1) {
+        return package_write_manifests(options, renditions, rendition_count,
+                                       clip_duration(renditions[0].clip, infc->duration));
+    }
+
+    return 0;
+}
+
+int create_decode_contexts(AVFormatContext *infc, AVCodecContext **in_codec_contexts,
+                           const struct transcode_options *options) {
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        AVCodecParameters *in_parameters = infc->streams[i]->codecpar;
+        if (in_parameters->codec_type != AVMEDIA_TYPE_VIDEO) {
+            continue;
+        }
+
+        int copied = 1;
+        for (int j = 0; j < options->rendition_count && copied; ++j) {
+            copied = can_copy_video(infc, infc->streams[i], &options->renditions[j], options);
+        }
+
+        // A stream every rendition copies is still decoded for thumbnails, but only its keyframes.
+        int thumbnailed = options->thumbnails_dir && options->pass != 1 &&
+                          i == av_find_best_stream(infc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (copied && !thumbnailed) {
+            continue;
+        }
+
+        const AVCodec *in_codec = find_decoder(in_parameters->codec_id, options);
+        if (!in_codec) {
+            printf("Failed to find decoder\n");
+            return -1;
+        }
+
+        in_codec_contexts[i] = create_decode_context(in_codec, in_parameters, options);
+        if (!in_codec_contexts[i]) {
+            return -1;
+        }
+        if (copied) {
+            in_codec_contexts[i]->skip_frame = AVDISCARD_NONKEY;
+        }
+    }
+
+    return 0;
+}
+
+static int create_streams(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *rendition,
+                          const AVCodec *out_codec, const struct transcode_options *options) {
+    int stream_count = -1;
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        AVStream *in_stream = infc->streams[i];
+        AVCodecParameters *in_parameters = in_stream->codecpar;
+        if (in_parameters->codec_type != AVMEDIA_TYPE_AUDIO && in_parameters->codec_type != AVMEDIA_TYPE_VIDEO) {
+            rendition->out_stream_indices[i] = -1;
+            continue;
+        }
+
+        AVCodecContext *outcc = NULL;
+        if (in_parameters->codec_type == AVMEDIA_TYPE_VIDEO &&
+            can_copy_video(infc, in_stream, rendition->options, options)) {
+            printf("Copying video stream %d into %s without re-encoding\n", i, rendition->options->output_file);
+        } else if (in_parameters->codec_type == AVMEDIA_TYPE_VIDEO) {
+            AVCodecContext *incc = in_codec_contexts[i];
+            outcc = create_encode_context(out_codec, incc, infc, in_stream, rendition->options, options);
+            if (!outcc) {
+                return -1;
+            }
+            rendition->out_codec_contexts[i] = outcc;
+
+            if (options->metrics && options->pass != 1) {
+                rendition->metrics[i] = metrics_open(outcc, rendition->options->output_file, i,
+                                                     options->metrics_interval, options);
+                if (!rendition->metrics[i]) {
+                    return -1;
+                }
+            }
+            if (incc->width != outcc->width || incc->height != outcc->height) {
+                rendition->scalers[i] = create_scaler(outcc, options);
+                if (!rendition->scalers[i]) {
+                    return -1;
+                }
+            }
+        }
+
+        AVStream *out_stream = avformat_new_stream(rendition->outfc, NULL);
+        if (!out_stream) {
+            printf("Failed to create output in_stream\n");
+            return -1;
+        }
+
+        // Re-encoded audio takes its parameters from the encoder of its stage, which every rendition shares.
+        AVCodecContext *encoder = outcc;
+        if (rendition->audio_stages && rendition->audio_stages[i]) {
+            encoder = rendition->audio_stages[i]->encoder;
+        }
+
+        if (encoder) {
+            int reason = avcodec_parameters_from_context(out_stream->codecpar, encoder);
+            if (reason) {
+                print_error("Failed to copy codec parameters from codec context to output in_stream\n", reason);
+                return -1;
+            }
+
+            out_stream->time_base = encoder->time_base;
+
+            // Deduplicated video is variable frame rate, which a time base of one frame may not represent, so its
+            // packets keep the input's.
+            if (options->dedup && outcc) {
+                out_stream->time_base = in_stream->time_base;
+            }
+        } else {
+            int reason = avcodec_parameters_copy(out_stream->codecpar, in_parameters);
+            if (reason) {
+                print_error("Failed to copy codec parameters to output in_stream\n", reason);
+                return -1;
+            }
+        }
+
+        // Apple players only take HEVC in HLS under the hvc1 tag, with the parameter sets out of band.
+        if (in_parameters->codec_type == AVMEDIA_TYPE_VIDEO) {
+            out_stream->avg_frame_rate = av_guess_frame_rate(infc, in_stream, NULL);
+            if (options->package_dir && out_stream->codecpar->codec_id == AV_CODEC_ID_HEVC) {
+                out_stream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+            }
+        }
+
+        rendition->out_stream_indices[i] = ++stream_count;
+    }
+
+    return 0;
+}
+
+void close_rendition(struct rendition *rendition, AVFormatContext *infc) {
+    if (rendition->mux_mutex_initialised) {
+        pthread_mutex_destroy(&rendition->mux_mutex);
+        rendition->mux_mutex_initialised = 0;
+    }
+
+    if (rendition->outfc) {
+        if (rendition->outfc->flags & AVFMT_FLAG_CUSTOM_IO) {
+            close_write_behind(&rendition->outfc->pb);
+        } else {
+            avio_closep(&rendition->outfc->pb);
+        }
+        avformat_free_context(rendition->outfc);
+        rendition->outfc = NULL;
+    }
+
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        if (rendition->metrics) {
+            metrics_close(&rendition->metrics[i], rendition->stats);
+        }
+        if (rendition->out_codec_contexts) {
+            avcodec_free_context(&rendition->out_codec_contexts[i]);
+        }
+        if (rendition->scalers) {
+            free_scaler(&rendition->scalers[i]);
+        }
+    }
+    av_freep(&rendition->metrics);
+    av_freep(&rendition->scalers);
+    av_freep(&rendition->out_codec_contexts);
+    av_freep(&rendition->out_stream_indices);
+    av_freep(&rendition->encoded_packets);
+}
+
+int open_rendition(struct rendition *rendition, const struct rendition_options *rendition_options,
+                   AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct audio_stage **audio_stages,
+                   const AVCodec *out_codec, const struct transcode_options *options) {
+    rendition->options = rendition_options;
+    rendition->audio_stages = audio_stages;
+    rendition->mux_mutex_initialised = !pthread_mutex_init(&rendition->mux_mutex, NULL);
+    if (!rendition->mux_mutex_initialised) {
+        printf("Failed to create mutex for rendition %s\n", rendition_options->output_file);
+        return -1;
+    }
+
+    // A first pass only feeds the encoder's analysis, so its packets go to the null muxer.
+    int package = options->package_dir && options->pass != 1;
+    int reason = 0;
+    if (package) {
+        if (package_open_rendition(options, rendition_options, &rendition->outfc)) {
+            return -1;
+        }
+        rendition->package_duration = options->package_duration * (int64_t) AV_TIME_BASE;
+        rendition->next_keyframe = AV_NOPTS_VALUE;
+    } else {
+        const char *format = options->format ? options->format : "mp4";
+        reason = avformat_alloc_output_context2(&rendition->outfc, NULL, options->pass == 1 ? "null" : format, NULL);
+    }
+    if (reason) {
+        print_error("Failed to create output context", reason);
+        return -1;
+    }
+
+    rendition->out_stream_indices = av_malloc_array(infc->nb_streams, sizeof *rendition->out_stream_indices);
+    rendition->out_codec_contexts = av_calloc(infc->nb_streams, sizeof(AVCodecContext *));
+    rendition->scalers = av_calloc(infc->nb_streams, sizeof(struct scaler *));
+    rendition->metrics = av_calloc(infc->nb_streams, sizeof(struct metrics *));
+    rendition->encoded_packets = av_calloc(infc->nb_streams, sizeof *rendition->encoded_packets);
+    rendition->stats = options->stats;
+    rendition->live = options->live;
+    if (options->max_interleave_delta) {
+        rendition->outfc->max_interleave_delta = options->max_interleave_delta;
+    }
+    if (!rendition->out_stream_indices || !rendition->out_codec_contexts || !rendition->scalers ||
+        !rendition->metrics || !rendition->encoded_packets) {
+        printf("Failed to allocate memory for rendition %s\n", rendition_options->output_file);
+        return -1;
+    }
+
+    if (create_streams(infc, in_codec_contexts, rendition, out_codec, options)) {
+        return -1;
+    }
+
+    // The HLS muxer opens its playlist and segments itself.
+    if (options->pass == 1 || package || rendition->sink) {
+        reason = 0;
+    } else if (options->checkpoint) {
+        reason = checkpoint_open_output(options->checkpoint, (int) (rendition_options - options->renditions),
+                                        &rendition->outfc->pb);
+    } else if (options->write_behind || options->direct_io) {
+        int size = options->write_behind ? options->write_behind : DEFAULT_WRITE_BEHIND;
+        reason = open_write_behind(&rendition->outfc->pb, rendition_options->output_file, size,
+                                   options->direct_io);
+        rendition->outfc->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else {
+        reason = avio_open(&rendition->outfc->pb, rendition_options->output_file, AVIO_FLAG_WRITE);
+    }
+    if (reason) {
+        print_error("Failed to open output file", reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int create_streams_and_transcode(AVFormatContext *infc, const struct transcode_options *options) {
+    const AVCodec *out_codec = find_encoder(options);
+    if (!out_codec) {
+        printf("Failed to find %s codec\n", encoder_name(options));
+        return -1;
+    }
+
+    AVCodecContext **in_codec_contexts = av_calloc(infc->nb_streams, sizeof(AVCodecContext *));
+    if (!in_codec_contexts) {
+        printf("Failed to allocate memory for input codec contexts\n");
+        return -1;
+    }
+
+    struct rendition *renditions = av_calloc(options->rendition_count, sizeof *renditions);
+    if (!renditions) {
+        printf("Failed to allocate memory for renditions\n");
+        av_freep(&in_codec_contexts);
+        return -1;
+    }
+
+    int result = -1;
+    struct audio_stage **audio_stages = NULL;
+    struct clip *clip = NULL;
+    struct thumbnails *thumbnails = NULL;
+    struct dedup **dedups = NULL;
+    if (create_decode_contexts(infc, in_codec_contexts, options) ||
+        open_audio_stages(infc, options, &audio_stages) ||
+        open_dedups(infc, in_codec_contexts, options, &dedups)) {
+        goto end;
+    }
+
+    for (int i = 0; i < options->rendition_count; ++i) {
+        if (open_rendition(&renditions[i], &options->renditions[i], infc, in_codec_contexts, audio_stages, out_codec,
+                           options)) {
+            goto end;
+        }
+        renditions[i].dedups = dedups;
+    }
+
+    if (options->clip_start || options->clip_end) {
+        clip = clip_open(infc, renditions, options->rendition_count, options);
+        if (!clip) {
+            goto end;
+        }
+    }
+
+    // A first pass leaves the thumbnails to the pass that writes the outputs.
+    if (options->thumbnails_dir && options->pass != 1) {
+        thumbnails = thumbnails_open(infc, options);
+        if (!thumbnails) {
+            goto end;
+        }
+        for (int i = 0; i < options->rendition_count; ++i) {
+            renditions[i].thumbnails = thumbnails;
+        }
+    }
+
+    result = write_output(infc, in_codec_contexts, renditions, options->rendition_count, options);
+
+    end:
+    thumbnails_close(&thumbnails);
+    clip_close(&clip);
+    for (int i = 0; i < options->rendition_count; ++i) {
+        close_rendition(&renditions[i], infc);
+    }
+    close_audio_stages(&audio_stages, infc->nb_streams);
+    close_dedups(&dedups, infc->nb_streams);
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        avcodec_free_context(&in_codec_contexts[i]);
+    }
+    av_freep(&renditions);
+    av_freep(&in_codec_contexts);
+    return result;
+}
+
+static double source_frame_rate(AVFormatContext *infc) {
+    for (int i = 0; i < infc->nb_streams; ++i) {
+        if (infc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            return av_q2d(av_guess_frame_rate(infc, infc->streams[i], NULL));
+        }
+    }
+
+    return 0;
+}
+
+int transcode_once(const char *input_file, const struct transcode_options *options) {
+    AVFormatContext *infc = open_input(input_file, options);
+    if (!infc) {
+        return -1;
+    }
+
+    // The device and stats are set up per run, so the caller's options stay untouched.
+    struct transcode_options run_options = *options;
+    int64_t frame_budget = fit_memory_budget(infc, &run_options);
+    pool_add_budget(frame_budget);
+    setup_hwaccel(&run_options, infc);
+    if (!options->stats) {
+        run_options.stats = stats_start(input_file, source_frame_rate(infc), &options->stats_options);
+    }
+
+    int result = -1;
+    if (options->checkpoint_file) {
+        run_options.checkpoint = checkpoint_open(options->checkpoint_file, infc, options);
+    }
+    if (!options->checkpoint_file || run_options.checkpoint) {
+        result = create_streams_and_transcode(infc, &run_options);
+    }
+    checkpoint_close(&run_options.checkpoint, !result);
+    if (!options->stats) {
+        if (run_options.stats && stats_finish(run_options.stats, result)) {
+            result = -1;
+        }
+        stats_free(&run_options.stats);
+    }
+    release_hwaccel(&run_options);
+    pool_add_budget(-frame_budget);
+    close_input(&infc);
+    return result;
+}
+
+int transcode_file(const char *input_file, const struct transcode_options *options) {
+    if (options->thumbnails_only) {
+        return transcode_thumbnails(input_file, options);
+    }
+    if (options->autotune_speed || options->autotune_psnr) {
+        struct transcode_options tuned;
+        if (autotune_options(input_file, options, &tuned)) {
+            return -1;
+        }
+
+        int result = transcode_file(input_file, &tuned);
+        free_autotuned(&tuned);
+        return result;
+    }
+    if (options->two_pass || options->analysis_reuse || options->per_title) {
+        return transcode_planned(input_file, options);
+    }
+
+    return transcode_once(input_file, options);
+}
@@ -0,0 +1,305 @@
+#ifndef VIDEO_RESIZE_TRANSCODE_H
+#define VIDEO_RESIZE_TRANSCODE_H
+
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "scale.h"
+#include "stats.h"
+
+struct audio_stage;
+struct checkpoint;
+struct clip;
+struct dedup;
+struct hwaccel;
+struct metrics;
+struct packet_list;
+struct thumbnails;
+
+// The write-behind queue used for --direct-io when no --write-behind size is given.
+#define DEFAULT_WRITE_BEHIND (8 << 20)
+
+// Frame threading stops paying off well before this and every extra thread keeps another frame in flight.
+#define MAX_AUTO_DECODE_THREADS 16
+
+struct rendition_options {
+    char *output_file;
+
+    // A dimension of 0 keeps the source size and -1 derives it from the other one, preserving the aspect ratio.
+    int width;
+    int height;
+
+    // A bit rate of 0 keeps the source bit rate. With a CRF it caps the rate instead of targeting it.
+    int64_t bit_rate;
+    int crf;
+
+    // x265 parameters for this rendition alone, appended to the shared ones. Multi-pass runs set them per pass.
+    const char *x265_params;
+};
+
+struct transcode_options {
+    int pipeline;
+    int queue_depth;
+
+    // Remux video that already matches a rendition instead of re-encoding it.
+    int stream_copy;
+
+    // Limits on how much of the input avformat_find_stream_info reads, 0 for FFmpeg's defaults, and whether to skip it
+    // when the container headers describe every stream. probe_cache is a directory of probe results keyed by a hash of
+    // the input file, or NULL.
+    int probesize;
+    int64_t analyze_duration;
+    int trust_headers;
+    const char *probe_cache;
+
+    // mmap_input maps local input files instead of reading them, and read_ahead is the bytes of any other input to
+    // buffer ahead of the demuxer on a separate thread, or 0 to read directly. fragment writes fragmented MP4 even to
+    // seekable outputs; outputs that cannot seek, such as pipes, are always fragmented.
+    int mmap_input;
+    int read_ahead;
+    int fragment;
+
+    // Live mode encodes without lookahead or reordering and writes every packet as its own fragment as soon as it is
+    // encoded, rather than interleaving the streams first.
+    int live;
+
+    // Bytes of output to queue for a separate writer thread, or 0 to write on the muxing thread. direct_io writes local
+    // files with O_DIRECT through that queue.
+    int write_behind;
+    int direct_io;
+
+    // The bytes the transcode should keep to, or 0 for no limit, which fit_memory_budget meets by lowering the settings
+    // that cost the most memory. max_interleave_delta caps how long the muxer waits for a lagging stream, in
+    // AV_TIME_BASE units, with 0 keeping FFmpeg's default.
+    int64_t memory_budget;
+    int64_t max_interleave_delta;
+
+    // The encoder of re-encoded video and the container of the outputs, NULL for libx265 and MP4. Under a hardware
+    // backend, its own encoder is used.
+    const char *encoder;
+    const char *format;
+
+    // Thread counts of 0 are resolved from the detected core count.
+    int threads;
+    int decode_threads;
+    int decode_thread_type;
+    int encode_threads;
+    const char *x265_pools;
+    int x265_frame_threads;
+    int x265_wpp;
+    const char *x265_params;
+
+    // The encoder preset, or NULL for the encoder's default. With an autotune_speed, a multiple of realtime, or an
+    // autotune_psnr, a floor on luma PSNR in dB, a calibration encode picks the x265 preset, encoder threads and CRF
+    // before the run, caching its choices in autotune_cache when that is set.
+    const char *preset;
+    double autotune_speed;
+    double autotune_psnr;
+    const char *autotune_cache;
+
+    // Caps on the encoder's rate-control lookahead and on consecutive B-frames, the frames it holds back before
+    // returning a packet. -1 keeps the encoder's default.
+    int lookahead;
+    int bframes;
+
+    // Leave out decoded frames that repeat the last one kept, when no 16x16 block of luma differs by more than
+    // dedup_threshold on average per pixel. The output is then variable frame rate.
+    int dedup;
+    double dedup_threshold;
+
+    // Measure PSNR and SSIM of every re-encoded video stream against the frames sent to its encoder, on one frame in
+    // every metrics_interval, while it is encoded.
+    int metrics;
+    int metrics_interval;
+
+    // two_pass encodes renditions with a target bit rate twice, analysis_reuse shares x265's analysis between passes
+    // or between ladder rungs, and per_title picks the bit rates from a complexity probe. Their files go in pass_dir.
+    // pass is 1 during a first pass, which writes no output.
+    int two_pass;
+    int analysis_reuse;
+    int per_title;
+    const char *pass_dir;
+    int pass;
+
+    int scale_flags;
+    int scale_threads;
+
+    // An audio_mode, and the channel count and bit rate of re-encoded audio, 0 to follow the source.
+    int audio_mode;
+    int audio_channels;
+    int64_t audio_bit_rate;
+
+    // The GPU backend asked for, and the device opened for it. hw_device stays NULL when running in software.
+    const struct hwaccel *hwaccel;
+    const char *hwaccel_device;
+    AVBufferRef *hw_device;
+
+    // The window of the input to transcode, in AV_TIME_BASE units from its start. A clip_start of 0 starts at the
+    // beginning and a clip_end of 0 runs to the end.
+    int64_t clip_start;
+    int64_t clip_end;
+
+    // Segment-parallel mode is off while segment_workers is 0 and no remote workers are given.
+    int segment_workers;
+    int segment_duration;
+
+    // A directory to write HLS and DASH manifests to over CMAF segments of package_duration seconds, instead of MP4
+    // files, or NULL.
+    const char *package_dir;
+    int package_duration;
+
+    // A directory to write sprite sheets of thumbnails to, with a WebVTT index of them, or NULL. A thumbnail is taken
+    // every thumbnail_interval seconds, or of every keyframe at 0, thumbnail_width pixels wide, on sheets of
+    // thumbnail_columns x thumbnail_rows in a thumbnail_format. thumbnails_only writes nothing else.
+    const char *thumbnails_dir;
+    int thumbnail_interval;
+    int thumbnail_width;
+    int thumbnail_columns;
+    int thumbnail_rows;
+    int thumbnail_format;
+    int thumbnails_only;
+
+    // A journal to record progress in after every segment, so a transcode that dies resumes from the last one, and
+    // the checkpoint of the run in progress, which transcode_once sets up.
+    const char *checkpoint_file;
+    struct checkpoint *checkpoint;
+
+    // Remote workers as "host:port[*slots],...", and the input URL to hand them when it differs from the local path.
+    // With worker_listen set, the process serves segments to a coordinator instead of transcoding a file. Coordinators
+    // and workers must agree on worker_token, an empty one when NULL.
+    const char *workers;
+    const char *worker_input;
+    const char *worker_listen;
+    const char *worker_token;
+
+    // A manifest of jobs to run instead of a single transcode, and how many of them run at once. A batch job waits for
+    // cores behind those of a higher job_priority, or with a priority of -1 ranks as live with live set and as
+    // on-demand otherwise.
+    const char *batch;
+    int jobs;
+    int priority;
+
+    // Instrumentation settings, and the stats of the run in progress, which transcode_file sets up.
+    struct stats_options stats_options;
+    struct transcode_stats *stats;
+
+    // The encoding options as command line arguments, so a remote worker can rebuild the same encoders.
+    char **forwarded_args;
+    int forwarded_arg_count;
+
+    struct rendition_options *renditions;
+    int rendition_count;
+};
+
+// Everything belonging to one output of the ladder. The arrays are indexed by input stream, like the decoders.
+struct rendition {
+    const struct rendition_options *options;
+    AVFormatContext *outfc;
+    int *out_stream_indices;
+    AVCodecContext **out_codec_contexts;
+    struct scaler **scalers;
+
+    // Packets each encoder has returned, which against the frames sent to it gives its latency.
+    int64_t *encoded_packets;
+    struct transcode_stats *stats;
+    int live;
+
+    // In packaged output, the segment duration and the time of the next keyframe to force, in AV_TIME_BASE units.
+    int64_t package_duration;
+    int64_t next_keyframe;
+
+    // The clip shared by every rendition when only part of the input is transcoded, or NULL.
+    struct clip *clip;
+
+    // Frame deduplication, indexed by input stream and shared by every rendition so they all leave out the same
+    // frames, or NULL when it is off.
+    struct dedup **dedups;
+
+    // The quality metrics stage of each re-encoded video stream, indexed by input stream, or NULL.
+    struct metrics **metrics;
+
+    // The thumbnails every rendition shares, taken of the decoded frames, or NULL.
+    struct thumbnails *thumbnails;
+
+    // Packets go to sink in the output time base instead of to the muxer when it is set, for callers that mux them
+    // themselves. outfc then only holds the output streams, and no output file is opened.
+    struct packet_list *sink;
+
+    // The audio stages, indexed by input stream and shared by every rendition, write from threads of their own, so
+    // every write to the output holds mux_mutex.
+    struct audio_stage **audio_stages;
+    pthread_mutex_t mux_mutex;
+    int mux_mutex_initialised;
+};
+
+void print_error(const char *description, int errnum);
+
+// Opens and probes input_file, which may be any URL FFmpeg can read, through the read-ahead buffer when one is set.
+AVFormatContext *open_input(const char *input_file, const struct transcode_options *options);
+
+// Closes an input from open_input along with its read-ahead buffer.
+void close_input(AVFormatContext **infc);
+
+// Demuxes the next packet, timing it against the demux stage of stats, which may be NULL.
+int read_packet(AVFormatContext *infc, AVPacket *packet, struct transcode_stats *stats);
+
+// Writes a packet of in_stream, in its time base, to the rendition's output. In live mode the packet is written and
+// flushed straight away, otherwise the muxer interleaves it and unreferences it.
+int write_packet(struct rendition *rendition, AVPacket *packet, AVStream *in_stream);
+
+// Like write_packet, for a packet of input stream stream_index whose timestamps are in time_base.
+int write_packet_in(struct rendition *rendition, AVPacket *packet, int stream_index, AVRational time_base);
+
+// Writes a packet that needs no transcoding to every rendition. The packet is unreferenced afterwards.
+int write_passthrough(struct rendition *renditions, int rendition_count, AVPacket *packet, AVPacket *copy,
+                      AVStream *in_stream);
+
+// Sends a demuxed packet of in_stream through its decoder and every rendition's encoder, or straight to the outputs
+// for a stream that is not decoded. The packet is unreferenced afterwards.
+int transcode_packet(AVCodecContext **in_codec_contexts, struct rendition *renditions, int rendition_count,
+                     AVPacket *packet, AVPacket *copy, AVFrame *frame, AVFrame *scaled_frame, AVStream *in_stream);
+
+// Drains each decoder and then each encoder, so the frames held back for threading, lookahead and reordering still
+// reach the output once the input ends.
+int flush_streams(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+                  int rendition_count, AVPacket *packet, AVFrame *frame, AVFrame *scaled_frame);
+
+// Transcodes the rest of the input on the calling thread.
+int write_body(AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct rendition *renditions,
+               int rendition_count);
+
+AVCodecContext *create_decode_context(const AVCodec *in_codec, AVCodecParameters *in_parameters,
+                                      const struct transcode_options *options);
+
+AVCodecContext *
+create_encode_context(const AVCodec *out_codec, AVCodecContext *incc, AVFormatContext *infc, AVStream *in_stream,
+                      const struct rendition_options *rendition_options, const struct transcode_options *options);
+
+// Resolves the rendition's size for an in_width x in_height source.
+void resolve_output_size(int in_width, int in_height, const struct rendition_options *rendition_options,
+                         int *width, int *height);
+
+struct scaler *create_scaler(AVCodecContext *outcc, const struct transcode_options *options);
+
+void free_scaler(struct scaler **scaler);
+
+// Opens a decoder for every video stream of infc that some rendition re-encodes or that thumbnails are taken of.
+int create_decode_contexts(AVFormatContext *infc, AVCodecContext **in_codec_contexts,
+                           const struct transcode_options *options);
+
+// Creates the output, streams and encoders of a rendition, and opens its output file unless a sink is set.
+int open_rendition(struct rendition *rendition, const struct rendition_options *rendition_options,
+                   AVFormatContext *infc, AVCodecContext **in_codec_contexts, struct audio_stage **audio_stages,
+                   const AVCodec *out_codec, const struct transcode_options *options);
+
+void close_rendition(struct rendition *rendition, AVFormatContext *infc);
+
+// Transcodes input_file into every rendition in options in a single run, ignoring the multi-pass options. The run
+// starts stats of its own unless options->stats is already set.
+int transcode_once(const char *input_file, const struct transcode_options *options);
+
+// Transcodes input_file into every rendition in options. This is the whole job main runs, for callers that embed it.
+int transcode_file(const char *input_file, const struct transcode_options *options);
+
+#endif
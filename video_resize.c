@@ -0,0 +1,227 @@
+#include "video_resize.h"
+
+#include "audio.h"
+#include "dedup.h"
+#include "hwaccel.h"
+#include "segment.h"
+
+struct video_resize {
+    // The caller's options, with the hardware device of this transcode.
+    struct transcode_options options;
+
+    // Holds the input streams for the decoders and renditions, but never reads anything.
+    AVFormatContext *infc;
+    AVCodecContext **in_codec_contexts;
+    struct dedup **dedups;
+    struct rendition *renditions;
+
+    // The packets each rendition has written and the next one to hand out.
+    struct packet_list *pending;
+    int *next_pending;
+    int ended;
+
+    AVPacket *copy;
+    AVPacket *drain_packet;
+    AVFrame *frame;
+    AVFrame *scaled_frame;
+};
+
+static int check_options(const struct transcode_options *options) {
+    if (!options->rendition_count) {
+        printf("A streaming transcode needs at least one rendition\n");
+        return -1;
+    }
+    if (options->pipeline || options->segment_workers || options->workers || options->two_pass ||
+        options->analysis_reuse || options->per_title || options->clip_start || options->clip_end ||
+        options->thumbnails_dir || options->package_dir || options->checkpoint_file || options->autotune_speed ||
+        options->autotune_psnr || options->memory_budget) {
+        printf("Streaming transcodes cannot run in --pipeline, segment-parallel, multi-pass, clip, thumbnail, package, "
+               "checkpoint, autotuning or memory budget modes\n");
+        return -1;
+    }
+    // Audio stages encode on threads of their own, which would write while the caller receives packets.
+    if (options->audio_mode != AUDIO_COPY) {
+        printf("Streaming transcodes copy audio\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static AVFormatContext *create_input(const struct video_resize_stream *streams, int stream_count) {
+    AVFormatContext *infc = avformat_alloc_context();
+    if (!infc) {
+        printf("Failed to allocate memory for input format context\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < stream_count; ++i) {
+        AVStream *stream = avformat_new_stream(infc, NULL);
+        if (!stream) {
+            printf("Failed to create input stream\n");
+            avformat_free_context(infc);
+            return NULL;
+        }
+
+        int reason = avcodec_parameters_copy(stream->codecpar, streams[i].parameters);
+        if (reason) {
+            print_error("Failed to copy input stream parameters", reason);
+            avformat_free_context(infc);
+            return NULL;
+        }
+        stream->time_base = streams[i].time_base;
+        stream->avg_frame_rate = streams[i].frame_rate;
+        stream->r_frame_rate = streams[i].frame_rate;
+    }
+
+    return infc;
+}
+
+struct video_resize *video_resize_open(const struct video_resize_stream *streams, int stream_count,
+                                       const struct transcode_options *options) {
+    if (check_options(options)) {
+        return NULL;
+    }
+
+    struct video_resize *resize = av_mallocz(sizeof *resize);
+    if (!resize) {
+        printf("Failed to allocate memory for transcode\n");
+        return NULL;
+    }
+
+    resize->options = *options;
+    resize->options.hw_device = NULL;
+    resize->infc = create_input(streams, stream_count);
+    if (!resize->infc) {
+        av_free(resize);
+        return NULL;
+    }
+
+    int rendition_count = options->rendition_count;
+    resize->in_codec_contexts = av_calloc(stream_count, sizeof *resize->in_codec_contexts);
+    resize->renditions = av_calloc(rendition_count, sizeof *resize->renditions);
+    resize->pending = av_calloc(rendition_count, sizeof *resize->pending);
+    resize->next_pending = av_calloc(rendition_count, sizeof *resize->next_pending);
+    resize->copy = av_packet_alloc();
+    resize->drain_packet = av_packet_alloc();
+    resize->frame = av_frame_alloc();
+    resize->scaled_frame = av_frame_alloc();
+    if (!resize->in_codec_contexts || !resize->renditions || !resize->pending || !resize->next_pending ||
+        !resize->copy || !resize->drain_packet || !resize->frame || !resize->scaled_frame) {
+        printf("Failed to allocate memory for transcode\n");
+        video_resize_close(&resize);
+        return NULL;
+    }
+
+    setup_hwaccel(&resize->options, resize->infc);
+    const AVCodec *out_codec = find_encoder(&resize->options);
+    if (!out_codec) {
+        printf("Failed to find %s codec\n", encoder_name(&resize->options));
+        video_resize_close(&resize);
+        return NULL;
+    }
+
+    if (create_decode_contexts(resize->infc, resize->in_codec_contexts, &resize->options) ||
+        open_dedups(resize->infc, resize->in_codec_contexts, &resize->options, &resize->dedups)) {
+        video_resize_close(&resize);
+        return NULL;
+    }
+
+    for (int i = 0; i < rendition_count; ++i) {
+        resize->renditions[i].sink = &resize->pending[i];
+        if (open_rendition(&resize->renditions[i], &options->renditions[i], resize->infc, resize->in_codec_contexts,
+                           NULL, out_codec, &resize->options)) {
+            video_resize_close(&resize);
+            return NULL;
+        }
+        resize->renditions[i].dedups = resize->dedups;
+    }
+
+    return resize;
+}
+
+void video_resize_close(struct video_resize **resize) {
+    if (!*resize) {
+        return;
+    }
+
+    struct video_resize *closing = *resize;
+    for (int i = 0; closing->renditions && i < closing->options.rendition_count; ++i) {
+        close_rendition(&closing->renditions[i], closing->infc);
+    }
+    for (int i = 0; closing->pending && i < closing->options.rendition_count; ++i) {
+        free_packet_list(&closing->pending[i]);
+    }
+    close_dedups(&closing->dedups, closing->infc->nb_streams);
+    for (int i = 0; closing->in_codec_contexts && i < closing->infc->nb_streams; ++i) {
+        avcodec_free_context(&closing->in_codec_contexts[i]);
+    }
+    release_hwaccel(&closing->options);
+
+    av_frame_free(&closing->scaled_frame);
+    av_frame_free(&closing->frame);
+    av_packet_free(&closing->drain_packet);
+    av_packet_free(&closing->copy);
+    av_freep(&closing->next_pending);
+    av_freep(&closing->pending);
+    av_freep(&closing->renditions);
+    av_freep(&closing->in_codec_contexts);
+    avformat_free_context(closing->infc);
+    av_freep(resize);
+}
+
+int video_resize_output_count(const struct video_resize *resize, int rendition) {
+    return (int) resize->renditions[rendition].outfc->nb_streams;
+}
+
+const AVStream *video_resize_output_stream(const struct video_resize *resize, int rendition, int stream_index) {
+    return resize->renditions[rendition].outfc->streams[stream_index];
+}
+
+int video_resize_send_packet(struct video_resize *resize, AVPacket *packet) {
+    if (resize->ended) {
+        printf("Packets were sent after the end of the input\n");
+        return -1;
+    }
+
+    if (!packet) {
+        resize->ended = 1;
+        return flush_streams(resize->infc, resize->in_codec_contexts, resize->renditions,
+                             resize->options.rendition_count, resize->drain_packet, resize->frame,
+                             resize->scaled_frame);
+    }
+
+    if (packet->stream_index < 0 || packet->stream_index >= resize->infc->nb_streams) {
+        printf("Packet of unknown stream %d\n", packet->stream_index);
+        av_packet_unref(packet);
+        return -1;
+    }
+
+    // Streams other than audio and video have no output to go to.
+    AVStream *in_stream = resize->infc->streams[packet->stream_index];
+    if (resize->renditions[0].out_stream_indices[in_stream->index] == -1) {
+        av_packet_unref(packet);
+        return 0;
+    }
+
+    return transcode_packet(resize->in_codec_contexts, resize->renditions, resize->options.rendition_count, packet,
+                            resize->copy, resize->frame, resize->scaled_frame, in_stream);
+}
+
+int video_resize_receive_packet(struct video_resize *resize, int rendition, AVPacket *packet) {
+    struct packet_list *pending = &resize->pending[rendition];
+    int *next = &resize->next_pending[rendition];
+    if (*next == pending->count) {
+        return resize->ended ? AVERROR_EOF : AVERROR(EAGAIN);
+    }
+
+    av_packet_move_ref(packet, pending->packets[*next]);
+    av_packet_free(&pending->packets[*next]);
+
+    // Once everything written has been received, the list starts over instead of growing.
+    if (++*next == pending->count) {
+        pending->count = 0;
+        *next = 0;
+    }
+    return 0;
+}
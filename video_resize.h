@@ -0,0 +1,43 @@
+#ifndef VIDEO_RESIZE_VIDEO_RESIZE_H
+#define VIDEO_RESIZE_VIDEO_RESIZE_H
+
+#include "options.h"
+#include "transcode.h"
+
+// The public interface of libvideo_resize, for services that embed the transcoder instead of running a process per
+// job. The caller demuxes the input itself and pushes its packets in, then pulls the encoded packets of each rendition
+// out to mux or send on. Packets move in and out by reference, so their data is never copied.
+struct video_resize;
+
+// An input stream: its parameters, the time base of its packets and, for video, its frame rate.
+struct video_resize_stream {
+    const AVCodecParameters *parameters;
+    AVRational time_base;
+    AVRational frame_rate;
+};
+
+// Sets up a transcode of stream_count input streams into every rendition of options, which parse_options can fill
+// in from command line arguments. A rendition's output_file only names it in messages, and options->format only picks
+// the output streams' time bases. Modes that read the input themselves (--pipeline, segment-parallel, multi-pass,
+// clips, thumbnails, packages, checkpoints and autotuning) are not available, and audio is copied.
+struct video_resize *video_resize_open(const struct video_resize_stream *streams, int stream_count,
+                                       const struct transcode_options *options);
+
+void video_resize_close(struct video_resize **resize);
+
+// The streams of a rendition's output, numbered by the stream_index of its packets. Their parameters and time bases
+// set up the caller's muxer.
+int video_resize_output_count(const struct video_resize *resize, int rendition);
+
+const AVStream *video_resize_output_stream(const struct video_resize *resize, int rendition, int stream_index);
+
+// Takes the reference of a packet of input stream packet->stream_index, with timestamps in its time base, and leaves
+// packet blank. A NULL packet ends the input, draining every decoder and encoder. Returns -1 on failure.
+int video_resize_send_packet(struct video_resize *resize, AVPacket *packet);
+
+// Moves the next packet of the rendition into packet, with timestamps in its output stream's time base. Returns 0
+// with a packet, AVERROR(EAGAIN) when the rendition needs more input, and AVERROR_EOF once the input has ended and
+// every packet has been received.
+int video_resize_receive_packet(struct video_resize *resize, int rendition, AVPacket *packet);
+
+#endif
@@ -0,0 +1,311 @@
+// O_DIRECT is a Linux extension.
+#define _GNU_SOURCE
+
+#include "write_behind.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libavutil/common.h>
+
+// The thread writes an eighth of the buffer at a time, within these bounds. O_DIRECT needs the memory, the file offset
+// and the length aligned to the logical block size, which DIRECT_ALIGNMENT covers on common storage.
+#define MIN_CHUNK_SIZE 65536
+#define MAX_CHUNK_SIZE (4 << 20)
+#define DIRECT_ALIGNMENT 4096
+
+struct write_behind {
+    // Output goes to sink, or straight to fd for O_DIRECT files, where position is the offset of the next write.
+    AVIOContext *sink;
+    int fd;
+    int direct;
+    int64_t position;
+
+    uint8_t *buffer;
+    int capacity;
+    int head;
+    int size;
+    uint8_t *chunk;
+    int chunk_size;
+
+    // busy is set while a chunk taken off the buffer is being written, and flushing while a caller waits for both the
+    // buffer and that write.
+    int busy;
+    int flushing;
+    int error;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+};
+
+static void take(struct write_behind *write_behind, int size) {
+    int first = FFMIN(size, write_behind->capacity - write_behind->head);
+    memcpy(write_behind->chunk, write_behind->buffer + write_behind->head, first);
+    memcpy(write_behind->chunk + first, write_behind->buffer, size - first);
+    write_behind->head = (write_behind->head + size) % write_behind->capacity;
+    write_behind->size -= size;
+}
+
+// O_DIRECT is dropped for good at the first write or seek that breaks the alignment. Muxers only do that at the end,
+// when writing the last partial block and patching the index.
+static void stop_direct(struct write_behind *write_behind) {
+    if (write_behind->direct) {
+        fcntl(write_behind->fd, F_SETFL, fcntl(write_behind->fd, F_GETFL) & ~O_DIRECT);
+        write_behind->direct = 0;
+    }
+}
+
+static int write_chunk(struct write_behind *write_behind, int size, int flush) {
+    if (write_behind->fd < 0) {
+        avio_write(write_behind->sink, write_behind->chunk, size);
+        if (flush) {
+            avio_flush(write_behind->sink);
+        }
+        return write_behind->sink->error;
+    }
+
+    if (size % DIRECT_ALIGNMENT) {
+        stop_direct(write_behind);
+    }
+
+    int written = 0;
+    while (written < size) {
+        ssize_t result = pwrite(write_behind->fd, write_behind->chunk + written, size - written,
+                                write_behind->position + written);
+        if (result < 0 && errno != EINTR) {
+            return AVERROR(errno);
+        }
+        if (result > 0) {
+            written += (int) result;
+        }
+    }
+
+    write_behind->position += size;
+    return 0;
+}
+
+static void *write_behind_thread(void *arg) {
+    struct write_behind *write_behind = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&write_behind->mutex);
+        while (!write_behind->stop && (write_behind->error || (write_behind->size < write_behind->chunk_size &&
+                                                               !(write_behind->flushing && write_behind->size)))) {
+            pthread_cond_wait(&write_behind->changed, &write_behind->mutex);
+        }
+        if (write_behind->stop) {
+            pthread_mutex_unlock(&write_behind->mutex);
+            return NULL;
+        }
+
+        int size = FFMIN(write_behind->size, write_behind->chunk_size);
+        take(write_behind, size);
+        int flush = write_behind->flushing && !write_behind->size;
+        write_behind->busy = 1;
+        pthread_cond_broadcast(&write_behind->changed);
+        pthread_mutex_unlock(&write_behind->mutex);
+
+        int reason = write_chunk(write_behind, size, flush);
+
+        pthread_mutex_lock(&write_behind->mutex);
+        write_behind->busy = 0;
+        if (reason < 0) {
+            write_behind->error = reason;
+        }
+        pthread_cond_broadcast(&write_behind->changed);
+        pthread_mutex_unlock(&write_behind->mutex);
+    }
+}
+
+static int drain(struct write_behind *write_behind) {
+    pthread_mutex_lock(&write_behind->mutex);
+    write_behind->flushing = 1;
+    pthread_cond_broadcast(&write_behind->changed);
+    while ((write_behind->size || write_behind->busy) && !write_behind->error) {
+        pthread_cond_wait(&write_behind->changed, &write_behind->mutex);
+    }
+    write_behind->flushing = 0;
+    int error = write_behind->error;
+    pthread_mutex_unlock(&write_behind->mutex);
+    return error;
+}
+
+static int write_buffered(void *opaque, const uint8_t *buf, int buf_size) {
+    struct write_behind *write_behind = opaque;
+
+    pthread_mutex_lock(&write_behind->mutex);
+    int stored = 0;
+    while (stored < buf_size && !write_behind->error) {
+        int space = write_behind->capacity - write_behind->size;
+        if (!space) {
+            pthread_cond_wait(&write_behind->changed, &write_behind->mutex);
+            continue;
+        }
+
+        int tail = (write_behind->head + write_behind->size) % write_behind->capacity;
+        int size = FFMIN(buf_size - stored, FFMIN(space, write_behind->capacity - tail));
+        memcpy(write_behind->buffer + tail, buf + stored, size);
+        write_behind->size += size;
+        stored += size;
+        pthread_cond_broadcast(&write_behind->changed);
+    }
+    int error = write_behind->error;
+    pthread_mutex_unlock(&write_behind->mutex);
+    return error ? error : buf_size;
+}
+
+// The thread is idle once drain returns, so the output can be repositioned from here.
+static int64_t seek_buffered(void *opaque, int64_t offset, int whence) {
+    struct write_behind *write_behind = opaque;
+
+    int reason = drain(write_behind);
+    if (reason < 0) {
+        return reason;
+    }
+
+    whence &= ~AVSEEK_FORCE;
+    if (write_behind->fd < 0) {
+        return whence == AVSEEK_SIZE ? avio_size(write_behind->sink)
+                                     : avio_seek(write_behind->sink, offset, whence);
+    }
+
+    struct stat status;
+    if ((whence == AVSEEK_SIZE || whence == SEEK_END) && fstat(write_behind->fd, &status)) {
+        return AVERROR(errno);
+    }
+
+    if (whence == AVSEEK_SIZE) {
+        return status.st_size;
+    } else if (whence == SEEK_SET) {
+        write_behind->position = offset;
+    } else if (whence == SEEK_CUR) {
+        write_behind->position += offset;
+    } else if (whence == SEEK_END) {
+        write_behind->position = status.st_size + offset;
+    } else {
+        return AVERROR(EINVAL);
+    }
+
+    stop_direct(write_behind);
+    return write_behind->position;
+}
+
+static void free_write_behind(struct write_behind *write_behind) {
+    if (write_behind->fd >= 0) {
+        close(write_behind->fd);
+    }
+    avio_closep(&write_behind->sink);
+    av_free(write_behind->buffer);
+    free(write_behind->chunk);
+    pthread_cond_destroy(&write_behind->changed);
+    pthread_mutex_destroy(&write_behind->mutex);
+    av_free(write_behind);
+}
+
+// Opens a local file for O_DIRECT writing, leaving fd at -1 for URLs and for filesystems that refuse O_DIRECT.
+static int open_direct(struct write_behind *write_behind, const char *url) {
+    const char *path = url;
+    if (!strncmp(path, "file:", 5)) {
+        path += 5;
+    } else if (strchr(path, ':')) {
+        return 0;
+    }
+
+    write_behind->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if (write_behind->fd < 0) {
+        if (errno != EINVAL) {
+            return AVERROR(errno);
+        }
+        printf("%s does not support direct I/O, so it is written through the page cache\n", path);
+        return 0;
+    }
+
+    write_behind->direct = 1;
+    return 0;
+}
+
+int open_write_behind(AVIOContext **pb, const char *url, int size, int direct) {
+    *pb = NULL;
+    struct write_behind *write_behind = av_mallocz(sizeof *write_behind);
+    if (!write_behind) {
+        return AVERROR(ENOMEM);
+    }
+    write_behind->fd = -1;
+    pthread_mutex_init(&write_behind->mutex, NULL);
+    pthread_cond_init(&write_behind->changed, NULL);
+
+    write_behind->chunk_size = av_clip(size / 8, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE) & ~(DIRECT_ALIGNMENT - 1);
+    write_behind->capacity = FFMAX(size, 2 * write_behind->chunk_size);
+    write_behind->buffer = av_malloc(write_behind->capacity);
+    uint8_t *io_buffer = av_malloc(write_behind->chunk_size);
+    void *chunk = NULL;
+    if (posix_memalign(&chunk, DIRECT_ALIGNMENT, write_behind->chunk_size)) {
+        chunk = NULL;
+    }
+    write_behind->chunk = chunk;
+    if (!write_behind->buffer || !write_behind->chunk || !io_buffer) {
+        av_free(io_buffer);
+        free_write_behind(write_behind);
+        return AVERROR(ENOMEM);
+    }
+
+    int reason = direct ? open_direct(write_behind, url) : 0;
+    if (!reason && write_behind->fd < 0) {
+        reason = avio_open(&write_behind->sink, url, AVIO_FLAG_WRITE);
+    }
+    if (reason < 0) {
+        av_free(io_buffer);
+        free_write_behind(write_behind);
+        return reason;
+    }
+
+    *pb = avio_alloc_context(io_buffer, write_behind->chunk_size, 1, write_behind, NULL, write_buffered,
+                             seek_buffered);
+    if (!*pb) {
+        av_free(io_buffer);
+        free_write_behind(write_behind);
+        return AVERROR(ENOMEM);
+    }
+    (*pb)->seekable = write_behind->fd >= 0 ? AVIO_SEEKABLE_NORMAL : write_behind->sink->seekable;
+
+    if (pthread_create(&write_behind->thread, NULL, write_behind_thread, write_behind)) {
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+        free_write_behind(write_behind);
+        return AVERROR(EAGAIN);
+    }
+
+    return 0;
+}
+
+int flush_write_behind(AVIOContext *pb) {
+    avio_flush(pb);
+    if (pb->error) {
+        return pb->error;
+    }
+
+    return drain(pb->opaque);
+}
+
+void close_write_behind(AVIOContext **pb) {
+    if (!*pb) {
+        return;
+    }
+
+    struct write_behind *write_behind = (*pb)->opaque;
+    pthread_mutex_lock(&write_behind->mutex);
+    write_behind->stop = 1;
+    pthread_cond_broadcast(&write_behind->changed);
+    pthread_mutex_unlock(&write_behind->mutex);
+    pthread_join(write_behind->thread, NULL);
+
+    free_write_behind(write_behind);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
@@ -0,0 +1,20 @@
+#ifndef VIDEO_RESIZE_WRITE_BEHIND_H
+#define VIDEO_RESIZE_WRITE_BEHIND_H
+
+#include <libavformat/avio.h>
+
+// Opens url for writing behind a thread that takes up to size bytes of muxed output off the caller and writes them in
+// large chunks, so slow storage does not stall encoding. Seeks wait for the queued data to be written first. With
+// direct set, a local file is written with O_DIRECT so the output bypasses the page cache. Returns 0 with *pb set, or
+// a negative AVERROR.
+int open_write_behind(AVIOContext **pb, const char *url, int size, int direct);
+
+// Waits until everything written to pb so far has reached the output. Returns 0, or the error a background write
+// failed with.
+int flush_write_behind(AVIOContext *pb);
+
+// Stops the write-behind thread, dropping anything not yet flushed, and closes the output. Does nothing to a NULL
+// context.
+void close_write_behind(AVIOContext **pb);
+
+#endif